@@ -13,6 +13,7 @@ class Randomizer
     @size = size
     print "Generating #{3 * size} random integers in 0...#{size}..."
     @randoms = (0..(3 * size)).map { rand(size) }
+    @packed_pairs = @randoms.first(2 * (size / 2 + 1)).pack('q*')
     puts "done"
   end
 
@@ -26,10 +27,15 @@ class Randomizer
       du.unite(e1, e2)
     end
   end
+
+  # The same sequence of unite operations, in a single call
+  def operate_in_batch(du)
+    du.unite_many(@packed_pairs)
+  end
 end
 
 size = Integer(ENV['test_size'] || 10_000_000)
-disjoint_union = c_disjoint_union = nil
+disjoint_union = c_disjoint_union = c_batch_disjoint_union = nil
 
 puts <<~MSG
 
@@ -41,7 +47,8 @@ puts <<~MSG
 
   Then, for each DisjointUnion instance, I will perform a sequence of #{size / 2}
   #unite operations, using the random integers as inputs. The instances will get the
-  same sequence of arguments.
+  same sequence of arguments. I will also give the same sequence to a third, C-based,
+  instance in a single call to #unite_many.
 
   Timing data will be output for
     - the construction of each DisjointUnion instance, and
@@ -57,6 +64,7 @@ puts "Now I will construct the Disjoint Union instances..."
 Benchmark.bm(10) do |x|
   x.report("ruby init") { disjoint_union = DisjointUnion.new(size) }
   x.report("C init") { c_disjoint_union = CDisjointUnion.new(size) }
+  c_batch_disjoint_union = CDisjointUnion.new(size)
 end
 
 puts "...done"
@@ -66,5 +74,6 @@ puts "And now the same sequence of #{size/2} #unite operations on each DisjointU
 Benchmark.bm(10) do |x|
   x.report("ruby op") { randomizer.operate(disjoint_union) }
   x.report("C op") { randomizer.operate(c_disjoint_union) }
+  x.report("C batch op") { randomizer.operate_in_batch(c_batch_disjoint_union) }
 end
 puts "...done"
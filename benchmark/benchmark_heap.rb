@@ -0,0 +1,67 @@
+$LOAD_PATH.unshift File.expand_path('../lib', File.dirname(__FILE__))
+
+require 'benchmark'
+require 'byebug'
+
+require 'data_structures_rmolinari'
+
+Heap = DataStructuresRMolinari::Heap
+CHeap = DataStructuresRMolinari::CHeap
+
+ARITIES = [2, 4, 8].freeze
+
+# Insert size items with random priorities and then pop them all, returning the time taken.
+def time_heap(klass, arity, priorities)
+  GC.start
+  heap = klass.new(arity:, addressable: false)
+  Benchmark.realtime do
+    priorities.each_with_index { |priority, item| heap.insert(item, priority) }
+    heap.pop until heap.empty?
+  end
+end
+
+max_size = Integer(ENV['test_size'] || 10_000_000)
+klass = ENV['lang'] == 'ruby' ? Heap : CHeap
+
+sizes = []
+size = 1_000
+while size <= max_size
+  sizes << size
+  size *= 10
+end
+
+puts <<~MSG
+
+  For each size below and each arity in #{ARITIES.join(', ')} I will insert that many items with random Float
+  priorities into a #{klass} and then pop them all. The items are the same for each arity.
+
+  The output shows the time for each arity relative to the binary heap. A value below 1.0 means that arity
+  was faster than the binary heap. Set lang=ruby in the environment to use the pure Ruby Heap.
+
+
+MSG
+
+puts format('%12s %10s %s', 'size', 'binary (s)', ARITIES.drop(1).map { |d| format('%8s', "d = #{d}") }.join)
+ratios_for = Hash.new { |h, d| h[d] = [] }
+sizes.each do |n|
+  priorities = Array.new(n) { rand }
+  times = ARITIES.to_h { |d| [d, time_heap(klass, d, priorities)] }
+  binary = times[2]
+
+  ratios = ARITIES.drop(1).map { |d| times[d] / binary }
+  ARITIES.drop(1).zip(ratios).each { |d, r| ratios_for[d] << r }
+
+  puts format('%12d %10.3f %s', n, binary, ratios.map { |r| format('%8.2f', r) }.join)
+end
+
+puts
+# The crossover is the smallest size from which the d-ary heap was faster at every larger size too
+ARITIES.drop(1).each do |d|
+  idx = sizes.size
+  idx -= 1 while idx.positive? && ratios_for[d][idx - 1] < 1.0
+  if idx < sizes.size
+    puts "arity #{d} beat the binary heap from size #{sizes[idx]} on"
+  else
+    puts "arity #{d} did not beat the binary heap at the largest size"
+  end
+end
@@ -24,6 +24,7 @@ class Randomizer
         [v1, v2]
       end
     end
+    @packed_int_pairs = @random_int_pairs.flatten.pack('q*')
     puts "done"
   end
 
@@ -36,6 +37,11 @@ class Randomizer
       seg_tree.max_on(v1, v2)
     end
   end
+
+  # The same queries, made in a single batch call with the intervals packed into a String
+  def operate_in_batch(seg_tree)
+    seg_tree.max_on_many(@packed_int_pairs)
+  end
 end
 
 size = Integer(ENV['test_size'] || 1_000_000)
@@ -75,5 +81,6 @@ puts "And now the same sequence of #{size} #max_on operations on each segment tr
 Benchmark.bm(10) do |x|
   x.report("ruby op") { randomizer.operate(seg_tree) }
   x.report("C op") { randomizer.operate(c_seg_tree) }
+  x.report("C batch op") { randomizer.operate_in_batch(c_seg_tree) }
 end
 puts "...done"
@@ -0,0 +1,41 @@
+require 'json'
+
+# Compare two JSON results files written by benchmark/suite.rb, say from the current and the previous releases of the gem.
+#
+#   ruby benchmark/compare.rb baseline.json current.json
+#
+# For each case in both files we print the ratio of the current ops/sec to the baseline's. A case has regressed if the ratio is below
+# 1 - threshold, where the threshold is given by the environment variable of that name (default 0.10). We exit with status 1 if any
+# case has regressed, so the script can gate an upgrade.
+#
+# The two runs should come from the same machine with the same Ruby. Small cases are noisy: the threshold may need to be looser for
+# them.
+
+KEY_FIELDS = %i[structure backend operation distribution size].freeze
+
+def load_results(path)
+  JSON.parse(File.read(path), symbolize_names: true)[:results].to_h { [_1.values_at(*KEY_FIELDS), _1] }
+end
+
+abort "Usage: #{$PROGRAM_NAME} baseline.json current.json" unless ARGV.size == 2
+
+threshold = Float(ENV['threshold'] || 0.10)
+baseline = load_results(ARGV[0])
+current = load_results(ARGV[1])
+
+regressions = 0
+puts format('%-15s %-5s %-25s %-12s %9s %14s %14s %7s', 'structure', 'lang', 'operation', 'distribution', 'size',
+            'baseline op/s', 'current op/s', 'ratio')
+(baseline.keys & current.keys).each do |key|
+  ratio = current[key][:ops_per_sec] / baseline[key][:ops_per_sec]
+  regressed = ratio < 1 - threshold
+  regressions += 1 if regressed
+
+  puts format('%-15s %-5s %-25s %-12s %9d %14.1f %14.1f %7.2f%s', *key, baseline[key][:ops_per_sec], current[key][:ops_per_sec],
+              ratio, regressed ? '  REGRESSION' : '')
+end
+
+missing = baseline.keys - current.keys
+puts "\n#{missing.size} cases of the baseline are missing from the current results" unless missing.empty?
+puts "\n#{regressions} of #{(baseline.keys & current.keys).size} cases regressed by more than #{(100 * threshold).round}%"
+exit(regressions.zero? ? 0 : 1)
@@ -0,0 +1,312 @@
+$LOAD_PATH.unshift File.expand_path('../lib', File.dirname(__FILE__))
+
+require 'json'
+require 'time'
+
+require 'data_structures_rmolinari'
+
+# A benchmark suite covering each data structure with both its Ruby and C implementations, over a sweep of input sizes and
+# distributions. The results are written as JSON so that runs from different versions of the gem can be compared with
+# benchmark/compare.rb.
+#
+# Each case is a structure, a backend (ruby or c), an operation, a distribution, and a size. We build the structure and then time
+# each operation separately, reporting
+# - build_seconds: the time taken to set the structure up
+# - ops_per_sec: the number of operations divided by their total time
+# - p50_us, p99_us: percentiles of the latency of a single operation, in microseconds. These include the cost of reading the clock,
+#   which is a noticeable part of the cheapest C operations.
+# - peak_rss_kb: the peak resident set size of the process that ran the case, from /proc/self/status. Each case runs in its own
+#   forked process, so this covers just the one case. It is null where we can't fork or there is no /proc.
+#
+# The environment controls the run:
+# - sizes: a comma-separated list of sizes (default 1000,10000,100000)
+# - ops: the number of operations to time for each case (default 100000, or the size if that is smaller)
+# - only: a comma-separated list of structures to run, from disjoint_union, heap, segment_tree, pst, mer (default all of them)
+# - out: where to write the JSON (default benchmark/results/<version>-<timestamp>.json). Use - for stdout.
+#
+# The maximal empty rectangle cases are much more expensive than the others. There the operation is a whole run over size / 100
+# points and we time just a few of them.
+module BenchmarkSuite
+  DSR = DataStructuresRMolinari
+  Point = Shared::Point
+
+  DISTRIBUTIONS = %i[random sorted adversarial].freeze
+  MER_REPEATS = 3
+
+  # A single benchmark. setup takes the size and distribution and returns [structure, inputs]. run is called with the structure and
+  # each input in turn, and is what we time.
+  Case = Struct.new(:structure, :backend, :operation, :setup, :run, keyword_init: true)
+
+  ########################################
+  # Input generators
+
+  # Pairs for unite(e, f).
+  # - random: pairs chosen uniformly.
+  # - sorted: (i, i + 1), which makes one long chain of unions.
+  # - adversarial: the merges that build binomial trees, (i, i + 1) for even i, then (i, i + 2) for i divisible by 4, and so on.
+  #   These give the tallest trees that union by rank allows, so the finds inside unite have the longest paths to walk.
+  module_function def unite_pairs(size, distribution, count)
+    case distribution
+    when :random
+      Array.new(count) do
+        e = rand(size)
+        f = rand(size - 1)
+        [e, f >= e ? f + 1 : f]
+      end
+    when :sorted
+      Array.new(count) { |i| [i % (size - 1), (i % (size - 1)) + 1] }
+    when :adversarial
+      pairs = []
+      step = 1
+      while step < size && pairs.size < count
+        (0...(size - step)).step(2 * step) { |i| pairs << [i + step - 1, i + (2 * step) - 1] if i + (2 * step) - 1 < size }
+        step *= 2
+      end
+      pairs.first(count)
+    end
+  end
+
+  # Priorities for a sequence of inserts, all of which are then popped.
+  # - sorted: ascending, so each insert stays at the bottom of the min-heap.
+  # - adversarial: descending, so each insert sifts all the way to the root.
+  module_function def priorities(count, distribution)
+    case distribution
+    when :random then Array.new(count) { rand }
+    when :sorted then Array.new(count) { |i| i.to_f }
+    when :adversarial then Array.new(count) { |i| (count - i).to_f }
+    end
+  end
+
+  # Intervals (i, j) for queries over an array of the given size.
+  # - random: endpoints chosen uniformly.
+  # - sorted: short intervals sweeping from left to right, which is kind to the cache.
+  # - adversarial: long intervals with ragged ends, which make a query visit the most nodes.
+  module_function def intervals(size, distribution, count)
+    case distribution
+    when :random
+      Array.new(count) { [rand(size), rand(size)].sort }
+    when :sorted
+      Array.new(count) { |k| [k % size, [(k % size) + 10, size - 1].min] }
+    when :adversarial
+      Array.new(count) { r = rand(size / 4); [1 + r, size - 2 - r] }
+    end
+  end
+
+  # Points with x values 0...size in random order.
+  # - random: y values chosen uniformly.
+  # - sorted: y increases with x.
+  # - adversarial: y decreases with x, so that every point is on the staircase of maximal points.
+  module_function def points(size, distribution)
+    xs = (0...size).to_a.shuffle
+    case distribution
+    when :random then xs.map { Point.new(_1, rand(size)) }
+    when :sorted then xs.map { Point.new(_1, _1) }
+    when :adversarial then xs.map { Point.new(_1, size - _1) }
+    end
+  end
+
+  # Corners (x0, y0) for quadrant queries
+  module_function def corners(size, count)
+    Array.new(count) { [rand(size), rand(size)] }
+  end
+
+  ########################################
+  # The cases
+
+  module_function def cases
+    @cases ||= [
+      disjoint_union_cases,
+      heap_cases,
+      segment_tree_cases,
+      pst_cases,
+      mer_cases
+    ].flatten
+  end
+
+  module_function def disjoint_union_cases
+    { ruby: DSR::DisjointUnion, c: DSR::CDisjointUnion }.map do |backend, klass|
+      Case.new(
+        structure: :disjoint_union, backend:, operation: :unite,
+        setup: lambda do |size, distribution, ops|
+          du = klass.new(size)
+          [du, unite_pairs(size, distribution, ops)]
+        end,
+        run: ->(du, (e, f)) { du.unite(e, f) unless e == f }
+      )
+    end
+  end
+
+  module_function def heap_cases
+    { ruby: DSR::Heap, c: DSR::CHeap }.map do |backend, klass|
+      Case.new(
+        structure: :heap, backend:, operation: :insert_then_pop,
+        setup: lambda do |_size, distribution, ops|
+          half = ops / 2
+          inputs = priorities(half, distribution).each_with_index.map { |priority, item| [item, priority] }
+          [klass.new(addressable: false), inputs + Array.new(half)]
+        end,
+        run: ->(heap, input) { input ? heap.insert(*input) : heap.pop }
+      )
+    end
+  end
+
+  module_function def segment_tree_cases
+    %i[ruby c].map do |backend|
+      Case.new(
+        structure: :segment_tree, backend:, operation: :max_on,
+        setup: lambda do |size, distribution, ops|
+          data = Array.new(size) { rand }
+          [DSR::SegmentTree.construct(data, :max, backend), intervals(size, distribution, ops)]
+        end,
+        run: ->(tree, (i, j)) { tree.max_on(i, j) }
+      )
+    end
+  end
+
+  module_function def pst_cases
+    { ruby: DSR::MaxPrioritySearchTree, c: DSR::CMaxPrioritySearchTree }.flat_map do |backend, klass|
+      %i[smallest_x_in_ne largest_y_in_ne].map do |operation|
+        Case.new(
+          structure: :pst, backend:, operation:,
+          setup: ->(size, distribution, ops) { [klass.new(points(size, distribution)), corners(size, ops)] },
+          run: ->(pst, (x0, y0)) { pst.send(operation, x0, y0) }
+        )
+      end
+    end
+  end
+
+  module_function def mer_cases
+    mer_size = ->(size) { [size / 100, 100].max }
+
+    [
+      Case.new(
+        structure: :mer, backend: :ruby, operation: :maximal_empty_rectangles,
+        setup: ->(size, distribution, _ops) { [points(mer_size.call(size), distribution), Array.new(MER_REPEATS)] },
+        run: ->(pts, _) { DSR::Algorithms.maximal_empty_rectangles(pts) { nil } }
+      ),
+      Case.new(
+        structure: :mer, backend: :c, operation: :maximal_empty_rectangles,
+        setup: lambda do |size, distribution, _ops|
+          [points(mer_size.call(size), distribution).flat_map { [_1.x, _1.y] }.pack('d*'), Array.new(MER_REPEATS)]
+        end,
+        run: ->(packed, _) { DSR::Algorithms.maximal_empty_rectangles_packed(packed) }
+      )
+    ]
+  end
+
+  ########################################
+  # Measurement
+
+  module_function def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  module_function def peak_rss_kb
+    File.foreach('/proc/self/status') { |line| return line.split[1].to_i if line.start_with?('VmHWM:') }
+    nil
+  rescue SystemCallError
+    nil
+  end
+
+  module_function def percentile(sorted, fraction)
+    sorted[((sorted.size - 1) * fraction).round]
+  end
+
+  module_function def measure(kase, size, distribution, ops)
+    GC.start
+    start = now
+    structure, inputs = kase.setup.call(size, distribution, ops)
+    build_seconds = now - start
+
+    run = kase.run
+    latencies = Array.new(inputs.size)
+    total_start = now
+    inputs.each_with_index do |input, idx|
+      op_start = now
+      run.call(structure, input)
+      latencies[idx] = now - op_start
+    end
+    total = now - total_start
+    latencies.sort!
+
+    {
+      structure: kase.structure, backend: kase.backend, operation: kase.operation, distribution:, size:,
+      build_seconds: build_seconds.round(6),
+      ops: inputs.size,
+      ops_per_sec: (inputs.size / total).round(1),
+      p50_us: (percentile(latencies, 0.5) * 1e6).round(3),
+      p99_us: (percentile(latencies, 0.99) * 1e6).round(3),
+      peak_rss_kb:
+    }
+  end
+
+  # Run the case in a child process, so that its peak RSS is its own and it can't disturb the cases that come after it
+  module_function def measure_in_child(kase, size, distribution, ops)
+    return measure(kase, size, distribution, ops) unless Process.respond_to?(:fork)
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      writer.write(JSON.generate(measure(kase, size, distribution, ops)))
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    json = reader.read
+    reader.close
+    Process.wait(pid)
+    raise "Child process failed for #{kase.structure}/#{kase.backend}/#{distribution}/#{size}" unless $?.success?
+
+    JSON.parse(json, symbolize_names: true)
+  end
+
+  module_function def run(sizes:, ops:, only:)
+    selected = cases.select { only.nil? || only.include?(_1.structure) }
+    sizes.flat_map do |size|
+      selected.flat_map do |kase|
+        DISTRIBUTIONS.map do |distribution|
+          result = measure_in_child(kase, size, distribution, [ops, size].min)
+          warn format('%-15s %-5s %-25s %-12s %9d %14.1f ops/s  p50 %9.3fus  p99 %9.3fus',
+                      *result.values_at(:structure, :backend, :operation, :distribution, :size, :ops_per_sec, :p50_us, :p99_us))
+          result
+        end
+      end
+    end
+  end
+
+  module_function def gem_version
+    Gem::Specification.load(File.expand_path('../data_structures_rmolinari.gemspec', File.dirname(__FILE__)))&.version.to_s
+  end
+end
+
+if __FILE__ == $PROGRAM_NAME
+  sizes = (ENV['sizes'] || '1000,10000,100000').split(',').map { Integer(_1) }
+  ops = Integer(ENV['ops'] || 100_000)
+  only = ENV['only']&.split(',')&.map(&:to_sym)
+
+  results = BenchmarkSuite.run(sizes:, ops:, only:)
+  report = {
+    meta: {
+      gem_version: BenchmarkSuite.gem_version,
+      ruby_version: RUBY_VERSION,
+      platform: RUBY_PLATFORM,
+      yjit: defined?(RubyVM::YJIT) && RubyVM::YJIT.enabled? ? true : false,
+      time: Time.now.utc.iso8601,
+      sizes:,
+      ops:
+    },
+    results:
+  }
+  json = JSON.pretty_generate(report)
+
+  out = ENV['out'] ||
+        File.expand_path("results/#{report[:meta][:gem_version]}-#{Time.now.utc.strftime('%Y%m%dT%H%M%S')}.json",
+                         File.dirname(__FILE__))
+  if out == '-'
+    puts json
+  else
+    Dir.mkdir(File.dirname(out)) unless Dir.exist?(File.dirname(out))
+    File.write(out, json)
+    warn "Wrote #{results.size} results to #{out}"
+  end
+end
@@ -18,6 +18,17 @@
 #include "ruby.h"
 #include "cc.h" // Convenient Containers
 #include "shared.h"
+#include "numeric.h"
+
+#include "ruby/thread.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+// Have the containers allocate through Ruby, so that the GC sees how much memory we use. They are only resized while we hold the GVL.
+#define CC_REALLOC ruby_xrealloc
+#define CC_FREE ruby_xfree
 
 /**
  * Data type for the (parent, rank) pair, and some accessor helpers for the vec() container we are going to be using.
@@ -30,18 +41,49 @@ typedef struct data_pair {
 
 #define DEFAULT_PARENT -1
 #define DEFAULT_RANK 0
-static data_pair default_pair = { .parent = DEFAULT_PARENT, .rank = DEFAULT_RANK };
-
-static data_pair make_data_pair(long parent, unsigned long rank) {
-  data_pair pair = { .parent = parent, .rank = rank };
-  return pair;
-}
 
 /* The vector generic from Convenient Containers */
 typedef vec(data_pair) pair_vector;
 
-#define parent(disjoint_union_ptr, idx) (get(disjoint_union->pairs, idx)->parent)
-#define rank(disjoint_union_ptr, idx) (get(disjoint_union->pairs, idx)->rank)
+/*
+ * For the compact layout: parents and ranks in separate arrays of int32 and uint8. A rank never exceeds log2 of the size of the
+ * universe, so a byte is plenty.
+ */
+typedef vec(int32_t) parent32_vector;
+typedef vec(uint8_t) rank8_vector;
+
+#define COMPACT_MAX_ELEMENT INT32_MAX
+
+/*
+ * For the rollback mode: a record of one change to the structure, so that it can be undone.
+ *
+ * make_set adds element to the universe. A link puts root element under another root, and may also increment the rank of that root.
+ */
+typedef enum {
+  UNDO_MAKE_SET,
+  UNDO_LINK,
+  UNDO_LINK_AND_RANK
+} undo_kind;
+
+typedef struct {
+  size_t element; // the element added by make_set, or the root that a link put under another
+  undo_kind kind;
+} undo_record;
+
+typedef vec(undo_record) undo_vector;
+
+/*
+ * For the per-set aggregates: the sum, minimum and maximum of the values of the elements in a set, kept as a run of AGGREGATE_CELLS
+ * cells. (A vec() of a struct of cells makes Convenient Containers trip a compiler warning.) Like the set sizes they are kept up to
+ * date only for the roots. The entries for other elements are left as they were when the element stopped being a root.
+ */
+#define AGGREGATE_SUM 0
+#define AGGREGATE_MIN 1
+#define AGGREGATE_MAX 2
+#define AGGREGATE_CELLS 3
+
+typedef vec(size_t) size_vector;
+typedef vec(cell) cell_vector;
 
 /**
  * The C implementation of a Disjoint Union
@@ -61,14 +103,178 @@ typedef vec(data_pair) pair_vector;
  *       keep the trees flat and so most nodes are close to their roots.
  *   - the "rank" of element i
  *     - this value is used to guide the "linking" of trees when subsets are being merged to keep the trees flat.
+ * - parents32, ranks8: when compact is true we use these instead of pairs. They hold the same values, in 5 bytes per element rather
+ *   than 16. The elements must then be no larger than COMPACT_MAX_ELEMENT.
+ * - rollback: when true, find doesn't compress paths and each change is recorded in undo_log so that rollback_to can undo it. The
+ *   trees are then kept shallow by union by rank alone, which gives O(log n) time for find rather than almost constant.
+ * - set_sizes: when aggregates is true, the size of the set each root is the root of.
+ * - value_aggregates: when has_values is true, the sum, min and max of the values of the elements of the set each root is the root
+ *   of. The values are of type value_dtype. In the rollback mode, aggregate_log holds the aggregates each link replaced.
+ * - potentials: when has_potentials is true, each element's potential relative to its parent, of type potential_dtype. The potential
+ *   of a root is zero. So the potential of an element relative to its root is the sum of the potentials on the way up.
  * - subset_count: the number of (disjoint) subsets.
  *   - it isn't needed internally but may be useful to client code.
+ * - stats: the hot-path counters reported by #stats, when they are compiled in. See shared.h.
  */
+#ifdef DSRM_STATS
+typedef struct {
+  uint64_t finds; // calls to find_root(), including the two made by each unite
+  uint64_t find_hops; // parent links between the elements we were asked about and their roots
+  uint64_t path_halving_writes; // parents rewritten by path halving
+  uint64_t links; // pairs of trees linked together
+  uint64_t rank_increments; // links between trees of equal rank, which make the new root's rank go up
+} du_stats;
+#endif
+
 typedef struct du_data {
   pair_vector *pairs; // The generic vector container from the amazing Convenient Containers library
+  parent32_vector *parents32;
+  rank8_vector *ranks8;
+  undo_vector *undo_log;
+  size_vector *set_sizes;
+  cell_vector *value_aggregates;
+  cell_vector *aggregate_log;
+  cell_vector *potentials;
+  int compact;
+  int rollback;
+  int aggregates;
+  int has_values;
+  numeric_dtype value_dtype;
+  int has_potentials;
+  numeric_dtype potential_dtype;
+  int busy; // true while a concurrent batch operation runs without the GVL
+  int ranks_stale; // true after a concurrent batch, which links trees without regard to rank. See repair_ranks().
   size_t subset_count;
+#ifdef DSRM_STATS
+  du_stats stats;
+#endif
 } disjoint_union_data;
 
+/*
+ * Accessors for the parent and rank of an element, whichever layout we use.
+ */
+static long parent_of(disjoint_union_data *disjoint_union, size_t idx) {
+  return disjoint_union->compact ? *get(disjoint_union->parents32, idx) : get(disjoint_union->pairs, idx)->parent;
+}
+
+static void set_parent(disjoint_union_data *disjoint_union, size_t idx, long parent) {
+  if (disjoint_union->compact) {
+    lval(disjoint_union->parents32, idx) = parent;
+  } else {
+    get(disjoint_union->pairs, idx)->parent = parent;
+  }
+}
+
+static unsigned long rank_of(disjoint_union_data *disjoint_union, size_t idx) {
+  return disjoint_union->compact ? *get(disjoint_union->ranks8, idx) : get(disjoint_union->pairs, idx)->rank;
+}
+
+static void set_rank(disjoint_union_data *disjoint_union, size_t idx, unsigned long rank) {
+  if (disjoint_union->compact) {
+    lval(disjoint_union->ranks8, idx) = rank;
+  } else {
+    get(disjoint_union->pairs, idx)->rank = rank;
+  }
+}
+
+static void increment_rank(disjoint_union_data *disjoint_union, size_t idx) {
+  if (disjoint_union->compact) {
+    lval(disjoint_union->ranks8, idx)++;
+  } else {
+    get(disjoint_union->pairs, idx)->rank++;
+  }
+}
+
+static void decrement_rank(disjoint_union_data *disjoint_union, size_t idx) {
+  if (disjoint_union->compact) {
+    lval(disjoint_union->ranks8, idx)--;
+  } else {
+    get(disjoint_union->pairs, idx)->rank--;
+  }
+}
+
+/*
+ * Arithmetic on values and potentials
+ */
+static cell cell_sum(numeric_dtype dtype, cell a, cell b) {
+  cell result;
+  if (dtype == DTYPE_F64) {
+    result.f = a.f + b.f;
+  } else if (__builtin_add_overflow(a.i, b.i, &result.i)) {
+    rb_raise(eSharedDataError, "Overflow in an int64 sum of values or potentials");
+  }
+  return result;
+}
+
+static cell cell_difference(numeric_dtype dtype, cell a, cell b) {
+  cell result;
+  if (dtype == DTYPE_F64) {
+    result.f = a.f - b.f;
+  } else if (__builtin_sub_overflow(a.i, b.i, &result.i)) {
+    rb_raise(eSharedDataError, "Overflow in an int64 difference of potentials");
+  }
+  return result;
+}
+
+/*
+ * The number of slots in the vectors. Not all of them need to be elements of the universe.
+ */
+static size_t slot_count(disjoint_union_data *disjoint_union) {
+  return disjoint_union->compact ? size(disjoint_union->parents32) : size(disjoint_union->pairs);
+}
+
+/*
+ * Grow the vectors to have new_size slots. The new ones are not (yet) elements of the universe.
+ */
+static void grow_slots(disjoint_union_data *disjoint_union, size_t new_size) {
+  size_t old_size = slot_count(disjoint_union);
+  if (disjoint_union->compact) {
+    if (!resize(disjoint_union->parents32, new_size) || !resize(disjoint_union->ranks8, new_size)) {
+      rb_memerror();
+    }
+  } else if (!resize(disjoint_union->pairs, new_size)) {
+    rb_memerror();
+  }
+  if (disjoint_union->aggregates && !resize(disjoint_union->set_sizes, new_size)) {
+    rb_memerror();
+  }
+  if (disjoint_union->has_values && !resize(disjoint_union->value_aggregates, AGGREGATE_CELLS * new_size)) {
+    rb_memerror();
+  }
+  if (disjoint_union->has_potentials && !resize(disjoint_union->potentials, new_size)) {
+    rb_memerror();
+  }
+
+  for (size_t i = old_size; i < new_size; i++) {
+    set_parent(disjoint_union, i, DEFAULT_PARENT);
+  }
+}
+
+/*
+ * Make element, which must be a valid slot, a member of the universe in its own singleton subset.
+ *
+ * value is the element's value when there are value aggregates, and is ignored otherwise.
+ */
+static void make_singleton(disjoint_union_data *disjoint_union, size_t element, cell value) {
+  set_parent(disjoint_union, element, element);
+  if (disjoint_union->compact) {
+    lval(disjoint_union->ranks8, element) = DEFAULT_RANK;
+  } else {
+    get(disjoint_union->pairs, element)->rank = DEFAULT_RANK;
+  }
+
+  if (disjoint_union->aggregates) {
+    lval(disjoint_union->set_sizes, element) = 1;
+  }
+  if (disjoint_union->has_values) {
+    cell *aggregate = get(disjoint_union->value_aggregates, AGGREGATE_CELLS * element);
+    aggregate[AGGREGATE_SUM] = aggregate[AGGREGATE_MIN] = aggregate[AGGREGATE_MAX] = value;
+  }
+  if (disjoint_union->has_potentials) {
+    lval(disjoint_union->potentials, element) = (cell){ .i = 0 }; // all zero bits, so 0.0 for f64 too
+  }
+}
+
 /************************************************************
  * Memory Management
  *
@@ -78,13 +284,39 @@ typedef struct du_data {
  * Create one (on the heap).
  */
 static disjoint_union_data *create_disjoint_union() {
-  disjoint_union_data *disjoint_union = (disjoint_union_data *)malloc(sizeof(disjoint_union_data));
+  disjoint_union_data *disjoint_union = ALLOC(disjoint_union_data);
 
   // Allocate the structures
-  disjoint_union->pairs = malloc(sizeof(pair_vector));
+  disjoint_union->pairs = ALLOC(pair_vector);
   init(disjoint_union->pairs);
+  disjoint_union->parents32 = ALLOC(parent32_vector);
+  init(disjoint_union->parents32);
+  disjoint_union->ranks8 = ALLOC(rank8_vector);
+  init(disjoint_union->ranks8);
+  disjoint_union->undo_log = ALLOC(undo_vector);
+  init(disjoint_union->undo_log);
+  disjoint_union->set_sizes = ALLOC(size_vector);
+  init(disjoint_union->set_sizes);
+  disjoint_union->value_aggregates = ALLOC(cell_vector);
+  init(disjoint_union->value_aggregates);
+  disjoint_union->aggregate_log = ALLOC(cell_vector);
+  init(disjoint_union->aggregate_log);
+  disjoint_union->potentials = ALLOC(cell_vector);
+  init(disjoint_union->potentials);
+  disjoint_union->compact = 0;
+  disjoint_union->rollback = 0;
+  disjoint_union->aggregates = 0;
+  disjoint_union->has_values = 0;
+  disjoint_union->value_dtype = DTYPE_I64;
+  disjoint_union->has_potentials = 0;
+  disjoint_union->potential_dtype = DTYPE_I64;
+  disjoint_union->busy = 0;
+  disjoint_union->ranks_stale = 0;
 
   disjoint_union->subset_count = 0;
+#ifdef DSRM_STATS
+  memset(&disjoint_union->stats, 0, sizeof(du_stats));
+#endif
 
   return disjoint_union;
 }
@@ -98,6 +330,21 @@ static void disjoint_union_free(void *ptr) {
   if (ptr) {
     disjoint_union_data *disjoint_union = ptr;
     cleanup(disjoint_union->pairs);
+    cleanup(disjoint_union->parents32);
+    cleanup(disjoint_union->ranks8);
+    cleanup(disjoint_union->undo_log);
+    cleanup(disjoint_union->set_sizes);
+    cleanup(disjoint_union->value_aggregates);
+    cleanup(disjoint_union->aggregate_log);
+    cleanup(disjoint_union->potentials);
+    xfree(disjoint_union->pairs);
+    xfree(disjoint_union->parents32);
+    xfree(disjoint_union->ranks8);
+    xfree(disjoint_union->undo_log);
+    xfree(disjoint_union->set_sizes);
+    xfree(disjoint_union->value_aggregates);
+    xfree(disjoint_union->aggregate_log);
+    xfree(disjoint_union->potentials);
     xfree(disjoint_union);
   }
 }
@@ -111,8 +358,30 @@ static size_t disjoint_union_memsize(const void *ptr) {
   if (ptr) {
     const disjoint_union_data *du = ptr;
 
-    // See https://github.com/JacksonAllan/CC/issues/3
-    return sizeof( cc_vec_hdr_ty ) + cap( du->pairs ) * CC_EL_SIZE( *(du->pairs) );
+    // See https://github.com/JacksonAllan/CC/issues/3. An empty vector uses a static placeholder, not an allocation, so only the
+    // vectors of the layout in use count. The handles themselves are allocated separately.
+    size_t handles = sizeof(pair_vector) + sizeof(parent32_vector) + sizeof(rank8_vector) + sizeof(undo_vector)
+      + sizeof(size_vector) + 3 * sizeof(cell_vector) + sizeof(disjoint_union_data);
+    if (du->rollback) {
+      handles += sizeof( cc_vec_hdr_ty ) + cap( du->undo_log ) * CC_EL_SIZE( *(du->undo_log) );
+    }
+    if (du->rollback && du->has_values) {
+      handles += sizeof( cc_vec_hdr_ty ) + cap( du->aggregate_log ) * CC_EL_SIZE( *(du->aggregate_log) );
+    }
+    if (du->aggregates) {
+      handles += sizeof( cc_vec_hdr_ty ) + cap( du->set_sizes ) * CC_EL_SIZE( *(du->set_sizes) );
+    }
+    if (du->has_values) {
+      handles += sizeof( cc_vec_hdr_ty ) + cap( du->value_aggregates ) * CC_EL_SIZE( *(du->value_aggregates) );
+    }
+    if (du->has_potentials) {
+      handles += sizeof( cc_vec_hdr_ty ) + cap( du->potentials ) * CC_EL_SIZE( *(du->potentials) );
+    }
+    if (du->compact) {
+      return handles + 2 * sizeof( cc_vec_hdr_ty ) + cap( du->parents32 ) * CC_EL_SIZE( *(du->parents32) )
+        + cap( du->ranks8 ) * CC_EL_SIZE( *(du->ranks8) );
+    }
+    return handles + sizeof( cc_vec_hdr_ty ) + cap( du->pairs ) * CC_EL_SIZE( *(du->pairs) );
   } else {
     return 0;
   }
@@ -147,10 +416,16 @@ static const rb_data_type_t disjoint_union_type = {
 
 /*
  * Unwrap a Ruby-side disjoint union object to get the C struct inside.
+ *
+ * While a concurrent batch operation is running (see unite_pairs_concurrently()) other Ruby threads may run, but they must not touch
+ * the structure, so we raise an exception.
  */
 static disjoint_union_data *unwrapped(VALUE self) {
   disjoint_union_data *disjoint_union;
   TypedData_Get_Struct((self), disjoint_union_data, &disjoint_union_type, disjoint_union);
+  if (disjoint_union->busy) {
+    rb_raise(rb_eRuntimeError, "CDisjointUnion is in use by a concurrent batch operation");
+  }
   return disjoint_union;
 }
 
@@ -177,7 +452,60 @@ static VALUE disjoint_union_alloc(VALUE klass) {
  * Is the given element already a member of the universe?
  */
 static int present_p(disjoint_union_data *disjoint_union, size_t element) {
-  return (size(disjoint_union->pairs) > element && (parent(disjoint_union, element) != DEFAULT_PARENT));
+  return (slot_count(disjoint_union) > element && (parent_of(disjoint_union, element) != DEFAULT_PARENT));
+}
+
+/*
+ * In the rollback mode, record a change so that rollback_to can undo it. Otherwise do nothing.
+ */
+static void log_change(disjoint_union_data *disjoint_union, size_t element, undo_kind kind) {
+  if (!disjoint_union->rollback) {
+    return;
+  }
+  undo_record record = { .element = element, .kind = kind };
+  if (!push(disjoint_union->undo_log, record)) {
+    rb_memerror();
+  }
+}
+
+/*
+ * Undo the changes recorded after the first checkpoint entries of the log, last first. Each takes O(1) time.
+ */
+static void roll_back(disjoint_union_data *disjoint_union, size_t checkpoint) {
+  for (size_t i = size(disjoint_union->undo_log); i > checkpoint; i--) {
+    undo_record *record = get(disjoint_union->undo_log, i - 1);
+    size_t element = record->element;
+
+    if (record->kind == UNDO_MAKE_SET) {
+      // The slot stays, as it would if the vectors had grown for a larger element. It just isn't in the universe any more.
+      set_parent(disjoint_union, element, DEFAULT_PARENT);
+      disjoint_union->subset_count--;
+    } else {
+      size_t root = parent_of(disjoint_union, element);
+      if (record->kind == UNDO_LINK_AND_RANK) {
+        decrement_rank(disjoint_union, root);
+      }
+      if (disjoint_union->aggregates) {
+        lval(disjoint_union->set_sizes, root) -= *get(disjoint_union->set_sizes, element);
+      }
+      if (disjoint_union->has_values) {
+        size_t saved = size(disjoint_union->aggregate_log) - AGGREGATE_CELLS;
+        memcpy(get(disjoint_union->value_aggregates, AGGREGATE_CELLS * root), get(disjoint_union->aggregate_log, saved),
+               AGGREGATE_CELLS * sizeof(cell));
+        if (!resize(disjoint_union->aggregate_log, saved)) {
+          rb_memerror();
+        }
+      }
+      if (disjoint_union->has_potentials) {
+        lval(disjoint_union->potentials, element) = (cell){ .i = 0 };
+      }
+      set_parent(disjoint_union, element, element);
+      disjoint_union->subset_count++;
+    }
+  }
+  if (!resize(disjoint_union->undo_log, checkpoint)) {
+    rb_memerror();
+  }
 }
 
 /*
@@ -190,26 +518,97 @@ static void assert_membership(disjoint_union_data *disjoint_union, size_t elemen
 }
 
 /*
- * Add a new element to the universe. It starts out in its own singleton subset.
+ * Add a new element to the universe. It starts out in its own singleton subset. value is its value for the aggregates, and is
+ * ignored if there aren't any.
  *
  * Shared::DataError is raised if it is already an element.
  */
-static void add_new_element(disjoint_union_data *disjoint_union, size_t element) {
+static void add_new_element(disjoint_union_data *disjoint_union, size_t element, cell value) {
   if (present_p(disjoint_union, element)) {
     rb_raise(eSharedDataError, "Element %zu already present in the universe", element);
   }
 
-  // Expand the underlying vector if necessary
-  size_t sz = size(disjoint_union->pairs);
-  if (sz <= element) {
-    resize(disjoint_union->pairs, element + 1);
-    for (size_t i = sz + 1; i <= element; i++) {
-      lval(disjoint_union->pairs, i) = default_pair;
-    }
+  if (disjoint_union->compact && element > COMPACT_MAX_ELEMENT) {
+    rb_raise(eSharedDataError, "Element %zu is too large for a compact disjoint union", element);
+  }
+
+  // Expand the underlying vectors if necessary
+  if (slot_count(disjoint_union) <= element) {
+    grow_slots(disjoint_union, element + 1);
   }
 
-  lval(disjoint_union->pairs, element) = make_data_pair(element, 0l);
+  make_singleton(disjoint_union, element, value);
   disjoint_union->subset_count++;
+  log_change(disjoint_union, element, UNDO_MAKE_SET);
+}
+
+/*
+ * find_root() in the rollback mode or with potentials. It is kept out of line so that the ordinary loops stay tight.
+ */
+static __attribute__((noinline)) size_t find_root_specially(disjoint_union_data *disjoint_union, size_t element) {
+  size_t x = element;
+  if (disjoint_union->rollback) {
+    // No compression, which would have to be undone too. Union by rank keeps the paths short enough.
+    long p;
+    while ((p = parent_of(disjoint_union, x)) != (long)x) {
+      count_stat(disjoint_union->stats.find_hops, 1);
+      x = p;
+    }
+    return x;
+  }
+
+  // Halving as in find_root(), except that the potential of x must now be relative to its grandparent
+  cell *potentials = get(disjoint_union->potentials, 0);
+  long p, gp;
+  while (p = parent_of(disjoint_union, x), gp = parent_of(disjoint_union, p), p != gp) {
+    potentials[x] = cell_sum(disjoint_union->potential_dtype, potentials[x], potentials[p]);
+    set_parent(disjoint_union, x, gp);
+    count_stat(disjoint_union->stats.find_hops, 2);
+    count_stat(disjoint_union->stats.path_halving_writes, 1);
+    x = gp;
+  }
+  count_stat(disjoint_union->stats.find_hops, (size_t)p != x);
+  return p;
+}
+
+/*
+ * Find the root of the tree containing element, which must be a member of the universe. See find() below.
+ */
+static size_t find_root(disjoint_union_data *disjoint_union, size_t element) {
+  // We use "halving" to shrink the length of paths to the root. See Tarjan and van Leeuwin p 252.
+  //
+  // This is the hot loop, so we work directly on the underlying arrays; the compact one has twice as many elements per cache line
+  // as the ordinary.
+  //
+  // Each step moves x up two levels and makes its grandparent its parent. When we stop, x is the root or a child of it.
+  size_t x = element;
+  count_stat(disjoint_union->stats.finds, 1);
+  if (disjoint_union->rollback || disjoint_union->has_potentials) {
+    return find_root_specially(disjoint_union, element);
+  }
+  if (disjoint_union->compact) {
+    int32_t *parents = get(disjoint_union->parents32, 0);
+    int32_t p, gp; // parent and grandparent
+    while (p = parents[x], gp = parents[p], p != gp) {
+      parents[x] = gp;
+      count_stat(disjoint_union->stats.find_hops, 2);
+      count_stat(disjoint_union->stats.path_halving_writes, 1);
+      x = gp;
+    }
+    count_stat(disjoint_union->stats.find_hops, (size_t)p != x);
+    return p;
+  }
+
+  data_pair *pairs = get(disjoint_union->pairs, 0);
+  long p, gp; // parent and grandparent
+  while (p = pairs[x].parent, gp = pairs[p].parent, p != gp) {
+    pairs[x].parent = gp;
+    count_stat(disjoint_union->stats.find_hops, 2);
+    count_stat(disjoint_union->stats.path_halving_writes, 1);
+    x = gp;
+  }
+  count_stat(disjoint_union->stats.find_hops, (size_t)p != x);
+  return p;
 }
 
 /*
@@ -219,15 +618,63 @@ static void add_new_element(disjoint_union_data *disjoint_union, size_t element)
  */
 static size_t find(disjoint_union_data *disjoint_union, size_t element) {
   assert_membership(disjoint_union, element);
+  return find_root(disjoint_union, element);
+}
 
-  // We use "halving" to shrink the length of paths to the root. See Tarjan and van Leeuwin p 252.
-  size_t x = element;
-  long p, gp; // parent and grandparent
-  while (p = parent(disjoint_union, x), gp = parent(disjoint_union, p), p != gp) {
-    parent(disjoint_union, p) = gp;
-    x = gp;
+/*
+ * Fold the aggregates of the set rooted at child into those of the set rooted at root, as child goes under root.
+ *
+ * An int64 sum that overflows raises Shared::DataError before anything is changed.
+ */
+static void merge_aggregates(disjoint_union_data *disjoint_union, size_t root, size_t child) {
+  if (disjoint_union->has_values) {
+    numeric_dtype dtype = disjoint_union->value_dtype;
+    cell sum = cell_sum(dtype, *get(disjoint_union->value_aggregates, AGGREGATE_CELLS * root + AGGREGATE_SUM),
+                        *get(disjoint_union->value_aggregates, AGGREGATE_CELLS * child + AGGREGATE_SUM));
+
+    if (disjoint_union->rollback) {
+      size_t saved = size(disjoint_union->aggregate_log);
+      if (!resize(disjoint_union->aggregate_log, saved + AGGREGATE_CELLS)) {
+        rb_memerror();
+      }
+      memcpy(get(disjoint_union->aggregate_log, saved), get(disjoint_union->value_aggregates, AGGREGATE_CELLS * root),
+             AGGREGATE_CELLS * sizeof(cell));
+    }
+
+    cell *into = get(disjoint_union->value_aggregates, AGGREGATE_CELLS * root);
+    const cell *from = get(disjoint_union->value_aggregates, AGGREGATE_CELLS * child);
+    into[AGGREGATE_SUM] = sum;
+    if (cell_less(dtype, from[AGGREGATE_MIN], into[AGGREGATE_MIN])) {
+      into[AGGREGATE_MIN] = from[AGGREGATE_MIN];
+    }
+    if (cell_less(dtype, into[AGGREGATE_MAX], from[AGGREGATE_MAX])) {
+      into[AGGREGATE_MAX] = from[AGGREGATE_MAX];
+    }
+  }
+  if (disjoint_union->aggregates) {
+    lval(disjoint_union->set_sizes, root) += *get(disjoint_union->set_sizes, child);
+  }
+}
+
+/*
+ * The work link_roots() does for aggregates and potentials, as child goes under root. Out of line, so that linking without them
+ * stays quick.
+ *
+ * offset is the potential of the second root link_roots() was given relative to the first, and so has to be reversed if child is the
+ * first.
+ */
+static __attribute__((noinline)) void link_extras(disjoint_union_data *disjoint_union, size_t root, size_t child, cell offset,
+                                                  int reversed) {
+  // Work out the child's potential first, as it may overflow, and merge_aggregates() raises before it changes anything
+  cell child_potential = offset;
+  if (disjoint_union->has_potentials && reversed) {
+    cell zero = { .i = 0 };
+    child_potential = cell_difference(disjoint_union->potential_dtype, zero, offset);
+  }
+  merge_aggregates(disjoint_union, root, child);
+  if (disjoint_union->has_potentials) {
+    lval(disjoint_union->potentials, child) = child_potential;
   }
-  return parent(disjoint_union, x);
 }
 
 /*
@@ -236,20 +683,78 @@ static size_t find(disjoint_union_data *disjoint_union, size_t element) {
  * In other words, merge the subtrees containing the two elements.
  *
  * elt1 and elt2 area must be disinct and the roots of their trees, though we don't check that here.
+ *
+ * When there are potentials, offset is the potential of elt2 relative to elt1. Otherwise it is ignored.
  */
-static void link_roots(disjoint_union_data *disjoint_union, size_t elt1, size_t elt2) {
-  if (rank(disjoint_union, elt1) > rank(disjoint_union, elt2)) {
-    parent(disjoint_union, elt2) =  elt1;
-  } else if (rank(disjoint_union, elt1) == rank(disjoint_union, elt2)) {
-    parent(disjoint_union, elt2) = elt1;
-    rank(disjoint_union, elt1)++;
-  } else {
-    parent(disjoint_union, elt1) = elt2;
+static void link_roots(disjoint_union_data *disjoint_union, size_t elt1, size_t elt2, cell offset) {
+  unsigned long rank1 = rank_of(disjoint_union, elt1);
+  unsigned long rank2 = rank_of(disjoint_union, elt2);
+  size_t root = rank1 >= rank2 ? elt1 : elt2;
+  size_t child = rank1 >= rank2 ? elt2 : elt1;
+
+  if (disjoint_union->aggregates || disjoint_union->has_potentials) {
+    link_extras(disjoint_union, root, child, offset, child == elt1);
+  }
+
+  set_parent(disjoint_union, child, root);
+  if (rank1 == rank2) {
+    increment_rank(disjoint_union, root);
+    count_stat(disjoint_union->stats.rank_increments, 1);
   }
+  log_change(disjoint_union, child, rank1 == rank2 ? UNDO_LINK_AND_RANK : UNDO_LINK);
 
+  count_stat(disjoint_union->stats.links, 1);
   disjoint_union->subset_count--;
 }
 
+/*
+ * The potential of element relative to the root of its tree. It must be a member of the universe.
+ */
+static cell potential_of(disjoint_union_data *disjoint_union, size_t element) {
+  numeric_dtype dtype = disjoint_union->potential_dtype;
+  cell potential = { .i = 0 };
+  long p;
+
+  for (size_t x = element; (p = parent_of(disjoint_union, x)) != (long)x; x = p) {
+    potential = cell_sum(dtype, potential, *get(disjoint_union->potentials, x));
+  }
+  return potential;
+}
+
+/*
+ * With potentials: merge the subsets containing elt1 and elt2 so that potential(elt2) - potential(elt1) = difference.
+ *
+ * If they are already in the same subset we check that the difference is the one we know about, raising Shared::DataError if not.
+ * For f64 potentials we don't check, as the rounding in the sums makes exact comparison meaningless.
+ */
+static void unite_with_difference(disjoint_union_data *disjoint_union, size_t elt1, size_t elt2, cell difference) {
+  numeric_dtype dtype = disjoint_union->potential_dtype;
+
+  assert_membership(disjoint_union, elt1);
+  assert_membership(disjoint_union, elt2);
+
+  if (elt1 == elt2) {
+    rb_raise(eSharedDataError, "Uniting an element with itself is meaningless");
+  }
+
+  size_t root1 = find_root(disjoint_union, elt1);
+  size_t root2 = find_root(disjoint_union, elt2);
+  cell potential1 = potential_of(disjoint_union, elt1);
+  cell potential2 = potential_of(disjoint_union, elt2);
+
+  if (root1 == root2) {
+    if (dtype == DTYPE_I64 && cell_difference(dtype, potential2, potential1).i != difference.i) {
+      rb_raise(eSharedDataError, "The difference %" PRId64 " between %zu and %zu contradicts the known one of %" PRId64,
+               difference.i, elt1, elt2, cell_difference(dtype, potential2, potential1).i);
+    }
+    return;
+  }
+
+  // potential(root2) - potential(root1) = (potential(elt2) - potential2) - (potential(elt1) - potential1)
+  cell offset = cell_difference(dtype, cell_sum(dtype, difference, potential1), potential2);
+  link_roots(disjoint_union, root1, root2, offset);
+}
+
 /*
  * "Unite" or merge the subsets containing elt1 and elt2.
  */
@@ -261,20 +766,383 @@ static void unite(disjoint_union_data *disjoint_union, size_t elt1, size_t elt2)
     rb_raise(eSharedDataError, "Uniting an element with itself is meaningless");
   }
 
-  size_t root1 = find(disjoint_union, elt1);
-  size_t root2 = find(disjoint_union, elt2);
+  size_t root1 = find_root(disjoint_union, elt1);
+  size_t root2 = find_root(disjoint_union, elt2);
 
   if (root1 == root2) {
     return; // already united
   }
 
-  link_roots(disjoint_union, root1, root2);
+  link_roots(disjoint_union, root1, root2, (cell){ .i = 0 });
+}
+
+/*
+ * Unite each of the given pairs of elements. A pair in which both elements are the same is skipped.
+ *
+ * If an element is not in the universe we raise Shared::DataError. The pairs before it will have been united.
+ */
+static void unite_pairs(disjoint_union_data *disjoint_union, const index_pairs *pairs) {
+  for (long i = 0; i < pairs->count; i++) {
+    size_t elt1, elt2;
+    index_pair_at(pairs, i, &elt1, &elt2);
+    assert_membership(disjoint_union, elt1);
+    assert_membership(disjoint_union, elt2);
+
+    size_t root1 = find_root(disjoint_union, elt1);
+    size_t root2 = find_root(disjoint_union, elt2);
+    if (root1 != root2) {
+      link_roots(disjoint_union, root1, root2, (cell){ .i = 0 });
+    }
+  }
 }
 
 /*
  * End C impelementaion of the Segment Tree API
  ************************************************************/
 
+/************************************************************
+ * Concurrent unite_many
+ *
+ * We split the batch of pairs among a set of POSIX threads, which run without the GVL and work on the parent array at the same time.
+ * This uses the lock-free ideas of Anderson and Woll and of Jayanti and Tarjan:
+ *
+ * - find() does path halving with compare-and-swap. If the CAS fails then some other thread has already changed the parent pointer,
+ *   always to an ancestor, and no harm is done.
+ * - To link two roots we CAS the parent of one of them from itself to the other. If that fails the root is no longer a root, and we
+ *   start again by finding the roots.
+ * - We can't maintain ranks atomically along with the parents. Instead we link by a fixed pseudorandom priority of the elements,
+ *   always putting the root of lower priority under the one of higher priority. This can't make a cycle and keeps the trees shallow
+ *   in expectation. The ranks are left alone, which is harmless: later calls to unite just see them as inaccurate and the trees stay
+ *   correct. Only an image needs them to be right, so dump repairs them first.
+ *
+ * - Anderson, R. J., Woll, H., _Wait-free Parallel Algorithms for the Union-Find Problem_, STOC 1991, pp 370-380.
+ * - Jayanti, S. V., Tarjan, R. E., _A Randomized Concurrent Algorithm for Disjoint Set Union_, PODC 2016, pp 75-82.
+ */
+
+#define MAX_THREADS 256
+
+/*
+ * The pairs for a concurrent batch, as a plain array of int64 values e0, f0, e1, f1, ...
+ */
+typedef struct {
+  disjoint_union_data *disjoint_union;
+  const int64_t *values;
+  long count; // the number of pairs
+  long thread_count;
+} concurrent_job;
+
+typedef struct {
+  concurrent_job *job;
+  long begin, end; // the range of pairs for this thread
+  size_t links; // how many successful links this thread made
+} concurrent_task;
+
+/* The priority by which we link roots */
+static uint64_t link_priority(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static int links_above(size_t x, size_t y) {
+  uint64_t px = link_priority(x), py = link_priority(y);
+  return px < py || (px == py && x < y);
+}
+
+/*
+ * The concurrent versions of find_root() and a unite that doesn't check its arguments, one for each layout. parent_type is the type
+ * of a parent value and PARENT(du, i) is an lvalue for the parent of i.
+ */
+#define DEFINE_CONCURRENT_OPS(suffix, parent_type, PARENT)                                                          \
+  static size_t concurrent_find_##suffix(disjoint_union_data *du, size_t x) {                                      \
+    for (;;) {                                                                                                      \
+      parent_type p = __atomic_load_n(&PARENT(du, x), __ATOMIC_RELAXED);                                            \
+      parent_type gp = __atomic_load_n(&PARENT(du, p), __ATOMIC_RELAXED);                                           \
+      if (p == gp) {                                                                                                \
+        return p;                                                                                                   \
+      }                                                                                                             \
+      __atomic_compare_exchange_n(&PARENT(du, x), &p, gp, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);                  \
+      x = gp;                                                                                                       \
+    }                                                                                                               \
+  }                                                                                                                 \
+                                                                                                                    \
+  static int concurrent_unite_##suffix(disjoint_union_data *du, size_t x, size_t y) {                              \
+    for (;;) {                                                                                                      \
+      x = concurrent_find_##suffix(du, x);                                                                          \
+      y = concurrent_find_##suffix(du, y);                                                                          \
+      if (x == y) {                                                                                                 \
+        return 0;                                                                                                   \
+      }                                                                                                             \
+      if (!links_above(x, y)) {                                                                                     \
+        size_t tmp = x;                                                                                             \
+        x = y;                                                                                                      \
+        y = tmp;                                                                                                    \
+      }                                                                                                             \
+      parent_type expected = x;                                                                                     \
+      if (__atomic_compare_exchange_n(&PARENT(du, x), &expected, (parent_type)y, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) { \
+        return 1;                                                                                                   \
+      }                                                                                                             \
+    }                                                                                                               \
+  }
+
+#define PAIR_PARENT(du, i) (get((du)->pairs, 0)[i].parent)
+#define COMPACT_PARENT(du, i) (get((du)->parents32, 0)[i])
+DEFINE_CONCURRENT_OPS(pairs, long, PAIR_PARENT)
+DEFINE_CONCURRENT_OPS(compact, int32_t, COMPACT_PARENT)
+
+static void *run_concurrent_task(void *arg) {
+  concurrent_task *task = arg;
+  disjoint_union_data *du = task->job->disjoint_union;
+  const int64_t *values = task->job->values;
+
+  size_t links = 0;
+  for (long i = task->begin; i < task->end; i++) {
+    size_t x = values[2 * i], y = values[2 * i + 1];
+    if (x != y) {
+      links += du->compact ? concurrent_unite_compact(du, x, y) : concurrent_unite_pairs(du, x, y);
+    }
+  }
+  task->links = links;
+  return NULL;
+}
+
+/*
+ * Run the job across its threads. This is called without the GVL, so it mustn't touch any Ruby objects.
+ *
+ * If we can't start a thread we do its share of the work here instead.
+ */
+static void *run_concurrent_job(void *arg) {
+  concurrent_job *job = arg;
+  concurrent_task tasks[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS];
+
+  long chunk = (job->count + job->thread_count - 1) / job->thread_count;
+  for (long t = 0; t < job->thread_count; t++) {
+    tasks[t].job = job;
+    tasks[t].begin = t * chunk < job->count ? t * chunk : job->count;
+    tasks[t].end = tasks[t].begin + chunk < job->count ? tasks[t].begin + chunk : job->count;
+    tasks[t].links = 0;
+    started[t] = t > 0 && pthread_create(&threads[t], NULL, run_concurrent_task, &tasks[t]) == 0;
+  }
+
+  // This thread takes the first share, and any that we failed to hand off.
+  for (long t = 0; t < job->thread_count; t++) {
+    if (!started[t]) {
+      run_concurrent_task(&tasks[t]);
+    }
+  }
+
+  size_t links = 0;
+  for (long t = 0; t < job->thread_count; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+    links += tasks[t].links;
+  }
+  job->disjoint_union->subset_count -= links;
+  return NULL;
+}
+
+/*
+ * Unite each of the given pairs, as unite_pairs() does, using thread_count threads.
+ *
+ * We check every element before we start, so that nothing in the batch is united if one of them is not in the universe.
+ */
+static void unite_pairs_concurrently(disjoint_union_data *disjoint_union, const index_pairs *pairs, long thread_count) {
+  // Take a copy of the pairs, so the worker threads don't need to look at any Ruby objects
+  int64_t *values = ALLOC_N(int64_t, 2 * pairs->count);
+  for (long i = 0; i < pairs->count; i++) {
+    size_t elt1, elt2;
+    index_pair_at(pairs, i, &elt1, &elt2);
+    if (!present_p(disjoint_union, elt1) || !present_p(disjoint_union, elt2)) {
+      xfree(values);
+      assert_membership(disjoint_union, elt1);
+      assert_membership(disjoint_union, elt2);
+    }
+    values[2 * i] = elt1;
+    values[2 * i + 1] = elt2;
+  }
+
+  concurrent_job job = {
+    .disjoint_union = disjoint_union,
+    .values = values,
+    .count = pairs->count,
+    .thread_count = thread_count
+  };
+
+  disjoint_union->busy = 1;
+  rb_thread_call_without_gvl(run_concurrent_job, &job, NULL, NULL);
+  disjoint_union->busy = 0;
+  disjoint_union->ranks_stale = 1;
+
+  xfree(values);
+}
+
+/*
+ * End concurrent unite_many
+ ************************************************************/
+
+/************************************************************
+ * Images
+ *
+ * See shared.h. After the header comes a du_image_preamble and then the raw vector contents for the layout: the data_pairs, or the
+ * int32 parents followed by the uint8 ranks.
+ *
+ * We can't use a mapped image in place, as the vectors belong to Convenient Containers and grow in make_set. Nor would it help much:
+ * find() rewrites parents as it goes, so the pages wouldn't stay shared for long. So CDisjointUnion.open maps the image only to copy
+ * it into fresh vectors.
+ */
+
+#define DU_IMAGE_KIND "CDJU"
+#define DU_IMAGE_VERSION 1
+
+typedef struct {
+  uint64_t slot_count;
+  uint64_t subset_count;
+  uint32_t compact;
+  uint32_t rollback; // zero in images written before the rollback mode existed
+} du_image_preamble;
+
+/*
+ * Raise ranks until each parent's rank is larger than its child's, as union by rank keeps them and restore_slots() checks.
+ *
+ * Raising the rank of an element can only break the link to its own parent, so we fix each chain from the bottom up. The ranks end
+ * up no larger than the heights of the trees, which the concurrent linking keeps to O(log n) in expectation.
+ */
+static void repair_ranks(disjoint_union_data *disjoint_union) {
+  size_t slots = slot_count(disjoint_union);
+  unsigned long max_rank = disjoint_union->compact ? UINT8_MAX : ULONG_MAX;
+
+  for (size_t i = 0; i < slots; i++) {
+    if (parent_of(disjoint_union, i) == DEFAULT_PARENT) {
+      continue;
+    }
+    size_t x = i;
+    size_t p;
+    while ((p = parent_of(disjoint_union, x)) != x && rank_of(disjoint_union, p) <= rank_of(disjoint_union, x)) {
+      unsigned long rank = rank_of(disjoint_union, x);
+      if (rank == max_rank) {
+        rb_raise(eSharedDataError, "A tree of the CDisjointUnion is too deep to dump");
+      }
+      set_rank(disjoint_union, p, rank + 1);
+      x = p;
+    }
+  }
+  disjoint_union->ranks_stale = 0;
+}
+
+static void dump_image(disjoint_union_data *disjoint_union, VALUE io) {
+  if (disjoint_union->ranks_stale) {
+    repair_ranks(disjoint_union);
+  }
+  size_t slots = slot_count(disjoint_union);
+  du_image_preamble preamble = {
+    .slot_count = slots,
+    .subset_count = disjoint_union->subset_count,
+    .compact = disjoint_union->compact,
+    .rollback = disjoint_union->rollback
+  };
+
+  image_write_header(io, DU_IMAGE_KIND, DU_IMAGE_VERSION);
+  image_write(io, &preamble, sizeof(preamble));
+  if (slots == 0) {
+    return;
+  }
+  if (disjoint_union->compact) {
+    image_write(io, get(disjoint_union->parents32, 0), slots * sizeof(int32_t));
+    image_write(io, get(disjoint_union->ranks8, 0), slots * sizeof(uint8_t));
+  } else {
+    image_write(io, get(disjoint_union->pairs, 0), slots * sizeof(data_pair));
+  }
+}
+
+/*
+ * Set up an empty disjoint union from the preamble of an image, with room for the vector contents.
+ */
+static void restore_preamble(disjoint_union_data *disjoint_union, const du_image_preamble *preamble) {
+  image_array_bytes(preamble->slot_count, sizeof(data_pair));
+  if (preamble->compact > 1 || preamble->rollback > 1 || preamble->subset_count > preamble->slot_count
+      || (preamble->compact && preamble->slot_count > (size_t)COMPACT_MAX_ELEMENT + 1)) {
+    rb_raise(eSharedDataError, "Image of a CDisjointUnion is corrupt");
+  }
+
+  disjoint_union->compact = preamble->compact;
+  disjoint_union->rollback = preamble->rollback;
+  disjoint_union->subset_count = preamble->subset_count;
+  grow_slots(disjoint_union, preamble->slot_count);
+}
+
+/*
+ * Copy the vector contents of an image into place. read_part is image_read() or a wrapper around image_mapped_part().
+ */
+static void restore_slots(disjoint_union_data *disjoint_union, void (*read_part)(VALUE, void *, size_t), VALUE source) {
+  size_t slots = slot_count(disjoint_union);
+  if (slots == 0) {
+    return;
+  }
+
+  if (disjoint_union->compact) {
+    read_part(source, get(disjoint_union->parents32, 0), slots * sizeof(int32_t));
+    read_part(source, get(disjoint_union->ranks8, 0), slots * sizeof(uint8_t));
+  } else {
+    read_part(source, get(disjoint_union->pairs, 0), slots * sizeof(data_pair));
+  }
+
+  // find() follows parents without checking them, so a corrupt image mustn't send it outside the vectors or round a cycle. Union by
+  // rank makes a parent's rank larger than its child's, and ranks that strictly increase along each parent chain mean that it
+  // reaches a root in fewer than slots steps.
+  size_t roots = 0;
+  for (size_t i = 0; i < slots; i++) {
+    long parent = parent_of(disjoint_union, i);
+    if (parent == DEFAULT_PARENT) {
+      continue;
+    }
+    if (parent < 0 || (size_t)parent >= slots || parent_of(disjoint_union, parent) == DEFAULT_PARENT) {
+      rb_raise(eSharedDataError, "Image of a CDisjointUnion is corrupt");
+    }
+    if ((size_t)parent == i) {
+      roots++;
+    } else if (rank_of(disjoint_union, parent) <= rank_of(disjoint_union, i)) {
+      rb_raise(eSharedDataError, "Image of a CDisjointUnion is corrupt");
+    }
+  }
+  if (roots != disjoint_union->subset_count) {
+    rb_raise(eSharedDataError, "Image of a CDisjointUnion is corrupt");
+  }
+}
+
+static void read_mapped_part(VALUE mapping, void *ptr, size_t len) {
+  memcpy(ptr, image_mapped_part((image_mapping *)mapping, len), len);
+}
+
+typedef struct {
+  VALUE self;
+  VALUE path;
+  image_mapping mapping;
+} open_args;
+
+static VALUE restore_from_mapping(VALUE arg) {
+  open_args *args = (open_args *)arg;
+  disjoint_union_data *disjoint_union = unwrapped(args->self);
+
+  image_map(args->path, &args->mapping, DU_IMAGE_KIND, DU_IMAGE_VERSION);
+  restore_preamble(disjoint_union, image_mapped_part(&args->mapping, sizeof(du_image_preamble)));
+  restore_slots(disjoint_union, read_mapped_part, (VALUE)&args->mapping);
+
+  return args->self;
+}
+
+static VALUE unmap_open_args(VALUE arg) {
+  image_unmap(&((open_args *)arg)->mapping);
+  return Qnil;
+}
+
+/*
+ * End images
+ ************************************************************/
+
 /************************************************************
  * The wrappers around the C functionality.
  *
@@ -286,24 +1154,75 @@ static void unite(disjoint_union_data *disjoint_union, size_t elt1, size_t elt2)
  * 0, 1, ..., s-1.
  *
  * If no argument is given we act as though a value of 0 were passed.
+ *
+ * The keyword argument compact: true selects the compact layout, which uses 5 bytes per element rather than 16 but limits the elements
+ * to be less than 2**31.
+ *
+ * The keyword argument rollback: true selects the rollback mode, in which changes can be undone: see #checkpoint and #rollback_to.
+ * Then find doesn't compress paths and takes O(log n) time.
+ *
+ * Per-set aggregates, kept up to date for each set as sets are united:
+ * - aggregates: true keeps the size of each set. See #set_size.
+ * - values: an Array of a value for each element, all Integers in the int64 range or all Floats, keeps the sum, minimum and maximum
+ *   of the values in each set as well as its size. See #set_aggregate. To start with an empty universe pass the dtype instead, :i64
+ *   or :f64, and no size. Either way, make_set then needs the new element's value.
+ * - potentials: :i64 or :f64 gives each element a potential, known relative to the others in its set. unite(e, f, d) then says that
+ *   potential(f) - potential(e) = d. See #potential_difference.
  */
 static VALUE disjoint_union_init(int argc, VALUE *argv, VALUE self) {
-  if (argc == 0) {
-    return self;
-  } else if (argc > 1) {
-    rb_raise(rb_eArgError, "wrong number of arguments");
-  } else {
-    size_t initial_size = checked_nonneg_fixnum(argv[0]);
-    disjoint_union_data *disjoint_union = unwrapped(self);
+  VALUE size_val, opts, values_arg = Qnil;
+  rb_scan_args(argc, argv, "01:", &size_val, &opts);
+  disjoint_union_data *disjoint_union = unwrapped(self);
+
+  if (!NIL_P(opts)) {
+    ID keys[5] = { rb_intern("compact"), rb_intern("rollback"), rb_intern("aggregates"), rb_intern("values"), rb_intern("potentials") };
+    VALUE values[5];
+    rb_get_kwargs(opts, keys, 0, 5, values);
+    disjoint_union->compact = values[0] != Qundef && RTEST(values[0]);
+    disjoint_union->rollback = values[1] != Qundef && RTEST(values[1]);
+    disjoint_union->aggregates = values[2] != Qundef && RTEST(values[2]);
 
-    pair_vector *pair_vec = disjoint_union->pairs;
-    resize(pair_vec, initial_size);
+    if (values[3] != Qundef && !NIL_P(values[3])) {
+      values_arg = values[3];
+      VALUE dtype = RB_TYPE_P(values_arg, T_SYMBOL) ? values_arg : native_dtype_of(values_arg, NULL);
+      if (NIL_P(dtype)) {
+        rb_raise(eSharedDataError, "values must all be Integers in the int64 range or all be Floats");
+      }
+      disjoint_union->has_values = 1;
+      disjoint_union->aggregates = 1;
+      disjoint_union->value_dtype = dtype_from_symbol(dtype);
+    }
 
-    for (size_t i = 0; i < initial_size; i++) {
-      lval(pair_vec, i) = make_data_pair(i, 0);
+    if (values[4] != Qundef && !NIL_P(values[4])) {
+      disjoint_union->has_potentials = 1;
+      disjoint_union->potential_dtype = dtype_from_symbol(values[4]);
     }
-    disjoint_union->subset_count = initial_size;
   }
+
+  size_t initial_size = NIL_P(size_val) ? 0 : checked_nonneg_fixnum(size_val);
+  if (disjoint_union->compact && initial_size > (size_t)COMPACT_MAX_ELEMENT + 1) {
+    rb_raise(eSharedDataError, "Size %zu is too large for a compact disjoint union", initial_size);
+  }
+
+  int values_given = RB_TYPE_P(values_arg, T_ARRAY);
+  if (values_given && (size_t)RARRAY_LEN(values_arg) != initial_size) {
+    rb_raise(rb_eArgError, "Got %ld values for a universe of size %zu", RARRAY_LEN(values_arg), initial_size);
+  }
+  if (disjoint_union->has_values && !values_given && initial_size > 0) {
+    rb_raise(rb_eArgError, "values: :%"PRIsVALUE" gives no values for a universe of size %zu. Pass an Array of values instead",
+             values_arg, initial_size);
+  }
+
+  grow_slots(disjoint_union, initial_size);
+  for (size_t i = 0; i < initial_size; i++) {
+    cell value = { .i = 0 };
+    if (values_given) {
+      value = cell_from_value(disjoint_union->value_dtype, RARRAY_AREF(values_arg, i));
+    }
+    make_singleton(disjoint_union, i, value);
+  }
+  disjoint_union->subset_count = initial_size;
+
   return self;
 }
 
@@ -312,9 +1231,25 @@ static VALUE disjoint_union_init(int argc, VALUE *argv, VALUE self) {
  *
  * @param arg the new element, starting in its own singleton subset
  *   - it must be a non-negative integer, not already part of the universe of elements.
+ * @param value the element's value, which is needed just when the disjoint union was made with values:
  */
-static VALUE disjoint_union_make_set(VALUE self, VALUE arg) {
-  add_new_element(unwrapped(self), checked_nonneg_fixnum(arg));
+static VALUE disjoint_union_make_set(int argc, VALUE *argv, VALUE self) {
+  VALUE arg, value_arg;
+  rb_scan_args(argc, argv, "11", &arg, &value_arg);
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  size_t element = checked_nonneg_fixnum(arg);
+
+  cell value = { .i = 0 };
+  if (disjoint_union->has_values) {
+    if (NIL_P(value_arg)) {
+      rb_raise(rb_eArgError, "make_set needs the value of the new element");
+    }
+    value = cell_from_value(disjoint_union->value_dtype, value_arg);
+  } else if (!NIL_P(value_arg)) {
+    rb_raise(rb_eArgError, "A value for make_set needs a CDisjointUnion made with values:");
+  }
+
+  add_new_element(disjoint_union, element, value);
 
   return Qnil;
 }
@@ -342,12 +1277,285 @@ static VALUE disjoint_union_find(VALUE self, VALUE arg) {
  * Declare that the arguments are equivalent, i.e., in the same subset. If they are already in the same subset this is a no-op.
  *
  * Each argument must be in the universe of elements
+ *
+ * With potentials the third argument, difference, is needed: it says that potential(arg2) - potential(arg1) = difference. If the
+ * arguments are already in the same subset and we know of a different difference - for :i64 potentials only - we raise
+ * Shared::DataError.
  */
-static VALUE disjoint_union_unite(VALUE self, VALUE arg1, VALUE arg2) {
-  unite(unwrapped(self), checked_nonneg_fixnum(arg1), checked_nonneg_fixnum(arg2));
+static VALUE disjoint_union_unite(int argc, VALUE *argv, VALUE self) {
+  VALUE arg1, arg2, difference;
+  rb_scan_args(argc, argv, "21", &arg1, &arg2, &difference);
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  size_t elt1 = checked_nonneg_fixnum(arg1);
+  size_t elt2 = checked_nonneg_fixnum(arg2);
 
+  if (disjoint_union->has_potentials) {
+    if (NIL_P(difference)) {
+      rb_raise(rb_eArgError, "unite needs the difference between the potentials");
+    }
+    unite_with_difference(disjoint_union, elt1, elt2, cell_from_value(disjoint_union->potential_dtype, difference));
+  } else if (!NIL_P(difference)) {
+    rb_raise(rb_eArgError, "A difference for unite needs a CDisjointUnion made with potentials:");
+  } else {
+    unite(disjoint_union, elt1, elt2);
+  }
+
+  return Qnil;
+}
+
+/*
+ * Unite each of a batch of pairs of elements, without returning to Ruby between them.
+ *
+ * The pairs are given as two Arrays of elements, firsts and seconds, of the same size, or as a single String of packed int64 values
+ * e0, f0, e1, f1, ..., as made by Array#pack('q*'). Pairs in which both elements are the same are skipped rather than raising an
+ * error as unite does.
+ *
+ * With the keyword argument threads: n, for n > 1, the work is shared among n native threads, which run without the GVL. The
+ * resulting partition is the same, but the canonical representatives may differ from the ones a sequential run would give. In this
+ * case, if any element is not in the universe no pairs are united. The threads compress paths as they go, and don't know about
+ * aggregates, so they can't be used in the rollback mode or with aggregates.
+ *
+ * There is no way to give the differences for potentials, so with potentials we raise Shared::LogicError. Use unite.
+ */
+static VALUE disjoint_union_unite_many(int argc, VALUE *argv, VALUE self) {
+  VALUE args[2], opts;
+  int pair_argc = rb_scan_args(argc, argv, "11:", &args[0], &args[1], &opts);
+
+  long thread_count = 1;
+  if (!NIL_P(opts)) {
+    ID keys[1] = { rb_intern("threads") };
+    VALUE values[1];
+    rb_get_kwargs(opts, keys, 0, 1, values);
+    if (values[0] != Qundef) {
+      thread_count = NUM2LONG(values[0]);
+      if (thread_count < 1 || thread_count > MAX_THREADS) {
+        rb_raise(rb_eArgError, "threads must be between 1 and %d", MAX_THREADS);
+      }
+    }
+  }
+
+  index_pairs pairs;
+  read_index_pairs(pair_argc, args, &pairs);
+
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (disjoint_union->has_potentials) {
+    rb_raise(eSharedLogicError, "unite_many can't be used with potentials");
+  }
+  if (thread_count > 1) {
+    if (disjoint_union->rollback || disjoint_union->aggregates) {
+      rb_raise(rb_eArgError, "threads: can't be used in the rollback mode or with aggregates");
+    }
+    unite_pairs_concurrently(disjoint_union, &pairs, thread_count);
+  } else {
+    unite_pairs(disjoint_union, &pairs);
+  }
+
+  RB_GC_GUARD(args[0]);
+  return Qnil;
+}
+
+/*
+ * The canonical representatives of a batch of elements.
+ *
+ * The elements are given as an Array of Integers, in which case we return an Array, or as a String of packed int64 values, in which
+ * case we return the representatives in the same form.
+ */
+static VALUE disjoint_union_find_many(VALUE self, VALUE elements) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  index_list list;
+  read_index_list(elements, &list);
+
+  if (list.packed) {
+    VALUE result = rb_str_new(NULL, list.count * sizeof(int64_t));
+    char *out = RSTRING_PTR(result);
+    for (long i = 0; i < list.count; i++) {
+      int64_t root = find(disjoint_union, index_list_at(&list, i));
+      memcpy(out + i * sizeof(int64_t), &root, sizeof(root));
+    }
+    RB_GC_GUARD(elements);
+    return result;
+  }
+
+  VALUE result = rb_ary_new_capa(list.count);
+  for (long i = 0; i < list.count; i++) {
+    rb_ary_push(result, LONG2NUM(find(disjoint_union, index_list_at(&list, i))));
+  }
+  return result;
+}
+
+/*
+ * Only with aggregates: the number of elements in the subset containing e, which must be in the universe.
+ */
+static VALUE disjoint_union_set_size(VALUE self, VALUE arg) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (!disjoint_union->aggregates) {
+    rb_raise(eSharedLogicError, "set_size needs a CDisjointUnion made with aggregates: true or values:");
+  }
+  return SIZET2NUM(*get(disjoint_union->set_sizes, find(disjoint_union, checked_nonneg_fixnum(arg))));
+}
+
+/*
+ * Only with aggregates: the aggregates of the subset containing e, which must be in the universe, as a Hash. It has the key :size
+ * and, if the disjoint union was made with values:, the keys :sum, :min and :max for the values of the subset's elements.
+ */
+static VALUE disjoint_union_set_aggregate(VALUE self, VALUE arg) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (!disjoint_union->aggregates) {
+    rb_raise(eSharedLogicError, "set_aggregate needs a CDisjointUnion made with aggregates: true or values:");
+  }
+
+  size_t root = find(disjoint_union, checked_nonneg_fixnum(arg));
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("size")), SIZET2NUM(*get(disjoint_union->set_sizes, root)));
+  if (disjoint_union->has_values) {
+    const cell *aggregate = get(disjoint_union->value_aggregates, AGGREGATE_CELLS * root);
+    numeric_dtype dtype = disjoint_union->value_dtype;
+    rb_hash_aset(hash, ID2SYM(rb_intern("sum")), value_from_cell(dtype, aggregate[AGGREGATE_SUM]));
+    rb_hash_aset(hash, ID2SYM(rb_intern("min")), value_from_cell(dtype, aggregate[AGGREGATE_MIN]));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max")), value_from_cell(dtype, aggregate[AGGREGATE_MAX]));
+  }
+  return hash;
+}
+
+/*
+ * Only with potentials: the potential of e relative to find(e), the canonical representative of its subset.
+ */
+static VALUE disjoint_union_potential(VALUE self, VALUE arg) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (!disjoint_union->has_potentials) {
+    rb_raise(eSharedLogicError, "potential needs a CDisjointUnion made with potentials:");
+  }
+
+  size_t element = checked_nonneg_fixnum(arg);
+  find(disjoint_union, element); // shortens the path we are about to walk
+  return value_from_cell(disjoint_union->potential_dtype, potential_of(disjoint_union, element));
+}
+
+/*
+ * Only with potentials: potential(f) - potential(e), or nil if e and f are in different subsets and so have no known difference.
+ */
+static VALUE disjoint_union_potential_difference(VALUE self, VALUE arg1, VALUE arg2) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (!disjoint_union->has_potentials) {
+    rb_raise(eSharedLogicError, "potential_difference needs a CDisjointUnion made with potentials:");
+  }
+
+  size_t elt1 = checked_nonneg_fixnum(arg1);
+  size_t elt2 = checked_nonneg_fixnum(arg2);
+  if (find(disjoint_union, elt1) != find(disjoint_union, elt2)) {
+    return Qnil;
+  }
+
+  numeric_dtype dtype = disjoint_union->potential_dtype;
+  cell difference = cell_difference(dtype, potential_of(disjoint_union, elt2), potential_of(disjoint_union, elt1));
+  return value_from_cell(dtype, difference);
+}
+
+/*
+ * Only in the rollback mode: a checkpoint, an Integer to pass to #rollback_to to undo the changes made after it.
+ */
+static VALUE disjoint_union_checkpoint(VALUE self) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (!disjoint_union->rollback) {
+    rb_raise(eSharedLogicError, "Checkpoints need a CDisjointUnion made with rollback: true");
+  }
+  return SIZET2NUM(size(disjoint_union->undo_log));
+}
+
+/*
+ * Only in the rollback mode: undo the calls to unite and make_set since checkpoint was taken, putting the structure back as it was
+ * then. This takes O(1) time for each link or new element undone.
+ *
+ * Checkpoints taken after the given one become invalid, and so in effect do those taken before a dump.
+ */
+static VALUE disjoint_union_rollback_to(VALUE self, VALUE checkpoint) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (!disjoint_union->rollback) {
+    rb_raise(eSharedLogicError, "Rolling back needs a CDisjointUnion made with rollback: true");
+  }
+
+  size_t c_checkpoint = checked_nonneg_fixnum(checkpoint);
+  if (c_checkpoint > size(disjoint_union->undo_log)) {
+    rb_raise(eSharedDataError, "%zu is not a current checkpoint", c_checkpoint);
+  }
+  roll_back(disjoint_union, c_checkpoint);
+
+  return Qnil;
+}
+
+/*
+ * Write an image of the disjoint union to io, which need only respond to +write+. Read it back with CDisjointUnion.load or, from a
+ * file, CDisjointUnion.open.
+ *
+ * The image is in native byte order. It says whether the rollback mode is in use, but leaves out the record of changes.
+ *
+ * A disjoint union with aggregates or potentials can't be dumped.
+ */
+static VALUE disjoint_union_dump(VALUE self, VALUE io) {
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  if (disjoint_union->aggregates || disjoint_union->has_potentials) {
+    rb_raise(eSharedLogicError, "A CDisjointUnion with aggregates or potentials can't be dumped");
+  }
+  dump_image(disjoint_union, io);
+  return self;
+}
+
+/*
+ * A disjoint union read from an image written by CDisjointUnion#dump. io need only respond to +read+.
+ */
+static VALUE disjoint_union_load(VALUE klass, VALUE io) {
+  VALUE self = rb_obj_alloc(klass);
+  disjoint_union_data *disjoint_union = unwrapped(self);
+  du_image_preamble preamble;
+
+  image_read_header(io, DU_IMAGE_KIND, DU_IMAGE_VERSION);
+  image_read(io, &preamble, sizeof(preamble));
+  restore_preamble(disjoint_union, &preamble);
+  restore_slots(disjoint_union, image_read, io);
+
+  return self;
+}
+
+/*
+ * A disjoint union read from the image file at path, which we mmap rather than read through an IO. Unlike the trees, the
+ * result doesn't keep using the mapping: see the "Images" section above.
+ */
+static VALUE disjoint_union_open(VALUE klass, VALUE path) {
+  open_args args = { .self = rb_obj_alloc(klass), .path = path, .mapping = { .base = NULL } };
+
+  return rb_ensure(restore_from_mapping, (VALUE)&args, unmap_open_args, (VALUE)&args);
+}
+
+#ifdef DSRM_STATS
+/*
+ * The hot-path counters since the disjoint union was made, or since the last call to reset_stats, as a Hash:
+ * - finds: the number of root-finding walks, including the two made by each call to unite
+ * - find_hops: the total length of those walks. find_hops / finds is the mean distance from an element to its root.
+ * - path_halving_writes: the number of parents rewritten by path halving on the way
+ * - links: the number of unions that merged two subsets
+ * - rank_increments: the number of those links that raised the rank of a root
+ *
+ * unite_many with threads: n, for n > 1, isn't counted. Nor is any work done before a dump, even if the image is loaded.
+ */
+static VALUE disjoint_union_stats(VALUE self) {
+  du_stats *stats = &unwrapped(self)->stats;
+  VALUE hash = rb_hash_new();
+  stat_to_hash(hash, "finds", stats->finds);
+  stat_to_hash(hash, "find_hops", stats->find_hops);
+  stat_to_hash(hash, "path_halving_writes", stats->path_halving_writes);
+  stat_to_hash(hash, "links", stats->links);
+  stat_to_hash(hash, "rank_increments", stats->rank_increments);
+  return hash;
+}
+
+/*
+ * Set the counters reported by stats back to zero.
+ */
+static VALUE disjoint_union_reset_stats(VALUE self) {
+  memset(&unwrapped(self)->stats, 0, sizeof(du_stats));
   return Qnil;
 }
+#endif
 
 /*
  * A Disjoint Union.
@@ -363,7 +1571,8 @@ static VALUE disjoint_union_unite(VALUE self, VALUE arg1, VALUE arg2) {
  * See https://en.wikipedia.org/wiki/Disjoint-set_data_structure for a good introduction.
  *
  * The code uses several ideas from Tarjan and van Leeuwen for efficiency. We use "union by rank" in +unite+ and path-halving in
- * +find+. Together, these make the amortized cost of each opperation effectively constant.
+ * +find+. Together, these make the amortized cost of each opperation effectively constant. In the rollback mode there is no path
+ * halving, so that changes can be undone, and find takes O(log n) time.
  *
  * - Tarjan, Robert E., van Leeuwen, Jan (1984). _Worst-case analysis of set union algorithms_. Journal of the ACM. 31 (2): 245–281.
  */
@@ -373,8 +1582,20 @@ void Init_c_disjoint_union() {
 
   rb_define_alloc_func(cDisjointUnion, disjoint_union_alloc);
   rb_define_method(cDisjointUnion, "initialize", disjoint_union_init, -1);
-  rb_define_method(cDisjointUnion, "make_set", disjoint_union_make_set, 1);
+  rb_define_method(cDisjointUnion, "make_set", disjoint_union_make_set, -1);
   rb_define_method(cDisjointUnion, "subset_count", disjoint_union_subset_count, 0);
   rb_define_method(cDisjointUnion, "find", disjoint_union_find, 1);
-  rb_define_method(cDisjointUnion, "unite", disjoint_union_unite, 2);
+  rb_define_method(cDisjointUnion, "unite", disjoint_union_unite, -1);
+  rb_define_method(cDisjointUnion, "unite_many", disjoint_union_unite_many, -1);
+  rb_define_method(cDisjointUnion, "find_many", disjoint_union_find_many, 1);
+  rb_define_method(cDisjointUnion, "set_size", disjoint_union_set_size, 1);
+  rb_define_method(cDisjointUnion, "set_aggregate", disjoint_union_set_aggregate, 1);
+  rb_define_method(cDisjointUnion, "potential", disjoint_union_potential, 1);
+  rb_define_method(cDisjointUnion, "potential_difference", disjoint_union_potential_difference, 2);
+  rb_define_method(cDisjointUnion, "checkpoint", disjoint_union_checkpoint, 0);
+  rb_define_method(cDisjointUnion, "rollback_to", disjoint_union_rollback_to, 1);
+  rb_define_method(cDisjointUnion, "dump", disjoint_union_dump, 1);
+  rb_define_singleton_method(cDisjointUnion, "load", disjoint_union_load, 1);
+  rb_define_singleton_method(cDisjointUnion, "open", disjoint_union_open, 1);
+  define_stats_methods(cDisjointUnion, disjoint_union_stats, disjoint_union_reset_stats);
 }
@@ -2,4 +2,6 @@ require 'mkmf'
 
 require_relative '../extconf_shared.rb'
 
+abort 'missing pthreads' unless have_library('pthread', 'pthread_create')
+
 generate_makefile('disjoint_union')
@@ -0,0 +1,4 @@
+require 'mkmf'
+require_relative '../extconf_shared.rb'
+
+generate_makefile('fenwick_tree')
@@ -0,0 +1,621 @@
+/*
+ * This is a C implementation of a Fenwick Tree (or Binary Indexed Tree), for sums over a numeric array that changes by point updates.
+ *
+ * For an array A(0...n) we keep a 1-based array T(1..n) in which T[i] is the sum of the values A(i - lowbit(i)...i), where lowbit(i)
+ * is the largest power of two dividing i. A prefix A(0...k) is then the union of the ranges for k, k - lowbit(k), and so on down to
+ * 0, and a change to A[i] touches the entries for i + 1, then adding lowbit each time, up to n. Both walks take O(log n) steps in a
+ * tight loop with no recursion.
+ *
+ * Compared to a SumSegmentTree it needs n cells rather than 2n, and the walks touch about half as many of them. But it can only do
+ * sums, since it answers a query on i..j as the difference of two prefix sums.
+ *
+ * Values are stored unboxed, as int64_t or double, as in CNumericSegmentTree.
+ *
+ * Integer sums can't overflow, because we keep the magnitudes of the values summing to at most INT64_MAX: a construction or change
+ * that would break that raises Shared::DataError. Then every entry of T, and every prefix and interval sum, fits in an int64_t, and a
+ * query never raises. The difference between an old and a new value may not fit, so we add and subtract int64 values with wrapping
+ * (unsigned) arithmetic. The entries it gives are exact all the same.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+#include "numeric.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The C implementation of a Fenwick Tree
+ */
+
+typedef struct {
+  cell *tree; // 1-based: tree[0] is unused
+  numeric_dtype dtype;
+  size_t size; // the number of values in the array
+  uint64_t abs_sum; // for int64 values: the sum of their magnitudes, which we keep <= INT64_MAX
+} fenwick_tree_data;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap).
+ */
+static fenwick_tree_data *create_fenwick_tree() {
+  fenwick_tree_data *fenwick_tree = ALLOC(fenwick_tree_data);
+
+  fenwick_tree->tree = NULL;
+  fenwick_tree->dtype = DTYPE_I64;
+  fenwick_tree->size = 0;
+  fenwick_tree->abs_sum = 0;
+
+  return fenwick_tree;
+}
+
+/*
+ * Free the memory associated with a fenwick_tree_data struct.
+ */
+static void fenwick_tree_free(void *ptr) {
+  if (ptr) {
+    fenwick_tree_data *fenwick_tree = ptr;
+    if (fenwick_tree->tree) {
+      native_array_free(fenwick_tree->tree, fenwick_tree->size + 1, sizeof(cell));
+    }
+    xfree(fenwick_tree);
+  }
+}
+
+/*
+ * How much memory does a fenwick_tree_data instance consume?
+ */
+static size_t fenwick_tree_memsize(const void *ptr) {
+  if (ptr) {
+    const fenwick_tree_data *fenwick_tree = ptr;
+    size_t tree_size = fenwick_tree->tree ? native_array_memsize(fenwick_tree->size + 1, sizeof(cell)) : 0;
+
+    return tree_size + sizeof(fenwick_tree_data);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * We hold no Ruby objects, so there is nothing to mark and no dmark function.
+ */
+static const rb_data_type_t fenwick_tree_type = {
+  .wrap_struct_name = "fenwick_tree",
+  { // help for the Ruby garbage collector
+    .dmark = NULL,
+    .dfree = fenwick_tree_free,
+    .dsize = fenwick_tree_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+
+/************************************************************
+ * Wrapping and unwrapping the C struct and other things.
+ *
+ */
+
+static fenwick_tree_data *unwrapped(VALUE self) {
+  fenwick_tree_data *fenwick_tree;
+  TypedData_Get_Struct((self), fenwick_tree_data, &fenwick_tree_type, fenwick_tree);
+  return fenwick_tree;
+}
+
+/*
+ * This is for CFenwickTree.allocate on the Ruby side.
+ */
+static VALUE fenwick_tree_alloc(VALUE klass) {
+  fenwick_tree_data *fenwick_tree = create_fenwick_tree();
+  return TypedData_Wrap_Struct(klass, &fenwick_tree_type, fenwick_tree);
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * The Fenwick Tree on the C side.
+ */
+
+/* The largest power of two dividing i, for i > 0 */
+#define lowbit(i) ((i) & -(i))
+
+/*
+ * The number of values in data, which must be an Array or else a String of packed 8-byte values.
+ */
+static size_t data_size(VALUE data) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    long len = RSTRING_LEN(data);
+    if (len % sizeof(cell) != 0) {
+      rb_raise(rb_eArgError, "packed data must be a whole number of 8-byte values (got %ld bytes)", len);
+    }
+    return len / sizeof(cell);
+  }
+
+  Check_Type(data, T_ARRAY);
+  return RARRAY_LEN(data);
+}
+
+/*
+ * The i-th value in data, an Array of values of the dtype or a String of packed values.
+ */
+static cell cell_at(numeric_dtype dtype, VALUE data, long i) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    cell c;
+    memcpy(&c, RSTRING_PTR(data) + i * sizeof(cell), sizeof(cell));
+    return c;
+  }
+  return cell_from_value(dtype, rb_ary_entry(data, i));
+}
+
+/*
+ * a + b and a - b. int64 values wrap, as described at the top.
+ */
+static inline cell sum_of(numeric_dtype dtype, cell a, cell b) {
+  cell result;
+  if (dtype == DTYPE_I64) {
+    result.i = (int64_t)((uint64_t)a.i + (uint64_t)b.i);
+  } else {
+    result.f = a.f + b.f;
+  }
+  return result;
+}
+
+static inline cell difference_of(numeric_dtype dtype, cell a, cell b) {
+  cell result;
+  if (dtype == DTYPE_I64) {
+    result.i = (int64_t)((uint64_t)a.i - (uint64_t)b.i);
+  } else {
+    result.f = a.f - b.f;
+  }
+  return result;
+}
+
+/*
+ * The magnitude of an int64 value. It is 2^63 for INT64_MIN, which is too large for any abs_sum.
+ */
+static inline uint64_t magnitude(int64_t v) {
+  return v < 0 ? -(uint64_t)v : (uint64_t)v;
+}
+
+/*
+ * abs_sum after a value of magnitude removed is replaced by one of magnitude added, raising Shared::DataError if it would exceed
+ * INT64_MAX.
+ */
+static uint64_t checked_abs_sum(const fenwick_tree_data *ft, uint64_t removed, uint64_t added) {
+  uint64_t abs_sum = ft->abs_sum - removed;
+  if (added > (uint64_t)INT64_MAX - abs_sum) {
+    rb_raise(eSharedDataError, "The magnitudes of the int64 values would sum to more than 2^63 - 1, and sums could overflow");
+  }
+  return abs_sum + added;
+}
+
+/*
+ * Build the tree in O(n) time from the values already in tree[1..size]: each entry, once complete, is added into its parent, the
+ * next entry whose range covers it.
+ */
+static void build(fenwick_tree_data *ft) {
+  cell *tree = ft->tree;
+  size_t n = ft->size;
+
+  for (size_t i = 1; i <= n; i++) {
+    size_t parent = i + lowbit(i);
+    if (parent <= n) {
+      tree[parent] = sum_of(ft->dtype, tree[parent], tree[i]);
+    }
+  }
+}
+
+/*
+ * The sum of the first count values, A(0...count).
+ */
+static cell prefix_sum(const fenwick_tree_data *ft, size_t count) {
+  const cell *tree = ft->tree;
+  cell sum = { .i = 0 };
+
+  if (ft->dtype == DTYPE_I64) {
+    for (size_t i = count; i > 0; i -= lowbit(i)) {
+      sum.i += tree[i].i;
+    }
+  } else {
+    for (size_t i = count; i > 0; i -= lowbit(i)) {
+      sum.f += tree[i].f;
+    }
+  }
+  return sum;
+}
+
+/*
+ * The sum of A(left..right). The interval must be non-empty and inside 0...size.
+ */
+static cell determine_val(const fenwick_tree_data *ft, size_t left, size_t right) {
+  return difference_of(ft->dtype, prefix_sum(ft, right + 1), prefix_sum(ft, left));
+}
+
+/*
+ * Set A[idx] to new_val.
+ *
+ * For int64 values we check abs_sum before changing anything, so that a failed change leaves the tree as it was.
+ */
+static void set_value(fenwick_tree_data *ft, size_t idx, cell new_val) {
+  cell old_val = determine_val(ft, idx, idx);
+  if (ft->dtype == DTYPE_I64) {
+    ft->abs_sum = checked_abs_sum(ft, magnitude(old_val.i), magnitude(new_val.i));
+  }
+
+  cell delta = difference_of(ft->dtype, new_val, old_val);
+  for (size_t i = idx + 1; i <= ft->size; i += lowbit(i)) {
+    ft->tree[i] = sum_of(ft->dtype, ft->tree[i], delta);
+  }
+}
+
+/*
+ * Add delta to A[idx], raising Shared::DataError if an int64 value overflows.
+ */
+static void add_at(fenwick_tree_data *ft, size_t idx, cell delta) {
+  cell new_val = determine_val(ft, idx, idx);
+
+  if (ft->dtype == DTYPE_I64) {
+    if (__builtin_add_overflow(new_val.i, delta.i, &new_val.i)) {
+      rb_raise(eSharedDataError, "Overflow after adding %" PRId64 " at index %zu", delta.i, idx);
+    }
+  } else {
+    new_val.f += delta.f;
+  }
+  set_value(ft, idx, new_val);
+}
+
+/*
+ * The smallest index idx with A(0..idx).sum >= target, or size if there is none. The values must all be non-negative, so that the
+ * prefix sums don't decrease.
+ *
+ * We descend the implicit tree from the top, taking each range whose sum still leaves us short of the target. That is one pass of
+ * O(log n) steps, rather than a binary search over prefix sums of O(log^2 n).
+ */
+static size_t lower_bound(const fenwick_tree_data *ft, cell target) {
+  const cell *tree = ft->tree;
+  size_t n = ft->size;
+  size_t pos = 0;
+
+  for (size_t step = (size_t)1 << (63 - __builtin_clzll(n)); step > 0; step >>= 1) {
+    size_t next = pos + step;
+    if (next > n) {
+      continue;
+    }
+
+    if (ft->dtype == DTYPE_I64 ? tree[next].i < target.i : tree[next].f < target.f) {
+      pos = next;
+      if (ft->dtype == DTYPE_I64) {
+        target.i -= tree[next].i;
+      } else {
+        target.f -= tree[next].f;
+      }
+    }
+  }
+  return pos;
+}
+
+/*
+ * Check an index into the array.
+ */
+static size_t checked_index(const fenwick_tree_data *ft, VALUE idx) {
+  size_t c_idx = checked_nonneg_fixnum(idx);
+  if (c_idx >= ft->size) {
+    rb_raise(eSharedDataError, "Index %zu is out of range (size = %zu)", c_idx, ft->size);
+  }
+  return c_idx;
+}
+
+/*
+ * Check the interval, returning false if it is empty.
+ */
+static int checked_interval(const fenwick_tree_data *ft, size_t left, size_t right) {
+  if (right >= ft->size) {
+    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", left, right, ft->size);
+  }
+  return left <= right;
+}
+
+/*
+ * The sum to give for an empty interval. Like the other numeric trees we return the Integer 0 whatever the dtype.
+ */
+#define EMPTY_SUM INT2FIX(0)
+
+/*
+ * End C implementation of the Fenwick Tree
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * CFenwickTree.native_dtype(data)
+ *
+ * The dtype to use for data, :i64 or :f64, or nil if the values in data can't be stored natively.
+ */
+static VALUE fenwick_tree_native_dtype(VALUE klass, VALUE data) {
+  return native_dtype_of(data, NULL);
+}
+
+/*
+ * CFenwickTree#initialize(data, dtype)
+ *
+ * - data: the initial values, as an Array of numeric values or a String of packed int64 or double values, as for
+ *   CNumericSegmentTree#initialize. We copy them and don't look at data again. Or an Integer n, for n zeros.
+ * - dtype: :i64 or :f64. For an Array it must be what CFenwickTree.native_dtype(data) returns. For a String it says how to read the
+ *   bytes.
+ */
+static VALUE fenwick_tree_init(VALUE self, VALUE data, VALUE dtype) {
+  fenwick_tree_data *ft = unwrapped(self);
+
+  ft->dtype = dtype_from_symbol(dtype);
+  int zeros = RB_INTEGER_TYPE_P(data);
+  ft->size = zeros ? checked_nonneg_fixnum(data) : data_size(data);
+
+  if (ft->size == 0) {
+    rb_raise(rb_eArgError, "size must be positive.");
+  }
+
+  ft->tree = native_array_alloc(ft->size + 1, sizeof(cell)); // zeroed, and a zero cell is 0 and 0.0 alike
+  if (!zeros) {
+    for (size_t i = 0; i < ft->size; i++) {
+      ft->tree[i + 1] = cell_at(ft->dtype, data, i);
+      if (ft->dtype == DTYPE_I64) {
+        ft->abs_sum = checked_abs_sum(ft, 0, magnitude(ft->tree[i + 1].i));
+      }
+    }
+    build(ft);
+  }
+
+  return self;
+}
+
+/*
+ * CFenwickTree#add_at(idx, delta)
+ *
+ * Add delta to A[idx], in O(log n) time. delta must be of the tree's dtype.
+ */
+static VALUE fenwick_tree_add_at(VALUE self, VALUE idx, VALUE delta) {
+  fenwick_tree_data *ft = unwrapped(self);
+  size_t c_idx = checked_index(ft, idx);
+
+  add_at(ft, c_idx, cell_from_value(ft->dtype, delta));
+  return Qnil;
+}
+
+/*
+ * CFenwickTree#update_at(idx, value)
+ *
+ * Set A[idx] to value, in O(log n) time.
+ */
+static VALUE fenwick_tree_update_at(VALUE self, VALUE idx, VALUE value) {
+  fenwick_tree_data *ft = unwrapped(self);
+  size_t c_idx = checked_index(ft, idx);
+
+  set_value(ft, c_idx, cell_from_value(ft->dtype, value));
+  return Qnil;
+}
+
+/*
+ * CFenwickTree#add_many(indices, deltas)
+ *
+ * Do add_at(indices[i], deltas[i]) for each i in turn.
+ *
+ * - indices: an Array of Integers or a String of packed int64 values.
+ * - deltas: an Array of values of the tree's dtype, or a String of packed values of that dtype. There must be as many as there are
+ *   indices.
+ */
+static VALUE fenwick_tree_add_many(VALUE self, VALUE indices, VALUE deltas) {
+  fenwick_tree_data *ft = unwrapped(self);
+  index_list list;
+  read_index_list(indices, &list);
+
+  size_t delta_count = data_size(deltas);
+  if (delta_count != (size_t)list.count) {
+    rb_raise(rb_eArgError, "add_many needs as many deltas as indices (got %zu and %ld)", delta_count, list.count);
+  }
+
+  for (long i = 0; i < list.count; i++) {
+    size_t idx = index_list_at(&list, i);
+    if (idx >= ft->size) {
+      rb_raise(eSharedDataError, "Index %zu is out of range (size = %zu)", idx, ft->size);
+    }
+    add_at(ft, idx, cell_at(ft->dtype, deltas, i));
+  }
+  return Qnil;
+}
+
+/*
+ * CFenwickTree#value_at(idx)
+ *
+ * The current value of A[idx].
+ */
+static VALUE fenwick_tree_value_at(VALUE self, VALUE idx) {
+  fenwick_tree_data *ft = unwrapped(self);
+  size_t c_idx = checked_index(ft, idx);
+
+  return value_from_cell(ft->dtype, determine_val(ft, c_idx, c_idx));
+}
+
+/*
+ * CFenwickTree#prefix_sum(idx)
+ *
+ * The sum of A(0..idx), in O(log n) time.
+ */
+static VALUE fenwick_tree_prefix_sum(VALUE self, VALUE idx) {
+  fenwick_tree_data *ft = unwrapped(self);
+  size_t c_idx = checked_index(ft, idx);
+
+  return value_from_cell(ft->dtype, prefix_sum(ft, c_idx + 1));
+}
+
+/*
+ * CFenwickTree#prefix_sum_many(indices)
+ *
+ * The prefix sums for a batch of indices, in a single call. indices is an Array of Integers, and we return an Array, or a String of
+ * packed int64 values, and we return a String of packed values of the tree's dtype.
+ */
+static VALUE fenwick_tree_prefix_sum_many(VALUE self, VALUE indices) {
+  fenwick_tree_data *ft = unwrapped(self);
+  index_list list;
+  read_index_list(indices, &list);
+
+  VALUE results = list.packed ? rb_str_new(NULL, list.count * sizeof(cell)) : rb_ary_new_capa(list.count);
+  for (long i = 0; i < list.count; i++) {
+    size_t idx = index_list_at(&list, i);
+    if (idx >= ft->size) {
+      rb_raise(eSharedDataError, "Index %zu is out of range (size = %zu)", idx, ft->size);
+    }
+
+    cell c = prefix_sum(ft, idx + 1);
+    if (list.packed) {
+      memcpy(RSTRING_PTR(results) + i * sizeof(cell), &c, sizeof(cell));
+    } else {
+      rb_ary_push(results, value_from_cell(ft->dtype, c));
+    }
+  }
+  return results;
+}
+
+/*
+ * (see SegmentTreeTemplate#query_on)
+ */
+static VALUE fenwick_tree_query_on(VALUE self, VALUE left, VALUE right) {
+  fenwick_tree_data *ft = unwrapped(self);
+  size_t c_left = checked_nonneg_fixnum(left);
+  size_t c_right = checked_nonneg_fixnum(right);
+
+  if (!checked_interval(ft, c_left, c_right)) {
+    return EMPTY_SUM;
+  }
+  return value_from_cell(ft->dtype, determine_val(ft, c_left, c_right));
+}
+
+/*
+ * (see CNumericSegmentTree#query_many)
+ */
+static VALUE fenwick_tree_query_many(int argc, VALUE *argv, VALUE self) {
+  fenwick_tree_data *ft = unwrapped(self);
+  index_pairs pairs;
+  read_index_pairs(argc, argv, &pairs);
+
+  size_t left, right;
+
+  if (!pairs.packed) {
+    VALUE results = rb_ary_new_capa(pairs.count);
+    for (long i = 0; i < pairs.count; i++) {
+      index_pair_at(&pairs, i, &left, &right);
+      rb_ary_push(results, checked_interval(ft, left, right) ? value_from_cell(ft->dtype, determine_val(ft, left, right)) : EMPTY_SUM);
+    }
+    return results;
+  }
+
+  VALUE packed_results = rb_str_new(NULL, pairs.count * sizeof(cell));
+  char *out = RSTRING_PTR(packed_results);
+  cell zero = { .i = 0 };
+
+  for (long i = 0; i < pairs.count; i++) {
+    index_pair_at(&pairs, i, &left, &right);
+    cell c = checked_interval(ft, left, right) ? determine_val(ft, left, right) : zero;
+    memcpy(out + i * sizeof(cell), &c, sizeof(cell));
+  }
+  return packed_results;
+}
+
+/*
+ * CFenwickTree#lower_bound(target)
+ *
+ * The smallest index idx with prefix_sum(idx) >= target, or nil if the whole array sums to less than target. This is the search
+ * for the k-th unit in a histogram, or for the price level at which a cumulative quantity is reached. It takes O(log n) time.
+ *
+ * The values must all be non-negative. We don't check, and otherwise the result is meaningless.
+ */
+static VALUE fenwick_tree_lower_bound(VALUE self, VALUE target) {
+  fenwick_tree_data *ft = unwrapped(self);
+  size_t idx = lower_bound(ft, cell_from_value(ft->dtype, target));
+
+  return idx == ft->size ? Qnil : SIZET2NUM(idx);
+}
+
+/*
+ * CFenwickTree#lower_bound_many(targets)
+ *
+ * lower_bound for a batch of targets, in a single call. targets is an Array of values of the tree's dtype, and we return an Array,
+ * or a String of packed values of that dtype, and we return a String of packed int64 indices with -1 for nil.
+ */
+static VALUE fenwick_tree_lower_bound_many(VALUE self, VALUE targets) {
+  fenwick_tree_data *ft = unwrapped(self);
+  int packed = RB_TYPE_P(targets, T_STRING);
+  long count = data_size(targets);
+
+  VALUE results = packed ? rb_str_new(NULL, count * sizeof(int64_t)) : rb_ary_new_capa(count);
+  for (long i = 0; i < count; i++) {
+    size_t idx = lower_bound(ft, cell_at(ft->dtype, targets, i));
+    if (packed) {
+      int64_t c_idx = idx == ft->size ? -1 : (int64_t)idx;
+      memcpy(RSTRING_PTR(results) + i * sizeof(int64_t), &c_idx, sizeof(int64_t));
+    } else {
+      rb_ary_push(results, idx == ft->size ? Qnil : SIZET2NUM(idx));
+    }
+  }
+  return results;
+}
+
+/*
+ * CFenwickTree#size
+ *
+ * The number of values in the array.
+ */
+static VALUE fenwick_tree_size(VALUE self) {
+  return SIZET2NUM(unwrapped(self)->size);
+}
+
+/*
+ * CFenwickTree#dtype
+ *
+ * The type of the values, :i64 or :f64.
+ */
+static VALUE fenwick_tree_dtype(VALUE self) {
+  return ID2SYM(rb_intern(unwrapped(self)->dtype == DTYPE_I64 ? "i64" : "f64"));
+}
+
+/*
+ * A Fenwick Tree over numeric data, for prefix and interval sums with point updates.
+ *
+ * (see SegmentTree.construct_fenwick)
+ */
+void Init_c_fenwick_tree() {
+  VALUE mSegmentTree = rb_define_module_under(mDataStructuresRMolinari, "SegmentTree");
+  VALUE cFenwickTree = rb_define_class_under(mSegmentTree, "CFenwickTree", rb_cObject);
+
+  rb_define_alloc_func(cFenwickTree, fenwick_tree_alloc);
+  rb_define_singleton_method(cFenwickTree, "native_dtype", fenwick_tree_native_dtype, 1);
+  rb_define_method(cFenwickTree, "initialize", fenwick_tree_init, 2);
+  rb_define_method(cFenwickTree, "add_at", fenwick_tree_add_at, 2);
+  rb_define_method(cFenwickTree, "update_at", fenwick_tree_update_at, 2);
+  rb_define_method(cFenwickTree, "add_many", fenwick_tree_add_many, 2);
+  rb_define_method(cFenwickTree, "value_at", fenwick_tree_value_at, 1);
+  rb_define_method(cFenwickTree, "prefix_sum", fenwick_tree_prefix_sum, 1);
+  rb_define_method(cFenwickTree, "prefix_sum_many", fenwick_tree_prefix_sum_many, 1);
+  rb_define_method(cFenwickTree, "query_on", fenwick_tree_query_on, 2);
+  rb_define_method(cFenwickTree, "query_many", fenwick_tree_query_many, -1);
+  rb_define_method(cFenwickTree, "sum_on", fenwick_tree_query_on, 2);
+  rb_define_method(cFenwickTree, "sum_on_many", fenwick_tree_query_many, -1);
+  rb_define_method(cFenwickTree, "lower_bound", fenwick_tree_lower_bound, 1);
+  rb_define_method(cFenwickTree, "lower_bound_many", fenwick_tree_lower_bound_many, 1);
+  rb_define_method(cFenwickTree, "size", fenwick_tree_size, 0);
+  rb_define_method(cFenwickTree, "dtype", fenwick_tree_dtype, 0);
+}
@@ -0,0 +1,5 @@
+require 'mkmf'
+
+require_relative '../extconf_shared.rb'
+
+generate_makefile('heap')
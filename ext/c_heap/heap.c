@@ -0,0 +1,955 @@
+/*
+ * This is a C implementation of a binary (or, optionally, d-ary) heap.
+ *
+ * It is the C version of the Heap Ruby class (heap.rb in this gem) and has the same API. The differences are internal.
+ *
+ * - Priorities are held unboxed when they allow it. While every priority in the heap is a Fixnum (or every one is a Float) we store
+ *   them as int64_t values (or doubles) and compare them directly in C. As soon as a priority of another type arrives we box them all
+ *   up as Ruby objects and compare them with <=>, exactly as the Ruby class does.
+ * - In an addressable heap each item gets a small integer "handle" when it is inserted. A hash map from the Convenient Containers
+ *   library takes an item to its handle, and a plain array takes a handle to the item's current location in the heap. So when sifting
+ *   moves an item we just update an array entry and don't need to hash the item again. The hash map is only used by insert, pop, and
+ *   update.
+ * - The tree can be d-ary rather than binary. The priorities are kept in their own array, separate from the items, and laid out so
+ *   that the children of each node start on a cache-line boundary. For arity 8 the children of a node fill exactly one cache line,
+ *   so sift_down takes one cache miss per level, and there are a third as many levels as in a binary heap.
+ */
+
+#include "ruby.h"
+#include "cc.h" // Convenient Containers
+#include "shared.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Have the containers allocate through Ruby, so that the GC sees how much memory we use.
+#define CC_REALLOC ruby_xrealloc
+#define CC_FREE ruby_xfree
+
+/**
+ * The data types
+ */
+
+/*
+ * How are the priorities currently stored?
+ *
+ * A heap starts out as PRIORITY_NONE and settles on a kind when the first element is inserted. It stays with that kind until a
+ * priority of another type turns up, at which point it changes to PRIORITY_VALUE for good, or at least until it is next empty.
+ */
+typedef enum {
+  PRIORITY_NONE,
+  PRIORITY_I64,   // every priority is a Fixnum
+  PRIORITY_F64,   // every priority is a Float
+  PRIORITY_VALUE, // the priorities are Ruby objects, compared with <=>
+} priority_kind;
+
+typedef union {
+  int64_t i;
+  double f;
+  VALUE v;
+} heap_priority;
+
+/*
+ * An item in the heap and its handle. The handle is only meaningful in an addressable heap.
+ */
+typedef struct {
+  VALUE item;
+  size_t handle;
+} heap_slot;
+
+/*
+ * Items are the keys for the item -> handle map. We want the same semantics as a Ruby Hash, so we use the item's #hash and #eql?
+ * methods. We don't need to call back into Ruby for the immediate values like Fixnums and Symbols, where eql? is identity.
+ */
+typedef struct {
+  VALUE item;
+} heap_key;
+
+/*
+ * The hash values of immediates and the low bits of pointers are poorly distributed, and the CC map uses the low bits of the hash to
+ * pick a bucket. So we mix things up first. This is the finalizer from SplitMix64.
+ */
+static size_t mixed_bits(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+static size_t heap_key_hash(VALUE item) {
+  if (SPECIAL_CONST_P(item)) {
+    return mixed_bits(item);
+  }
+  return mixed_bits(NUM2LONG(rb_hash(item)));
+}
+
+/*
+ * The CC map only cares whether this result is zero (the keys are the same) or not.
+ */
+static int heap_key_cmp(VALUE item1, VALUE item2) {
+  if (item1 == item2) {
+    return 0;
+  } else if (SPECIAL_CONST_P(item1) || SPECIAL_CONST_P(item2)) {
+    return 1;
+  }
+  return !rb_eql(item1, item2);
+}
+
+#define CC_CMPR heap_key, { return heap_key_cmp(val_1.item, val_2.item); }
+#define CC_HASH heap_key, { return heap_key_hash(val.item); }
+#include "cc.h"
+
+/* The containers from Convenient Containers */
+typedef vec(size_t) size_vector;
+typedef map(heap_key, size_t) handle_map;
+
+/**
+ * The C implementation of a Heap
+ *
+ * See heap.rb for a discussion of the algorithms, which come from
+ *
+ * Edelkamp, S., Elmasry, A., Katajainen, J., _Optimizing Binary Heaps_, Theory Comput Syst (2017), vol 61, pp 606-636.
+ */
+
+/*
+ * The Heap struct.
+ * - priorities and slots: the heap itself, as an implicit d-ary tree held in two parallel arrays. See below for the layout.
+ *   - priorities is allocated on a cache-line boundary.
+ *   - capacity is the allocated length of each of them.
+ * - positions: positions[h] is the index in the arrays of the item with handle h. Only used for addressable heaps.
+ * - free_handles: handles that were used by items no longer in the heap, available for reuse.
+ * - handles: the map item -> handle.
+ * - size: the number of items in the heap.
+ * - kind: how the priorities are currently stored.
+ * - arity: the number of children of each node
+ * - root: the index of the root of the tree. It is arity - 1: see first_child().
+ */
+typedef struct {
+  heap_priority *priorities;
+  heap_slot *slots;
+  size_t capacity;
+  size_vector positions;
+  size_vector free_handles;
+  handle_map handles;
+  size_t size;
+  priority_kind kind;
+  size_t arity;
+  size_t root;
+  int max_heap;
+  int addressable;
+  int debug;
+} heap_data;
+
+/*
+ * The layout of the tree.
+ *
+ * Number the nodes 0, 1, 2, ... in level order, so that the children of node i are di + 1, ..., di + d. We store node i at index
+ * i + d - 1 of the arrays. Then the first child of the node at index p is at index d(p - d + 2), a multiple of d. When d is a power
+ * of 2 no larger than 8 the priorities of a node's children, d * 8 bytes, lie in the same cache line.
+ *
+ * When d = 2 this gives the familiar binary layout with the root at 1 and the children of p at 2p and 2p + 1.
+ */
+static size_t first_child(heap_data *heap, size_t p) {
+  return heap->arity * (p - heap->root + 1);
+}
+
+static size_t parent_of(heap_data *heap, size_t p) {
+  return (p - heap->root - 1) / heap->arity + heap->root;
+}
+
+/* The index of the last element of the heap. Only meaningful when the heap is not empty. */
+#define last_index(heap) ((heap)->root + (heap)->size - 1)
+
+static ID id_cmp;
+static ID id_plus;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap, naturally).
+ */
+static heap_data *create_heap() {
+  heap_data *heap = ALLOC(heap_data);
+
+  heap->priorities = NULL; // we allocate on the first insert, once we know the arity
+  heap->slots = NULL;
+  heap->capacity = 0;
+  init(&heap->positions);
+  init(&heap->free_handles);
+  init(&heap->handles);
+
+  heap->size = 0;
+  heap->kind = PRIORITY_NONE;
+  heap->arity = 2;
+  heap->root = 1;
+  heap->max_heap = 0;
+  heap->addressable = 1;
+  heap->debug = 0;
+
+  return heap;
+}
+
+/*
+ * Free the memory associated with a heap.
+ *
+ * This will end up getting triggered by the Ruby garbage collector. Ruby learns about it via the heap_type struct below.
+ */
+static void heap_free(void *ptr) {
+  if (ptr) {
+    heap_data *heap = ptr;
+    native_aligned_array_free(heap->priorities, heap->capacity, sizeof(heap_priority));
+    xfree(heap->slots);
+    cleanup(&heap->positions);
+    cleanup(&heap->free_handles);
+    cleanup(&heap->handles);
+    xfree(heap);
+  }
+}
+
+/*
+ * How much memory (roughly) does a heap_data instance consume?
+ */
+static size_t heap_memsize(const void *ptr) {
+  if (ptr) {
+    heap_data *heap = (heap_data *)ptr;
+
+    return sizeof(heap_data)
+      + (heap->priorities ? native_aligned_array_memsize(heap->capacity, sizeof(heap_priority)) : 0)
+      + heap->capacity * sizeof(heap_slot)
+      + (cap(&heap->positions) + cap(&heap->free_handles)) * sizeof(size_t)
+      + cap(&heap->handles) * (sizeof(heap_key) + sizeof(size_t));
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Mark the Ruby objects we hold so that the Ruby garbage collector knows that they are still in use.
+ *
+ * The keys of the handles map are the items in the heap, so marking the entries covers them too.
+ */
+static void heap_mark(void *ptr) {
+  heap_data *heap = ptr;
+
+  for (size_t i = heap->root; i < heap->root + heap->size; i++) {
+    rb_gc_mark(heap->slots[i].item);
+    if (heap->kind == PRIORITY_VALUE) {
+      rb_gc_mark(heap->priorities[i].v);
+    }
+  }
+}
+
+/*
+ * Make sure that there is room in the arrays for count more elements.
+ *
+ * realloc() doesn't preserve alignment so we make a fresh, cache-aligned allocation for the priorities and copy.
+ */
+static void ensure_capacity(heap_data *heap, size_t count) {
+  size_t needed = heap->root + heap->size + count;
+  if (needed <= heap->capacity) {
+    return;
+  }
+
+  size_t new_capacity = heap->capacity < CACHE_LINE_SIZE ? CACHE_LINE_SIZE : 2 * heap->capacity;
+  if (new_capacity < needed) {
+    new_capacity = needed;
+  }
+  REALLOC_N(heap->slots, heap_slot, new_capacity);
+
+  heap_priority *new_priorities = native_aligned_array_alloc(new_capacity, sizeof(heap_priority));
+  if (heap->priorities) {
+    memcpy(new_priorities, heap->priorities, heap->capacity * sizeof(heap_priority));
+    native_aligned_array_free(heap->priorities, heap->capacity, sizeof(heap_priority));
+  }
+  heap->priorities = new_priorities;
+  heap->capacity = new_capacity;
+}
+
+/*
+ * A configuration struct that tells the Ruby runtime how to deal with a heap_data object.
+ *
+ * https://docs.ruby-lang.org/en/master/extension_rdoc.html#label-Encapsulate+C+data+into+a+Ruby+object
+ */
+static const rb_data_type_t heap_type = {
+  .wrap_struct_name = "heap",
+  { // help for the Ruby garbage collector
+    .dmark = heap_mark, // dmark, for marking other Ruby objects.
+    .dfree = heap_free, // how to free the memory associated with an object
+    .dsize = heap_memsize, // roughly how much space does the object consume?
+  },
+  .data = NULL, // a data field we could use for something here if we wanted. Ruby ignores it
+  .flags = 0  // GC-related flag values.
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+/************************************************************
+ * Wrapping and unwrapping things for the Ruby runtime
+ *
+ */
+
+/*
+ * Unwrap a Ruby-side heap object to get the C struct inside.
+ */
+static heap_data *unwrapped(VALUE self) {
+  heap_data *heap;
+  TypedData_Get_Struct((self), heap_data, &heap_type, heap);
+  return heap;
+}
+
+/*
+ * This is for CHeap.allocate on the Ruby side
+ */
+static VALUE heap_alloc(VALUE klass) {
+  // Get one on the heap
+  heap_data *heap = create_heap();
+  // Wrap it up into a Ruby object
+  return TypedData_Wrap_Struct(klass, &heap_type, heap);
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * Priorities
+ *
+ */
+
+static priority_kind kind_of(VALUE priority) {
+  if (FIXNUM_P(priority)) {
+    return PRIORITY_I64;
+  } else if (RB_FLOAT_TYPE_P(priority)) {
+    return PRIORITY_F64;
+  }
+  return PRIORITY_VALUE;
+}
+
+/*
+ * The Ruby object for a stored priority
+ */
+static VALUE priority_value(heap_data *heap, heap_priority priority) {
+  switch (heap->kind) {
+  case PRIORITY_I64:
+    return LONG2FIX(priority.i);
+  case PRIORITY_F64:
+    return DBL2NUM(priority.f);
+  default:
+    return priority.v;
+  }
+}
+
+/*
+ * Switch the heap over to boxed priorities.
+ *
+ * Boxing a Float may allocate and so trigger garbage collection. We collect the boxed values in a Ruby Array until they are all
+ * ready, so that every Ruby object is always reachable.
+ */
+static void box_priorities(heap_data *heap) {
+  VALUE boxed = rb_ary_new_capa(heap->size);
+  for (size_t i = 0; i < heap->size; i++) {
+    rb_ary_push(boxed, priority_value(heap, heap->priorities[heap->root + i]));
+  }
+
+  heap->kind = PRIORITY_VALUE;
+  for (size_t i = 0; i < heap->size; i++) {
+    heap->priorities[heap->root + i].v = RARRAY_AREF(boxed, i);
+  }
+  RB_GC_GUARD(boxed);
+}
+
+/*
+ * Convert a Ruby priority to the form in which we store it, first changing the way the heap stores its priorities if necessary.
+ */
+static heap_priority make_priority(heap_data *heap, VALUE value) {
+  priority_kind kind = kind_of(value);
+  if (heap->size == 0) {
+    heap->kind = kind;
+  } else if (heap->kind != kind && heap->kind != PRIORITY_VALUE) {
+    box_priorities(heap);
+  }
+
+  heap_priority priority;
+  switch (heap->kind) {
+  case PRIORITY_I64:
+    priority.i = FIX2LONG(value);
+    break;
+  case PRIORITY_F64:
+    priority.f = RFLOAT_VALUE(value);
+    break;
+  default:
+    priority.v = value;
+  }
+  return priority;
+}
+
+/*
+ * Compare two Ruby values, as Heap#less_than_priority? does. A nil result from <=> counts as "neither is less."
+ */
+static int compare_values(VALUE v1, VALUE v2) {
+  if (FIXNUM_P(v1) && FIXNUM_P(v2)) {
+    long i1 = FIX2LONG(v1), i2 = FIX2LONG(v2);
+    return (i1 > i2) - (i1 < i2);
+  }
+
+  VALUE result = rb_funcall(v1, id_cmp, 1, v2);
+  if (NIL_P(result)) {
+    return 0;
+  }
+  return rb_cmpint(result, v1, v2);
+}
+
+/*
+ * Should p1 be above p2 in the heap? For a min-heap that means p1 < p2, and for a max-heap p1 > p2.
+ */
+static int priority_less(heap_data *heap, heap_priority p1, heap_priority p2) {
+  switch (heap->kind) {
+  case PRIORITY_I64:
+    return heap->max_heap ? p1.i > p2.i : p1.i < p2.i;
+  case PRIORITY_F64:
+    return heap->max_heap ? p1.f > p2.f : p1.f < p2.f;
+  default: {
+    int cmp = compare_values(p1.v, p2.v);
+    return heap->max_heap ? cmp > 0 : cmp < 0;
+  }
+  }
+}
+
+/*
+ * End priority functions
+ ************************************************************/
+
+/************************************************************
+ * The Heap API here on the C side
+ *
+ */
+
+/*
+ * Put the item at the given location in the heap
+ */
+static void place(heap_data *heap, heap_priority priority, heap_slot slot, size_t idx) {
+  heap->priorities[idx] = priority;
+  heap->slots[idx] = slot;
+  if (heap->addressable) {
+    lval(&heap->positions, slot.handle) = idx;
+  }
+}
+
+/*
+ * For debugging: raise Shared::InternalLogicError if the heap property doesn't hold
+ */
+static void check_heap_property(heap_data *heap) {
+  for (size_t idx = heap->root + 1; idx < heap->root + heap->size; idx++) {
+    size_t parent = parent_of(heap, idx);
+    if (priority_less(heap, heap->priorities[idx], heap->priorities[parent])) {
+      rb_raise(eSharedInternalLogicError, "Heap property violated by child %zu of index %zu", idx, parent);
+    }
+  }
+}
+
+/*
+ * Filter the value at index up to its correct location. Algorithm from Edelkamp et. al.
+ */
+static void sift_up(heap_data *heap, size_t idx) {
+  heap_priority x_priority = heap->priorities[idx];
+  heap_slot x_slot = heap->slots[idx];
+
+  while (idx != heap->root) {
+    size_t parent = parent_of(heap, idx);
+    if (!priority_less(heap, x_priority, heap->priorities[parent])) {
+      break;
+    }
+    place(heap, heap->priorities[parent], heap->slots[parent], idx);
+    idx = parent;
+  }
+  place(heap, x_priority, x_slot, idx);
+}
+
+/*
+ * Filter the value at index down to its correct location. Algorithm from Edelkamp et. al.
+ */
+static void sift_down(heap_data *heap, size_t idx) {
+  heap_priority x_priority = heap->priorities[idx];
+  heap_slot x_slot = heap->slots[idx];
+  size_t last = last_index(heap);
+
+  size_t j;
+  while ((j = first_child(heap, idx)) <= last) {
+    // Find the least of the children
+    size_t end = j + heap->arity - 1;
+    if (end > last) {
+      end = last;
+    }
+    for (size_t k = j + 1; k <= end; k++) {
+      if (priority_less(heap, heap->priorities[k], heap->priorities[j])) {
+        j = k;
+      }
+    }
+
+    if (!priority_less(heap, heap->priorities[j], x_priority)) {
+      break;
+    }
+    place(heap, heap->priorities[j], heap->slots[j], idx);
+    idx = j;
+  }
+  place(heap, x_priority, x_slot, idx);
+}
+
+/*
+ * A handle for a newly inserted item
+ */
+static size_t new_handle(heap_data *heap) {
+  size_t count = size(&heap->free_handles);
+  if (count > 0) {
+    size_t handle = *last(&heap->free_handles);
+    erase(&heap->free_handles, count - 1);
+    return handle;
+  }
+
+  if (!push(&heap->positions, 0)) {
+    rb_memerror();
+  }
+  return size(&heap->positions) - 1;
+}
+
+/*
+ * Add a new item at the bottom of the heap without restoring the heap property.
+ */
+static void append_item(heap_data *heap, VALUE item, VALUE priority_val) {
+  heap_slot slot = { .item = item };
+
+  if (heap->addressable) {
+    heap_key key = { item };
+    if (get(&heap->handles, key)) {
+      rb_raise(eSharedDataError, "Heap already contains %"PRIsVALUE, item);
+    }
+
+    slot.handle = new_handle(heap);
+    if (!insert(&heap->handles, key, slot.handle)) {
+      rb_memerror();
+    }
+  }
+
+  heap_priority priority = make_priority(heap, priority_val);
+  ensure_capacity(heap, 1);
+  heap->size++;
+  place(heap, priority, slot, last_index(heap));
+}
+
+static void insert_item(heap_data *heap, VALUE item, VALUE priority_val) {
+  append_item(heap, item, priority_val);
+  sift_up(heap, last_index(heap));
+}
+
+/*
+ * Restore the heap property everywhere with Floyd's bottom-up method: sift down each node that has a child, from the bottom up. This
+ * takes O(N) time.
+ */
+static void rebuild(heap_data *heap) {
+  if (heap->size < 2) {
+    return;
+  }
+
+  size_t idx = parent_of(heap, last_index(heap));
+  for (;;) {
+    sift_down(heap, idx);
+    if (idx == heap->root) {
+      break;
+    }
+    idx--;
+  }
+}
+
+/*
+ * When inserting count new items, is it cheaper to rebuild the heap than to sift each one up? See Heap#rebuild_is_cheaper?
+ */
+static int rebuild_is_cheaper(heap_data *heap, size_t count) {
+  double n = heap->size + count;
+  return count * log2(n + 1) > n;
+}
+
+typedef struct {
+  heap_data *heap;
+  VALUE items;
+  VALUE priorities;
+} insert_many_args;
+
+static VALUE append_items(VALUE args_val) {
+  insert_many_args *args = (insert_many_args *)args_val;
+  for (long i = 0; i < RARRAY_LEN(args->items); i++) {
+    append_item(args->heap, rb_ary_entry(args->items, i), rb_ary_entry(args->priorities, i));
+  }
+  return Qnil;
+}
+
+static VALUE rebuild_after_append(VALUE args_val) {
+  rebuild(((insert_many_args *)args_val)->heap);
+  return Qnil;
+}
+
+/*
+ * Insert all the items. If the heap is addressable and one of them is already present we raise Shared::DataError, having inserted
+ * the items before it.
+ */
+static void insert_items(heap_data *heap, VALUE items, VALUE priorities) {
+  long count = RARRAY_LEN(items);
+
+  // Do the allocations once, up front
+  ensure_capacity(heap, count);
+  if (heap->addressable) {
+    if (!reserve(&heap->handles, size(&heap->handles) + count)) {
+      rb_memerror();
+    }
+  }
+
+  if (rebuild_is_cheaper(heap, count)) {
+    insert_many_args args = { heap, items, priorities };
+    rb_ensure(append_items, (VALUE)&args, rebuild_after_append, (VALUE)&args);
+  } else {
+    for (long i = 0; i < count; i++) {
+      insert_item(heap, rb_ary_entry(items, i), rb_ary_entry(priorities, i));
+    }
+  }
+}
+
+/*
+ * The index of the top of the heap, raising an exception if the heap is empty
+ */
+static size_t checked_top(heap_data *heap) {
+  if (heap->size == 0) {
+    rb_raise(rb_eRuntimeError, "Heap is empty!");
+  }
+  return heap->root;
+}
+
+static VALUE pop_item(heap_data *heap) {
+  heap_slot top = heap->slots[checked_top(heap)];
+
+  if (heap->addressable) {
+    heap_key key = { top.item };
+    erase(&heap->handles, key);
+    if (!push(&heap->free_handles, top.handle)) {
+      rb_memerror();
+    }
+  }
+
+  size_t last = last_index(heap);
+  heap->size--;
+
+  if (heap->size > 0) {
+    place(heap, heap->priorities[last], heap->slots[last], heap->root);
+    sift_down(heap, heap->root);
+  }
+
+  return top.item;
+}
+
+/*
+ * The location in the heap of an item whose priority we are about to update.
+ */
+static size_t position_for_update(heap_data *heap, VALUE item) {
+  if (!heap->addressable) {
+    rb_raise(eSharedLogicError, "Cannot update priorities in a non-addressable heap");
+  }
+
+  heap_key key = { item };
+  size_t *handle = get(&heap->handles, key);
+  if (!handle) {
+    rb_raise(eSharedDataError, "Cannot update priority for value %"PRIsVALUE" not already in the heap", item);
+  }
+  return lval(&heap->positions, *handle);
+}
+
+static void update_priority(heap_data *heap, size_t idx, VALUE priority_val) {
+  heap_priority new_priority = make_priority(heap, priority_val); // this might box the old priority, so get it afterwards
+
+  heap_priority old_priority = heap->priorities[idx];
+  heap->priorities[idx] = new_priority;
+
+  if (priority_less(heap, old_priority, new_priority)) {
+    sift_down(heap, idx);
+  } else if (priority_less(heap, new_priority, old_priority)) {
+    sift_up(heap, idx);
+  }
+}
+
+/*
+ * The new priority for update_by_delta. We avoid calling back into Ruby when we can.
+ */
+static VALUE priority_plus_delta(heap_data *heap, heap_priority priority, VALUE delta) {
+  if (heap->kind == PRIORITY_I64 && FIXNUM_P(delta)) {
+    int64_t sum;
+    if (!__builtin_add_overflow(priority.i, FIX2LONG(delta), &sum) && FIXABLE(sum)) {
+      return LONG2FIX(sum);
+    }
+  } else if (heap->kind == PRIORITY_F64 && RB_FLOAT_TYPE_P(delta)) {
+    return DBL2NUM(priority.f + RFLOAT_VALUE(delta));
+  }
+
+  return rb_funcall(priority_value(heap, priority), id_plus, 1, delta);
+}
+
+/*
+ * End C implementation of the Heap API
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * Keyword arguments are max_heap:, addressable:, arity:, and debug:, with the same meanings and defaults as for Heap.
+ */
+static VALUE heap_init(int argc, VALUE *argv, VALUE self) {
+  VALUE opts;
+  rb_scan_args(argc, argv, ":", &opts);
+
+  heap_data *heap = unwrapped(self);
+  if (!NIL_P(opts)) {
+    ID keys[4] = { rb_intern("max_heap"), rb_intern("addressable"), rb_intern("arity"), rb_intern("debug") };
+    VALUE values[4];
+    rb_get_kwargs(opts, keys, 0, 4, values);
+
+    if (values[0] != Qundef) {
+      heap->max_heap = RTEST(values[0]);
+    }
+    if (values[1] != Qundef) {
+      heap->addressable = RTEST(values[1]);
+    }
+    if (values[2] != Qundef) {
+      if (!FIXNUM_P(values[2]) || FIX2LONG(values[2]) < 2) {
+        rb_raise(eSharedDataError, "arity must be an Integer at least 2, not %"PRIsVALUE, values[2]);
+      }
+      heap->arity = FIX2LONG(values[2]);
+      heap->root = heap->arity - 1;
+    }
+    if (values[3] != Qundef) {
+      heap->debug = RTEST(values[3]);
+    }
+  }
+  return self;
+}
+
+/*
+ * @return the number of items currently in the heap
+ */
+static VALUE heap_size(VALUE self) {
+  return ULONG2NUM(unwrapped(self)->size);
+}
+
+/*
+ * Is the heap empty?
+ */
+static VALUE heap_empty_p(VALUE self) {
+  return unwrapped(self)->size == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * Insert a new element into the heap with the given priority.
+ *
+ * If the heap is addressable (the default) it is an error to insert an item that is already present in the heap.
+ *
+ * If the priority is omitted we use the inserted value as its own priority.
+ */
+static VALUE heap_insert(int argc, VALUE *argv, VALUE self) {
+  VALUE item, priority;
+  rb_scan_args(argc, argv, "11", &item, &priority);
+  if (argc == 1) {
+    priority = item;
+  }
+
+  heap_data *heap = unwrapped(self);
+  insert_item(heap, item, priority);
+  if (heap->debug) {
+    check_heap_property(heap);
+  }
+  return Qnil;
+}
+
+/*
+ * Insert the given items into the heap. See Heap#insert_many.
+ *
+ * priorities, if given, must be an Array of the same size as items. If omitted, each item is its own priority.
+ */
+static VALUE heap_insert_many(int argc, VALUE *argv, VALUE self) {
+  VALUE items, priorities;
+  rb_scan_args(argc, argv, "11", &items, &priorities);
+  if (argc == 1) {
+    priorities = items;
+  }
+  Check_Type(items, T_ARRAY);
+  Check_Type(priorities, T_ARRAY);
+  if (RARRAY_LEN(items) != RARRAY_LEN(priorities)) {
+    rb_raise(rb_eArgError, "items and priorities must have the same size (%ld != %ld)", RARRAY_LEN(items), RARRAY_LEN(priorities));
+  }
+
+  heap_data *heap = unwrapped(self);
+  insert_items(heap, items, priorities);
+  if (heap->debug) {
+    check_heap_property(heap);
+  }
+  return Qnil;
+}
+
+/*
+ * A new instance of klass, built from items and priorities in O(N) time. opts, if not nil, is a Hash of keyword arguments for the
+ * initializer.
+ */
+static VALUE build_heap(VALUE klass, VALUE items, VALUE priorities, VALUE opts) {
+  VALUE heap = NIL_P(opts) ? rb_class_new_instance(0, NULL, klass) : rb_class_new_instance_kw(1, &opts, klass, RB_PASS_KEYWORDS);
+
+  VALUE insert_args[2] = { items, priorities };
+  heap_insert_many(2, insert_args, heap);
+  return heap;
+}
+
+/*
+ * Build a heap containing the given items in O(N) time. See Heap.from.
+ *
+ * Any keyword arguments are passed to the initializer.
+ */
+static VALUE heap_s_from(int argc, VALUE *argv, VALUE klass) {
+  VALUE items, priorities, opts;
+  rb_scan_args(argc, argv, "11:", &items, &priorities, &opts);
+
+  return build_heap(klass, items, NIL_P(priorities) ? items : priorities, opts);
+}
+
+/*
+ * Build a heap in O(N) time from an Array of [item, priority] pairs. See Heap.heapify.
+ */
+static VALUE heap_s_heapify(int argc, VALUE *argv, VALUE klass) {
+  VALUE pairs, opts;
+  rb_scan_args(argc, argv, "1:", &pairs, &opts);
+  Check_Type(pairs, T_ARRAY);
+
+  long count = RARRAY_LEN(pairs);
+  VALUE items = rb_ary_new_capa(count);
+  VALUE priorities = rb_ary_new_capa(count);
+  for (long i = 0; i < count; i++) {
+    VALUE pair = rb_ary_entry(pairs, i);
+    Check_Type(pair, T_ARRAY);
+    rb_ary_push(items, rb_ary_entry(pair, 0));
+    rb_ary_push(priorities, rb_ary_entry(pair, 1));
+  }
+
+  return build_heap(klass, items, priorities, opts);
+}
+
+/*
+ * Return the top of the heap without removing it
+ */
+static VALUE heap_top(VALUE self) {
+  heap_data *heap = unwrapped(self);
+  return heap->slots[checked_top(heap)].item;
+}
+
+/*
+ * Return the priority of the item at the top of the heap
+ */
+static VALUE heap_top_priority(VALUE self) {
+  heap_data *heap = unwrapped(self);
+  return priority_value(heap, heap->priorities[checked_top(heap)]);
+}
+
+/*
+ * Return the top of the heap and remove it
+ */
+static VALUE heap_pop(VALUE self) {
+  heap_data *heap = unwrapped(self);
+  VALUE result = pop_item(heap);
+  if (heap->debug) {
+    check_heap_property(heap);
+  }
+  return result;
+}
+
+/*
+ * Remove and return the top k items, in order. If there are fewer than k we return all of them.
+ */
+static VALUE heap_pop_many(VALUE self, VALUE k_val) {
+  long k = NUM2LONG(k_val);
+  if (k < 0) {
+    rb_raise(eSharedDataError, "Cannot pop a negative number (%ld) of items", k);
+  }
+
+  heap_data *heap = unwrapped(self);
+  if ((size_t)k > heap->size) {
+    k = heap->size;
+  }
+
+  VALUE result = rb_ary_new_capa(k);
+  for (long i = 0; i < k; i++) {
+    rb_ary_push(result, pop_item(heap));
+  }
+  if (heap->debug) {
+    check_heap_property(heap);
+  }
+  return result;
+}
+
+/*
+ * Update the priority of the given element, which must already be in the heap.
+ */
+static VALUE heap_update(VALUE self, VALUE item, VALUE priority) {
+  heap_data *heap = unwrapped(self);
+  update_priority(heap, position_for_update(heap, item), priority);
+  if (heap->debug) {
+    check_heap_property(heap);
+  }
+  return Qnil;
+}
+
+/*
+ * Update the priority of the given element, which must already be in the heap, by changing it by delta.
+ */
+static VALUE heap_update_by_delta(VALUE self, VALUE item, VALUE delta) {
+  heap_data *heap = unwrapped(self);
+  size_t idx = position_for_update(heap, item);
+  VALUE priority = priority_plus_delta(heap, heap->priorities[idx], delta);
+
+  update_priority(heap, idx, priority);
+  if (heap->debug) {
+    check_heap_property(heap);
+  }
+  return Qnil;
+}
+
+/*
+ * A Heap, implemented in C.
+ *
+ * The API is the same as that of the Heap class: see heap.rb. When the priorities are all Fixnums or all Floats they are stored and
+ * compared without involving any Ruby objects.
+ */
+void Init_c_heap() {
+  id_cmp = rb_intern("<=>");
+  id_plus = rb_intern("+");
+
+  VALUE cHeap = rb_define_class_under(mDataStructuresRMolinari, "CHeap", rb_cObject);
+
+  rb_define_alloc_func(cHeap, heap_alloc);
+  rb_define_method(cHeap, "initialize", heap_init, -1);
+  rb_define_method(cHeap, "size", heap_size, 0);
+  rb_define_method(cHeap, "empty?", heap_empty_p, 0);
+  rb_define_singleton_method(cHeap, "from", heap_s_from, -1);
+  rb_define_singleton_method(cHeap, "heapify", heap_s_heapify, -1);
+  rb_define_method(cHeap, "insert", heap_insert, -1);
+  rb_define_method(cHeap, "insert_many", heap_insert_many, -1);
+  rb_define_method(cHeap, "top", heap_top, 0);
+  rb_define_method(cHeap, "top_priority", heap_top_priority, 0);
+  rb_define_method(cHeap, "pop", heap_pop, 0);
+  rb_define_method(cHeap, "pop_many", heap_pop_many, 1);
+  rb_define_method(cHeap, "update", heap_update, 2);
+  rb_define_method(cHeap, "update_by_delta", heap_update_by_delta, 2);
+}
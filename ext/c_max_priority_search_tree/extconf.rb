@@ -0,0 +1,6 @@
+require 'mkmf'
+require_relative '../extconf_shared.rb'
+
+abort 'missing pthreads' unless have_library('pthread', 'pthread_create')
+
+generate_makefile('max_priority_search_tree')
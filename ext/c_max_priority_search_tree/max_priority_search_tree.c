@@ -0,0 +1,2923 @@
+/*
+ * This is a C implementation of a Max Priority Search Tree.
+ *
+ * It is the C version of the MaxPrioritySearchTree Ruby class (max_priority_search_tree.rb in this gem) and has the same API. See
+ * that file for a description of the data structure and the algorithms, which come from the papers of De, Maheshwari, Nandy, and
+ * Smid. The comments here are mostly about the differences.
+ *
+ * - We read the coordinates of each point once, at construction, and store them as doubles in two plain arrays, xs and ys. The
+ *   queries never call back into Ruby. The point objects themselves are kept in a third array so that we can return them.
+ * - So the coordinates must be Numeric. Integers are converted to doubles and must be no larger than 2**53 in magnitude if they are to
+ *   be distinguished exactly.
+ * - The data array passed to the constructor is not changed. We build the tree in our own arrays.
+ * - Open regions are handled as in the Ruby class, by moving the boundaries to the adjacent double with nextafter().
+ * - A tree can be dumped to an image and loaded back, or mmap'd, without being rebuilt. The point objects can't go into the image, so
+ *   a loaded tree has no points array and returns Shared::Points made from the coordinates. The same goes for a tree made by
+ *   from_columns out of packed coordinates.
+ *
+ * We also implement Algorithms.maximal_empty_rectangles_packed here, as it needs a MaxPST and gains most from not going through Ruby
+ * objects.
+ */
+
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include "ruby/thread.h"
+#include "shared.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * The C implementation of a MaxPST
+ */
+
+/*
+ * The PST struct.
+ * - xs, ys, points: the implicit binary tree, as three parallel arrays. They are 1-based, like the tree arithmetic, so entry 0 is
+ *   unused. points is NULL for a tree loaded from an image or made from packed coordinates.
+ * - mapping: for a tree made by CMaxPrioritySearchTree.open, xs and ys live in the mapped image rather than on the heap.
+ * - size: the number of points in the tree when it was built.
+ * - member_count: the number of points currently in the tree. It is less than size once delete_top! has been called.
+ * - dynamic: can we call delete_top!? In a dynamic tree we have to work harder to know which nodes are still in the tree.
+ * - the remaining fields describe the shape of a tree that isn't dynamic, so we can answer leaf? and one_child? quickly.
+ * - stats: the hot-path counters reported by #stats, when they are compiled in. See shared.h.
+ */
+#ifdef DSRM_STATS
+typedef struct {
+  uint64_t delete_tops;
+  uint64_t delete_top_depths; // the total of the depths down to which delete_top! pushed the old top
+  uint64_t max_delete_top_depth;
+} pst_stats;
+#endif
+
+typedef struct {
+  double *xs;
+  double *ys;
+  VALUE *points;
+  size_t size;
+  size_t member_count;
+  int dynamic;
+  size_t last_non_leaf;
+  size_t parent_of_one_child; // 0 if there is no such node
+  image_mapping mapping;
+#ifdef DSRM_STATS
+  pst_stats stats;
+#endif
+} pst_data;
+
+static ID id_x;
+static ID id_y;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap, naturally).
+ */
+static pst_data *create_pst() {
+  pst_data *pst = ALLOC(pst_data);
+
+  pst->xs = NULL;
+  pst->ys = NULL;
+  pst->points = NULL;
+  pst->size = 0;
+  pst->member_count = 0;
+  pst->dynamic = 0;
+  pst->last_non_leaf = 0;
+  pst->parent_of_one_child = 0;
+  pst->mapping.base = NULL;
+#ifdef DSRM_STATS
+  memset(&pst->stats, 0, sizeof(pst_stats));
+#endif
+
+  return pst;
+}
+
+/*
+ * Free the memory associated with a PST.
+ *
+ * This will end up getting triggered by the Ruby garbage collector. Ruby learns about it via the pst_type struct below.
+ */
+static void pst_free(void *ptr) {
+  if (ptr) {
+    pst_data *pst = ptr;
+    if (pst->mapping.base) {
+      image_unmap(&pst->mapping);
+    } else {
+      xfree(pst->xs);
+      xfree(pst->ys);
+    }
+    xfree(pst->points);
+    xfree(pst);
+  }
+}
+
+/*
+ * How much memory (roughly) does a pst_data instance consume? We don't count a mapped image, whose pages may be shared with other
+ * processes.
+ */
+static size_t pst_memsize(const void *ptr) {
+  if (ptr) {
+    const pst_data *pst = ptr;
+    size_t coords_size = pst->xs && !pst->mapping.base ? (pst->size + 1) * 2 * sizeof(double) : 0;
+    return sizeof(pst_data) + coords_size + (pst->points ? (pst->size + 1) * sizeof(VALUE) : 0);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Mark the point objects we hold so that the Ruby garbage collector knows that they are still in use.
+ */
+static void pst_mark(void *ptr) {
+  pst_data *pst = ptr;
+  if (!pst->points) {
+    return;
+  }
+
+  for (size_t i = TREE_ROOT; i <= pst->size; i++) {
+    rb_gc_mark(pst->points[i]);
+  }
+}
+
+/*
+ * A configuration struct that tells the Ruby runtime how to deal with a pst_data object.
+ *
+ * https://docs.ruby-lang.org/en/master/extension_rdoc.html#label-Encapsulate+C+data+into+a+Ruby+object
+ */
+static const rb_data_type_t pst_type = {
+  .wrap_struct_name = "max_priority_search_tree",
+  { // help for the Ruby garbage collector
+    .dmark = pst_mark, // dmark, for marking other Ruby objects.
+    .dfree = pst_free, // how to free the memory associated with an object
+    .dsize = pst_memsize, // roughly how much space does the object consume?
+  },
+  .data = NULL, // a data field we could use for something here if we wanted. Ruby ignores it
+  .flags = 0  // GC-related flag values.
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+/************************************************************
+ * Wrapping and unwrapping things for the Ruby runtime
+ *
+ */
+
+/*
+ * Unwrap a Ruby-side PST object to get the C struct inside.
+ */
+static pst_data *unwrapped(VALUE self) {
+  pst_data *pst;
+  TypedData_Get_Struct((self), pst_data, &pst_type, pst);
+  return pst;
+}
+
+/*
+ * This is for CMaxPrioritySearchTree.allocate on the Ruby side
+ */
+static VALUE pst_alloc(VALUE klass) {
+  // Get one on the heap
+  pst_data *pst = create_pst();
+  // Wrap it up into a Ruby object
+  return TypedData_Wrap_Struct(klass, &pst_type, pst);
+}
+
+/*
+ * A Shared::Point with the given coordinates. We use these for "nothing found" results, like (infty, -infty).
+ */
+static VALUE make_point(double x, double y) {
+  return rb_struct_new(cSharedPoint, DBL2NUM(x), DBL2NUM(y));
+}
+
+/*
+ * The point at the given node: the object we were given or, for a tree without point objects, a Shared::Point with its coordinates.
+ */
+static VALUE point_at(pst_data *pst, size_t node) {
+  return pst->points ? pst->points[node] : make_point(pst->xs[node], pst->ys[node]);
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * Tree structure
+ *
+ * These follow the private helpers of the same names in the Ruby class.
+ */
+
+#define parent_of(i) ((i) >> 1)
+#define is_left_child(i) (((i) & 1) == 0)
+
+/* The level in the tree of node i. The root is at level 0. */
+static int level(size_t i) {
+  return 63 - __builtin_clzll(i);
+}
+
+/*
+ * Does the value at index i have a "better" y value than the value at index j?
+ *
+ * A value is better if it is larger, or if it is equal and the x value is smaller (which is how we break the tie)
+ */
+static int better_y(pst_data *pst, size_t i, size_t j) {
+  if (pst->ys[i] != pst->ys[j]) {
+    return pst->ys[i] > pst->ys[j];
+  }
+  return pst->xs[i] < pst->xs[j];
+}
+
+/*
+ * Is node i in the tree?
+ *
+ * In a dynamic tree a deleted point has been swapped down to a leaf, where it is y-better than its parent.
+ */
+static int in_tree(pst_data *pst, size_t i) {
+  if (!pst->dynamic) {
+    return i <= pst->size;
+  }
+  if (pst->member_count == 0 || i > pst->size) {
+    return 0;
+  }
+  if (i == TREE_ROOT) {
+    return 1;
+  }
+  return better_y(pst, parent_of(i), i);
+}
+
+/* i has no children */
+static int is_leaf(pst_data *pst, size_t i) {
+  if (!pst->dynamic) {
+    return i > pst->last_non_leaf;
+  }
+  return !(in_tree(pst, left_child(i)) || in_tree(pst, right_child(i)));
+}
+
+/*
+ * If i has exactly one child, return it. Otherwise return 0.
+ *
+ * Unless the PST is dynamic this will be the left child. Otherwise it could be either.
+ */
+static size_t one_child(pst_data *pst, size_t i) {
+  if (!pst->dynamic) {
+    return i == pst->parent_of_one_child ? left_child(i) : 0;
+  }
+
+  int left_in = in_tree(pst, left_child(i));
+  if (left_in == in_tree(pst, right_child(i))) {
+    return 0;
+  }
+  return left_in ? left_child(i) : right_child(i);
+}
+
+/*
+ * Swap the points at nodes i and j. The points array may be NULL, for a tree without point objects or for the private copies of the
+ * tree made by the threads of maximal_empty_rectangles_packed.
+ */
+static void swap_nodes(pst_data *pst, size_t i, size_t j) {
+  double tmp_x = pst->xs[i];
+  double tmp_y = pst->ys[i];
+
+  pst->xs[i] = pst->xs[j];
+  pst->ys[i] = pst->ys[j];
+
+  pst->xs[j] = tmp_x;
+  pst->ys[j] = tmp_y;
+
+  if (pst->points) {
+    VALUE tmp_point = pst->points[i];
+    pst->points[i] = pst->points[j];
+    pst->points[j] = tmp_point;
+  }
+}
+
+/* The smallest double larger than x */
+static double slightly_bigger(double x) {
+  if (isinf(x)) {
+    rb_raise(rb_eRuntimeError, "%f out of Float range", x);
+  }
+  return nextafter(x, INFINITY);
+}
+
+/* The largest double smaller than x */
+static double slightly_smaller(double x) {
+  if (isinf(x)) {
+    rb_raise(rb_eRuntimeError, "%f out of Float range", x);
+  }
+  return nextafter(x, -INFINITY);
+}
+
+/*
+ * The same without the check, for code that runs without the GVL and so mustn't raise. The caller makes sure x is finite.
+ */
+static inline double next_up(double x) {
+  return nextafter(x, INFINITY);
+}
+
+static inline double next_down(double x) {
+  return nextafter(x, -INFINITY);
+}
+
+/*
+ * End tree structure functions
+ ************************************************************/
+
+/************************************************************
+ * Construction
+ *
+ */
+
+/*
+ * Sort the nodes l..r by x, in place.
+ *
+ * This is an introsort: quicksort with a median-of-3 pivot, insertion sort for short ranges, and heapsort if the recursion gets too
+ * deep, so it is O(n log n) in the worst case.
+ */
+#define INSERTION_SORT_THRESHOLD 16
+
+static void sift_down_by_x(pst_data *pst, size_t base, size_t idx, size_t count) {
+  for (;;) {
+    size_t largest = idx;
+    size_t left = 2 * idx + 1;
+    size_t right = left + 1;
+    if (left < count && pst->xs[base + left] > pst->xs[base + largest]) {
+      largest = left;
+    }
+    if (right < count && pst->xs[base + right] > pst->xs[base + largest]) {
+      largest = right;
+    }
+    if (largest == idx) {
+      return;
+    }
+    swap_nodes(pst, base + idx, base + largest);
+    idx = largest;
+  }
+}
+
+static void heapsort_by_x(pst_data *pst, size_t l, size_t r) {
+  size_t count = r - l + 1;
+  for (size_t i = count / 2; i-- > 0; ) {
+    sift_down_by_x(pst, l, i, count);
+  }
+  for (size_t end = count - 1; end > 0; end--) {
+    swap_nodes(pst, l, l + end);
+    sift_down_by_x(pst, l, 0, end);
+  }
+}
+
+static void insertion_sort_by_x(pst_data *pst, size_t l, size_t r) {
+  for (size_t i = l + 1; i <= r; i++) {
+    for (size_t j = i; j > l && pst->xs[j - 1] > pst->xs[j]; j--) {
+      swap_nodes(pst, j - 1, j);
+    }
+  }
+}
+
+static void introsort_by_x(pst_data *pst, size_t l, size_t r, int depth_limit) {
+  double *xs = pst->xs;
+
+  while (r > l + INSERTION_SORT_THRESHOLD) {
+    if (depth_limit-- == 0) {
+      heapsort_by_x(pst, l, r);
+      return;
+    }
+
+    // Put the median of xs[l], xs[mid], xs[r] at mid, and use it as the pivot
+    size_t mid = l + (r - l) / 2;
+    if (xs[mid] < xs[l]) {
+      swap_nodes(pst, mid, l);
+    }
+    if (xs[r] < xs[l]) {
+      swap_nodes(pst, r, l);
+    }
+    if (xs[r] < xs[mid]) {
+      swap_nodes(pst, r, mid);
+    }
+    double pivot = xs[mid];
+
+    // Hoare partition. Now xs[l] <= pivot <= xs[r], so the scans stay in range.
+    size_t i = l, j = r;
+    for (;;) {
+      while (xs[++i] < pivot);
+      while (xs[--j] > pivot);
+      if (i >= j) {
+        break;
+      }
+      swap_nodes(pst, i, j);
+    }
+
+    // Recurse on the smaller side and loop on the larger, so the stack depth is O(log n)
+    if (j - l < r - j) {
+      introsort_by_x(pst, l, j, depth_limit);
+      l = j + 1;
+    } else {
+      introsort_by_x(pst, j + 1, r, depth_limit);
+      r = j;
+    }
+  }
+  insertion_sort_by_x(pst, l, r);
+}
+
+static void sort_subarray(pst_data *pst, size_t l, size_t r) {
+  if (r <= l) {
+    return;
+  }
+  introsort_by_x(pst, l, r, 2 * level(r - l + 1));
+}
+
+/*
+ * The index in l..r having the largest value for y, breaking ties with the smaller x value. Since we are already sorted by x we
+ * just take the first one we see.
+ */
+static size_t index_with_largest_y_in(pst_data *pst, size_t l, size_t r) {
+  size_t best = l;
+  for (size_t i = l + 1; i <= r; i++) {
+    if (pst->ys[i] > pst->ys[best]) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+/*
+ * Read the coordinates of the points in data into our arrays.
+ *
+ * Shared::Points are read directly from the Struct. Anything else must respond to #x and #y.
+ */
+static void read_points(pst_data *pst, VALUE data) {
+  VALUE cPoint = cSharedPoint;
+  long n = RARRAY_LEN(data);
+
+  pst->xs = ALLOC_N(double, n + 1);
+  pst->ys = ALLOC_N(double, n + 1);
+  pst->points = ALLOC_N(VALUE, n + 1);
+
+  for (long i = 0; i < n; i++) {
+    VALUE point = rb_ary_entry(data, i); // nil if calls to #x or #y have shrunk the array
+    VALUE x, y;
+    if (rb_obj_class(point) == cPoint) {
+      x = RSTRUCT_GET(point, 0);
+      y = RSTRUCT_GET(point, 1);
+    } else {
+      x = rb_funcall(point, id_x, 0);
+      y = rb_funcall(point, id_y, 0);
+    }
+    double x_val = NUM2DBL(x);
+    double y_val = NUM2DBL(y);
+    if (isnan(x_val) || isnan(y_val)) {
+      rb_raise(eSharedDataError, "Coordinates must not be NaN");
+    }
+
+    // size counts the points read so far, so that pst_mark sees them if calls to #x and #y trigger a GC
+    size_t node = pst->size + 1;
+    pst->xs[node] = x_val;
+    pst->ys[node] = y_val;
+    pst->points[node] = point;
+    pst->size++;
+  }
+  pst->member_count = pst->size;
+}
+
+/*
+ * Read the coordinates from two Strings of packed doubles, as made by Array#pack('d*'). We keep no point objects: the queries return
+ * Shared::Points made from the coordinates.
+ */
+static void read_columns(pst_data *pst, VALUE xs, VALUE ys) {
+  StringValue(xs);
+  StringValue(ys);
+  long len = RSTRING_LEN(xs);
+  if (len % sizeof(double) != 0) {
+    rb_raise(rb_eArgError, "packed coordinates must be a whole number of doubles (got %ld bytes)", len);
+  }
+  if (RSTRING_LEN(ys) != len) {
+    rb_raise(rb_eArgError, "xs and ys must have the same size (%ld != %ld bytes)", len, RSTRING_LEN(ys));
+  }
+  size_t n = len / sizeof(double);
+
+  pst->xs = ALLOC_N(double, n + 1);
+  pst->ys = ALLOC_N(double, n + 1);
+  memcpy(pst->xs + TREE_ROOT, RSTRING_PTR(xs), len);
+  memcpy(pst->ys + TREE_ROOT, RSTRING_PTR(ys), len);
+  for (size_t i = TREE_ROOT; i <= n; i++) {
+    if (isnan(pst->xs[i]) || isnan(pst->ys[i])) {
+      rb_raise(eSharedDataError, "Coordinates must not be NaN");
+    }
+  }
+
+  pst->size = n;
+  pst->member_count = n;
+}
+
+/*
+ * The number of nodes in the subtree at node v in a tree with size nodes.
+ */
+static size_t subtree_size(size_t v, size_t size) {
+  size_t count = 0;
+  for (size_t lo = v, width = 1; lo <= size; lo <<= 1, width <<= 1) {
+    size_t hi = lo + width - 1;
+    count += (hi < size ? hi : size) - lo + 1;
+  }
+  return count;
+}
+
+/*
+ * Build the tree in the arrays. See construct_pst in the Ruby class.
+ *
+ * We sort the points by x once. Then we work level by level. At level i the points not yet placed are in positions 2^i..size,
+ * sorted by x, in one group for each node of the level. We find the highest point in each group and move these to the front, to the
+ * nodes of level i, while the other points close up behind them, still in order. This takes O(n) time for each level and O(n log n)
+ * in all.
+ *
+ * The paper does the stable partitioning step in place with the algorithm of Katajainen and Pasanen. We settle for a scratch array
+ * to hold the points chosen for a level. There are never more than (size + 1) / 2 of them.
+ *
+ * The points array may be NULL, when we have only coordinates.
+ */
+static void construct_pst(pst_data *pst) {
+  size_t size = pst->size;
+  double *xs = pst->xs;
+  double *ys = pst->ys;
+  VALUE *points = pst->points;
+
+  sort_subarray(pst, 1, size);
+  for (size_t i = 2; i <= size; i++) {
+    if (xs[i] == xs[i - 1]) {
+      rb_raise(eSharedDataError, "Duplicate x values are not supported");
+    }
+  }
+
+  pst->last_non_leaf = size / 2;
+  pst->parent_of_one_child = (size % 2 == 0) ? pst->last_non_leaf : 0;
+
+  if (size < 2) {
+    return;
+  }
+
+  size_t scratch_size = (size + 1) / 2;
+  double *chosen_xs = ALLOC_N(double, scratch_size);
+  double *chosen_ys = ALLOC_N(double, scratch_size);
+  VALUE *chosen_points = points ? ALLOC_N(VALUE, scratch_size) : NULL;
+
+  // No Ruby code runs and nothing is allocated from here until the end, so there is no GC while the chosen points are only in the
+  // scratch arrays.
+  for (size_t level_start = TREE_ROOT; 2 * level_start <= size; level_start *= 2) {
+    size_t node_count = size - level_start + 1 < level_start ? size - level_start + 1 : level_start;
+
+    // We work from right to left, so that we can move each unchosen point to its final place right away. The write position is
+    // never to the left of the read position.
+    size_t group_end = size;
+    size_t write = size;
+    for (size_t j = node_count; j-- > 0; ) {
+      size_t group_start = group_end + 1 - subtree_size(level_start + j, size);
+
+      size_t highest = index_with_largest_y_in(pst, group_start, group_end);
+      chosen_xs[j] = xs[highest];
+      chosen_ys[j] = ys[highest];
+      if (points) {
+        chosen_points[j] = points[highest];
+      }
+
+      for (size_t read = group_end; read + 1 > group_start; read--) {
+        if (read != highest) {
+          xs[write] = xs[read];
+          ys[write] = ys[read];
+          if (points) {
+            points[write] = points[read];
+          }
+          write--;
+        }
+      }
+      group_end = group_start - 1;
+    }
+
+    for (size_t j = 0; j < node_count; j++) {
+      xs[level_start + j] = chosen_xs[j];
+      ys[level_start + j] = chosen_ys[j];
+      if (points) {
+        points[level_start + j] = chosen_points[j];
+      }
+    }
+  }
+
+  xfree(chosen_xs);
+  xfree(chosen_ys);
+  xfree(chosen_points);
+}
+
+/*
+ * The min and max x values in the subtree at node, for verify_properties.
+ */
+static void x_range_of_subtree(pst_data *pst, size_t node, double *min_x, double *max_x) {
+  if (node > pst->size) {
+    *min_x = INFINITY;
+    *max_x = -INFINITY;
+    return;
+  }
+
+  double l_min, l_max, r_min, r_max;
+  x_range_of_subtree(pst, left_child(node), &l_min, &l_max);
+  x_range_of_subtree(pst, right_child(node), &r_min, &r_max);
+
+  double x = pst->xs[node];
+  *min_x = fmin(x, fmin(l_min, r_min));
+  *max_x = fmax(x, fmax(l_max, r_max));
+}
+
+/*
+ * Check that our data satisfies the requirements of a Priority Search Tree:
+ * - max-heap in y
+ * - all the x values in the left subtree are less than all the x values in the right subtree
+ */
+static void verify_properties(pst_data *pst) {
+  for (size_t node = 2; node <= pst->size; node++) {
+    if (pst->ys[node] > pst->ys[parent_of(node)]) {
+      rb_raise(eSharedInternalLogicError, "Heap property violated at child %zu", node);
+    }
+  }
+
+  for (size_t node = TREE_ROOT; right_child(node) <= pst->size; node++) {
+    double l_min, l_max, r_min, r_max;
+    x_range_of_subtree(pst, left_child(node), &l_min, &l_max);
+    x_range_of_subtree(pst, right_child(node), &r_min, &r_max);
+    if (!(l_max < r_min)) {
+      rb_raise(eSharedInternalLogicError, "Left-right property of x-values violated at %zu", node);
+    }
+  }
+}
+
+/*
+ * End construction functions
+ ************************************************************/
+
+/************************************************************
+ * Queries
+ *
+ * Each of these is a direct translation of the method of the same name in the Ruby class. See the comments there. The results are
+ * node indices, with 0 meaning "nothing found".
+ */
+
+/*
+ * The best point found so far in a search. When node is 0 the coordinates are those of the "nothing found" sentinel.
+ */
+typedef struct {
+  size_t node;
+  double x;
+  double y;
+} best_point;
+
+static void set_best(pst_data *pst, best_point *best, size_t node) {
+  best->node = node;
+  best->x = pst->xs[node];
+  best->y = pst->ys[node];
+}
+
+static VALUE best_point_value(pst_data *pst, best_point *best) {
+  return best->node ? point_at(pst, best->node) : make_point(best->x, best->y);
+}
+
+/*
+ * Consider node as the highest point found so far. We break ties by preferring points with smaller x values.
+ */
+static void update_highest(pst_data *pst, best_point *best, size_t node, int in_q) {
+  if (in_q && (pst->ys[node] > best->y || (pst->ys[node] == best->y && pst->xs[node] < best->x))) {
+    set_best(pst, best, node);
+  }
+}
+
+/*
+ * largest_y_in_ne (when ne is true) and largest_y_in_nw (when it is false).
+ *
+ * Where the Ruby code has lambdas for the preferred child, etc., we use the sign trick of extremal_in_x_dimension: in the NW
+ * quadrant we negate x-values, which turns x <= x0 into -x >= -x0, and swap the roles of the children.
+ */
+static void largest_y_in_quadrant(pst_data *pst, double x0, double y0, int ne, best_point *best) {
+  double sign = ne ? 1 : -1;
+  double *xs = pst->xs;
+  double *ys = pst->ys;
+
+  best->node = 0;
+  best->x = ne ? INFINITY : -INFINITY;
+  best->y = -INFINITY;
+
+  if (pst->member_count == 0) {
+    return;
+  }
+
+#define sufficient_x(x) (sign * (x) >= sign * x0)
+#define in_q(node) (sufficient_x(xs[node]) && ys[node] >= y0)
+#define preferred_child(node) (ne ? right_child(node) : left_child(node))
+#define nonpreferred_child(node) (ne ? left_child(node) : right_child(node))
+
+  size_t p = TREE_ROOT;
+  while (!is_leaf(pst, p)) {
+    size_t child;
+    if (in_q(p)) {
+      // p \in Q and nothing in its subtree can beat it because of the max-heap
+      update_highest(pst, best, p, 1);
+      return;
+    } else if (ys[p] < y0) {
+      // p is too low for Q, so the entire subtree is too low as well
+      return;
+    } else if ((child = one_child(pst, p))) {
+      p = child;
+    } else if (xs[preferred_child(p)] == x0 || !sufficient_x(xs[preferred_child(p)])) {
+      // the preferred child might be in Q, but nothing in the other subtree can be, by the PST property on x.
+      p = preferred_child(p);
+    } else if (sufficient_x(xs[nonpreferred_child(p)])) {
+      // Both children have sufficient x, so try the y-higher of them.
+      p = ys[right_child(p)] > ys[left_child(p)] ? right_child(p) : left_child(p);
+    } else if (ys[preferred_child(p)] < y0) {
+      p = nonpreferred_child(p);
+    } else {
+      // The preferred child is in Q and nothing in its subtree can beat it. But there might be something better in the other subtree.
+      update_highest(pst, best, preferred_child(p), in_q(preferred_child(p)));
+      p = nonpreferred_child(p);
+    }
+  }
+  update_highest(pst, best, p, in_q(p)); // try the leaf
+
+#undef sufficient_x
+#undef in_q
+#undef preferred_child
+#undef nonpreferred_child
+}
+
+/*
+ * determine_next_nodes from extremal_in_x_dimension in the Ruby code. c has length len, which is between 2 and 4.
+ *
+ * We set *p and *q to the nodes to explore next, which may be 0 to say there is nothing worth exploring.
+ */
+static void determine_next_nodes(pst_data *pst, double x0, double y0, int ne, size_t *c, int len, size_t *p, size_t *q) {
+  double sign = ne ? 1 : -1;
+  double *xs = pst->xs;
+  double *ys = pst->ys;
+
+  if (!ne) {
+    for (int i = 0; i < len / 2; i++) {
+      size_t tmp = c[i];
+      c[i] = c[len - 1 - i];
+      c[len - 1 - i] = tmp;
+    }
+  }
+
+  if (sign * xs[c[0]] > sign * x0) {
+    // All subtrees have x-values good enough for Q. Explore the "leftmost" subtree with large enough y values.
+    size_t leftmost = 0;
+    for (int i = 0; i < len; i++) {
+      if (ys[c[i]] >= y0) {
+        leftmost = c[i];
+        break;
+      }
+    }
+    *p = *q = leftmost;
+    return;
+  }
+
+  if (sign * xs[c[len - 1]] <= sign * x0) {
+    // only the "rightmost" subtree can possibly have anything in Q, assuming distinct x-values
+    *p = *q = c[len - 1];
+    return;
+  }
+
+  // The checks above mean the loop stops early for sensible x0. The bound on i keeps us inside c whatever x0 is.
+  int i = 0;
+  while (i < len - 2 && !(sign * xs[c[i]] <= sign * x0 && sign * x0 < sign * xs[c[i + 1]])) {
+    i++;
+  }
+
+  size_t new_q = 0;
+  for (int j = i + 1; j < len; j++) {
+    if (ys[c[j]] >= y0) {
+      new_q = c[j];
+      break;
+    }
+  }
+  size_t new_p = ys[c[i]] >= y0 ? c[i] : 0;
+  if (!new_p) {
+    new_p = new_q;
+  }
+  if (!new_q) {
+    new_q = new_p;
+  }
+
+  if (ne) {
+    *p = new_p;
+    *q = new_q;
+  } else {
+    *p = new_q;
+    *q = new_p;
+  }
+}
+
+/*
+ * smallest_x_in_ne (when ne is true) and largest_x_in_nw (when it is false).
+ */
+static void extremal_in_x_dimension(pst_data *pst, double x0, double y0, int ne, best_point *best) {
+  double sign = ne ? 1 : -1;
+
+  best->node = 0;
+  best->x = ne ? INFINITY : -INFINITY;
+  best->y = INFINITY;
+
+  if (pst->member_count == 0) {
+    return;
+  }
+
+#define update_best(node)                                                                                    \
+  do {                                                                                                       \
+    size_t n_ = (node);                                                                                      \
+    if (sign * pst->xs[n_] >= sign * x0 && pst->ys[n_] >= y0 && sign * pst->xs[n_] < sign * best->x) {  \
+      set_best(pst, best, n_);                                                                               \
+    }                                                                                                        \
+  } while (0)
+
+  size_t p = TREE_ROOT, q = TREE_ROOT;
+  while (!(is_leaf(pst, p) && is_leaf(pst, q))) {
+    update_best(p);
+    update_best(q);
+
+    if (p == q) {
+      size_t child = one_child(pst, p);
+      if (child) {
+        p = q = child;
+      } else {
+        q = right_child(p);
+        p = left_child(p);
+      }
+    } else if (is_leaf(pst, q)) {
+      q = p;
+    } else if (is_leaf(pst, p)) {
+      p = q;
+    } else {
+      size_t p_only_child = one_child(pst, p);
+      size_t q_only_child = one_child(pst, q);
+      size_t c[4];
+      int len = 0;
+      if (p_only_child) {
+        c[len++] = p_only_child;
+      } else {
+        c[len++] = left_child(p);
+        c[len++] = right_child(p);
+      }
+      if (q_only_child) {
+        c[len++] = q_only_child;
+      } else {
+        c[len++] = left_child(q);
+        c[len++] = right_child(q);
+      }
+      determine_next_nodes(pst, x0, y0, ne, c, len, &p, &q);
+      if (!p) {
+        break; // we've run out of useful nodes
+      }
+    }
+  }
+  if (p) {
+    update_best(p);
+  }
+  if (q) {
+    update_best(q);
+  }
+
+#undef update_best
+}
+
+/*
+ * largest_y_in_3_sided. The helpers check_left and check_right of the Ruby code are inlined in the main loop.
+ */
+static void largest_y_in_3_sided(pst_data *pst, double x0, double x1, double y0, best_point *best) {
+  double *xs = pst->xs;
+
+  best->node = 0;
+  best->x = INFINITY;
+  best->y = -INFINITY;
+
+  if (pst->member_count == 0) {
+    return;
+  }
+
+#define in_x_range(node) (x0 <= xs[node] && xs[node] <= x1)
+#define update(node) update_highest(pst, best, (node), in_x_range(node) && pst->ys[node] >= y0)
+
+  size_t p = 0, q = 0;
+  int left = 0, right = 0;
+
+  if (in_x_range(TREE_ROOT)) {
+    // If y(root) is large enough then the root is the winner because of the max heap property in y. And if it isn't large enough
+    // then no other point in the tree can be high enough either
+    if (pst->ys[TREE_ROOT] >= y0) {
+      set_best(pst, best, TREE_ROOT);
+    }
+  }
+
+  if (xs[TREE_ROOT] < x0) {
+    p = TREE_ROOT;
+    left = 1;
+  } else {
+    q = TREE_ROOT;
+    right = 1;
+  }
+
+  while (left || right) {
+    size_t only_child;
+    if (left && (!right || level(p) <= level(q))) {
+      // check_left: we know that x(p) < x0
+      if (is_leaf(pst, p)) {
+        left = 0;
+      } else if ((only_child = one_child(pst, p))) {
+        if (in_x_range(only_child)) {
+          update(only_child);
+          left = 0; // can't do y-better in the subtree
+        } else if (xs[only_child] < x0) {
+          p = only_child;
+        } else {
+          q = only_child;
+          right = 1;
+          left = 0;
+        }
+      } else {
+        size_t l = left_child(p), r = right_child(p);
+        if (xs[l] < x0) {
+          if (xs[r] < x0) {
+            p = r;
+          } else if (xs[r] <= x1) {
+            update(r);
+            p = l;
+          } else {
+            q = r;
+            p = l;
+            right = 1;
+          }
+        } else if (xs[l] <= x1) {
+          update(l);
+          left = 0; // we won't do better in T(p_l)
+          if (xs[r] > x1) {
+            q = r;
+            right = 1;
+          } else {
+            update(r);
+          }
+        } else {
+          q = l;
+          left = 0;
+          right = 1;
+        }
+      }
+    } else {
+      // check_right: we know that x(q) > x1
+      if (is_leaf(pst, q)) {
+        right = 0;
+      } else if ((only_child = one_child(pst, q))) {
+        if (in_x_range(only_child)) {
+          update(only_child);
+          right = 0; // can't do y-better in the subtree
+        } else if (xs[only_child] < x0) {
+          p = only_child;
+          left = 1;
+          right = 0;
+        } else {
+          q = only_child;
+        }
+      } else {
+        size_t l = left_child(q), r = right_child(q);
+        if (xs[l] < x0) {
+          left = 1;
+          if (xs[r] < x0) {
+            p = r;
+            right = 0;
+          } else if (xs[r] <= x1) {
+            update(r);
+            p = l;
+            right = 0;
+          } else {
+            p = l;
+            q = r;
+          }
+        } else if (xs[l] <= x1) {
+          update(l);
+          if (xs[r] > x1) {
+            q = r;
+          } else {
+            update(r);
+            right = 0;
+          }
+        } else {
+          q = l;
+        }
+      }
+    }
+  }
+
+#undef in_x_range
+#undef update
+}
+
+/*
+ * What an enumeration does with each point it finds.
+ */
+typedef enum {
+  REPORT_YIELD,   // yield it to the block
+  REPORT_COLLECT, // push it onto the result Array
+  REPORT_COUNT,   // just count it
+  REPORT_PACK     // write its coordinates to the buffer
+} report_mode;
+
+/*
+ * Work that a step of the search leaves to be done before the next step: report a node, or explore the subtree under it. See
+ * enumerate_3_sided().
+ *
+ * For an exploration, current and state say how far it has got, as in explore().
+ */
+typedef struct {
+  size_t node;
+  int is_exploration;
+  size_t current;
+  int state;
+} enumeration_task;
+
+// A step leaves at most three tasks: it reports its node and explores at most one subtree, or it explores at most two.
+#define MAX_ENUMERATION_TASKS 4
+
+/*
+ * The state of an enumerate_3_sided search. See the long comment in the Ruby code.
+ *
+ * Instead of using primes we use "_in", so p_in is the paper's p'.
+ *
+ * The fields after the node-tracking ones are about what we do with the points we find. For REPORT_PACK we write up to capacity
+ * points to buffer. When it is full we set done and the search stops. Everything needed to carry on is in the struct, and a later
+ * call can do so by resetting buffer, capacity, written and done. See pst_enumerate_3_sided_into().
+ */
+typedef struct {
+  pst_data *pst;
+  double x0, x1, y0;
+  int started;
+  size_t p, p_in, q_in, q;
+  int left, left_in, right_in, right;
+  enumeration_task tasks[MAX_ENUMERATION_TASKS]; // a FIFO queue
+  int task_count;
+  report_mode mode;
+  VALUE result;
+  size_t count; // the number of points reported so far
+  char *buffer;
+  size_t capacity;
+  size_t written;
+  int done;
+} enumeration;
+
+static void add_task(enumeration *e, size_t node, int is_exploration) {
+  if (e->task_count == MAX_ENUMERATION_TASKS) {
+    rb_raise(eSharedInternalLogicError, "Too many enumeration tasks");
+  }
+  e->tasks[e->task_count++] = (enumeration_task){ .node = node, .is_exploration = is_exploration, .current = node, .state = 0 };
+}
+
+/* Report the point at node, once the tasks before it are done */
+static void report(enumeration *e, size_t node) {
+  add_task(e, node, 0);
+}
+
+/* Report the points under t, as explore() does, once the tasks before it are done */
+static void explore_later(enumeration *e, size_t t) {
+  add_task(e, t, 1);
+}
+
+/* Really report the point at node */
+static void emit(enumeration *e, size_t node) {
+  switch (e->mode) {
+  case REPORT_YIELD:
+    rb_yield(point_at(e->pst, node));
+    break;
+  case REPORT_COLLECT:
+    rb_ary_push(e->result, point_at(e->pst, node));
+    break;
+  case REPORT_COUNT:
+    e->count++;
+    break;
+  case REPORT_PACK:
+    if (e->done) {
+      return;
+    }
+    double coords[2] = { e->pst->xs[node], e->pst->ys[node] };
+    memcpy(e->buffer + e->written * sizeof(coords), coords, sizeof(coords));
+    e->done = ++e->written == e->capacity;
+    break;
+  }
+}
+
+/*
+ * "reports all points in T_t whose y-coordinates are at least y0"
+ *
+ * This is a pre-order traversal that uses the parent links of the implicit tree, and so O(1) extra space. The task says where in
+ * the traversal we are. If we stop early because the buffer is full we save our place there and return false.
+ */
+static int explore(enumeration *e, enumeration_task *task) {
+  pst_data *pst = e->pst;
+  size_t t = task->node;
+  size_t current = task->current;
+  int state = task->state;
+
+  while ((current != t || state != 2) && !e->done) {
+    switch (state) {
+    case 0:
+      // we have arrived at this node for the first time
+      if (pst->ys[current] >= e->y0) {
+        emit(e, current);
+      }
+      if (!is_leaf(pst, current) && in_tree(pst, left_child(current)) && pst->ys[left_child(current)] >= e->y0) {
+        current = left_child(current);
+      } else {
+        state = 1;
+      }
+      break;
+    case 1:
+      // we've already handled this node and its left subtree. Should we descend to the right subtree?
+      if (in_tree(pst, right_child(current)) && pst->ys[right_child(current)] >= e->y0) {
+        current = right_child(current);
+        state = 0;
+      } else {
+        state = 2;
+      }
+      break;
+    case 2:
+      // we're done with this node and its subtrees. Go back up a level, having set state correctly for the logic at the parent.
+      if (is_left_child(current)) {
+        state = 1;
+      }
+      current = parent_of(current);
+      break;
+    }
+  }
+
+  task->current = current;
+  task->state = state;
+  return current == t && state == 2;
+}
+
+/*
+ * Do the queued tasks in order, stopping early if the buffer fills up.
+ */
+static void run_tasks(enumeration *e) {
+  while (e->task_count > 0 && !e->done) {
+    enumeration_task *task = &e->tasks[0];
+    if (task->is_exploration) {
+      if (!explore(e, task)) {
+        return;
+      }
+    } else {
+      emit(e, task->node);
+    }
+    e->task_count--;
+    memmove(e->tasks, e->tasks + 1, e->task_count * sizeof(enumeration_task));
+  }
+}
+
+/* Mark p_in as inactive. Then, if q_in is active, it becomes p_in. */
+static void deactivate_p_in(enumeration *e) {
+  e->left_in = 0;
+  if (e->right_in) {
+    e->p_in = e->q_in;
+    e->left_in = 1;
+    e->right_in = 0;
+  }
+}
+
+/* Add a new leftmost "in" point. This becomes p_in. We handle existing "inside" points appropriately */
+static void add_leftmost_inner_node(enumeration *e, size_t node) {
+  if (e->left_in && e->right_in) {
+    // the old p_in is squeezed between node and q_in
+    explore_later(e, e->p_in);
+  } else if (e->left_in) {
+    e->q_in = e->p_in;
+    e->right_in = 1;
+  } else {
+    e->left_in = 1;
+  }
+  e->p_in = node;
+}
+
+static void add_rightmost_inner_node(enumeration *e, size_t node) {
+  if (e->left_in && e->right_in) {
+    // the old q_in is squeezed between p_in and node
+    explore_later(e, e->q_in);
+    e->q_in = node;
+  } else if (e->left_in) {
+    e->q_in = node;
+    e->right_in = 1;
+  } else {
+    e->p_in = node;
+    e->left_in = 1;
+  }
+}
+
+#define in_x_range(e, node) ((e)->x0 <= (e)->pst->xs[node] && (e)->pst->xs[node] <= (e)->x1)
+
+/* Handle the next step of the subtree at p */
+static void enumerate_left(enumeration *e) {
+  pst_data *pst = e->pst;
+  double *xs = pst->xs;
+  size_t p = e->p;
+
+  if (is_leaf(pst, p)) {
+    e->left = 0;
+    return;
+  }
+
+  size_t only_child = one_child(pst, p);
+  if (only_child) {
+    if (in_x_range(e, only_child)) {
+      add_leftmost_inner_node(e, only_child);
+      e->left = 0;
+    } else if (xs[only_child] < e->x0) {
+      e->p = only_child;
+    } else {
+      e->q = only_child;
+      e->right = 1;
+      e->left = 0;
+    }
+    return;
+  }
+
+  // p has two children
+  size_t l = left_child(p), r = right_child(p);
+  if (xs[l] < e->x0) {
+    if (xs[r] < e->x0) {
+      e->p = r;
+    } else if (xs[r] <= e->x1) {
+      add_leftmost_inner_node(e, r);
+      e->p = l;
+    } else {
+      e->q = r;
+      e->p = l;
+      e->right = 1;
+    }
+  } else if (xs[l] <= e->x1) {
+    if (xs[r] > e->x1) {
+      e->q = r;
+      e->p_in = l;
+      e->left = 0;
+      e->left_in = e->right = 1;
+    } else {
+      // p_l and p_r both lie inside [x0, x1]
+      add_leftmost_inner_node(e, r);
+      add_leftmost_inner_node(e, l);
+      e->left = 0;
+    }
+  } else {
+    e->q = l;
+    e->left = 0;
+    e->right = 1;
+  }
+}
+
+/* Given: p_in satisfies x0 <= x(p_in) <= x1. */
+static void enumerate_left_in(enumeration *e) {
+  pst_data *pst = e->pst;
+  double *xs = pst->xs;
+  size_t p_in = e->p_in;
+
+  if (pst->ys[p_in] >= e->y0) {
+    report(e, p_in);
+  }
+
+  if (is_leaf(pst, p_in)) { // nothing more to do
+    deactivate_p_in(e);
+    return;
+  }
+
+  size_t only_child = one_child(pst, p_in);
+  if (only_child) {
+    if (in_x_range(e, only_child)) {
+      e->p_in = only_child;
+    } else if (xs[only_child] < e->x0) {
+      // We aren't in the [x0, x1] zone any more and have moved out to the left
+      e->p = only_child;
+      deactivate_p_in(e);
+      e->left = 1;
+    } else {
+      // similar, but we've moved out to the right.
+      if (e->right_in) {
+        rb_raise(eSharedInternalLogicError, "q_in should not be active (by the val of left(p_in))");
+      }
+      e->q = only_child;
+      deactivate_p_in(e);
+      e->right = 1;
+    }
+    return;
+  }
+
+  // p_in has two children
+  size_t l = left_child(p_in), r = right_child(p_in);
+  if (xs[l] < e->x0) {
+    if (xs[r] < e->x0) {
+      e->p = r;
+      e->left = 1;
+      deactivate_p_in(e);
+    } else if (xs[r] <= e->x1) {
+      e->p = l;
+      e->p_in = r;
+      e->left = 1;
+    } else {
+      if (e->right_in) {
+        rb_raise(eSharedInternalLogicError, "q_in cannot be active, by the value in the right child of p_in!");
+      }
+      e->p = l;
+      e->q = r;
+      deactivate_p_in(e);
+      e->left = 1;
+      e->right = 1;
+    }
+  } else if (xs[l] <= e->x1) {
+    if (xs[r] > e->x1) {
+      if (e->right_in) {
+        rb_raise(eSharedInternalLogicError, "q_in cannot be active, by the value in the right child of p_in!");
+      }
+      e->q = r;
+      e->p_in = l;
+      e->right = 1;
+    } else if (e->right_in) {
+      explore_later(e, r);
+      e->p_in = l;
+    } else {
+      e->q_in = r;
+      e->p_in = l;
+      e->right_in = 1;
+    }
+  } else {
+    if (e->right_in) {
+      rb_raise(eSharedInternalLogicError, "q_in cannot be active, by the value in the right child of p_in!");
+    }
+    e->q = l;
+    deactivate_p_in(e);
+    e->right = 1;
+  }
+}
+
+/* This is "just like" enumerate_left, but handles q instead of p. */
+static void enumerate_right(enumeration *e) {
+  pst_data *pst = e->pst;
+  double *xs = pst->xs;
+  size_t q = e->q;
+
+  if (is_leaf(pst, q)) {
+    e->right = 0;
+    return;
+  }
+
+  size_t only_child = one_child(pst, q);
+  if (only_child) {
+    if (in_x_range(e, only_child)) {
+      add_rightmost_inner_node(e, only_child);
+      e->right = 0;
+    } else if (xs[only_child] < e->x0) {
+      e->p = only_child;
+      e->left = 1;
+      e->right = 0;
+    } else {
+      e->q = only_child;
+    }
+    return;
+  }
+
+  // q has two children
+  size_t l = left_child(q), r = right_child(q);
+  if (xs[l] < e->x0) {
+    if (e->left_in || e->right_in) {
+      rb_raise(eSharedInternalLogicError, "p_in and q_in should not be active, based on the value at left(q)");
+    }
+    e->left = 1;
+    if (xs[r] < e->x0) {
+      e->p = r;
+      e->right = 0;
+    } else if (xs[r] <= e->x1) {
+      e->p_in = r;
+      e->p = l;
+      e->left_in = 1;
+      e->right = 0;
+    } else {
+      e->p = l;
+      e->q = r;
+    }
+  } else if (xs[l] <= e->x1) {
+    add_rightmost_inner_node(e, l);
+    if (xs[r] > e->x1) {
+      e->q = r;
+    } else {
+      add_rightmost_inner_node(e, r);
+      e->right = 0;
+    }
+  } else {
+    // x(q_l) > x1
+    e->q = l;
+  }
+}
+
+/* Given: q_in is active and satisfies x0 <= x(q_in) <= x1 */
+static void enumerate_right_in(enumeration *e) {
+  pst_data *pst = e->pst;
+  double *xs = pst->xs;
+  size_t q_in = e->q_in;
+
+  if (pst->ys[q_in] >= e->y0) {
+    report(e, q_in);
+  }
+
+  if (is_leaf(pst, q_in)) {
+    e->right_in = 0;
+    return;
+  }
+
+  size_t only_child = one_child(pst, q_in);
+  if (only_child) {
+    if (in_x_range(e, only_child)) {
+      e->q_in = only_child;
+    } else if (xs[only_child] < e->x0) {
+      // We have moved out to the left
+      e->p = only_child;
+      e->right_in = 0;
+      e->left = 1;
+    } else {
+      // We have moved out to the right
+      e->q = only_child;
+      e->right_in = 0;
+      e->right = 1;
+    }
+    return;
+  }
+
+  // q_in has two children
+  size_t l = left_child(q_in), r = right_child(q_in);
+  if (xs[l] < e->x0) {
+    if (e->left_in) {
+      rb_raise(eSharedInternalLogicError, "p_in cannot be active, by the value in the left child of q_in");
+    }
+    if (xs[r] < e->x0) {
+      e->p = r;
+    } else if (xs[r] <= e->x1) {
+      e->p = l;
+      e->p_in = r;
+      e->left_in = 1;
+    } else {
+      e->p = l;
+      e->q = r;
+      e->right = 1;
+    }
+    e->right_in = 0;
+    e->left = 1;
+  } else if (xs[l] <= e->x1) {
+    if (xs[r] > e->x1) {
+      e->q = r;
+      e->right = 1;
+      if (e->left_in) {
+        e->q_in = l;
+      } else {
+        e->p_in = l;
+        e->left_in = 1;
+        e->right_in = 0;
+      }
+    } else {
+      if (e->left_in) {
+        explore_later(e, l);
+      } else {
+        e->p_in = l;
+        e->left_in = 1;
+      }
+      e->q_in = r;
+    }
+  } else {
+    e->q = l;
+    e->right_in = 0;
+    e->right = 1;
+  }
+}
+
+/*
+ * Run the search, or carry on with it after an earlier call stopped because the buffer was full.
+ *
+ * A step doesn't report points itself but queues the reports and explorations it calls for, and we do them, in the same order,
+ * before the next step. The steps never look at what has been reported, so this changes nothing but lets us stop between any two
+ * points: the queue and the active nodes then say exactly where we are.
+ */
+static void enumerate_3_sided(enumeration *e) {
+  pst_data *pst = e->pst;
+
+  if (!e->started) {
+    e->started = 1;
+
+    if (pst->member_count == 0 || pst->ys[TREE_ROOT] < e->y0) {
+      // no hope, no op
+    } else if (pst->xs[TREE_ROOT] < e->x0) {
+      e->p = TREE_ROOT;
+      e->left = 1;
+    } else if (pst->xs[TREE_ROOT] <= e->x1) {
+      e->p_in = TREE_ROOT;
+      e->left_in = 1;
+    } else {
+      e->q = TREE_ROOT;
+      e->right = 1;
+    }
+  }
+
+  // At each step we advance the active node that is highest in the tree, preferring them in the order left, left_in, right_in,
+  // right.
+  while (!e->done) {
+    if (e->task_count > 0) {
+      run_tasks(e);
+      continue;
+    }
+    if (!(e->left || e->left_in || e->right_in || e->right)) {
+      break;
+    }
+
+    if (e->right_in && !e->left_in) {
+      rb_raise(eSharedInternalLogicError, "It should not be that q_in is active but p_in is not");
+    }
+
+    int best_level = INT32_MAX;
+    int choice = -1;
+    size_t nodes[4] = { e->p, e->p_in, e->q_in, e->q };
+    int active[4] = { e->left, e->left_in, e->right_in, e->right };
+    for (int i = 0; i < 4; i++) {
+      if (active[i] && level(nodes[i]) < best_level) {
+        best_level = level(nodes[i]);
+        choice = i;
+      }
+    }
+
+    switch (choice) {
+    case 0:
+      enumerate_left(e);
+      break;
+    case 1:
+      enumerate_left_in(e);
+      break;
+    case 2:
+      enumerate_right_in(e);
+      break;
+    default:
+      enumerate_right(e);
+    }
+  }
+}
+
+#undef in_x_range
+
+/*
+ * Delete the top (max-y) element of the PST, returning the index where it ends up. See delete_top! in the Ruby class.
+ */
+static size_t delete_top(pst_data *pst) {
+  size_t i = TREE_ROOT;
+  while (!is_leaf(pst, i)) {
+    size_t next_node = one_child(pst, i);
+    if (!next_node) {
+      next_node = better_y(pst, right_child(i), left_child(i)) ? right_child(i) : left_child(i);
+    }
+    swap_nodes(pst, i, next_node);
+    i = next_node;
+  }
+  pst->member_count--;
+  return i;
+}
+
+/*
+ * End query functions
+ ************************************************************/
+
+/************************************************************
+ * Maximal empty rectangles
+ *
+ * A C version of Algorithms.maximal_empty_rectangles. See the Ruby code for the algorithm, which we follow step by step. The
+ * differences are in the input and output: the points come in as doubles and the rectangles go out as packed doubles, so we allocate
+ * nothing for each point or rectangle. Rectangles can also be filtered by area as they are found.
+ *
+ * The work runs without the GVL, optionally shared among several POSIX threads.
+ *
+ * - Type 1 rectangles come straight from the sorted x values. We find them before starting any threads.
+ * - Type 2 rectangles come from two quadrant queries for each point. They don't change the tree, so we give each thread a slice of
+ *   the points and they all query the tree at once.
+ * - Type 3 rectangles come from the sweep that deletes the top of the tree, one point at a time. We give each of the first few
+ *   threads a slice of the sequence of deletions. A thread takes its own copy of the tree and gets to the start of its slice by
+ *   deleting the points that come before it, so the last of t threads repeats (t - 1) / t of the deletions and only the queries
+ *   made after them are really shared out. The slices can't be split by x instead, since a type 3 rectangle can span the whole
+ *   x range. So more threads buy little here, while each costs a copy of the tree, two doubles per point: we use at most
+ *   MAX_TYPE_3_THREADS of them.
+ *
+ * Each thread keeps its results separately. We put them together at the end in the order a single thread would have found them.
+ */
+
+#define MAX_THREADS 256
+#define MAX_TYPE_3_THREADS 4
+
+/*
+ * A rectangle (left, right, bottom, top), with its area.
+ */
+typedef struct {
+  double coords[4];
+  double area;
+} mer_rect;
+
+/*
+ * Where the rectangles found by one thread in one phase go.
+ *
+ * - We drop rectangles with area less than min_area.
+ * - If bounded is false we keep all the rest, in the order we find them.
+ * - Otherwise we keep only the k largest, in a min-heap on area.
+ *
+ * The rectangles are in rects, with room for capacity of them. This memory comes from malloc() rather than from Ruby, as we don't
+ * hold the GVL. If we can't get any more we set failed and ignore the rest of the rectangles.
+ */
+typedef struct {
+  double min_area;
+  int bounded;
+  size_t k;
+  mer_rect *rects;
+  size_t count;
+  size_t capacity;
+  int failed;
+} mer_sink;
+
+/*
+ * Compare rectangles by area, breaking ties by the coordinates so that the results don't depend on the order we find things in.
+ */
+static int compare_mer_rects(const mer_rect *a, const mer_rect *b) {
+  if (a->area != b->area) {
+    return a->area < b->area ? -1 : 1;
+  }
+  for (int i = 0; i < 4; i++) {
+    if (a->coords[i] != b->coords[i]) {
+      return a->coords[i] < b->coords[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* For qsort: the largest first */
+static int mer_rect_cmp_descending(const void *a, const void *b) {
+  return compare_mer_rects(b, a);
+}
+
+static void mer_sift_down(mer_sink *sink, size_t idx) {
+  mer_rect *heap = sink->rects;
+  while (1) {
+    size_t smallest = idx;
+    size_t l = 2 * idx + 1, r = 2 * idx + 2;
+    if (l < sink->count && compare_mer_rects(&heap[l], &heap[smallest]) < 0) {
+      smallest = l;
+    }
+    if (r < sink->count && compare_mer_rects(&heap[r], &heap[smallest]) < 0) {
+      smallest = r;
+    }
+    if (smallest == idx) {
+      return;
+    }
+    mer_rect tmp = heap[idx];
+    heap[idx] = heap[smallest];
+    heap[smallest] = tmp;
+    idx = smallest;
+  }
+}
+
+static void mer_sift_up(mer_sink *sink, size_t idx) {
+  mer_rect *heap = sink->rects;
+  while (idx > 0) {
+    size_t parent = (idx - 1) / 2;
+    if (compare_mer_rects(&heap[idx], &heap[parent]) >= 0) {
+      return;
+    }
+    mer_rect tmp = heap[idx];
+    heap[idx] = heap[parent];
+    heap[parent] = tmp;
+    idx = parent;
+  }
+}
+
+/* Make room for one more rectangle, returning false if we can't */
+static int mer_sink_reserve(mer_sink *sink) {
+  if (sink->count < sink->capacity) {
+    return 1;
+  }
+  size_t new_capacity = sink->capacity ? 2 * sink->capacity : 64;
+  if (sink->bounded && new_capacity > sink->k) {
+    new_capacity = sink->k;
+  }
+  mer_rect *new_rects = realloc(sink->rects, new_capacity * sizeof(mer_rect));
+  if (!new_rects) {
+    sink->failed = 1;
+    return 0;
+  }
+  sink->rects = new_rects;
+  sink->capacity = new_capacity;
+  return 1;
+}
+
+static void emit_mer(mer_sink *sink, double left, double right, double bottom, double top) {
+  mer_rect rect = { { left, right, bottom, top }, (right - left) * (top - bottom) };
+  if (rect.area < sink->min_area || sink->failed) {
+    return;
+  }
+
+  if (!sink->bounded || sink->count < sink->k) {
+    if (!mer_sink_reserve(sink)) {
+      return;
+    }
+    sink->rects[sink->count++] = rect;
+    if (sink->bounded) {
+      mer_sift_up(sink, sink->count - 1);
+    }
+  } else if (sink->k > 0 && compare_mer_rects(&rect, &sink->rects[0]) > 0) {
+    sink->rects[0] = rect;
+    mer_sift_down(sink, 0);
+  }
+}
+
+/*
+ * Would the sink drop every rectangle of width at most w and height at most h? We use this to skip work, so we must be careful to
+ * keep rectangles tied with the smallest one in a full heap: they may still win on the tie-break.
+ */
+static int too_small(const mer_sink *sink, double w, double h) {
+  double threshold = sink->min_area;
+  if (sink->bounded) {
+    if (sink->k == 0) {
+      return 1;
+    }
+    if (sink->count == sink->k && sink->rects[0].area > threshold) {
+      threshold = sink->rects[0].area;
+    }
+  }
+  return w * h < threshold;
+}
+
+/*
+ * A whole maximal_empty_rectangles calculation.
+ *
+ * - pst: a dynamic PST on the points
+ * - coords: the points in the order we were given them, as x0, y0, x1, y1, ...
+ * - n: the number of points
+ * - sorted_xs: the x values in increasing order
+ * - type_1: where the type 1 rectangles go
+ * - cancelled: set when Ruby wants us to stop, for example on Ctrl-C, or to look at a signal. The tasks then return early and we
+ *   take the GVL back. If no exception is raised they carry on from where they stopped.
+ */
+typedef struct mer_job mer_job;
+
+/*
+ * One thread's share of the type 2 and type 3 work: the points coords[begin_2...end_2] and the deletions begin_3...end_3. The
+ * tasks after the first MAX_TYPE_3_THREADS have no deletions.
+ *
+ * - next_2, next_3: how far we have got, so that a task stopped by a cancellation can be resumed
+ * - copy: when there is more than one thread and the task has deletions to make, the task's own copy of the tree, from which it
+ *   deletes the first begin_3 tops (counted by replayed) and then its share. Its arrays are allocated through Ruby, while we have
+ *   the GVL.
+ * - copied: whether copy's arrays have been filled in from the tree
+ */
+typedef struct {
+  mer_job *job;
+  size_t begin_2, end_2;
+  size_t begin_3, end_3;
+  size_t next_2, next_3;
+  pst_data copy;
+  int copied;
+  size_t replayed;
+  mer_sink type_2, type_3;
+} mer_task;
+
+struct mer_job {
+  pst_data *pst;
+  double *coords;
+  size_t n;
+  double *sorted_xs;
+  double x_min, x_max, y_min, y_max;
+  mer_sink type_1;
+  long thread_count;
+  mer_task *tasks;
+  int cancelled;
+  int simulated_interrupts;
+  int checks_until_interrupt;
+  int interrupts_handled;
+};
+
+/*
+ * Should the tasks stop, so that we can handle an interrupt?
+ *
+ * For the tests we can simulate interrupts: while simulated_interrupts is positive, the second check of each run cancels it. The
+ * run has always made some progress by then, so the job still finishes.
+ */
+static int cancelled(mer_job *job) {
+  if (job->simulated_interrupts > 0 && __atomic_sub_fetch(&job->checks_until_interrupt, 1, __ATOMIC_RELAXED) == 0) {
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+  }
+  return __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED);
+}
+
+static void find_type_2(mer_task *task) {
+  mer_job *job = task->job;
+  pst_data *pst = job->pst;
+  best_point best;
+
+  for (size_t i = task->next_2; i < task->end_2; i++) {
+    if ((i & 0xfff) == 0 && cancelled(job)) {
+      task->next_2 = i;
+      return;
+    }
+    double x = job->coords[2 * i], y = job->coords[2 * i + 1];
+    if (y == job->y_max || y == job->y_min || too_small(&task->type_2, job->x_max - job->x_min, job->y_max - y)) {
+      continue;
+    }
+
+    extremal_in_x_dimension(pst, next_down(x), next_up(y), 0, &best);
+    double left = isinf(best.x) ? job->x_min : best.x;
+    extremal_in_x_dimension(pst, next_up(x), next_up(y), 1, &best);
+    double right = isinf(best.x) ? job->x_max : best.x;
+    if (left == right) {
+      continue;
+    }
+    emit_mer(&task->type_2, left, right, y, job->y_max);
+  }
+  task->next_2 = task->end_2;
+}
+
+/*
+ * The type 3 rectangles for the deletions begin_3...end_3, using the tree pst, from which the earlier points have been deleted.
+ */
+static void find_type_3(mer_task *task, pst_data *pst) {
+  mer_job *job = task->job;
+  best_point best;
+
+  for (size_t i = task->next_3; i < task->end_3; i++) {
+    if (cancelled(job)) {
+      task->next_3 = i;
+      return;
+    }
+
+    size_t top_node = delete_top(pst);
+    double top = pst->ys[top_node];
+    double top_x = pst->xs[top_node];
+    if (top == job->y_max || top == job->y_min) {
+      continue;
+    }
+    // The tops only get lower from here on
+    if (too_small(&task->type_3, job->x_max - job->x_min, top - job->y_min)) {
+      break;
+    }
+
+    double l = job->x_min, r = job->x_max;
+    // The rectangles only get narrower as we go
+    while (!too_small(&task->type_3, r - l, top - job->y_min)) {
+      largest_y_in_3_sided(pst, next_up(l), next_down(r), next_up(job->y_min), &best);
+      int at_bottom = isinf(best.y);
+
+      emit_mer(&task->type_3, l, r, at_bottom ? job->y_min : best.y, top);
+      if (at_bottom) {
+        break;
+      }
+
+      if (best.x < top_x) {
+        l = best.x;
+      } else {
+        r = best.x;
+      }
+    }
+  }
+  task->next_3 = task->end_3;
+}
+
+static void *run_mer_task(void *arg) {
+  mer_task *task = arg;
+  mer_job *job = task->job;
+
+  find_type_2(task);
+
+  if (task->next_3 == task->end_3) {
+    return NULL;
+  }
+  if (job->thread_count == 1) {
+    // Nobody else is using the tree, so we can just delete from it
+    find_type_3(task, job->pst);
+    return NULL;
+  }
+
+  // Our copy of the tree, made in do_mer_job(), which we fill in here so that the copying is shared out too
+  if (!task->copied) {
+    size_t bytes = (job->pst->size + 1) * sizeof(double);
+    memcpy(task->copy.xs, job->pst->xs, bytes);
+    memcpy(task->copy.ys, job->pst->ys, bytes);
+    task->copied = 1;
+  }
+  for (; task->replayed < task->begin_3; task->replayed++) {
+    if (cancelled(job)) {
+      return NULL;
+    }
+    delete_top(&task->copy);
+  }
+  find_type_3(task, &task->copy);
+  return NULL;
+}
+
+/* Has every task finished? */
+static int mer_job_done(const mer_job *job) {
+  for (long t = 0; t < job->thread_count; t++) {
+    if (job->tasks[t].next_2 < job->tasks[t].end_2 || job->tasks[t].next_3 < job->tasks[t].end_3) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Run the job's tasks, one to a thread. This is called without the GVL, so it mustn't touch any Ruby objects.
+ *
+ * If we can't start a thread we do its share of the work here instead.
+ */
+static void *run_mer_job(void *arg) {
+  mer_job *job = arg;
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS];
+
+  for (long t = 0; t < job->thread_count; t++) {
+    started[t] = t > 0 && pthread_create(&threads[t], NULL, run_mer_task, &job->tasks[t]) == 0;
+  }
+  for (long t = 0; t < job->thread_count; t++) {
+    if (!started[t]) {
+      run_mer_task(&job->tasks[t]);
+    }
+  }
+  for (long t = 0; t < job->thread_count; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  return NULL;
+}
+
+static void cancel_mer_job(void *arg) {
+  mer_job *job = arg;
+  __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+static int double_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* The share of count things that goes to task t of thread_count */
+static size_t share_begin(size_t count, long t, long thread_count) {
+  return count / thread_count * t + (count % thread_count < (size_t)t ? count % thread_count : (size_t)t);
+}
+
+static void append_rects(VALUE out, const mer_sink *sink) {
+  for (size_t i = 0; i < sink->count; i++) {
+    rb_str_cat(out, (const char *)sink->rects[i].coords, sizeof(sink->rects[i].coords));
+  }
+}
+
+/*
+ * Do the job, returning the rectangles as a String of packed doubles. We run under rb_ensure() with free_mer_job() to clean up.
+ */
+static VALUE do_mer_job(VALUE job_val) {
+  mer_job *job = (mer_job *)job_val;
+  size_t n = job->n;
+
+  construct_pst(job->pst);
+
+  job->sorted_xs = ALLOC_N(double, n);
+  job->y_min = INFINITY;
+  job->y_max = -INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    job->sorted_xs[i] = job->coords[2 * i];
+    job->y_min = fmin(job->y_min, job->coords[2 * i + 1]);
+    job->y_max = fmax(job->y_max, job->coords[2 * i + 1]);
+  }
+  qsort(job->sorted_xs, n, sizeof(double), double_cmp);
+  job->x_min = job->sorted_xs[0];
+  job->x_max = job->sorted_xs[n - 1];
+
+  for (size_t i = 0; i + 1 < n; i++) {
+    emit_mer(&job->type_1, job->sorted_xs[i], job->sorted_xs[i + 1], job->y_min, job->y_max);
+  }
+
+  long type_3_threads = job->thread_count < MAX_TYPE_3_THREADS ? job->thread_count : MAX_TYPE_3_THREADS;
+  job->tasks = ZALLOC_N(mer_task, job->thread_count);
+  for (long t = 0; t < job->thread_count; t++) {
+    mer_task *task = &job->tasks[t];
+    task->job = job;
+    task->begin_2 = share_begin(n, t, job->thread_count);
+    task->end_2 = share_begin(n, t + 1, job->thread_count);
+    task->begin_3 = t < type_3_threads ? share_begin(n, t, type_3_threads) : n;
+    task->end_3 = t < type_3_threads ? share_begin(n, t + 1, type_3_threads) : n;
+    task->next_2 = task->begin_2;
+    task->next_3 = task->begin_3;
+    task->type_2 = task->type_3 = (mer_sink){ .min_area = job->type_1.min_area, .bounded = job->type_1.bounded, .k = job->type_1.k };
+
+    if (job->thread_count > 1 && task->begin_3 < task->end_3) {
+      // A copy of the tree that the task can delete from. Only xs and ys: swap_nodes() leaves the points alone when there are none.
+      task->copy = *job->pst;
+      task->copy.points = NULL;
+      task->copy.xs = ALLOC_N(double, job->pst->size + 1);
+      task->copy.ys = ALLOC_N(double, job->pst->size + 1);
+    }
+  }
+
+  // When Ruby interrupts us - for a signal, a Thread#raise or a Thread#wakeup, say - the tasks stop where they are and we handle the
+  // interrupt with the GVL. If that doesn't raise, we let them carry on.
+  do {
+    job->cancelled = 0;
+    job->checks_until_interrupt = 2;
+    rb_thread_call_without_gvl(run_mer_job, job, cancel_mer_job, job);
+    if (job->cancelled) {
+      job->interrupts_handled++;
+      if (job->simulated_interrupts > 0) {
+        job->simulated_interrupts--;
+      }
+      rb_thread_check_ints();
+    }
+  } while (!mer_job_done(job));
+
+  int failed = job->type_1.failed;
+  for (long t = 0; t < job->thread_count; t++) {
+    failed = failed || job->tasks[t].type_2.failed || job->tasks[t].type_3.failed;
+  }
+  if (failed) {
+    rb_memerror();
+  }
+
+  VALUE out = rb_str_buf_new(0);
+  if (!job->type_1.bounded) {
+    append_rects(out, &job->type_1);
+    for (long t = 0; t < job->thread_count; t++) {
+      append_rects(out, &job->tasks[t].type_2);
+    }
+    for (long t = 0; t < job->thread_count; t++) {
+      append_rects(out, &job->tasks[t].type_3);
+    }
+    return out;
+  }
+
+  // Each sink has the k largest of its own rectangles, so the k largest overall are among them.
+  mer_sink all = { .bounded = 0 };
+  const mer_sink *sinks[2 * MAX_THREADS + 1];
+  int sink_count = 0;
+  sinks[sink_count++] = &job->type_1;
+  for (long t = 0; t < job->thread_count; t++) {
+    sinks[sink_count++] = &job->tasks[t].type_2;
+    sinks[sink_count++] = &job->tasks[t].type_3;
+  }
+  for (int s = 0; s < sink_count; s++) {
+    all.count += sinks[s]->count;
+  }
+  mer_rect *rects = ALLOC_N(mer_rect, all.count);
+  all.rects = rects;
+  all.count = 0;
+  for (int s = 0; s < sink_count; s++) {
+    memcpy(rects + all.count, sinks[s]->rects, sinks[s]->count * sizeof(mer_rect));
+    all.count += sinks[s]->count;
+  }
+  qsort(rects, all.count, sizeof(mer_rect), mer_rect_cmp_descending);
+  if (all.count > job->type_1.k) {
+    all.count = job->type_1.k;
+  }
+  append_rects(out, &all);
+  xfree(rects);
+
+  return out;
+}
+
+static VALUE free_mer_job(VALUE job_val) {
+  mer_job *job = (mer_job *)job_val;
+  xfree(job->coords);
+  xfree(job->sorted_xs);
+  free(job->type_1.rects);
+  if (job->tasks) {
+    for (long t = 0; t < job->thread_count; t++) {
+      free(job->tasks[t].type_2.rects);
+      free(job->tasks[t].type_3.rects);
+      xfree(job->tasks[t].copy.xs);
+      xfree(job->tasks[t].copy.ys);
+    }
+    xfree(job->tasks);
+  }
+  return Qnil;
+}
+
+/*
+ * End maximal empty rectangles
+ ************************************************************/
+
+/************************************************************
+ * Images
+ *
+ * See shared.h. After the header comes a pst_image_preamble and then the xs and ys arrays, each with its unused entry 0 so that a
+ * mapped image can be used in place.
+ */
+
+#define PST_IMAGE_KIND "CPST"
+#define PST_IMAGE_VERSION 1
+
+typedef struct {
+  uint64_t size;
+  uint64_t member_count;
+  uint64_t last_non_leaf;
+  uint64_t parent_of_one_child;
+  uint32_t dynamic;
+  uint32_t unused;
+} pst_image_preamble;
+
+static void dump_image(const pst_data *pst, VALUE io) {
+  pst_image_preamble preamble = {
+    .size = pst->size,
+    .member_count = pst->member_count,
+    .last_non_leaf = pst->last_non_leaf,
+    .parent_of_one_child = pst->parent_of_one_child,
+    .dynamic = pst->dynamic,
+    .unused = 0
+  };
+  const double zero = 0.0; // in place of the unused entries xs[0] and ys[0], which we never set
+
+  image_write_header(io, PST_IMAGE_KIND, PST_IMAGE_VERSION);
+  image_write(io, &preamble, sizeof(preamble));
+  image_write(io, &zero, sizeof(zero));
+  image_write(io, pst->xs + TREE_ROOT, pst->size * sizeof(double));
+  image_write(io, &zero, sizeof(zero));
+  image_write(io, pst->ys + TREE_ROOT, pst->size * sizeof(double));
+}
+
+static void raise_corrupt_image() {
+  rb_raise(eSharedDataError, "Image of a CMaxPrioritySearchTree is corrupt");
+}
+
+/*
+ * Set up pst from the preamble of an image, checking that it is consistent. The arrays still have to be allocated or mapped.
+ *
+ * The shape of the tree is determined by its size, as in construct_pst(), and the queries trust it to stay inside the arrays. So we
+ * insist on exactly that shape.
+ */
+static void restore_preamble(pst_data *pst, const pst_image_preamble *preamble) {
+  image_array_bytes(preamble->size + 1, 2 * sizeof(double));
+  size_t last_non_leaf = preamble->size / 2;
+  size_t parent_of_one_child = (preamble->size % 2 == 0) ? last_non_leaf : 0;
+  if (preamble->member_count > preamble->size || preamble->last_non_leaf != last_non_leaf
+      || preamble->parent_of_one_child != parent_of_one_child || preamble->dynamic > 1) {
+    raise_corrupt_image();
+  }
+
+  pst->size = preamble->size;
+  pst->member_count = preamble->member_count;
+  pst->last_non_leaf = preamble->last_non_leaf;
+  pst->parent_of_one_child = preamble->parent_of_one_child;
+  pst->dynamic = preamble->dynamic;
+}
+
+/*
+ * Check the coordinates of a restored tree. Every comparison with a NaN is false, so the queries would make no sense of one.
+ */
+static void check_restored_coordinates(const pst_data *pst) {
+  for (size_t i = TREE_ROOT; i <= pst->size; i++) {
+    if (isnan(pst->xs[i]) || isnan(pst->ys[i])) {
+      raise_corrupt_image();
+    }
+  }
+}
+
+/*
+ * End images
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * Read the open: keyword argument
+ */
+static int read_open(VALUE opts) {
+  if (NIL_P(opts)) {
+    return 0;
+  }
+  ID keys[1] = { rb_intern("open") };
+  VALUE values[1];
+  rb_get_kwargs(opts, keys, 0, 1, values);
+  return values[0] != Qundef && RTEST(values[0]);
+}
+
+/*
+ * Read the keyword arguments dynamic: and verify:, as for MaxPrioritySearchTree. We return the value of verify:.
+ */
+static int read_construction_opts(pst_data *pst, VALUE opts) {
+  if (NIL_P(opts)) {
+    return 0;
+  }
+  ID keys[2] = { rb_intern("dynamic"), rb_intern("verify") };
+  VALUE values[2];
+  rb_get_kwargs(opts, keys, 0, 2, values);
+  pst->dynamic = values[0] != Qundef && RTEST(values[0]);
+  return values[1] != Qundef && RTEST(values[1]);
+}
+
+/*
+ * Construct a MaxPST from the collection of points in data, which must be an Array.
+ *
+ * Keyword arguments are dynamic: and verify:, as for MaxPrioritySearchTree.
+ */
+static VALUE pst_init(int argc, VALUE *argv, VALUE self) {
+  VALUE data, opts;
+  rb_scan_args(argc, argv, "1:", &data, &opts);
+  Check_Type(data, T_ARRAY);
+
+  pst_data *pst = unwrapped(self);
+  int verify = read_construction_opts(pst, opts);
+
+  read_points(pst, data);
+  construct_pst(pst);
+  if (verify) {
+    verify_properties(pst);
+  }
+
+  RB_GC_GUARD(data);
+  return self;
+}
+
+/*
+ * CMaxPrioritySearchTree.from_columns(xs, ys, dynamic: false, verify: false)
+ *
+ * Construct a MaxPST from the coordinates of the points, given as two Strings of packed doubles in native byte order, as made by
+ * Array#pack('d*'). No Ruby object is made for any point: the queries return Shared::Points made from the coordinates when they are
+ * called.
+ */
+static VALUE pst_from_columns(int argc, VALUE *argv, VALUE klass) {
+  VALUE xs, ys, opts;
+  rb_scan_args(argc, argv, "2:", &xs, &ys, &opts);
+
+  VALUE self = rb_obj_alloc(klass);
+  pst_data *pst = unwrapped(self);
+  int verify = read_construction_opts(pst, opts);
+
+  read_columns(pst, xs, ys);
+  construct_pst(pst);
+  if (verify) {
+    verify_properties(pst);
+  }
+
+  RB_GC_GUARD(xs);
+  RB_GC_GUARD(ys);
+  return self;
+}
+
+static VALUE pst_empty_p(VALUE self) {
+  return unwrapped(self)->member_count == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * A single quadrant query at (x0, y0), with the boundaries already adjusted for an open region.
+ */
+static void run_quadrant_query(pst_data *pst, double x0, double y0, int by_y, int ne, best_point *best) {
+  if (by_y) {
+    largest_y_in_quadrant(pst, x0, y0, ne, best);
+  } else {
+    extremal_in_x_dimension(pst, x0, y0, ne, best);
+  }
+}
+
+/*
+ * Every comparison with a NaN is false, so a NaN boundary would make the queries meaningless.
+ */
+static void check_query_bound(double v) {
+  if (isnan(v)) {
+    rb_raise(eSharedDataError, "Query boundaries must not be NaN");
+  }
+}
+
+/*
+ * Move the corner (x0, y0) of a quadrant so that the closed region we search is the open region the caller asked for.
+ */
+static void open_quadrant_corner(double *x0, double *y0, int ne) {
+  *x0 = ne ? slightly_bigger(*x0) : slightly_smaller(*x0);
+  *y0 = slightly_bigger(*y0);
+}
+
+static VALUE quadrant_query(int argc, VALUE *argv, VALUE self, int by_y, int ne) {
+  VALUE x0_val, y0_val, opts;
+  rb_scan_args(argc, argv, "2:", &x0_val, &y0_val, &opts);
+
+  double x0 = NUM2DBL(x0_val);
+  double y0 = NUM2DBL(y0_val);
+  check_query_bound(x0);
+  check_query_bound(y0);
+  if (read_open(opts)) {
+    open_quadrant_corner(&x0, &y0, ne);
+  }
+
+  pst_data *pst = unwrapped(self);
+  best_point best;
+  run_quadrant_query(pst, x0, y0, by_y, ne, &best);
+  return best_point_value(pst, &best);
+}
+
+/*
+ * The corners (x0, y0) of a batch of quadrant queries. They are given either as
+ * - two Arrays of Numerics, xs and ys, of the same length, or
+ * - a single String of packed doubles x0, y0, x1, y1, ..., in native byte order as made by Array#pack('d*').
+ */
+typedef struct {
+  long count;
+  VALUE xs;
+  VALUE ys;
+  const char *packed; // NULL unless we were given a String
+} corner_list;
+
+static void read_corner_list(VALUE xs, VALUE ys, corner_list *corners) {
+  if (NIL_P(ys)) {
+    StringValue(xs);
+    long len = RSTRING_LEN(xs);
+    if (len % (2 * sizeof(double)) != 0) {
+      rb_raise(rb_eArgError, "packed coordinates must be a whole number of pairs of doubles (got %ld bytes)", len);
+    }
+    corners->count = len / (2 * sizeof(double));
+    corners->packed = RSTRING_PTR(xs);
+  } else {
+    Check_Type(xs, T_ARRAY);
+    Check_Type(ys, T_ARRAY);
+    if (RARRAY_LEN(xs) != RARRAY_LEN(ys)) {
+      rb_raise(rb_eArgError, "xs and ys must have the same size (%ld != %ld)", RARRAY_LEN(xs), RARRAY_LEN(ys));
+    }
+    corners->count = RARRAY_LEN(xs);
+    corners->packed = NULL;
+  }
+  corners->xs = xs;
+  corners->ys = ys;
+}
+
+static void corner_at(const corner_list *corners, long i, double *x0, double *y0) {
+  if (corners->packed) {
+    double vals[2];
+    memcpy(vals, corners->packed + 2 * i * sizeof(double), sizeof(vals));
+    *x0 = vals[0];
+    *y0 = vals[1];
+  } else {
+    *x0 = NUM2DBL(RARRAY_AREF(corners->xs, i));
+    *y0 = NUM2DBL(RARRAY_AREF(corners->ys, i));
+  }
+}
+
+/*
+ * A batch of quadrant queries. See MaxPrioritySearchTree#largest_y_in_ne_many.
+ *
+ * When the corners are given as two Arrays we return an Array with the point each single query would return. When they are given as
+ * a packed String we return a packed String of doubles, x and y for each result, in native byte order. The points of P are then
+ * given only by their coordinates; the "nothing found" sentinels have infinite coordinates as usual.
+ */
+static VALUE quadrant_query_many(int argc, VALUE *argv, VALUE self, int by_y, int ne) {
+  VALUE xs, ys, opts;
+  rb_scan_args(argc, argv, "11:", &xs, &ys, &opts);
+
+  corner_list corners;
+  read_corner_list(xs, ys, &corners);
+  int open = read_open(opts);
+
+  pst_data *pst = unwrapped(self);
+  best_point best;
+  double x0, y0;
+
+  if (!corners.packed) {
+    VALUE results = rb_ary_new_capa(corners.count);
+    for (long i = 0; i < corners.count; i++) {
+      corner_at(&corners, i, &x0, &y0);
+      check_query_bound(x0);
+      check_query_bound(y0);
+      if (open) {
+        open_quadrant_corner(&x0, &y0, ne);
+      }
+      run_quadrant_query(pst, x0, y0, by_y, ne, &best);
+      rb_ary_push(results, best_point_value(pst, &best));
+    }
+    return results;
+  }
+
+  VALUE packed_results = rb_str_new(NULL, corners.count * 2 * sizeof(double));
+  char *out = RSTRING_PTR(packed_results);
+
+  for (long i = 0; i < corners.count; i++) {
+    corner_at(&corners, i, &x0, &y0);
+    check_query_bound(x0);
+    check_query_bound(y0);
+    if (open) {
+      open_quadrant_corner(&x0, &y0, ne);
+    }
+    run_quadrant_query(pst, x0, y0, by_y, ne, &best);
+
+    double coords[2] = { best.x, best.y };
+    memcpy(out + 2 * i * sizeof(double), coords, sizeof(coords));
+  }
+  RB_GC_GUARD(xs);
+  return packed_results;
+}
+
+/*
+ * The highest point in P to the "northeast" of (x0, y0), or (infty, -infty) if there is no such point.
+ */
+static VALUE pst_largest_y_in_ne(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query(argc, argv, self, 1, 1);
+}
+
+/*
+ * The highest point in P to the "northwest" of (x0, y0), or (-infty, -infty) if there is no such point.
+ */
+static VALUE pst_largest_y_in_nw(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query(argc, argv, self, 1, 0);
+}
+
+/*
+ * The leftmost point in P to the "northeast" of (x0, y0), or (infty, infty) if there is no such point.
+ */
+static VALUE pst_smallest_x_in_ne(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query(argc, argv, self, 0, 1);
+}
+
+/*
+ * The rightmost point in P to the "northwest" of (x0, y0), or (-infty, infty) if there is no such point.
+ */
+static VALUE pst_largest_x_in_nw(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query(argc, argv, self, 0, 0);
+}
+
+/*
+ * (see MaxPrioritySearchTree#largest_y_in_ne_many)
+ */
+static VALUE pst_largest_y_in_ne_many(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query_many(argc, argv, self, 1, 1);
+}
+
+/*
+ * (see MaxPrioritySearchTree#largest_y_in_nw_many)
+ */
+static VALUE pst_largest_y_in_nw_many(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query_many(argc, argv, self, 1, 0);
+}
+
+/*
+ * (see MaxPrioritySearchTree#smallest_x_in_ne_many)
+ */
+static VALUE pst_smallest_x_in_ne_many(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query_many(argc, argv, self, 0, 1);
+}
+
+/*
+ * (see MaxPrioritySearchTree#largest_x_in_nw_many)
+ */
+static VALUE pst_largest_x_in_nw_many(int argc, VALUE *argv, VALUE self) {
+  return quadrant_query_many(argc, argv, self, 0, 0);
+}
+
+/*
+ * Read the boundaries x0, x1, y0 of a 3-sided query, adjusting them for an open region.
+ */
+static void read_3_sided_bounds(VALUE x0_val, VALUE x1_val, VALUE y0_val, int open, double *x0, double *x1, double *y0) {
+  *x0 = NUM2DBL(x0_val);
+  *x1 = NUM2DBL(x1_val);
+  *y0 = NUM2DBL(y0_val);
+  check_query_bound(*x0);
+  check_query_bound(*x1);
+  check_query_bound(*y0);
+  if (open) {
+    *x0 = slightly_bigger(*x0);
+    *x1 = slightly_smaller(*x1);
+    *y0 = slightly_bigger(*y0);
+  }
+}
+
+/*
+ * Read the arguments (x0, x1, y0, open: false) of a 3-sided query, adjusting the boundaries for an open region.
+ */
+static void read_3_sided_args(int argc, VALUE *argv, double *x0, double *x1, double *y0) {
+  VALUE x0_val, x1_val, y0_val, opts;
+  rb_scan_args(argc, argv, "3:", &x0_val, &x1_val, &y0_val, &opts);
+
+  read_3_sided_bounds(x0_val, x1_val, y0_val, read_open(opts), x0, x1, y0);
+}
+
+/*
+ * The highest point of P in the box bounded by x0, x1, and y0, or (infty, -infty) if there is no such point.
+ */
+static VALUE pst_largest_y_in_3_sided(int argc, VALUE *argv, VALUE self) {
+  double x0, x1, y0;
+  read_3_sided_args(argc, argv, &x0, &x1, &y0);
+
+  pst_data *pst = unwrapped(self);
+  best_point best;
+  largest_y_in_3_sided(pst, x0, x1, y0, &best);
+  return best_point_value(pst, &best);
+}
+
+/*
+ * Enumerate the points of P in the box bounded by x0, x1, and y0.
+ *
+ * If a block is given we yield each point to it. Otherwise we return a Set containing the points.
+ */
+static VALUE pst_enumerate_3_sided(int argc, VALUE *argv, VALUE self) {
+  int block_given = rb_block_given_p();
+  enumeration e = {
+    .pst = unwrapped(self),
+    .mode = block_given ? REPORT_YIELD : REPORT_COLLECT,
+    .result = block_given ? Qnil : rb_ary_new()
+  };
+  read_3_sided_args(argc, argv, &e.x0, &e.x1, &e.y0);
+
+  enumerate_3_sided(&e);
+
+  if (block_given) {
+    return Qnil;
+  }
+  VALUE cSet = rb_const_get(rb_cObject, rb_intern("Set"));
+  return rb_funcall(cSet, rb_intern("new"), 1, e.result);
+}
+
+/*
+ * (see MaxPrioritySearchTree#count_3_sided)
+ */
+static VALUE pst_count_3_sided(int argc, VALUE *argv, VALUE self) {
+  enumeration e = {
+    .pst = unwrapped(self),
+    .mode = REPORT_COUNT
+  };
+  read_3_sided_args(argc, argv, &e.x0, &e.x1, &e.y0);
+
+  enumerate_3_sided(&e);
+
+  return SIZET2NUM(e.count);
+}
+
+/*
+ * A paused enumerate_3_sided_into search: the enumeration itself, and the tree it runs on. We keep the tree's member count so we
+ * can refuse to carry on after delete_top! has changed the tree.
+ */
+typedef struct {
+  VALUE tree;
+  size_t member_count;
+  enumeration e;
+} enumeration_cursor;
+
+static void enumeration_cursor_mark(void *ptr) {
+  rb_gc_mark(((enumeration_cursor *)ptr)->tree);
+}
+
+static size_t enumeration_cursor_memsize(const void *ptr) {
+  return sizeof(enumeration_cursor);
+}
+
+static const rb_data_type_t enumeration_cursor_type = {
+  .wrap_struct_name = "max_priority_search_tree_enumeration_cursor",
+  {
+    .dmark = enumeration_cursor_mark,
+    .dfree = RUBY_DEFAULT_FREE,
+    .dsize = enumeration_cursor_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+// CMaxPrioritySearchTree::EnumerationCursor
+static VALUE cEnumerationCursor;
+
+/*
+ * (see MaxPrioritySearchTree#enumerate_3_sided_into)
+ *
+ * The coordinates we write are the doubles we read at construction.
+ */
+static VALUE pst_enumerate_3_sided_into(int argc, VALUE *argv, VALUE self) {
+  VALUE buffer, x0_val, x1_val, y0_val, opts;
+  rb_scan_args(argc, argv, "4:", &buffer, &x0_val, &x1_val, &y0_val, &opts);
+
+  int open = 0;
+  VALUE cursor = Qnil;
+  if (!NIL_P(opts)) {
+    ID keys[2] = { rb_intern("open"), rb_intern("cursor") };
+    VALUE values[2];
+    rb_get_kwargs(opts, keys, 0, 2, values);
+    open = values[0] != Qundef && RTEST(values[0]);
+    if (values[1] != Qundef) {
+      cursor = values[1];
+    }
+  }
+
+  StringValue(buffer);
+  if (rb_enc_get_index(buffer) != rb_ascii8bit_encindex()) {
+    rb_raise(rb_eArgError, "buffer must be a binary String");
+  }
+  size_t capacity = RSTRING_LEN(buffer) / (2 * sizeof(double));
+  if (capacity == 0) {
+    rb_raise(rb_eArgError, "buffer must have room for at least one point");
+  }
+
+  pst_data *pst = unwrapped(self);
+  enumeration e = {
+    .pst = pst,
+    .mode = REPORT_PACK
+  };
+  read_3_sided_bounds(x0_val, x1_val, y0_val, open, &e.x0, &e.x1, &e.y0);
+
+  if (!NIL_P(cursor)) {
+    if (!rb_typeddata_is_kind_of(cursor, &enumeration_cursor_type)) {
+      rb_raise(rb_eArgError, "cursor must be nil or a cursor returned by enumerate_3_sided_into");
+    }
+    enumeration_cursor *saved = RTYPEDDATA_DATA(cursor);
+    if (saved->tree != self || saved->member_count != pst->member_count) {
+      rb_raise(rb_eArgError, "cursor belongs to a different tree, or the tree has changed since");
+    }
+    if (saved->e.x0 != e.x0 || saved->e.x1 != e.x1 || saved->e.y0 != e.y0) {
+      rb_raise(rb_eArgError, "cursor belongs to a query with different bounds");
+    }
+    e = saved->e;
+  }
+
+  rb_str_modify(buffer);
+  e.buffer = RSTRING_PTR(buffer);
+  e.capacity = capacity;
+  e.written = 0;
+  e.done = 0;
+
+  enumerate_3_sided(&e);
+
+  if (!e.done) {
+    // The search is over. It may have filled the buffer exactly, but we can only tell that we are finished by trying for more.
+    return rb_ary_new_from_args(2, SIZET2NUM(e.written), Qnil);
+  }
+
+  enumeration_cursor *next;
+  VALUE next_cursor = TypedData_Make_Struct(cEnumerationCursor, enumeration_cursor, &enumeration_cursor_type, next);
+  next->tree = self;
+  next->member_count = pst->member_count;
+  next->e = e;
+  next->e.buffer = NULL;
+  return rb_ary_new_from_args(2, SIZET2NUM(e.written), next_cursor);
+}
+
+/*
+ * The work of maximal_empty_rectangles_packed, with the given number of simulated interrupts. See cancelled(). If interrupts_handled
+ * isn't NULL we set it to the number of interrupts, simulated or real, that were handled along the way.
+ */
+static VALUE find_mers(int argc, VALUE *argv, int simulated_interrupts, int *interrupts_handled) {
+  VALUE xs, ys, opts;
+  rb_scan_args(argc, argv, "11:", &xs, &ys, &opts);
+
+  corner_list points;
+  read_corner_list(xs, ys, &points);
+
+  mer_job job = { .type_1 = { .min_area = -INFINITY }, .thread_count = 1, .simulated_interrupts = simulated_interrupts };
+  if (!NIL_P(opts)) {
+    ID keys[3] = { rb_intern("min_area"), rb_intern("k"), rb_intern("threads") };
+    VALUE values[3];
+    rb_get_kwargs(opts, keys, 0, 3, values);
+    if (values[0] != Qundef && !NIL_P(values[0])) {
+      job.type_1.min_area = NUM2DBL(values[0]);
+    }
+    if (values[1] != Qundef && !NIL_P(values[1])) {
+      job.type_1.bounded = 1;
+      job.type_1.k = checked_nonneg_fixnum(values[1]);
+    }
+    if (values[2] != Qundef) {
+      job.thread_count = NUM2LONG(values[2]);
+      if (job.thread_count < 1 || job.thread_count > MAX_THREADS) {
+        rb_raise(rb_eArgError, "threads must be between 1 and %d", MAX_THREADS);
+      }
+    }
+  }
+
+  size_t n = points.count;
+  if (n <= 1) {
+    return rb_str_new(NULL, 0);
+  }
+
+  // The tree is owned by a hidden Ruby object, so that the GC cleans up if we raise an exception
+  VALUE tree = TypedData_Wrap_Struct(0, &pst_type, create_pst());
+  pst_data *pst = RTYPEDDATA_DATA(tree);
+  pst->xs = ALLOC_N(double, n + 1);
+  pst->ys = ALLOC_N(double, n + 1);
+  pst->dynamic = 1;
+
+  for (size_t i = 0; i < n; i++) {
+    double x, y;
+    corner_at(&points, i, &x, &y);
+    // The work is done without the GVL, where we can't raise, so we check here that the coordinates can be nudged with next_up()
+    if (!isfinite(x) || !isfinite(y)) {
+      rb_raise(eSharedDataError, "Coordinates must be finite");
+    }
+    pst->xs[i + 1] = x;
+    pst->ys[i + 1] = y;
+    pst->size++;
+  }
+  pst->member_count = n;
+
+  job.pst = pst;
+  job.n = n;
+  job.coords = ALLOC_N(double, 2 * n);
+  for (size_t i = 0; i < n; i++) {
+    job.coords[2 * i] = pst->xs[i + 1];
+    job.coords[2 * i + 1] = pst->ys[i + 1];
+  }
+  VALUE result = rb_ensure(do_mer_job, (VALUE)&job, free_mer_job, (VALUE)&job);
+  if (interrupts_handled) {
+    *interrupts_handled = job.interrupts_handled;
+  }
+
+  RB_GC_GUARD(tree);
+  RB_GC_GUARD(xs);
+  RB_GC_GUARD(ys);
+  return result;
+}
+
+/*
+ * Algorithms.maximal_empty_rectangles_packed(xs, ys = nil, min_area: nil, k: nil)
+ *
+ * The maximal empty rectangles of a set of points, as Algorithms.maximal_empty_rectangles gives them.
+ *
+ * - The points are given as two Arrays of Numerics, xs and ys, or as a single String of packed doubles x0, y0, x1, y1, ... The x
+ *   values must be distinct, as for the MaxPST.
+ * - We return a String of packed doubles, left, right, bottom, top for each rectangle.
+ * - min_area: leave out the rectangles with smaller area.
+ * - k: return only the k largest rectangles, in descending order of area. Ties are broken by the coordinates. Without k the
+ *   rectangles come in the order Algorithms.maximal_empty_rectangles yields them.
+ * - threads: share the work among this many native threads, from 1 (the default) to 256. The results are the same, in the same
+ *   order. The GVL is released in any case.
+ *
+ *   The threads share the tree for the type 2 rectangles, which are split evenly among all of them. The type 3 ones, found by
+ *   deleting the tops in turn, are split among at most 4 threads, each with a copy of its own of the tree: 16 bytes a point,
+ *   counted by the GC like any other allocation. A thread must make all the deletions that come before its share of them, so
+ *   only the queries made after each deletion are really shared out. More than a few threads help only with the type 2 work.
+ */
+static VALUE mer_packed(int argc, VALUE *argv, VALUE self) {
+  return find_mers(argc, argv, 0, NULL);
+}
+
+/*
+ * Algorithms.maximal_empty_rectangles_packed_with_interrupts(interrupts, xs, ys = nil, **opts), a private method for the tests.
+ *
+ * As maximal_empty_rectangles_packed, but the work is interrupted the given number of times, as though by a Thread#wakeup, when
+ * it has only partly been done. We return the rectangles and the number of interrupts that were handled.
+ */
+static VALUE mer_packed_with_interrupts(int argc, VALUE *argv, VALUE self) {
+  rb_check_arity(argc, 2, UNLIMITED_ARGUMENTS);
+  int interrupts_handled = 0;
+  VALUE result = find_mers(argc - 1, argv + 1, NUM2INT(argv[0]), &interrupts_handled);
+  return rb_ary_new_from_args(2, result, INT2NUM(interrupts_handled));
+}
+
+/*
+ * Delete the top (max-y) element of the PST and return it. This is possible only for dynamic PSTs.
+ */
+static VALUE pst_delete_top(VALUE self) {
+  pst_data *pst = unwrapped(self);
+  if (!pst->dynamic) {
+    rb_raise(eSharedLogicError, "delete_top! not supported for PSTs that are not dynamic");
+  }
+  if (pst->member_count == 0) {
+    rb_raise(eSharedDataError, "delete_top! not possible for empty PSTs");
+  }
+
+  size_t node = delete_top(pst);
+#ifdef DSRM_STATS
+  size_t depth = level(node);
+  pst->stats.delete_tops++;
+  pst->stats.delete_top_depths += depth;
+  if (depth > pst->stats.max_delete_top_depth) {
+    pst->stats.max_delete_top_depth = depth;
+  }
+#endif
+  return point_at(pst, node);
+}
+
+#ifdef DSRM_STATS
+/*
+ * The hot-path counters since the tree was built, or since the last call to reset_stats, as a Hash:
+ * - delete_tops: the number of calls to delete_top!
+ * - delete_top_depths: the total of the depths, from the root at depth 0, to which those calls pushed the old top down before
+ *   taking it out. Each level costs a comparison and a swap.
+ * - max_delete_top_depth: the deepest of them
+ *
+ * The deletions made by Algorithms.maximal_empty_rectangles_packed aren't counted.
+ */
+static VALUE pst_stats_hash(VALUE self) {
+  pst_stats *stats = &unwrapped(self)->stats;
+  VALUE hash = rb_hash_new();
+  stat_to_hash(hash, "delete_tops", stats->delete_tops);
+  stat_to_hash(hash, "delete_top_depths", stats->delete_top_depths);
+  stat_to_hash(hash, "max_delete_top_depth", stats->max_delete_top_depth);
+  return hash;
+}
+
+/*
+ * Set the counters reported by stats back to zero.
+ */
+static VALUE pst_reset_stats(VALUE self) {
+  memset(&unwrapped(self)->stats, 0, sizeof(pst_stats));
+  return Qnil;
+}
+#endif
+
+/*
+ * CMaxPrioritySearchTree#dump(io)
+ *
+ * Write an image of the tree to io, which need only respond to +write+. Read it back with CMaxPrioritySearchTree.load or, from a
+ * file, CMaxPrioritySearchTree.open.
+ *
+ * The image holds the coordinates of the points, in native byte order, but not the point objects themselves.
+ */
+static VALUE pst_dump(VALUE self, VALUE io) {
+  dump_image(unwrapped(self), io);
+  return self;
+}
+
+/*
+ * CMaxPrioritySearchTree.load(io)
+ *
+ * A tree read from an image written by CMaxPrioritySearchTree#dump. io need only respond to +read+.
+ *
+ * The tree answers queries just as the dumped one did, except that where that returned one of the objects it was built from, this
+ * returns a Shared::Point with the same coordinates, as Floats.
+ */
+static VALUE pst_load(VALUE klass, VALUE io) {
+  VALUE self = rb_obj_alloc(klass);
+  pst_data *pst = unwrapped(self);
+  pst_image_preamble preamble;
+
+  image_read_header(io, PST_IMAGE_KIND, PST_IMAGE_VERSION);
+  image_read(io, &preamble, sizeof(preamble));
+  restore_preamble(pst, &preamble);
+
+  pst->xs = ALLOC_N(double, pst->size + 1);
+  pst->ys = ALLOC_N(double, pst->size + 1);
+  image_read(io, pst->xs, (pst->size + 1) * sizeof(double));
+  image_read(io, pst->ys, (pst->size + 1) * sizeof(double));
+  check_restored_coordinates(pst);
+
+  return self;
+}
+
+/*
+ * CMaxPrioritySearchTree.open(path)
+ *
+ * Like CMaxPrioritySearchTree.load, but we mmap the image file rather than reading it, and use the coordinate arrays in place. The
+ * mapping is private: pages are shared with any other process that maps the same file until one of them is written by delete_top!.
+ * So forked workers can all open the one prebuilt image cheaply.
+ */
+static VALUE pst_open(VALUE klass, VALUE path) {
+  VALUE self = rb_obj_alloc(klass);
+  pst_data *pst = unwrapped(self);
+
+  image_map(path, &pst->mapping, PST_IMAGE_KIND, PST_IMAGE_VERSION);
+  restore_preamble(pst, image_mapped_part(&pst->mapping, sizeof(pst_image_preamble)));
+
+  pst->xs = image_mapped_part(&pst->mapping, (pst->size + 1) * sizeof(double));
+  pst->ys = image_mapped_part(&pst->mapping, (pst->size + 1) * sizeof(double));
+  check_restored_coordinates(pst);
+
+  return self;
+}
+
+/*
+ * End wrappers
+ ************************************************************/
+
+/*
+ * A Max Priority Search Tree, implemented in C.
+ *
+ * The API is the same as that of the MaxPrioritySearchTree class. The coordinates are read once, at construction, and must be
+ * Numeric.
+ */
+void Init_c_max_priority_search_tree() {
+  id_x = rb_intern("x");
+  id_y = rb_intern("y");
+
+  VALUE cPST = rb_define_class_under(mDataStructuresRMolinari, "CMaxPrioritySearchTree", rb_cObject);
+  VALUE mAlgorithms = rb_define_module_under(mDataStructuresRMolinari, "Algorithms");
+
+  rb_define_alloc_func(cPST, pst_alloc);
+  rb_define_method(cPST, "initialize", pst_init, -1);
+  rb_define_singleton_method(cPST, "from_columns", pst_from_columns, -1);
+  rb_define_method(cPST, "empty?", pst_empty_p, 0);
+  rb_define_method(cPST, "largest_y_in_ne", pst_largest_y_in_ne, -1);
+  rb_define_method(cPST, "largest_y_in_nw", pst_largest_y_in_nw, -1);
+  rb_define_method(cPST, "smallest_x_in_ne", pst_smallest_x_in_ne, -1);
+  rb_define_method(cPST, "largest_x_in_nw", pst_largest_x_in_nw, -1);
+  rb_define_method(cPST, "largest_y_in_ne_many", pst_largest_y_in_ne_many, -1);
+  rb_define_method(cPST, "largest_y_in_nw_many", pst_largest_y_in_nw_many, -1);
+  rb_define_method(cPST, "smallest_x_in_ne_many", pst_smallest_x_in_ne_many, -1);
+  rb_define_method(cPST, "largest_x_in_nw_many", pst_largest_x_in_nw_many, -1);
+  rb_define_method(cPST, "largest_y_in_3_sided", pst_largest_y_in_3_sided, -1);
+  rb_define_method(cPST, "enumerate_3_sided", pst_enumerate_3_sided, -1);
+  rb_define_method(cPST, "count_3_sided", pst_count_3_sided, -1);
+  rb_define_method(cPST, "enumerate_3_sided_into", pst_enumerate_3_sided_into, -1);
+  cEnumerationCursor = rb_define_class_under(cPST, "EnumerationCursor", rb_cObject);
+  rb_undef_alloc_func(cEnumerationCursor);
+  rb_define_method(cPST, "delete_top!", pst_delete_top, 0);
+  rb_define_method(cPST, "dump", pst_dump, 1);
+  rb_define_singleton_method(cPST, "load", pst_load, 1);
+  rb_define_singleton_method(cPST, "open", pst_open, 1);
+  define_stats_methods(cPST, pst_stats_hash, pst_reset_stats);
+
+  rb_define_module_function(mAlgorithms, "maximal_empty_rectangles_packed", mer_packed, -1);
+  rb_define_private_method(rb_singleton_class(mAlgorithms), "maximal_empty_rectangles_packed_with_interrupts",
+                           mer_packed_with_interrupts, -1);
+}
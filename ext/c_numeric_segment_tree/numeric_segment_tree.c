@@ -0,0 +1,1117 @@
+/*
+ * This is a C implementation of Segment Trees for a few built-in operations on numeric data.
+ *
+ * CSegmentTreeTemplate is generic: it stores arbitrary Ruby values in its tree and combines them by calling Ruby lambdas. That costs
+ * us an rb_funcall() at nearly every node we visit. Here we give that genericity up. Values are stored unboxed - as int64_t or double
+ * - and are combined with the C "kernels" below, so that we never call back into Ruby while answering a query.
+ *
+ * The supported operations are those of the concrete classes MaxValSegmentTree, MinValSegmentTree, SumSegmentTree and
+ * IndexOfMaxValSegmentTree. See segment_tree.rb for how instances are chosen.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+#include "numeric.h"
+#include "simd.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * How the tree is laid out in memory.
+ *
+ * - LAYOUT_BINARY: the bottom-up binary tree with 2n nodes of segment_tree_template.c.
+ * - LAYOUT_WIDE: a B-ary tree with B = WIDE_NODE_ARITY, stored level by level. See the "wide layout" section below.
+ * - LAYOUT_BLOCKED: leaves in blocks of LEAF_BLOCK_SIZE under a binary tree of blocks. See the "blocked layout" section below.
+ */
+typedef enum {
+  LAYOUT_BINARY,
+  LAYOUT_WIDE,
+  LAYOUT_BLOCKED
+} numeric_layout;
+
+// With 8-byte cells, the children of a node in the wide layout fill exactly one 64-byte cache line.
+#define WIDE_NODE_ARITY 8
+// Enough levels for any size_t number of cells.
+#define MAX_WIDE_LEVELS 24
+// 32 cells are four cache lines, and eight AVX2 or sixteen NEON vectors.
+#define LEAF_BLOCK_SIZE 32
+
+/*
+ * What a subtree tells us about its interval: the combined value and, for OP_INDEX_OF_MAX, the index at which it is found.
+ */
+typedef struct {
+  cell val;
+  size_t idx;
+} node_val;
+
+/**
+ * The C implementation of a numeric Segment Tree
+ */
+
+typedef struct {
+  cell *tree; // The implicit tree in which the data structure lives. Its shape depends on the layout.
+  size_t *index_tree; // only for OP_INDEX_OF_MAX: the index in the data array of the value at the corresponding node of tree
+  VALUE data; // the underlying data: an Array or a String of packed values. We read from it again in update_at. It is nil for a
+              // tree loaded without it.
+  image_mapping mapping; // for a tree made by CNumericSegmentTree.open: tree and index_tree live in here, not on the heap
+  numeric_op operation;
+  numeric_dtype dtype;
+  numeric_layout layout;
+  int64_t max_abs_for_sum; // for i64 sums: a bound on the magnitude of cell values that guarantees the sums don't overflow
+  size_t size; // the size of the underlying data array
+  size_t tree_alloc_size; // the number of elements in the tree array
+
+  // Only for LAYOUT_WIDE. Level 0 holds the leaves.
+  size_t level_count;
+  size_t level_offset[MAX_WIDE_LEVELS]; // where in tree the nodes of each level start
+  size_t level_size[MAX_WIDE_LEVELS]; // the number of nodes on each level
+
+  // Only for LAYOUT_BLOCKED
+  size_t block_count; // ceil(size / LEAF_BLOCK_SIZE)
+  simd_reduce_fn reduce; // how we combine a run of leaves, chosen for this CPU
+} numeric_segment_tree_data;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap).
+ */
+static numeric_segment_tree_data *create_numeric_segment_tree() {
+  numeric_segment_tree_data *segment_tree = ALLOC(numeric_segment_tree_data);
+
+  segment_tree->tree = NULL; // we don't yet know how much space we need
+  segment_tree->index_tree = NULL;
+  segment_tree->data = Qnil;
+  segment_tree->mapping.base = NULL;
+  segment_tree->operation = OP_SUM;
+  segment_tree->dtype = DTYPE_I64;
+  segment_tree->layout = LAYOUT_BINARY;
+  segment_tree->level_count = 0;
+  segment_tree->block_count = 0;
+  segment_tree->reduce = NULL;
+  segment_tree->max_abs_for_sum = INT64_MAX;
+  segment_tree->size = 0;
+  segment_tree->tree_alloc_size = 0;
+
+  return segment_tree;
+}
+
+/*
+ * Free the memory associated with a numeric_segment_tree_data struct.
+ */
+static void numeric_segment_tree_free(void *ptr) {
+  if (ptr) {
+    numeric_segment_tree_data *segment_tree = ptr;
+    if (segment_tree->mapping.base) {
+      image_unmap(&segment_tree->mapping);
+    } else {
+      native_array_free(segment_tree->tree, segment_tree->tree_alloc_size, sizeof(cell));
+      native_array_free(segment_tree->index_tree, segment_tree->tree_alloc_size, sizeof(size_t));
+    }
+    xfree(segment_tree);
+  }
+}
+
+/*
+ * How much memory does a numeric_segment_tree_data instance consume?
+ *
+ * A mapped image isn't on the Ruby heap, and its pages may be shared with other processes, so we don't count it.
+ */
+static size_t numeric_segment_tree_memsize(const void *ptr) {
+  if (ptr) {
+    const numeric_segment_tree_data *st = ptr;
+    if (st->mapping.base) {
+      return sizeof(numeric_segment_tree_data);
+    }
+    size_t index_tree_size = st->index_tree ? native_array_memsize(st->tree_alloc_size, sizeof(size_t)) : 0;
+
+    return native_array_memsize(st->tree_alloc_size, sizeof(cell)) + index_tree_size + sizeof(numeric_segment_tree_data);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * The only Ruby object we hold is the underlying data array. The tree itself contains no VALUEs, so there is nothing else to mark.
+ */
+static void numeric_segment_tree_mark(void *ptr) {
+  numeric_segment_tree_data *st = ptr;
+  rb_gc_mark(st->data);
+}
+
+static const rb_data_type_t numeric_segment_tree_type = {
+  .wrap_struct_name = "numeric_segment_tree",
+  { // help for the Ruby garbage collector
+    .dmark = numeric_segment_tree_mark,
+    .dfree = numeric_segment_tree_free,
+    .dsize = numeric_segment_tree_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+
+/************************************************************
+ * Wrapping and unwrapping the C struct and other things.
+ *
+ */
+
+static numeric_segment_tree_data *unwrapped(VALUE self) {
+  numeric_segment_tree_data *segment_tree;
+  TypedData_Get_Struct((self), numeric_segment_tree_data, &numeric_segment_tree_type, segment_tree);
+  return segment_tree;
+}
+
+/*
+ * This is for CNumericSegmentTree.allocate on the Ruby side.
+ */
+static VALUE numeric_segment_tree_alloc(VALUE klass) {
+  numeric_segment_tree_data *segment_tree = create_numeric_segment_tree();
+  return TypedData_Wrap_Struct(klass, &numeric_segment_tree_type, segment_tree);
+}
+
+/*
+ * Translate the Ruby-side layout symbol into our enum.
+ */
+static numeric_layout layout_from_symbol(VALUE layout) {
+  Check_Type(layout, T_SYMBOL);
+  ID id = SYM2ID(layout);
+
+  if (id == rb_intern("binary")) {
+    return LAYOUT_BINARY;
+  } else if (id == rb_intern("wide")) {
+    return LAYOUT_WIDE;
+  } else if (id == rb_intern("blocked")) {
+    return LAYOUT_BLOCKED;
+  }
+  rb_raise(rb_eArgError, "Unknown layout %" PRIsVALUE, layout);
+}
+
+/*
+ * The inverse of operation_from_symbol().
+ */
+static VALUE symbol_from_operation(numeric_op operation) {
+  switch (operation) {
+  case OP_SUM:
+    return ID2SYM(rb_intern("sum"));
+  case OP_MAX:
+    return ID2SYM(rb_intern("max"));
+  case OP_MIN:
+    return ID2SYM(rb_intern("min"));
+  case OP_INDEX_OF_MAX:
+  default:
+    return ID2SYM(rb_intern("index_of_max"));
+  }
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * The combine "kernels"
+ *
+ * These are what CSegmentTreeTemplate calls Ruby lambdas to do.
+ */
+
+/*
+ * Combine the values from two adjacent subintervals, with a from the one on the left.
+ *
+ * For OP_INDEX_OF_MAX we prefer the left-hand index when the values are equal, just as the Ruby lambda in IndexOfMaxValSegmentTree
+ * does.
+ */
+static inline node_val combined_val(const numeric_segment_tree_data *st, node_val a, node_val b) {
+  switch (st->operation) {
+  case OP_SUM:
+    if (st->dtype == DTYPE_I64) {
+      a.val.i += b.val.i;
+    } else {
+      a.val.f += b.val.f;
+    }
+    return a;
+  case OP_MIN:
+    return cell_less(st->dtype, b.val, a.val) ? b : a;
+  case OP_MAX:
+  case OP_INDEX_OF_MAX:
+  default:
+    return cell_less(st->dtype, a.val, b.val) ? b : a;
+  }
+}
+
+/*
+ * End combine kernels
+ ************************************************************/
+
+/************************************************************
+ * The Segment Tree API on the C side.
+ *
+ * The logic is the same as in segment_tree_template.c.
+ */
+
+static inline node_val node_at(const numeric_segment_tree_data *st, size_t tree_idx) {
+  node_val result = { .val = st->tree[tree_idx], .idx = st->index_tree ? st->index_tree[tree_idx] : 0 };
+  return result;
+}
+
+static inline void set_node(numeric_segment_tree_data *st, size_t tree_idx, node_val v) {
+  st->tree[tree_idx] = v.val;
+  if (st->index_tree) {
+    st->index_tree[tree_idx] = v.idx;
+  }
+}
+
+/*
+ * Read the value at index idx of the underlying data. Packed data is read in place, without making a Ruby object.
+ */
+static node_val single_cell_val_at(const numeric_segment_tree_data *st, size_t idx) {
+  node_val result = { .idx = idx };
+
+  if (RB_TYPE_P(st->data, T_STRING)) {
+    // The caller may have changed the String since we last looked
+    if ((size_t)RSTRING_LEN(st->data) / sizeof(cell) <= idx) {
+      rb_raise(eSharedDataError, "Packed data no longer has a value at index %zu", idx);
+    }
+    memcpy(&result.val, RSTRING_PTR(st->data) + idx * sizeof(cell), sizeof(cell));
+  } else {
+    result.val = cell_from_value(st->dtype, rb_ary_entry(st->data, idx));
+  }
+
+  if (st->operation == OP_SUM && st->dtype == DTYPE_I64) {
+    // The same check as in CNumericSegmentTree.native_dtype, so that no node value can overflow.
+    if (result.val.i > st->max_abs_for_sum || result.val.i < -st->max_abs_for_sum) {
+      rb_raise(eSharedDataError, "Value at index %zu is too large in magnitude for a native sum tree", idx);
+    }
+  }
+  return result;
+}
+
+/*
+ * The binary layout
+ *
+ * This is the bottom-up layout of segment_tree_template.c: leaves at tree[n], ..., tree[2n - 1] and internal node i combining its
+ * children 2i and 2i + 1. See the comments there for the details.
+ */
+
+static void binary_build(numeric_segment_tree_data *st) {
+  size_t n = st->size;
+
+  for (size_t i = 0; i < n; i++) {
+    set_node(st, n + i, single_cell_val_at(st, i));
+  }
+
+  for (size_t i = n - 1; i >= TREE_ROOT; i--) {
+    set_node(st, i, combined_val(st, node_at(st, left_child(i)), node_at(st, right_child(i))));
+  }
+}
+
+/*
+ * The query on left..right of a bottom-up tree with n leaves at the start of st->tree. The blocked layout uses this too, for its tree
+ * of blocks.
+ */
+static node_val bottom_up_query(const numeric_segment_tree_data* st, size_t n, size_t left, size_t right) {
+  node_val left_result = { 0 }, right_result = { 0 };
+  int have_left = 0, have_right = 0;
+
+  size_t l = left + n;
+  size_t r = right + n + 1;
+
+  while (l < r) {
+    if (l & 1) {
+      left_result = have_left ? combined_val(st, left_result, node_at(st, l)) : node_at(st, l);
+      have_left = 1;
+      l++;
+    }
+    if (r & 1) {
+      r--;
+      right_result = have_right ? combined_val(st, node_at(st, r), right_result) : node_at(st, r);
+      have_right = 1;
+    }
+    l >>= 1;
+    r >>= 1;
+  }
+
+  if (have_left && have_right) {
+    return combined_val(st, left_result, right_result);
+  }
+  return have_left ? left_result : right_result;
+}
+
+/*
+ * Recalculate the ancestors of node i of a bottom-up tree after it has changed.
+ */
+static void bottom_up_update_ancestors(numeric_segment_tree_data *st, size_t i) {
+  for (i >>= 1; i >= TREE_ROOT; i >>= 1) {
+    set_node(st, i, combined_val(st, node_at(st, left_child(i)), node_at(st, right_child(i))));
+  }
+}
+
+static node_val binary_determine_val(const numeric_segment_tree_data* st, size_t left, size_t right) {
+  return bottom_up_query(st, st->size, left, right);
+}
+
+static void binary_update_val_at(numeric_segment_tree_data *st, size_t idx) {
+  size_t i = idx + st->size;
+
+  set_node(st, i, single_cell_val_at(st, idx));
+  bottom_up_update_ancestors(st, i);
+}
+
+/*
+ * The wide layout
+ *
+ * For large arrays, the binary layout takes a cache miss at almost every level of the walk to the root. Here we use a B-ary tree
+ * instead, with B = WIDE_NODE_ARITY.
+ *
+ * Level 0 holds the n leaves. Node b of level k + 1 combines the "block" of nodes B*b, ..., B*b + B - 1 of level k (the last block
+ * on a level may be short). There are about log_B(n) levels and the tree needs only about n * B / (B - 1) cells. The levels are
+ * stored one after another in the tree array, and the small upper levels are likely to stay in cache.
+ *
+ * A query on l..r at some level combines the partial blocks at each end directly, by scanning them, and leaves the fully-covered
+ * blocks in between to the level above. Like the binary layout we keep the left- and right-hand partial results separate so that
+ * values are combined in order.
+ */
+
+/*
+ * Combine the values of the nodes from..to (inclusive) on the given level.
+ */
+static node_val scan_level(const numeric_segment_tree_data *st, size_t level, size_t from, size_t to) {
+  size_t base = st->level_offset[level];
+  node_val result = node_at(st, base + from);
+
+  for (size_t i = from + 1; i <= to; i++) {
+    result = combined_val(st, result, node_at(st, base + i));
+  }
+  return result;
+}
+
+/*
+ * The value of the node on (level + 1) that covers the given block on level.
+ */
+static node_val block_val(const numeric_segment_tree_data *st, size_t level, size_t block) {
+  size_t from = block * WIDE_NODE_ARITY;
+  size_t to = from + WIDE_NODE_ARITY - 1;
+
+  if (to >= st->level_size[level]) {
+    to = st->level_size[level] - 1;
+  }
+  return scan_level(st, level, from, to);
+}
+
+/*
+ * Work out the sizes and offsets of the levels, returning the total number of nodes.
+ */
+static size_t wide_plan_levels(numeric_segment_tree_data *st) {
+  size_t total = 0;
+  size_t level_size = st->size;
+  size_t level = 0;
+
+  while (1) {
+    st->level_offset[level] = total;
+    st->level_size[level] = level_size;
+    total += level_size;
+    level++;
+
+    if (level_size <= WIDE_NODE_ARITY) {
+      break;
+    }
+    level_size = (level_size + WIDE_NODE_ARITY - 1) / WIDE_NODE_ARITY;
+  }
+  st->level_count = level;
+
+  return total;
+}
+
+static void wide_build(numeric_segment_tree_data *st) {
+  for (size_t i = 0; i < st->size; i++) {
+    set_node(st, i, single_cell_val_at(st, i));
+  }
+
+  for (size_t level = 1; level < st->level_count; level++) {
+    size_t base = st->level_offset[level];
+    for (size_t b = 0; b < st->level_size[level]; b++) {
+      set_node(st, base + b, block_val(st, level - 1, b));
+    }
+  }
+}
+
+static node_val wide_determine_val(const numeric_segment_tree_data *st, size_t left, size_t right) {
+  node_val left_result = { 0 }, right_result = { 0 };
+  int have_left = 0, have_right = 0;
+
+  size_t l = left;
+  size_t r = right;
+
+  for (size_t level = 0; level < st->level_count; level++) {
+    size_t left_block = l / WIDE_NODE_ARITY;
+    size_t right_block = r / WIDE_NODE_ARITY;
+
+    if (left_block == right_block) {
+      // What is left of the interval lies inside one node of the level above. Just scan it.
+      node_val middle = scan_level(st, level, l, r);
+      left_result = have_left ? combined_val(st, left_result, middle) : middle;
+      have_left = 1;
+      break;
+    }
+
+    if (l % WIDE_NODE_ARITY != 0) {
+      // The left end is a partial block
+      node_val part = scan_level(st, level, l, left_block * WIDE_NODE_ARITY + WIDE_NODE_ARITY - 1);
+      left_result = have_left ? combined_val(st, left_result, part) : part;
+      have_left = 1;
+      left_block++;
+    }
+
+    if (r % WIDE_NODE_ARITY != WIDE_NODE_ARITY - 1 && r != st->level_size[level] - 1) {
+      // The right end is a partial block
+      node_val part = scan_level(st, level, right_block * WIDE_NODE_ARITY, r);
+      right_result = have_right ? combined_val(st, part, right_result) : part;
+      have_right = 1;
+      right_block--; // right_block > left_block >= 0 here
+    }
+
+    if (left_block > right_block) {
+      break;
+    }
+    l = left_block;
+    r = right_block;
+  }
+
+  if (have_left && have_right) {
+    return combined_val(st, left_result, right_result);
+  }
+  return have_left ? left_result : right_result;
+}
+
+static void wide_update_val_at(numeric_segment_tree_data *st, size_t idx) {
+  set_node(st, idx, single_cell_val_at(st, idx));
+
+  for (size_t level = 1; level < st->level_count; level++) {
+    idx /= WIDE_NODE_ARITY;
+    set_node(st, st->level_offset[level] + idx, block_val(st, level - 1, idx));
+  }
+}
+
+/*
+ * The blocked layout
+ *
+ * In the binary layout most of the work of a query is near the leaves, where the nodes are many and the subintervals small. Here we
+ * cut the bottom levels off. The leaves are stored in blocks of LEAF_BLOCK_SIZE (the last block may be short) and a binary tree over
+ * the blocks, in the bottom-up layout, sits above them. A query reduces the partial blocks at its ends with a vectorized scan over
+ * contiguous cells - see simd.h - and asks the tree of blocks for the fully-covered blocks in between.
+ *
+ * With nb = block_count, the tree array holds the 2nb nodes of the tree of blocks followed by the n leaves. That is about n cells
+ * fewer than the binary layout needs.
+ *
+ * The scan only knows about values, so the layout can't do OP_INDEX_OF_MAX.
+ */
+
+static inline const cell *blocked_leaves(const numeric_segment_tree_data *st) {
+  return st->tree + 2 * st->block_count;
+}
+
+/*
+ * The combined value of the leaves from..to (inclusive).
+ */
+static inline node_val blocked_scan(const numeric_segment_tree_data *st, size_t from, size_t to) {
+  node_val result = { .val = st->reduce(blocked_leaves(st) + from, to - from + 1), .idx = 0 };
+  return result;
+}
+
+/*
+ * The value of the given block of leaves.
+ */
+static node_val leaf_block_val(const numeric_segment_tree_data *st, size_t block) {
+  size_t from = block * LEAF_BLOCK_SIZE;
+  size_t to = from + LEAF_BLOCK_SIZE - 1;
+
+  if (to >= st->size) {
+    to = st->size - 1;
+  }
+  return blocked_scan(st, from, to);
+}
+
+/*
+ * Set up the fields used only by the blocked layout, returning the number of cells in the tree array.
+ */
+static size_t blocked_plan(numeric_segment_tree_data *st) {
+  if (st->operation == OP_INDEX_OF_MAX) {
+    rb_raise(rb_eArgError, "The blocked layout does not support index_of_max");
+  }
+  st->block_count = (st->size + LEAF_BLOCK_SIZE - 1) / LEAF_BLOCK_SIZE;
+  st->reduce = simd_reducer(st->operation, st->dtype);
+
+  return 2 * st->block_count + st->size;
+}
+
+static void blocked_build(numeric_segment_tree_data *st) {
+  size_t nb = st->block_count;
+  cell *leaves = st->tree + 2 * nb;
+
+  for (size_t i = 0; i < st->size; i++) {
+    leaves[i] = single_cell_val_at(st, i).val;
+  }
+
+  for (size_t b = 0; b < nb; b++) {
+    set_node(st, nb + b, leaf_block_val(st, b));
+  }
+  for (size_t i = nb - 1; i >= TREE_ROOT; i--) {
+    set_node(st, i, combined_val(st, node_at(st, left_child(i)), node_at(st, right_child(i))));
+  }
+}
+
+static node_val blocked_determine_val(const numeric_segment_tree_data *st, size_t left, size_t right) {
+  size_t left_block = left / LEAF_BLOCK_SIZE;
+  size_t right_block = right / LEAF_BLOCK_SIZE;
+
+  if (left_block == right_block) {
+    return blocked_scan(st, left, right);
+  }
+
+  node_val left_result = { 0 }, right_result = { 0 };
+  int have_left = 0, have_right = 0;
+
+  if (left % LEAF_BLOCK_SIZE != 0) {
+    // The left end is a partial block
+    left_result = blocked_scan(st, left, left_block * LEAF_BLOCK_SIZE + LEAF_BLOCK_SIZE - 1);
+    have_left = 1;
+    left_block++;
+  }
+
+  if (right % LEAF_BLOCK_SIZE != LEAF_BLOCK_SIZE - 1 && right != st->size - 1) {
+    // The right end is a partial block
+    right_result = blocked_scan(st, right_block * LEAF_BLOCK_SIZE, right);
+    have_right = 1;
+    right_block--; // right_block > left_block >= 0 here
+  }
+
+  if (left_block <= right_block) {
+    node_val middle = bottom_up_query(st, st->block_count, left_block, right_block);
+    left_result = have_left ? combined_val(st, left_result, middle) : middle;
+    have_left = 1;
+  }
+
+  if (have_left && have_right) {
+    return combined_val(st, left_result, right_result);
+  }
+  return have_left ? left_result : right_result;
+}
+
+static void blocked_update_val_at(numeric_segment_tree_data *st, size_t idx) {
+  size_t block = idx / LEAF_BLOCK_SIZE;
+  size_t i = st->block_count + block;
+
+  st->tree[2 * st->block_count + idx] = single_cell_val_at(st, idx).val;
+  set_node(st, i, leaf_block_val(st, block));
+  bottom_up_update_ancestors(st, i);
+}
+
+/*
+ * Dispatch on the layout.
+ */
+
+/*
+ * Work out the shape of the tree for st->layout, returning the number of cells in the tree array.
+ */
+static size_t plan_layout(numeric_segment_tree_data *st) {
+  switch (st->layout) {
+  case LAYOUT_WIDE:
+    return wide_plan_levels(st);
+  case LAYOUT_BLOCKED:
+    return blocked_plan(st);
+  case LAYOUT_BINARY:
+  default:
+    return 2 * st->size;
+  }
+}
+
+static void build(numeric_segment_tree_data *st) {
+  switch (st->layout) {
+  case LAYOUT_WIDE:
+    wide_build(st);
+    break;
+  case LAYOUT_BLOCKED:
+    blocked_build(st);
+    break;
+  case LAYOUT_BINARY:
+  default:
+    binary_build(st);
+  }
+}
+
+static node_val determine_val(const numeric_segment_tree_data* st, size_t left, size_t right) {
+  switch (st->layout) {
+  case LAYOUT_WIDE:
+    return wide_determine_val(st, left, right);
+  case LAYOUT_BLOCKED:
+    return blocked_determine_val(st, left, right);
+  case LAYOUT_BINARY:
+  default:
+    return binary_determine_val(st, left, right);
+  }
+}
+
+static void update_val_at(numeric_segment_tree_data *st, size_t idx) {
+  switch (st->layout) {
+  case LAYOUT_WIDE:
+    wide_update_val_at(st, idx);
+    break;
+  case LAYOUT_BLOCKED:
+    blocked_update_val_at(st, idx);
+    break;
+  case LAYOUT_BINARY:
+  default:
+    binary_update_val_at(st, idx);
+  }
+}
+
+/*
+ * The value we return for an empty interval. These agree with the identity values used by the concrete classes.
+ */
+static VALUE identity(const numeric_segment_tree_data *st) {
+  switch (st->operation) {
+  case OP_SUM:
+    return INT2FIX(0);
+  case OP_MAX:
+    return DBL2NUM(-HUGE_VAL);
+  case OP_MIN:
+    return DBL2NUM(HUGE_VAL);
+  case OP_INDEX_OF_MAX:
+  default:
+    return Qnil;
+  }
+}
+
+/*
+ * Box up the result of a query in the same shape as the generic template would give.
+ *
+ * For OP_INDEX_OF_MAX that is the pair [index, value].
+ */
+static VALUE boxed_result(const numeric_segment_tree_data *st, node_val v) {
+  VALUE val = value_from_cell(st->dtype, v.val);
+
+  if (st->operation == OP_INDEX_OF_MAX) {
+    return rb_assoc_new(SIZET2NUM(v.idx), val);
+  }
+  return val;
+}
+
+/*
+ * The number of values in data, which must be an Array or else a String of packed 8-byte values.
+ */
+static size_t data_size(VALUE data) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    long len = RSTRING_LEN(data);
+    if (len % sizeof(cell) != 0) {
+      rb_raise(rb_eArgError, "packed data must be a whole number of 8-byte values (got %ld bytes)", len);
+    }
+    return len / sizeof(cell);
+  }
+
+  Check_Type(data, T_ARRAY);
+  return RARRAY_LEN(data);
+}
+
+/*
+ * End C implementation of the Segment Tree API
+ ************************************************************/
+
+/************************************************************
+ * Images
+ *
+ * See shared.h. After the header comes a numeric_image_preamble and then the tree array and, for OP_INDEX_OF_MAX, the index_tree
+ * array. The level tables of the wide layout and the block count of the blocked layout are worked out again from the size rather than
+ * stored.
+ */
+
+#define NUMERIC_IMAGE_KIND "CNST"
+#define NUMERIC_IMAGE_VERSION 1
+
+typedef struct {
+  uint32_t operation;
+  uint32_t dtype;
+  uint32_t layout;
+  uint32_t unused;
+  uint64_t size;
+  uint64_t tree_alloc_size;
+  int64_t max_abs_for_sum;
+} numeric_image_preamble;
+
+static void dump_image(const numeric_segment_tree_data *st, VALUE io) {
+  numeric_image_preamble preamble = {
+    .operation = st->operation,
+    .dtype = st->dtype,
+    .layout = st->layout,
+    .unused = 0,
+    .size = st->size,
+    .tree_alloc_size = st->tree_alloc_size,
+    .max_abs_for_sum = st->max_abs_for_sum
+  };
+
+  image_write_header(io, NUMERIC_IMAGE_KIND, NUMERIC_IMAGE_VERSION);
+  image_write(io, &preamble, sizeof(preamble));
+  image_write(io, st->tree, sizeof(cell) * st->tree_alloc_size);
+  if (st->index_tree) {
+    image_write(io, st->index_tree, sizeof(size_t) * st->tree_alloc_size);
+  }
+}
+
+/*
+ * Set up st from the preamble of an image, checking that it is consistent. The arrays still have to be allocated or mapped.
+ */
+static void restore_preamble(numeric_segment_tree_data *st, const numeric_image_preamble *preamble) {
+  if (preamble->operation > OP_INDEX_OF_MAX || preamble->dtype > DTYPE_F64 || preamble->layout > LAYOUT_BLOCKED ||
+      (preamble->layout == LAYOUT_BLOCKED && preamble->operation == OP_INDEX_OF_MAX)) {
+    rb_raise(eSharedDataError, "Image of a CNumericSegmentTree is corrupt");
+  }
+  st->operation = preamble->operation;
+  st->dtype = preamble->dtype;
+  st->layout = preamble->layout;
+  st->max_abs_for_sum = preamble->max_abs_for_sum;
+
+  // Checks that 3 * size cells, which is more than any layout needs, fit in memory
+  image_array_bytes(preamble->size, 3 * sizeof(cell));
+  st->size = preamble->size;
+
+  size_t tree_size = plan_layout(st);
+  if (st->size == 0 || tree_size != preamble->tree_alloc_size) {
+    rb_raise(eSharedDataError, "Image of a CNumericSegmentTree is corrupt");
+  }
+  st->tree_alloc_size = tree_size;
+}
+
+/*
+ * Check the data optionally passed to CNumericSegmentTree.load or .open and remember it, so that update_at works.
+ */
+static void attach_data(numeric_segment_tree_data *st, VALUE data) {
+  if (NIL_P(data)) {
+    return;
+  }
+
+  size_t size = data_size(data);
+  if (size != st->size) {
+    rb_raise(rb_eArgError, "data has size %zu but the tree was built over %zu values", size, st->size);
+  }
+  st->data = data;
+}
+
+/*
+ * End images
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * CNumericSegmentTree.native_dtype(data, operation)
+ *
+ * Can the values in data be stored natively in a tree doing the given operation? If so return the dtype to use, :i64 or :f64, and
+ * otherwise return nil.
+ *
+ * - data must be an Array, all of whose elements are Integers that fit into an int64_t or all of whose elements are Floats.
+ * - for :sum over Integers we also need size * max(|value|) to fit into an int64_t so that no internal sum can overflow.
+ */
+static VALUE numeric_segment_tree_native_dtype(VALUE klass, VALUE data, VALUE operation) {
+  int64_t max_abs = 0;
+  VALUE dtype = native_dtype_of(data, &max_abs);
+
+  if (operation_from_symbol(operation) == OP_SUM && dtype == ID2SYM(rb_intern("i64")) && max_abs > INT64_MAX / RARRAY_LEN(data)) {
+    return Qnil;
+  }
+  return dtype;
+}
+
+/*
+ * CNumericSegmentTree#initialize(operation, data, dtype, layout)
+ *
+ * - operation: one of :sum, :max, :min, :index_of_max
+ * - data: an Array of numeric values, or a String of int64 or double values in native byte order, as made by Array#pack('q*') or
+ *   Array#pack('d*'). A String is read in place, and no Ruby object is made for its values.
+ * - dtype: :i64 or :f64. For an Array it must be what CNumericSegmentTree.native_dtype(data, operation) returns. For a String it
+ *   says how to read the bytes.
+ * - layout: :binary, :wide or :blocked. :blocked doesn't support :index_of_max.
+ */
+static VALUE numeric_segment_tree_init(VALUE self, VALUE operation, VALUE data, VALUE dtype, VALUE layout) {
+  numeric_segment_tree_data *st = unwrapped(self);
+
+  st->operation = operation_from_symbol(operation);
+  st->dtype = dtype_from_symbol(dtype);
+  st->layout = layout_from_symbol(layout);
+  st->size = data_size(data);
+  st->data = data;
+
+  if (st->size == 0) {
+    rb_raise(rb_eArgError, "size must be positive.");
+  }
+
+  st->max_abs_for_sum = INT64_MAX / (int64_t)st->size;
+
+  size_t tree_size = plan_layout(st);
+  st->tree_alloc_size = tree_size; // first, so that numeric_segment_tree_free() knows how the arrays were allocated
+  st->tree = native_array_alloc(tree_size, sizeof(cell));
+  if (st->operation == OP_INDEX_OF_MAX) {
+    st->index_tree = native_array_alloc(tree_size, sizeof(size_t));
+  }
+  build(st);
+
+  return self;
+}
+
+/*
+ * The value on left..right, after checking that the interval makes sense.
+ *
+ * - is_empty: set to true if the interval is empty. The return value is meaningless in that case.
+ */
+static node_val checked_query(const numeric_segment_tree_data* st, size_t left, size_t right, int *is_empty) {
+  node_val result = { 0 };
+
+  if (right >= st->size) {
+    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", left, right, st->size);
+  }
+
+  *is_empty = left > right;
+  if (*is_empty) {
+    return result;
+  }
+  return determine_val(st, left, right);
+}
+
+/*
+ * (see SegmentTreeTemplate#query_on)
+ */
+static VALUE numeric_segment_tree_query_on(VALUE self, VALUE left, VALUE right) {
+  numeric_segment_tree_data* st = unwrapped(self);
+  int is_empty;
+  node_val result = checked_query(st, checked_nonneg_fixnum(left), checked_nonneg_fixnum(right), &is_empty);
+
+  return is_empty ? identity(st) : boxed_result(st, result);
+}
+
+/*
+ * The raw bytes we write to a packed result for an empty interval. We use the same identity values as the unpacked results, except
+ * for :index_of_max, which gets -1 rather than nil.
+ */
+static cell packed_identity(const numeric_segment_tree_data *st) {
+  cell c;
+  int is_i64 = st->dtype == DTYPE_I64;
+
+  switch (st->operation) {
+  case OP_SUM:
+    if (is_i64) { c.i = 0; } else { c.f = 0.0; }
+    break;
+  case OP_MAX:
+    if (is_i64) { c.i = INT64_MIN; } else { c.f = -HUGE_VAL; }
+    break;
+  case OP_MIN:
+    if (is_i64) { c.i = INT64_MAX; } else { c.f = HUGE_VAL; }
+    break;
+  case OP_INDEX_OF_MAX:
+  default:
+    c.i = -1;
+  }
+  return c;
+}
+
+/*
+ * (see SegmentTreeTemplate#query_many)
+ *
+ * When the intervals are given as two Arrays we return an Array of results, each just as query_on would give.
+ *
+ * When they are given as a packed String we return a packed String of values, one 8-byte value for each interval, in native byte
+ * order. They are int64 or double values according to the dtype, except for :index_of_max where they are the int64 indices.
+ *
+ * Empty intervals give the identity value. For packed results of int64 max and min, which have no infinities, we use the most
+ * extreme int64 values instead. For :index_of_max we use -1.
+ */
+static VALUE numeric_segment_tree_query_many(int argc, VALUE *argv, VALUE self) {
+  numeric_segment_tree_data* st = unwrapped(self);
+  index_pairs pairs;
+  read_index_pairs(argc, argv, &pairs);
+
+  int is_empty;
+  size_t left, right;
+
+  if (!pairs.packed) {
+    VALUE results = rb_ary_new_capa(pairs.count);
+    for (long i = 0; i < pairs.count; i++) {
+      index_pair_at(&pairs, i, &left, &right);
+      node_val result = checked_query(st, left, right, &is_empty);
+      rb_ary_push(results, is_empty ? identity(st) : boxed_result(st, result));
+    }
+    return results;
+  }
+
+  VALUE packed_results = rb_str_new(NULL, pairs.count * sizeof(cell));
+  char *out = RSTRING_PTR(packed_results);
+  cell empty_val = packed_identity(st);
+
+  for (long i = 0; i < pairs.count; i++) {
+    index_pair_at(&pairs, i, &left, &right);
+    node_val result = checked_query(st, left, right, &is_empty);
+
+    cell c;
+    if (is_empty) {
+      c = empty_val;
+    } else if (st->operation == OP_INDEX_OF_MAX) {
+      c.i = result.idx;
+    } else {
+      c = result.val;
+    }
+    memcpy(out + i * sizeof(cell), &c, sizeof(cell));
+  }
+  return packed_results;
+}
+
+/*
+ * (see SegmentTreeTemplate#update_at)
+ *
+ * We read the new value directly from the data we were given at construction. This is the one place where we look at a Ruby object
+ * after construction. For packed data, the caller changes the bytes of the String. A tree loaded from an image without its data
+ * can't be updated.
+ */
+static VALUE numeric_segment_tree_update_at(VALUE self, VALUE idx) {
+  numeric_segment_tree_data *st = unwrapped(self);
+  size_t c_idx = checked_nonneg_fixnum(idx);
+
+  if (NIL_P(st->data)) {
+    rb_raise(eSharedLogicError, "Cannot update a tree loaded from an image without its data array");
+  }
+
+  if (c_idx >= st->size) {
+    rb_raise(eSharedDataError, "Cannot update value at index %lu, size = %lu", c_idx, st->size);
+  }
+
+  update_val_at(st, c_idx);
+
+  return Qnil;
+}
+
+/*
+ * CNumericSegmentTree#dump(io)
+ *
+ * Write an image of the tree to io, which need only respond to +write+. Read it back with CNumericSegmentTree.load or, from a file,
+ * CNumericSegmentTree.open.
+ *
+ * The image holds the built tree but not the underlying data array. It is in native byte order.
+ */
+static VALUE numeric_segment_tree_dump(VALUE self, VALUE io) {
+  dump_image(unwrapped(self), io);
+  return self;
+}
+
+/*
+ * CNumericSegmentTree.load(io, data = nil)
+ *
+ * A tree read from an image written by CNumericSegmentTree#dump. io need only respond to +read+.
+ *
+ * - data: the underlying data array. It is needed only for update_at, and must then hold the values the tree was built over.
+ */
+static VALUE numeric_segment_tree_load(int argc, VALUE *argv, VALUE klass) {
+  VALUE io, data;
+  rb_scan_args(argc, argv, "11", &io, &data);
+
+  VALUE self = rb_obj_alloc(klass);
+  numeric_segment_tree_data *st = unwrapped(self);
+  numeric_image_preamble preamble;
+
+  image_read_header(io, NUMERIC_IMAGE_KIND, NUMERIC_IMAGE_VERSION);
+  image_read(io, &preamble, sizeof(preamble));
+  restore_preamble(st, &preamble);
+  attach_data(st, data);
+
+  st->tree = native_array_alloc(st->tree_alloc_size, sizeof(cell));
+  image_read(io, st->tree, sizeof(cell) * st->tree_alloc_size);
+  if (st->operation == OP_INDEX_OF_MAX) {
+    st->index_tree = native_array_alloc(st->tree_alloc_size, sizeof(size_t));
+    image_read(io, st->index_tree, sizeof(size_t) * st->tree_alloc_size);
+  }
+
+  return self;
+}
+
+/*
+ * CNumericSegmentTree.open(path, data = nil)
+ *
+ * Like CNumericSegmentTree.load, but we mmap the image file rather than reading it, and use the arrays in place. The mapping is
+ * private: pages are shared with any other process that maps the same file until one of them is written by update_at. So forked
+ * workers can all open the one prebuilt image cheaply.
+ */
+static VALUE numeric_segment_tree_open(int argc, VALUE *argv, VALUE klass) {
+  VALUE path, data;
+  rb_scan_args(argc, argv, "11", &path, &data);
+
+  VALUE self = rb_obj_alloc(klass);
+  numeric_segment_tree_data *st = unwrapped(self);
+
+  image_map(path, &st->mapping, NUMERIC_IMAGE_KIND, NUMERIC_IMAGE_VERSION);
+  restore_preamble(st, image_mapped_part(&st->mapping, sizeof(numeric_image_preamble)));
+  attach_data(st, data);
+
+  st->tree = image_mapped_part(&st->mapping, sizeof(cell) * st->tree_alloc_size);
+  if (st->operation == OP_INDEX_OF_MAX) {
+    st->index_tree = image_mapped_part(&st->mapping, sizeof(size_t) * st->tree_alloc_size);
+  }
+
+  return self;
+}
+
+/*
+ * CNumericSegmentTree#operation
+ *
+ * The operation the tree does: :sum, :max, :min or :index_of_max.
+ */
+static VALUE numeric_segment_tree_operation(VALUE self) {
+  return symbol_from_operation(unwrapped(self)->operation);
+}
+
+/*
+ * CNumericSegmentTree#dtype
+ *
+ * The type of the values the tree stores: :i64 or :f64.
+ */
+static VALUE numeric_segment_tree_dtype(VALUE self) {
+  return ID2SYM(rb_intern(unwrapped(self)->dtype == DTYPE_I64 ? "i64" : "f64"));
+}
+
+/*
+ * CNumericSegmentTree.simd
+ *
+ * The vector instructions the blocked layout uses on this machine: :avx2, :neon or, if neither, :scalar.
+ */
+static VALUE numeric_segment_tree_simd(VALUE klass) {
+  return ID2SYM(rb_intern(simd_isa()));
+}
+
+/*
+ * A Segment Tree over numeric data for a fixed set of operations, written in C.
+ *
+ * (see SegmentTreeTemplate and CSegmentTreeTemplate)
+ */
+void Init_c_numeric_segment_tree() {
+  VALUE mSegmentTree = rb_define_module_under(mDataStructuresRMolinari, "SegmentTree");
+  VALUE cNumericSegmentTree = rb_define_class_under(mSegmentTree, "CNumericSegmentTree", rb_cObject);
+
+  rb_define_alloc_func(cNumericSegmentTree, numeric_segment_tree_alloc);
+  rb_define_singleton_method(cNumericSegmentTree, "native_dtype", numeric_segment_tree_native_dtype, 2);
+  rb_define_method(cNumericSegmentTree, "initialize", numeric_segment_tree_init, 4);
+  rb_define_method(cNumericSegmentTree, "query_on", numeric_segment_tree_query_on, 2);
+  rb_define_method(cNumericSegmentTree, "query_many", numeric_segment_tree_query_many, -1);
+  rb_define_method(cNumericSegmentTree, "update_at", numeric_segment_tree_update_at, 1);
+  rb_define_method(cNumericSegmentTree, "operation", numeric_segment_tree_operation, 0);
+  rb_define_method(cNumericSegmentTree, "dtype", numeric_segment_tree_dtype, 0);
+  rb_define_method(cNumericSegmentTree, "dump", numeric_segment_tree_dump, 1);
+  rb_define_singleton_method(cNumericSegmentTree, "load", numeric_segment_tree_load, -1);
+  rb_define_singleton_method(cNumericSegmentTree, "open", numeric_segment_tree_open, -1);
+  rb_define_singleton_method(cNumericSegmentTree, "simd", numeric_segment_tree_simd, 0);
+}
@@ -0,0 +1,724 @@
+/*
+ * This is a C implementation of a persistent Segment Tree over unboxed numeric values.
+ *
+ * An update doesn't change the tree. It makes a new version, copying just the nodes on the path from the root to the updated leaf -
+ * about log2(n) of them - and sharing every other node with the version it came from. Old versions are untouched, so queries on them
+ * keep giving the answers they always did.
+ *
+ * All the versions made from one initial tree keep their nodes in a single pool: an arena that only grows. Each version is a Ruby
+ * object holding the pool and the index of its root node. The pool is freed by the garbage collector once no version refers to it,
+ * so the nodes of a version that has gone out of scope are not reclaimed while its relatives live on.
+ *
+ * The tree is top-down, and sums, maxima and minima are as in CNumericSegmentTree, with the same results for queries.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+#include "numeric.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The C implementation of a persistent Segment Tree
+ */
+
+/*
+ * A node of the tree. Nodes refer to their children by their index in the pool, which is half the size of a pointer.
+ *
+ * A leaf's children are unused: we always know the interval a node covers as we walk down the tree.
+ */
+typedef struct {
+  cell val; // the sum, max or min over the node's interval. For OP_INDEX_OF_MAX, the maximum.
+  uint32_t left;
+  uint32_t right;
+} pst_node;
+
+/*
+ * The arena of nodes shared by all the versions of a tree.
+ */
+typedef struct {
+  pst_node *nodes;
+  size_t *index_of_val; // only for OP_INDEX_OF_MAX: the index in the data array of each node's val
+  size_t node_count; // the number of nodes in use
+  size_t capacity; // the number of nodes there is room for
+  numeric_op operation;
+  numeric_dtype dtype;
+  size_t size; // the size of the underlying data array
+  int64_t max_abs_for_sum; // for i64 sums: a bound on the magnitude of values that guarantees the sums don't overflow
+} node_pool;
+
+/*
+ * One version of the tree
+ */
+typedef struct {
+  VALUE pool; // the node_pool, wrapped as a Ruby object so that the garbage collector knows when no version needs it
+  uint32_t root;
+} persistent_segment_tree_data;
+
+/*
+ * What a subtree tells us about its interval: the combined value and, for OP_INDEX_OF_MAX, the index at which it is found.
+ */
+typedef struct {
+  cell val;
+  size_t idx;
+} node_val;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+static node_pool *create_node_pool() {
+  node_pool *pool = ALLOC(node_pool);
+
+  pool->nodes = NULL;
+  pool->index_of_val = NULL;
+  pool->node_count = 0;
+  pool->capacity = 0;
+  pool->operation = OP_SUM;
+  pool->dtype = DTYPE_I64;
+  pool->size = 0;
+  pool->max_abs_for_sum = INT64_MAX;
+
+  return pool;
+}
+
+static void node_pool_free(void *ptr) {
+  if (ptr) {
+    node_pool *pool = ptr;
+    xfree(pool->nodes);
+    xfree(pool->index_of_val);
+    xfree(pool);
+  }
+}
+
+static size_t node_pool_memsize(const void *ptr) {
+  if (ptr) {
+    const node_pool *pool = ptr;
+    size_t per_node = sizeof(pst_node) + (pool->index_of_val ? sizeof(size_t) : 0);
+
+    return pool->capacity * per_node + sizeof(node_pool);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * The pool holds no Ruby objects, so there is no dmark function.
+ */
+static const rb_data_type_t node_pool_type = {
+  .wrap_struct_name = "persistent_segment_tree_pool",
+  { // help for the Ruby garbage collector
+    .dmark = NULL,
+    .dfree = node_pool_free,
+    .dsize = node_pool_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+static persistent_segment_tree_data *create_persistent_segment_tree() {
+  persistent_segment_tree_data *pst = ALLOC(persistent_segment_tree_data);
+
+  pst->pool = Qnil;
+  pst->root = 0;
+
+  return pst;
+}
+
+/*
+ * The nodes belong to the pool, so a version frees just its own struct.
+ */
+static void persistent_segment_tree_free(void *ptr) {
+  xfree(ptr);
+}
+
+/*
+ * The size of the version itself. The pool, which the versions share, reports its own size.
+ */
+static size_t persistent_segment_tree_memsize(const void *ptr) {
+  return ptr ? sizeof(persistent_segment_tree_data) : 0;
+}
+
+static void persistent_segment_tree_mark(void *ptr) {
+  persistent_segment_tree_data *pst = ptr;
+  rb_gc_mark(pst->pool);
+}
+
+static const rb_data_type_t persistent_segment_tree_type = {
+  .wrap_struct_name = "persistent_segment_tree",
+  { // help for the Ruby garbage collector
+    .dmark = persistent_segment_tree_mark,
+    .dfree = persistent_segment_tree_free,
+    .dsize = persistent_segment_tree_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+
+/************************************************************
+ * Wrapping and unwrapping the C struct and other things.
+ *
+ */
+
+static persistent_segment_tree_data *unwrapped(VALUE self) {
+  persistent_segment_tree_data *pst;
+  TypedData_Get_Struct((self), persistent_segment_tree_data, &persistent_segment_tree_type, pst);
+  return pst;
+}
+
+static node_pool *pool_of(const persistent_segment_tree_data *pst) {
+  node_pool *pool;
+  TypedData_Get_Struct((pst->pool), node_pool, &node_pool_type, pool);
+  return pool;
+}
+
+/*
+ * This is for CPersistentSegmentTree.allocate on the Ruby side.
+ */
+static VALUE persistent_segment_tree_alloc(VALUE klass) {
+  persistent_segment_tree_data *pst = create_persistent_segment_tree();
+  return TypedData_Wrap_Struct(klass, &persistent_segment_tree_type, pst);
+}
+
+/*
+ * A new version, of the same class as self, that shares self's pool.
+ */
+static VALUE new_version(VALUE self, uint32_t root) {
+  VALUE version = persistent_segment_tree_alloc(rb_obj_class(self));
+  persistent_segment_tree_data *pst = unwrapped(version);
+
+  pst->pool = unwrapped(self)->pool;
+  pst->root = root;
+
+  return version;
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * The node pool
+ */
+
+/*
+ * Make sure there is room for count more nodes, so that the nodes don't move while we are making them.
+ *
+ * The capacity doubles as it grows, and so each node costs O(1) amortized time to find room for.
+ */
+static void reserve_nodes(node_pool *pool, size_t count) {
+  size_t needed = pool->node_count + count;
+  if (needed <= pool->capacity) {
+    return;
+  }
+  if (needed > UINT32_MAX) {
+    rb_raise(eSharedDataError, "A persistent segment tree can't hold more than %u nodes", UINT32_MAX);
+  }
+
+  size_t new_capacity = pool->capacity ? 2 * pool->capacity : 16;
+  if (new_capacity < needed) {
+    new_capacity = needed;
+  }
+  if (new_capacity > UINT32_MAX) {
+    new_capacity = UINT32_MAX;
+  }
+
+  REALLOC_N(pool->nodes, pst_node, new_capacity);
+  if (pool->operation == OP_INDEX_OF_MAX) {
+    REALLOC_N(pool->index_of_val, size_t, new_capacity);
+  }
+  pool->capacity = new_capacity;
+}
+
+/*
+ * Take a node from the pool. There must be room for it: see reserve_nodes().
+ */
+static inline uint32_t new_node(node_pool *pool, node_val v, uint32_t left, uint32_t right) {
+  uint32_t node_idx = pool->node_count++;
+  pst_node *node = &pool->nodes[node_idx];
+
+  node->val = v.val;
+  node->left = left;
+  node->right = right;
+  if (pool->index_of_val) {
+    pool->index_of_val[node_idx] = v.idx;
+  }
+  return node_idx;
+}
+
+static inline node_val node_at(const node_pool *pool, uint32_t node_idx) {
+  node_val result = { .val = pool->nodes[node_idx].val, .idx = pool->index_of_val ? pool->index_of_val[node_idx] : 0 };
+  return result;
+}
+
+/*
+ * The most nodes a path from the root to a leaf can have in a tree over size values.
+ */
+static size_t path_length(size_t size) {
+  size_t length = 1;
+  for (size_t span = 1; span < size; span *= 2) {
+    length++;
+  }
+  return length;
+}
+
+/*
+ * End node pool
+ ************************************************************/
+
+/************************************************************
+ * The persistent Segment Tree on the C side.
+ */
+
+/*
+ * Combine the values from two adjacent subintervals, with a from the one on the left.
+ *
+ * For OP_INDEX_OF_MAX we prefer the left-hand index when the values are equal, as CNumericSegmentTree does.
+ */
+static inline node_val combined_val(const node_pool *pool, node_val a, node_val b) {
+  switch (pool->operation) {
+  case OP_SUM:
+    if (pool->dtype == DTYPE_I64) {
+      a.val.i += b.val.i;
+    } else {
+      a.val.f += b.val.f;
+    }
+    return a;
+  case OP_MIN:
+    return cell_less(pool->dtype, b.val, a.val) ? b : a;
+  case OP_MAX:
+  case OP_INDEX_OF_MAX:
+  default:
+    return cell_less(pool->dtype, a.val, b.val) ? b : a;
+  }
+}
+
+/*
+ * Convert a value to go into the tree at index idx, checking that an i64 sum can't overflow.
+ */
+static node_val checked_leaf_val(const node_pool *pool, VALUE value, size_t idx) {
+  node_val result = { .val = cell_from_value(pool->dtype, value), .idx = idx };
+
+  if (pool->operation == OP_SUM && pool->dtype == DTYPE_I64) {
+    // The same check as in CNumericSegmentTree, so that no node value can overflow.
+    if (result.val.i > pool->max_abs_for_sum || result.val.i < -pool->max_abs_for_sum) {
+      rb_raise(eSharedDataError, "Value at index %zu is too large in magnitude for a native sum tree", idx);
+    }
+  }
+  return result;
+}
+
+/*
+ * The same, for a value already packed into a cell.
+ */
+static node_val checked_leaf_cell(const node_pool *pool, cell c, size_t idx) {
+  node_val result = { .val = c, .idx = idx };
+
+  if (pool->operation == OP_SUM && pool->dtype == DTYPE_I64) {
+    if (c.i > pool->max_abs_for_sum || c.i < -pool->max_abs_for_sum) {
+      rb_raise(eSharedDataError, "Value at index %zu is too large in magnitude for a native sum tree", idx);
+    }
+  }
+  return result;
+}
+
+/*
+ * Build the subtree over data[tree_l..tree_r], returning its root.
+ *
+ * The recursion is only log2(n) deep.
+ */
+static uint32_t build(node_pool *pool, VALUE data, size_t tree_l, size_t tree_r) {
+  if (tree_l == tree_r) {
+    node_val v;
+    if (RB_TYPE_P(data, T_STRING)) {
+      cell c;
+      memcpy(&c, RSTRING_PTR(data) + tree_l * sizeof(cell), sizeof(cell));
+      v = checked_leaf_cell(pool, c, tree_l);
+    } else {
+      v = checked_leaf_val(pool, rb_ary_entry(data, tree_l), tree_l);
+    }
+    return new_node(pool, v, 0, 0);
+  }
+
+  size_t mid = tree_l + (tree_r - tree_l) / 2;
+  uint32_t left = build(pool, data, tree_l, mid);
+  uint32_t right = build(pool, data, mid + 1, tree_r);
+
+  return new_node(pool, combined_val(pool, node_at(pool, left), node_at(pool, right)), left, right);
+}
+
+/*
+ * The combined value on left..right in the subtree over tree_l..tree_r rooted at node_idx. The two intervals must overlap.
+ */
+static node_val determine_val(const node_pool *pool, uint32_t node_idx, size_t tree_l, size_t tree_r, size_t left, size_t right) {
+  // Does the current tree node exactly serve up the interval we're interested in?
+  if (left <= tree_l && tree_r <= right) {
+    return node_at(pool, node_idx);
+  }
+
+  const pst_node *node = &pool->nodes[node_idx];
+  size_t mid = tree_l + (tree_r - tree_l) / 2;
+
+  if (right <= mid) {
+    return determine_val(pool, node->left, tree_l, mid, left, right);
+  } else if (left > mid) {
+    return determine_val(pool, node->right, mid + 1, tree_r, left, right);
+  }
+
+  node_val left_val = determine_val(pool, node->left, tree_l, mid, left, right);
+  node_val right_val = determine_val(pool, node->right, mid + 1, tree_r, left, right);
+  return combined_val(pool, left_val, right_val);
+}
+
+/*
+ * A copy of the path from node_idx down to the leaf for idx, with the leaf's value set to v. Returns the root of the copy, which
+ * shares all the nodes off the path with the original.
+ *
+ * There must be room in the pool for the new path.
+ */
+static uint32_t updated_path(node_pool *pool, uint32_t node_idx, size_t tree_l, size_t tree_r, size_t idx, node_val v) {
+  if (tree_l == tree_r) {
+    return new_node(pool, v, 0, 0);
+  }
+
+  uint32_t left = pool->nodes[node_idx].left;
+  uint32_t right = pool->nodes[node_idx].right;
+  size_t mid = tree_l + (tree_r - tree_l) / 2;
+
+  if (idx <= mid) {
+    left = updated_path(pool, left, tree_l, mid, idx, v);
+  } else {
+    right = updated_path(pool, right, mid + 1, tree_r, idx, v);
+  }
+  return new_node(pool, combined_val(pool, node_at(pool, left), node_at(pool, right)), left, right);
+}
+
+/*
+ * The root of a new version, made from the one rooted at root by setting the value at idx.
+ */
+static uint32_t updated_root(node_pool *pool, uint32_t root, size_t idx, node_val v) {
+  if (idx >= pool->size) {
+    rb_raise(eSharedDataError, "Cannot update value at index %lu, size = %lu", idx, pool->size);
+  }
+  reserve_nodes(pool, path_length(pool->size));
+  return updated_path(pool, root, 0, pool->size - 1, idx, v);
+}
+
+/*
+ * Check the interval, returning false if it is empty.
+ */
+static int checked_interval(const node_pool *pool, size_t left, size_t right) {
+  if (right >= pool->size) {
+    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", left, right, pool->size);
+  }
+  return left <= right;
+}
+
+/*
+ * The value we return for an empty interval, as CNumericSegmentTree does.
+ */
+static VALUE identity(const node_pool *pool) {
+  switch (pool->operation) {
+  case OP_SUM:
+    return INT2FIX(0);
+  case OP_MAX:
+    return DBL2NUM(-HUGE_VAL);
+  case OP_MIN:
+    return DBL2NUM(HUGE_VAL);
+  case OP_INDEX_OF_MAX:
+  default:
+    return Qnil;
+  }
+}
+
+/*
+ * Box up the result of a query in the same shape as CNumericSegmentTree gives: for OP_INDEX_OF_MAX the pair [index, value].
+ */
+static VALUE boxed_result(const node_pool *pool, node_val v) {
+  VALUE val = value_from_cell(pool->dtype, v.val);
+
+  if (pool->operation == OP_INDEX_OF_MAX) {
+    return rb_assoc_new(SIZET2NUM(v.idx), val);
+  }
+  return val;
+}
+
+/*
+ * The raw bytes of a packed result for an empty interval. See CNumericSegmentTree#query_many.
+ */
+static cell packed_identity(const node_pool *pool) {
+  cell c;
+  int is_i64 = pool->dtype == DTYPE_I64;
+
+  switch (pool->operation) {
+  case OP_SUM:
+    if (is_i64) { c.i = 0; } else { c.f = 0.0; }
+    break;
+  case OP_MAX:
+    if (is_i64) { c.i = INT64_MIN; } else { c.f = -HUGE_VAL; }
+    break;
+  case OP_MIN:
+    if (is_i64) { c.i = INT64_MAX; } else { c.f = HUGE_VAL; }
+    break;
+  case OP_INDEX_OF_MAX:
+  default:
+    c.i = -1;
+  }
+  return c;
+}
+
+/*
+ * The number of values in data, which must be an Array or else a String of packed 8-byte values.
+ */
+static size_t data_size(VALUE data) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    long len = RSTRING_LEN(data);
+    if (len % sizeof(cell) != 0) {
+      rb_raise(rb_eArgError, "packed data must be a whole number of 8-byte values (got %ld bytes)", len);
+    }
+    return len / sizeof(cell);
+  }
+
+  Check_Type(data, T_ARRAY);
+  return RARRAY_LEN(data);
+}
+
+/*
+ * End C implementation of the persistent Segment Tree
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * CPersistentSegmentTree#initialize(operation, data, dtype)
+ *
+ * Build version 0 of the tree.
+ *
+ * - operation: one of :sum, :max, :min, :index_of_max
+ * - data: an Array of numeric values, or a String of packed int64 or double values, as for CNumericSegmentTree#initialize. We copy
+ *   the values and don't look at data again.
+ * - dtype: :i64 or :f64. For an Array it must be what CNumericSegmentTree.native_dtype(data, operation) returns. For a String it
+ *   says how to read the bytes.
+ */
+static VALUE persistent_segment_tree_init(VALUE self, VALUE operation, VALUE data, VALUE dtype) {
+  persistent_segment_tree_data *pst = unwrapped(self);
+  node_pool *pool = create_node_pool();
+
+  pst->pool = TypedData_Wrap_Struct(0, &node_pool_type, pool); // a hidden object: nothing on the Ruby side can see it
+
+  pool->operation = operation_from_symbol(operation);
+  pool->dtype = dtype_from_symbol(dtype);
+  pool->size = data_size(data);
+
+  if (pool->size == 0) {
+    rb_raise(rb_eArgError, "size must be positive.");
+  }
+
+  pool->max_abs_for_sum = INT64_MAX / (int64_t)pool->size;
+
+  // A tree over n values has 2n - 1 nodes. Leave room for a few updates before the pool has to grow.
+  reserve_nodes(pool, 2 * pool->size - 1 + 4 * path_length(pool->size));
+  pst->root = build(pool, data, 0, pool->size - 1);
+
+  return self;
+}
+
+/*
+ * (see SegmentTreeTemplate#query_on)
+ */
+static VALUE persistent_segment_tree_query_on(VALUE self, VALUE left, VALUE right) {
+  persistent_segment_tree_data *pst = unwrapped(self);
+  const node_pool *pool = pool_of(pst);
+  size_t c_left = checked_nonneg_fixnum(left);
+  size_t c_right = checked_nonneg_fixnum(right);
+
+  if (!checked_interval(pool, c_left, c_right)) {
+    return identity(pool);
+  }
+  return boxed_result(pool, determine_val(pool, pst->root, 0, pool->size - 1, c_left, c_right));
+}
+
+/*
+ * (see CNumericSegmentTree#query_many)
+ */
+static VALUE persistent_segment_tree_query_many(int argc, VALUE *argv, VALUE self) {
+  persistent_segment_tree_data *pst = unwrapped(self);
+  const node_pool *pool = pool_of(pst);
+  index_pairs pairs;
+  read_index_pairs(argc, argv, &pairs);
+
+  size_t left, right;
+
+  if (!pairs.packed) {
+    VALUE results = rb_ary_new_capa(pairs.count);
+    for (long i = 0; i < pairs.count; i++) {
+      index_pair_at(&pairs, i, &left, &right);
+      VALUE result = checked_interval(pool, left, right)
+        ? boxed_result(pool, determine_val(pool, pst->root, 0, pool->size - 1, left, right))
+        : identity(pool);
+      rb_ary_push(results, result);
+    }
+    return results;
+  }
+
+  VALUE packed_results = rb_str_new(NULL, pairs.count * sizeof(cell));
+  char *out = RSTRING_PTR(packed_results);
+  cell empty_val = packed_identity(pool);
+
+  for (long i = 0; i < pairs.count; i++) {
+    index_pair_at(&pairs, i, &left, &right);
+
+    cell c;
+    if (!checked_interval(pool, left, right)) {
+      c = empty_val;
+    } else {
+      node_val result = determine_val(pool, pst->root, 0, pool->size - 1, left, right);
+      if (pool->operation == OP_INDEX_OF_MAX) {
+        c.i = result.idx;
+      } else {
+        c = result.val;
+      }
+    }
+    memcpy(out + i * sizeof(cell), &c, sizeof(cell));
+  }
+  return packed_results;
+}
+
+/*
+ * CPersistentSegmentTree#value_at(idx)
+ *
+ * The value at index idx in this version.
+ */
+static VALUE persistent_segment_tree_value_at(VALUE self, VALUE idx) {
+  persistent_segment_tree_data *pst = unwrapped(self);
+  const node_pool *pool = pool_of(pst);
+  size_t c_idx = checked_nonneg_fixnum(idx);
+
+  checked_interval(pool, c_idx, c_idx);
+  return value_from_cell(pool->dtype, determine_val(pool, pst->root, 0, pool->size - 1, c_idx, c_idx).val);
+}
+
+/*
+ * CPersistentSegmentTree#update_at(idx, value)
+ *
+ * A new version of the tree, the same as this one except that the value at idx is value. This version is unchanged.
+ *
+ * The value must be of the tree's dtype: an Integer for :i64 and a Float for :f64. Takes O(log n) time and adds O(log n) nodes to the
+ * pool.
+ */
+static VALUE persistent_segment_tree_update_at(VALUE self, VALUE idx, VALUE value) {
+  persistent_segment_tree_data *pst = unwrapped(self);
+  node_pool *pool = pool_of(pst);
+  size_t c_idx = checked_nonneg_fixnum(idx);
+
+  uint32_t root = updated_root(pool, pst->root, c_idx, checked_leaf_val(pool, value, c_idx));
+  return new_version(self, root);
+}
+
+/*
+ * CPersistentSegmentTree#update_many(indices, values)
+ *
+ * The version we get by applying update_at(indices[i], values[i]) for each i in turn. None of the intermediate versions is made as a
+ * Ruby object, though their nodes are still added to the pool.
+ *
+ * - indices: an Array of Integers or a String of packed int64 values.
+ * - values: an Array of values of the tree's dtype, or a String of packed values of that dtype. There must be as many as there are
+ *   indices.
+ */
+static VALUE persistent_segment_tree_update_many(VALUE self, VALUE indices, VALUE values) {
+  persistent_segment_tree_data *pst = unwrapped(self);
+  node_pool *pool = pool_of(pst);
+  index_list list;
+  read_index_list(indices, &list);
+
+  size_t value_count = data_size(values);
+  if (value_count != (size_t)list.count) {
+    rb_raise(rb_eArgError, "update_many needs as many values as indices (got %zu and %ld)", value_count, list.count);
+  }
+
+  uint32_t root = pst->root;
+  for (long i = 0; i < list.count; i++) {
+    size_t idx = index_list_at(&list, i);
+    node_val v;
+
+    if (RB_TYPE_P(values, T_STRING)) {
+      cell c;
+      memcpy(&c, RSTRING_PTR(values) + i * sizeof(cell), sizeof(cell));
+      v = checked_leaf_cell(pool, c, idx);
+    } else {
+      v = checked_leaf_val(pool, rb_ary_entry(values, i), idx);
+    }
+    root = updated_root(pool, root, idx, v);
+  }
+  return new_version(self, root);
+}
+
+/*
+ * CPersistentSegmentTree#size
+ *
+ * The number of values in the underlying data array.
+ */
+static VALUE persistent_segment_tree_size(VALUE self) {
+  return SIZET2NUM(pool_of(unwrapped(self))->size);
+}
+
+/*
+ * CPersistentSegmentTree#node_count
+ *
+ * The number of nodes in the pool shared by this version and all the others made from the same initial tree.
+ */
+static VALUE persistent_segment_tree_node_count(VALUE self) {
+  return SIZET2NUM(pool_of(unwrapped(self))->node_count);
+}
+
+/*
+ * CPersistentSegmentTree#operation
+ *
+ * The operation the tree does: :sum, :max, :min or :index_of_max.
+ */
+static VALUE persistent_segment_tree_operation(VALUE self) {
+  switch (pool_of(unwrapped(self))->operation) {
+  case OP_SUM:
+    return ID2SYM(rb_intern("sum"));
+  case OP_MIN:
+    return ID2SYM(rb_intern("min"));
+  case OP_INDEX_OF_MAX:
+    return ID2SYM(rb_intern("index_of_max"));
+  case OP_MAX:
+  default:
+    return ID2SYM(rb_intern("max"));
+  }
+}
+
+/*
+ * A persistent Segment Tree over numeric data. Updates make new versions and leave the old ones as they were.
+ *
+ * (see SegmentTree.construct_persistent)
+ */
+void Init_c_persistent_segment_tree() {
+  VALUE mSegmentTree = rb_define_module_under(mDataStructuresRMolinari, "SegmentTree");
+  VALUE cPersistentSegmentTree = rb_define_class_under(mSegmentTree, "CPersistentSegmentTree", rb_cObject);
+
+  rb_define_alloc_func(cPersistentSegmentTree, persistent_segment_tree_alloc);
+  rb_define_method(cPersistentSegmentTree, "initialize", persistent_segment_tree_init, 3);
+  rb_define_method(cPersistentSegmentTree, "query_on", persistent_segment_tree_query_on, 2);
+  rb_define_method(cPersistentSegmentTree, "query_many", persistent_segment_tree_query_many, -1);
+  rb_define_method(cPersistentSegmentTree, "value_at", persistent_segment_tree_value_at, 1);
+  rb_define_method(cPersistentSegmentTree, "update_at", persistent_segment_tree_update_at, 2);
+  rb_define_method(cPersistentSegmentTree, "update_many", persistent_segment_tree_update_many, 2);
+  rb_define_method(cPersistentSegmentTree, "size", persistent_segment_tree_size, 0);
+  rb_define_method(cPersistentSegmentTree, "node_count", persistent_segment_tree_node_count, 0);
+  rb_define_method(cPersistentSegmentTree, "operation", persistent_segment_tree_operation, 0);
+}
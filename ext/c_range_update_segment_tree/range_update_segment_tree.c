@@ -0,0 +1,534 @@
+/*
+ * This is a C implementation of a Segment Tree with range updates via lazy propagation, storing unboxed numeric values.
+ *
+ * It is the C version of the RangeUpdateSegmentTree Ruby class, for which see elsewhere in the repo.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+#include "numeric.h"
+
+#include <math.h>
+#include <stdint.h>
+
+/**
+ * The C implementation of a numeric Segment Tree with range updates.
+ *
+ * For each node of the tree we have
+ * - its value: the sum (or max or min) over the node's interval, with all the changes in pending_add and pending_assign applied
+ * - pending_add: a value still to be added to each cell in the node's interval in the node's descendants
+ * - pending_assign: if has_assign is set, a value to which each cell in the node's interval is still to be set in the node's
+ *   descendants. It is applied before pending_add.
+ */
+typedef struct {
+  // The node arrays, indexed as a 1-based implicit binary tree with children 2i and 2i + 1. Lazy propagation pushes changes down
+  // from the root, so we keep this recursive layout rather than the bottom-up 2n layout of CNumericSegmentTree.
+  cell *tree;
+  cell *pending_add;
+  cell *pending_assign;
+  unsigned char *has_assign;
+  numeric_op operation;
+  numeric_dtype dtype;
+  size_t size; // the size of the underlying data array
+  size_t tree_alloc_size; // the number of nodes in the tree arrays
+  uint64_t magnitude_bound; // for i64 values: a bound on their magnitudes, which we keep <= INT64_MAX. See check_change().
+} range_update_segment_tree_data;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap).
+ */
+static range_update_segment_tree_data *create_range_update_segment_tree() {
+  range_update_segment_tree_data *segment_tree = ALLOC(range_update_segment_tree_data);
+
+  segment_tree->tree = NULL; // we don't yet know how much space we need
+  segment_tree->pending_add = NULL;
+  segment_tree->pending_assign = NULL;
+  segment_tree->has_assign = NULL;
+  segment_tree->operation = OP_SUM;
+  segment_tree->dtype = DTYPE_I64;
+  segment_tree->size = 0;
+  segment_tree->tree_alloc_size = 0;
+  segment_tree->magnitude_bound = 0;
+
+  return segment_tree;
+}
+
+static void range_update_segment_tree_free(void *ptr) {
+  if (ptr) {
+    range_update_segment_tree_data *segment_tree = ptr;
+    size_t n = segment_tree->tree_alloc_size;
+    native_array_free(segment_tree->tree, n, sizeof(cell));
+    native_array_free(segment_tree->pending_add, n, sizeof(cell));
+    native_array_free(segment_tree->pending_assign, n, sizeof(cell));
+    native_array_free(segment_tree->has_assign, n, sizeof(unsigned char));
+    xfree(segment_tree);
+  }
+}
+
+static size_t range_update_segment_tree_memsize(const void *ptr) {
+  if (ptr) {
+    const range_update_segment_tree_data *st = ptr;
+    size_t n = st->tree_alloc_size;
+    return 3 * native_array_memsize(n, sizeof(cell)) + native_array_memsize(n, sizeof(unsigned char))
+      + sizeof(range_update_segment_tree_data);
+  } else {
+    return 0;
+  }
+}
+
+// There is no need for a mark() function as we don't hold any Ruby objects ourselves.
+
+static const rb_data_type_t range_update_segment_tree_type = {
+  .wrap_struct_name = "range_update_segment_tree",
+  { // help for the Ruby garbage collector
+    .dmark = NULL,
+    .dfree = range_update_segment_tree_free,
+    .dsize = range_update_segment_tree_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+/************************************************************
+ * Wrapping and unwrapping the C struct and other things.
+ *
+ */
+
+static range_update_segment_tree_data *unwrapped(VALUE self) {
+  range_update_segment_tree_data *segment_tree;
+  TypedData_Get_Struct((self), range_update_segment_tree_data, &range_update_segment_tree_type, segment_tree);
+  return segment_tree;
+}
+
+/*
+ * This is for CRangeUpdateSegmentTree.allocate on the Ruby side.
+ */
+static VALUE range_update_segment_tree_alloc(VALUE klass) {
+  range_update_segment_tree_data *segment_tree = create_range_update_segment_tree();
+  return TypedData_Wrap_Struct(klass, &range_update_segment_tree_type, segment_tree);
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * Arithmetic on cells
+ *
+ * Integer arithmetic wraps around, modulo 2^64, rather than being checked for overflow. A pending add or a product delta * len may
+ * wrap, but every node value we get is then right modulo 2^64. Before each change, check_change() makes sure that the node values
+ * will all fit into an int64, so they are exactly right.
+ */
+
+static inline cell cell_plus(const range_update_segment_tree_data *st, cell a, cell b) {
+  if (st->dtype == DTYPE_I64) {
+    a.i = (int64_t)((uint64_t)a.i + (uint64_t)b.i);
+  } else {
+    a.f += b.f;
+  }
+  return a;
+}
+
+/* v * len */
+static inline cell cell_times(const range_update_segment_tree_data *st, cell v, size_t len) {
+  if (st->dtype == DTYPE_I64) {
+    v.i = (int64_t)((uint64_t)v.i * len);
+  } else {
+    v.f *= len;
+  }
+  return v;
+}
+
+/*
+ * The magnitude of an int64 value. It is 2^63 for INT64_MIN, which is too large for any magnitude_bound.
+ */
+static inline uint64_t magnitude(int64_t v) {
+  return v < 0 ? -(uint64_t)v : (uint64_t)v;
+}
+
+static inline int cell_is_zero(const range_update_segment_tree_data *st, cell c) {
+  return st->dtype == DTYPE_I64 ? c.i == 0 : c.f == 0.0;
+}
+
+static inline cell combined_val(const range_update_segment_tree_data *st, cell a, cell b) {
+  switch (st->operation) {
+  case OP_SUM:
+    return cell_plus(st, a, b);
+  case OP_MIN:
+    return cell_less(st->dtype, b, a) ? b : a;
+  case OP_MAX:
+  default:
+    return cell_less(st->dtype, a, b) ? b : a;
+  }
+}
+
+/*
+ * End arithmetic
+ ************************************************************/
+
+/************************************************************
+ * The Segment Tree API on the C side.
+ *
+ * The logic is the same as in range_update_segment_tree.rb.
+ */
+
+/*
+ * Set every value in the interval of node, which has length len, to v
+ */
+static void apply_assign(range_update_segment_tree_data *st, size_t node, size_t len, cell v) {
+  st->tree[node] = st->operation == OP_SUM ? cell_times(st, v, len) : v;
+  st->pending_assign[node] = v;
+  st->has_assign[node] = 1;
+  st->pending_add[node].i = 0; // all-zero bits are also 0.0
+}
+
+/*
+ * Add delta to every value in the interval of node, which has length len
+ */
+static void apply_add(range_update_segment_tree_data *st, size_t node, size_t len, cell delta) {
+  st->tree[node] = cell_plus(st, st->tree[node], st->operation == OP_SUM ? cell_times(st, delta, len) : delta);
+  if (st->has_assign[node]) {
+    st->pending_assign[node] = cell_plus(st, st->pending_assign[node], delta);
+  } else {
+    st->pending_add[node] = cell_plus(st, st->pending_add[node], delta);
+  }
+}
+
+/*
+ * Pass the pending changes at node down to its children
+ */
+static void push_down(range_update_segment_tree_data *st, size_t node, size_t tree_l, size_t tree_r) {
+  size_t mid = midpoint(tree_l, tree_r);
+  size_t left_len = mid - tree_l + 1;
+  size_t right_len = tree_r - mid;
+
+  if (st->has_assign[node]) {
+    apply_assign(st, left_child(node), left_len, st->pending_assign[node]);
+    apply_assign(st, right_child(node), right_len, st->pending_assign[node]);
+    st->has_assign[node] = 0;
+  }
+
+  if (!cell_is_zero(st, st->pending_add[node])) {
+    apply_add(st, left_child(node), left_len, st->pending_add[node]);
+    apply_add(st, right_child(node), right_len, st->pending_add[node]);
+    st->pending_add[node].i = 0;
+  }
+}
+
+/*
+ * Fold the magnitude of a value into a magnitude bound: for :sum the bound is on the sum of the magnitudes, and otherwise on the
+ * largest of them. Returns false if the result would exceed INT64_MAX.
+ */
+static int add_magnitude(const range_update_segment_tree_data *st, uint64_t *bound, uint64_t mag) {
+  if (mag > INT64_MAX) {
+    return 0;
+  }
+  if (st->operation != OP_SUM) {
+    *bound = mag > *bound ? mag : *bound;
+    return 1;
+  }
+  if (mag > INT64_MAX - *bound) {
+    return 0;
+  }
+  *bound += mag;
+  return 1;
+}
+
+/*
+ * Build the subtree at node, checking that the int64 values fit the magnitude bound.
+ */
+static void build(range_update_segment_tree_data *st, VALUE data, size_t node, size_t tree_l, size_t tree_r) {
+  if (tree_l == tree_r) {
+    st->tree[node] = cell_from_value(st->dtype, rb_ary_entry(data, tree_l));
+    if (st->dtype == DTYPE_I64 && !add_magnitude(st, &st->magnitude_bound, magnitude(st->tree[node].i))) {
+      rb_raise(eSharedDataError, "The magnitudes of the int64 values sum to more than 2^63 - 1, and sums could overflow");
+    }
+  } else {
+    size_t mid = midpoint(tree_l, tree_r);
+    build(st, data, left_child(node), tree_l, mid);
+    build(st, data, right_child(node), mid + 1, tree_r);
+    st->tree[node] = combined_val(st, st->tree[left_child(node)], st->tree[right_child(node)]);
+  }
+}
+
+static cell determine_val(range_update_segment_tree_data *st, size_t node, size_t tree_l, size_t tree_r, size_t left, size_t right) {
+  if (left <= tree_l && tree_r <= right) {
+    return st->tree[node];
+  }
+
+  push_down(st, node, tree_l, tree_r);
+
+  size_t mid = midpoint(tree_l, tree_r);
+  if (right <= mid) {
+    return determine_val(st, left_child(node), tree_l, mid, left, right);
+  } else if (left > mid) {
+    return determine_val(st, right_child(node), mid + 1, tree_r, left, right);
+  } else {
+    return combined_val(
+                        st,
+                        determine_val(st, left_child(node), tree_l, mid, left, right),
+                        determine_val(st, right_child(node), mid + 1, tree_r, left, right)
+                        );
+  }
+}
+
+typedef enum { CHANGE_ADD, CHANGE_ASSIGN } change_kind;
+
+/*
+ * The magnitude bound the values would have after the change, found by visiting every leaf. We push all the pending changes down on
+ * the way, which leaves the values as they are. Returns false if a value or the bound would overflow.
+ */
+static int exact_bound_after(range_update_segment_tree_data *st, size_t node, size_t tree_l, size_t tree_r, size_t left,
+                             size_t right, change_kind kind, cell v, uint64_t *bound) {
+  if (tree_l == tree_r) {
+    int64_t val = st->tree[node].i;
+    if (left <= tree_l && tree_l <= right) {
+      if (kind == CHANGE_ASSIGN) {
+        val = v.i;
+      } else if (__builtin_add_overflow(val, v.i, &val)) {
+        return 0;
+      }
+    }
+    return add_magnitude(st, bound, magnitude(val));
+  }
+
+  push_down(st, node, tree_l, tree_r);
+
+  size_t mid = midpoint(tree_l, tree_r);
+  return exact_bound_after(st, left_child(node), tree_l, mid, left, right, kind, v, bound)
+    && exact_bound_after(st, right_child(node), mid + 1, tree_r, left, right, kind, v, bound);
+}
+
+/*
+ * Check that the change of the given kind to the cells in left..right can be made without an int64 overflow, raising RangeError if
+ * not. Nothing in the tree changes value, so a failed update leaves the tree as it was.
+ *
+ * magnitude_bound is always at least the sum (for :sum) or the maximum (otherwise) of the magnitudes of the values. While it is at
+ * most INT64_MAX every node value fits into an int64. We grow the bound cheaply, by what the change could add to it, and only when
+ * that would pass INT64_MAX do we work out the exact bound after the change, in O(n) time.
+ */
+static void check_change(range_update_segment_tree_data *st, size_t left, size_t right, change_kind kind, cell v) {
+  if (st->dtype != DTYPE_I64) {
+    return;
+  }
+
+  uint64_t bound = st->magnitude_bound;
+  uint64_t weight = magnitude(v.i);
+  if (st->operation == OP_SUM && __builtin_mul_overflow(weight, (uint64_t)(right - left + 1), &weight)) {
+    weight = UINT64_MAX;
+  }
+  if (kind == CHANGE_ADD && st->operation != OP_SUM) {
+    // Each value grows by at most |v|
+    weight = weight > INT64_MAX - bound ? UINT64_MAX : bound + weight;
+    bound = 0;
+  }
+  if (add_magnitude(st, &bound, weight)) {
+    st->magnitude_bound = bound;
+    return;
+  }
+
+  bound = 0;
+  if (!exact_bound_after(st, TREE_ROOT, 0, st->size - 1, left, right, kind, v, &bound)) {
+    rb_raise(rb_eRangeError, "Integer overflow in CRangeUpdateSegmentTree. The tree is unchanged.");
+  }
+  st->magnitude_bound = bound;
+}
+
+/*
+ * Apply a change of the given kind to the cells in left..right.
+ */
+static void change_range(range_update_segment_tree_data *st, size_t node, size_t tree_l, size_t tree_r, size_t left, size_t right,
+                         change_kind kind, cell v) {
+  if (right < tree_l || tree_r < left) {
+    return;
+  }
+
+  if (left <= tree_l && tree_r <= right) {
+    if (kind == CHANGE_ADD) {
+      apply_add(st, node, tree_r - tree_l + 1, v);
+    } else {
+      apply_assign(st, node, tree_r - tree_l + 1, v);
+    }
+    return;
+  }
+
+  push_down(st, node, tree_l, tree_r);
+
+  size_t mid = midpoint(tree_l, tree_r);
+  change_range(st, left_child(node), tree_l, mid, left, right, kind, v);
+  change_range(st, right_child(node), mid + 1, tree_r, left, right, kind, v);
+  st->tree[node] = combined_val(st, st->tree[left_child(node)], st->tree[right_child(node)]);
+}
+
+/*
+ * The value we return for an empty interval: the same as in RangeUpdateSegmentTree.
+ */
+static VALUE identity(const range_update_segment_tree_data *st) {
+  switch (st->operation) {
+  case OP_SUM:
+    return INT2FIX(0);
+  case OP_MAX:
+    return DBL2NUM(-HUGE_VAL);
+  case OP_MIN:
+  default:
+    return DBL2NUM(HUGE_VAL);
+  }
+}
+
+/*
+ * Check the interval given by Ruby code, returning true if it is non-empty.
+ */
+static int checked_interval(const range_update_segment_tree_data *st, VALUE left, VALUE right, size_t *c_left, size_t *c_right) {
+  *c_left = checked_nonneg_fixnum(left);
+  *c_right = checked_nonneg_fixnum(right);
+
+  if (*c_right >= st->size) {
+    rb_raise(eSharedDataError, "Bad interval %lu..%lu (size = %lu)", *c_left, *c_right, st->size);
+  }
+  return *c_left <= *c_right;
+}
+
+/*
+ * End C implementation of the Segment Tree API
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * CRangeUpdateSegmentTree.native_dtype(data, operation)
+ *
+ * The dtype to use for data, :i64 or :f64, or nil if the values in data can't be stored natively. For :sum over Integers we also
+ * need the magnitudes of the values to sum to at most INT64_MAX, so that no sum can overflow.
+ */
+static VALUE range_update_segment_tree_native_dtype(VALUE klass, VALUE data, VALUE operation) {
+  VALUE dtype = native_dtype_of(data, NULL);
+
+  if (operation_from_symbol(operation) == OP_SUM && dtype == ID2SYM(rb_intern("i64"))) {
+    uint64_t abs_sum = 0;
+    for (long i = 0; i < RARRAY_LEN(data); i++) {
+      uint64_t mag = magnitude(NUM2LL(RARRAY_AREF(data, i)));
+      if (mag > INT64_MAX - abs_sum) {
+        return Qnil;
+      }
+      abs_sum += mag;
+    }
+  }
+  return dtype;
+}
+
+/*
+ * CRangeUpdateSegmentTree#initialize(operation, data, dtype)
+ *
+ * - operation: one of :sum, :max, :min
+ * - data: an Array of numeric values. We copy them.
+ * - dtype: :i64 or :f64, as returned by CRangeUpdateSegmentTree.native_dtype(data, operation)
+ */
+static VALUE range_update_segment_tree_init(VALUE self, VALUE operation, VALUE data, VALUE dtype) {
+  range_update_segment_tree_data *st = unwrapped(self);
+
+  Check_Type(data, T_ARRAY);
+
+  st->operation = operation_from_symbol(operation);
+  if (st->operation == OP_INDEX_OF_MAX) {
+    rb_raise(rb_eArgError, "Range updates are not supported for %" PRIsVALUE, operation);
+  }
+  st->dtype = dtype_from_symbol(dtype);
+  st->size = RARRAY_LEN(data);
+
+  if (st->size == 0) {
+    rb_raise(rb_eArgError, "size must be positive.");
+  }
+
+  // Implicit binary tree with n leaves and straightforward left() and right() may use indices up to 4n.
+  size_t tree_size = 1 + 4 * st->size;
+  st->tree_alloc_size = tree_size; // first, so that range_update_segment_tree_free() knows how the arrays were allocated
+  st->tree = native_array_alloc(tree_size, sizeof(cell));
+  st->pending_add = native_array_alloc(tree_size, sizeof(cell));
+  st->pending_assign = native_array_alloc(tree_size, sizeof(cell));
+  st->has_assign = native_array_alloc(tree_size, sizeof(unsigned char));
+
+  build(st, data, TREE_ROOT, 0, st->size - 1);
+
+  return self;
+}
+
+/*
+ * (see RangeUpdateSegmentTree#query_on)
+ */
+static VALUE range_update_segment_tree_query_on(VALUE self, VALUE left, VALUE right) {
+  range_update_segment_tree_data *st = unwrapped(self);
+  size_t c_left, c_right;
+
+  if (!checked_interval(st, left, right, &c_left, &c_right)) {
+    return identity(st);
+  }
+  return value_from_cell(st->dtype, determine_val(st, TREE_ROOT, 0, st->size - 1, c_left, c_right));
+}
+
+/*
+ * (see RangeUpdateSegmentTree#value_at)
+ */
+static VALUE range_update_segment_tree_value_at(VALUE self, VALUE idx) {
+  return range_update_segment_tree_query_on(self, idx, idx);
+}
+
+/*
+ * (see RangeUpdateSegmentTree#update_range)
+ */
+static VALUE range_update_segment_tree_update_range(VALUE self, VALUE left, VALUE right, VALUE delta) {
+  range_update_segment_tree_data *st = unwrapped(self);
+  size_t c_left, c_right;
+  cell c_delta = cell_from_value(st->dtype, delta);
+
+  if (checked_interval(st, left, right, &c_left, &c_right)) {
+    check_change(st, c_left, c_right, CHANGE_ADD, c_delta);
+    change_range(st, TREE_ROOT, 0, st->size - 1, c_left, c_right, CHANGE_ADD, c_delta);
+  }
+  return Qnil;
+}
+
+/*
+ * (see RangeUpdateSegmentTree#assign_range)
+ */
+static VALUE range_update_segment_tree_assign_range(VALUE self, VALUE left, VALUE right, VALUE value) {
+  range_update_segment_tree_data *st = unwrapped(self);
+  size_t c_left, c_right;
+  cell c_value = cell_from_value(st->dtype, value);
+
+  if (checked_interval(st, left, right, &c_left, &c_right)) {
+    check_change(st, c_left, c_right, CHANGE_ASSIGN, c_value);
+    change_range(st, TREE_ROOT, 0, st->size - 1, c_left, c_right, CHANGE_ASSIGN, c_value);
+  }
+  return Qnil;
+}
+
+/*
+ * A Segment Tree with range updates over numeric data, written in C.
+ *
+ * (see RangeUpdateSegmentTree)
+ */
+void Init_c_range_update_segment_tree() {
+  VALUE mSegmentTree = rb_define_module_under(mDataStructuresRMolinari, "SegmentTree");
+  VALUE cRangeUpdateSegmentTree = rb_define_class_under(mSegmentTree, "CRangeUpdateSegmentTree", rb_cObject);
+
+  rb_define_alloc_func(cRangeUpdateSegmentTree, range_update_segment_tree_alloc);
+  rb_define_singleton_method(cRangeUpdateSegmentTree, "native_dtype", range_update_segment_tree_native_dtype, 2);
+  rb_define_method(cRangeUpdateSegmentTree, "initialize", range_update_segment_tree_init, 3);
+  rb_define_method(cRangeUpdateSegmentTree, "query_on", range_update_segment_tree_query_on, 2);
+  rb_define_method(cRangeUpdateSegmentTree, "value_at", range_update_segment_tree_value_at, 1);
+  rb_define_method(cRangeUpdateSegmentTree, "update_range", range_update_segment_tree_update_range, 3);
+  rb_define_method(cRangeUpdateSegmentTree, "assign_range", range_update_segment_tree_assign_range, 3);
+}
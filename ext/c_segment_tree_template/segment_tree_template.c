@@ -7,6 +7,8 @@
 #include "ruby.h"
 #include "shared.h"
 
+#include <string.h>
+
 #define single_cell_val_at(seg_tree, idx) rb_funcall(seg_tree->single_cell_array_val_lambda, rb_intern("call"), 1, LONG2FIX(idx))
 #define combined_val(seg_tree, v1, v2) rb_funcall(seg_tree->combine_lambda, rb_intern("call"), 2, (v1), (v2))
 
@@ -14,13 +16,31 @@
  * The C implementation of a generic Segment Tree
  */
 
+#ifdef DSRM_STATS
+/*
+ * The hot-path counters reported by #stats. See shared.h. The funcalls are calls to the combine and single_cell_array_val lambdas.
+ */
 typedef struct {
-  VALUE *tree; // The 1-based implicit binary tree in which the data structure lives
+  uint64_t queries;
+  uint64_t query_node_visits; // nodes whose values went into a query result
+  uint64_t query_funcalls;
+  uint64_t updates;
+  uint64_t update_node_visits; // nodes recalculated by an update, from the leaf to the root
+  uint64_t update_funcalls;
+} segment_tree_stats;
+#endif
+
+typedef struct {
+  VALUE *tree; // The implicit binary tree in which the data structure lives, in the bottom-up layout. See build().
   VALUE single_cell_array_val_lambda;
   VALUE combine_lambda;
   VALUE identity;
   size_t size; // the size of the underlying data array
   size_t tree_alloc_size; // the size of the VALUE* tree array
+  int holds_heap_objects; // has any node ever held a VALUE that isn't a special constant? See segment_tree_mark().
+#ifdef DSRM_STATS
+  segment_tree_stats stats;
+#endif
 } segment_tree_data;
 
 /************************************************************
@@ -32,7 +52,7 @@ typedef struct {
  * Create one (on the heap).
  */
 static segment_tree_data *create_segment_tree() {
-  segment_tree_data *segment_tree = malloc(sizeof(segment_tree_data));
+  segment_tree_data *segment_tree = ALLOC(segment_tree_data);
 
   // Allocate the structures
   segment_tree->tree = NULL; // we don't yet know how much space we need
@@ -40,6 +60,11 @@ static segment_tree_data *create_segment_tree() {
   segment_tree->single_cell_array_val_lambda = 0;
   segment_tree->combine_lambda = 0;
   segment_tree->size = 0; // we don't know the right value yet
+  segment_tree->tree_alloc_size = 0;
+  segment_tree->holds_heap_objects = 0;
+#ifdef DSRM_STATS
+  memset(&segment_tree->stats, 0, sizeof(segment_tree_stats));
+#endif
 
   return segment_tree;
 }
@@ -52,7 +77,7 @@ static segment_tree_data *create_segment_tree() {
 static void segment_tree_free(void *ptr) {
   if (ptr) {
     segment_tree_data *segment_tree = ptr;
-    xfree(segment_tree->tree);
+    native_array_free(segment_tree->tree, segment_tree->tree_alloc_size, sizeof(VALUE));
     xfree(segment_tree);
   }
 }
@@ -67,7 +92,7 @@ static size_t segment_tree_memsize(const void *ptr) {
     const segment_tree_data *st = ptr;
 
     // for the tree array plus the size of the segment_tree_data struct itself.
-    return sizeof( VALUE ) * st->tree_alloc_size * 4 + sizeof(segment_tree_data);
+    return native_array_memsize(st->tree_alloc_size, sizeof(VALUE)) + sizeof(segment_tree_data);
   } else {
     return 0;
   }
@@ -75,6 +100,9 @@ static size_t segment_tree_memsize(const void *ptr) {
 
 /*
  * Mark the Ruby objects we hold so that the Ruby garbage collector knows that they are still in use.
+ *
+ * Fixnums, flonums, nil and so on aren't objects on the heap and needn't be marked. If no node has ever held anything else - as for a
+ * tree over Integer data, say - we skip the walk over the tree, and marking takes O(1) time rather than O(n).
  */
 static void segment_tree_mark(void *ptr) {
   segment_tree_data *st = ptr;
@@ -83,6 +111,9 @@ static void segment_tree_mark(void *ptr) {
   rb_gc_mark(st->single_cell_array_val_lambda);
   rb_gc_mark(st->identity);
 
+  if (!st->holds_heap_objects) {
+    return;
+  }
   for (size_t i = 0; i < st->tree_alloc_size; i++) {
     VALUE value = st->tree[i];
     if (value) {
@@ -152,28 +183,36 @@ static VALUE segment_tree_alloc(VALUE klass) {
  */
 
 /*
- * Recursively build the internal tree data structure.
+ * Set a node of the tree, noting whether the value needs to be marked.
+ */
+static inline void set_node(segment_tree_data *seg_tree, size_t i, VALUE val) {
+  seg_tree->tree[i] = val;
+  if (!RB_SPECIAL_CONST_P(val)) {
+    seg_tree->holds_heap_objects = 1;
+  }
+}
+
+/*
+ * Build the internal tree data structure.
+ *
+ * We use the "bottom-up" layout described at https://codeforces.com/blog/entry/18051 and
+ * https://en.algorithmica.org/hpc/data-structures/segment-trees/. The tree has 2n nodes. The leaves are tree[n], ..., tree[2n - 1],
+ * holding the values for the cells 0, ..., n - 1 of the underlying array, and each internal node i < n combines the values of its
+ * children 2i and 2i + 1. The root is at TREE_ROOT.
  *
- * - tree_idx: the index into the tree array of the node being calculated
- * - [tree_l, tree_r]: the sub-interval of the underlying array data corresponding to the tree node being calculated.
+ * Unless n is a power of two, some internal nodes combine values from subintervals that are not adjacent in the underlying array.
+ * That does no harm, as the queries below never use those nodes.
  */
-static void build(segment_tree_data *segment_tree, size_t tree_idx, size_t tree_l, size_t tree_r) {
+static void build(segment_tree_data *segment_tree) {
   VALUE *tree = segment_tree->tree;
+  size_t n = segment_tree->size;
 
-  if (tree_l == tree_r) {
-    // Base case: the node corresponds to a subarray of length 1.
-    segment_tree->tree[tree_idx] = single_cell_val_at(segment_tree, tree_l);
-  } else {
-    // Build to two child nodes, and then combine their values for this node.
-    size_t mid = midpoint(tree_l, tree_r);
-    size_t left = left_child(tree_idx);
-    size_t right = right_child(tree_idx);
-
-    build(segment_tree, left, tree_l, mid);
-    build(segment_tree, right, mid + 1, tree_r);
+  for (size_t i = 0; i < n; i++) {
+    set_node(segment_tree, n + i, single_cell_val_at(segment_tree, i));
+  }
 
-    VALUE comb_val = combined_val(segment_tree, tree[left], tree[right]);
-    segment_tree->tree[tree_idx] = comb_val;
+  for (size_t i = n - 1; i >= TREE_ROOT; i--) {
+    set_node(segment_tree, i, combined_val(segment_tree, tree[left_child(i)], tree[right_child(i)]));
   }
 }
 
@@ -206,89 +245,80 @@ static void setup(segment_tree_data* seg_tree, VALUE combine, VALUE single_cell_
     rb_raise(rb_eArgError, "size must be positive.");
   }
 
-  // Implicit binary tree with n leaves and straightforward left() and right() may use indices up to 4n.  But see here for a way to
-  // reduce the requirement to 2n: https://cp-algorithms.com/data_structures/segment_tree.html#memory-efficient-implementation
-  size_t tree_size = 1 + 4 * seg_tree->size;
-  seg_tree->tree = calloc(tree_size, sizeof(VALUE));
+  // The bottom-up layout needs 2n slots, of which slot 0 is unused.
+  size_t tree_size = 2 * seg_tree->size;
+  seg_tree->tree = native_array_alloc(tree_size, sizeof(VALUE));
   seg_tree->tree_alloc_size = tree_size;
 
-  build(seg_tree, TREE_ROOT, 0, seg_tree->size - 1);
+  build(seg_tree);
 }
 
 /*
  * Determine the value for the subarray A(left, right).
  *
- * - tree_idx: the index in the array of the node we are currently visiting
- * - tree_l..tree_r: the subarray handled by the current node.
- * - left..right: the subarray whose value we are currently looking for.
- *
- * As an invariant we have left..right \subset tree_l..tree_r.
+ * We walk up the tree from the leaves for left and right. At each level, if the left boundary node is a right child then its parent
+ * covers cells outside the interval and so we take the node's value into our left-hand result and step inward. Symmetrically for the
+ * right boundary. Then we move up a level.
  *
- * We start out with
- * - tree_idx = TREE_ROOT
- * - tree_l..tree_r = 0..(size - 1), and
- * - left..right given by the client code's query
+ * The left- and right-hand results are kept separate so that values are always combined in the order of their subintervals. The
+ * combine lambda need not be commutative.
  *
- * If [tree_l, tree_r] = [left, right] then the current node gives the desired answer. Otherwise we decend the tree with one or two
- * recursive calls.
- *
- * If left..right is contained the the bottom or top half of tree_l..tree_r we decend to the corresponding child with one recursive
- * call. Otherwise we split left..right at the midpoint of tree_l..tree_r, make two recursive calls, and then combine the results.
+ * As the interval is non-empty at least one of the two partial results gets a value.
  */
-static VALUE determine_val(segment_tree_data* seg_tree, size_t tree_idx, size_t left, size_t right, size_t tree_l, size_t tree_r) {
-  // Does the current tree node exactly serve up the interval we're interested in?
-  if (left == tree_l && right == tree_r) {
-    return seg_tree->tree[tree_idx];
+static VALUE determine_val(segment_tree_data* seg_tree, size_t left, size_t right) {
+  VALUE *tree = seg_tree->tree;
+  VALUE left_result = Qnil, right_result = Qnil;
+  int have_left = 0, have_right = 0;
+
+  // Work with the half-open interval [l, r) of leaves.
+  size_t l = left + seg_tree->size;
+  size_t r = right + seg_tree->size + 1;
+  count_stat(seg_tree->stats.queries, 1);
+
+  while (l < r) {
+    if (l & 1) {
+      count_stat(seg_tree->stats.query_node_visits, 1);
+      count_stat(seg_tree->stats.query_funcalls, have_left);
+      left_result = have_left ? combined_val(seg_tree, left_result, tree[l]) : tree[l];
+      have_left = 1;
+      l++;
+    }
+    if (r & 1) {
+      r--;
+      count_stat(seg_tree->stats.query_node_visits, 1);
+      count_stat(seg_tree->stats.query_funcalls, have_right);
+      right_result = have_right ? combined_val(seg_tree, tree[r], right_result) : tree[r];
+      have_right = 1;
+    }
+    l >>= 1;
+    r >>= 1;
   }
 
-  // We need to go further down the tree */
-  size_t mid = midpoint(tree_l, tree_r);
-  if (mid >= right) {
-    // Our interval is contained by the left child's interval
-    return determine_val(seg_tree, left_child(tree_idx),  left, right, tree_l,  mid);
-  } else if (mid + 1 <= left) {
-    // Our interval is contained by the right child's interval
-    return determine_val(seg_tree, right_child(tree_idx), left, right, mid + 1, tree_r);
-  } else {
-    // Our interval is split between the two, so we need to combine the results from the children.
-    return rb_funcall(
-                      seg_tree->combine_lambda, rb_intern("call"), 2,
-                      determine_val(seg_tree, left_child(tree_idx),  left,    mid,   tree_l,  mid),
-                      determine_val(seg_tree, right_child(tree_idx), mid + 1, right, mid + 1, tree_r)
-                      );
+  if (have_left && have_right) {
+    count_stat(seg_tree->stats.query_funcalls, 1);
+    return combined_val(seg_tree, left_result, right_result);
   }
+  return have_left ? left_result : right_result;
 }
 
 /*
  * Update the structure to reflect the change in the underlying array at index idx.
  *
- * - idx: the index at which the underlying array data has changed.
- * - tree_id: the index in the internal datastructure of the node we are currently visiting.
- * - tree_l..tree_r: the range handled by the current node
+ * We replace the value at the leaf and then recalculate each of its ancestors on the way up to the root.
  */
-static void update_val_at(segment_tree_data *seg_tree, size_t idx, size_t tree_idx, size_t tree_l, size_t tree_r) {
-  if (tree_l == tree_r) {
-    // We have found the base case of our update
-    if (tree_l != idx) {
-      rb_raise(
-               eSharedInternalLogicError,
-               "tree_l == tree_r == %lu but they do not agree with the idx %lu holding the updated value",
-               tree_r, idx
-               );
-    }
-    seg_tree->tree[tree_idx] = single_cell_val_at(seg_tree, tree_l);
-  } else {
-    // Recursively update the appropriate subtree...
-    size_t mid = midpoint(tree_l, tree_r);
-    size_t left = left_child(tree_idx);
-    size_t right = right_child(tree_idx);
-    if (mid >= idx) {
-      update_val_at(seg_tree, idx, left, tree_l, mid);
-    } else {
-      update_val_at(seg_tree, idx, right, mid + 1, tree_r);
-    }
-    // ...and ourself to incorporate the change
-    seg_tree->tree[tree_idx] = combined_val(seg_tree, seg_tree->tree[left], seg_tree->tree[right]);
+static void update_val_at(segment_tree_data *seg_tree, size_t idx) {
+  VALUE *tree = seg_tree->tree;
+  size_t i = idx + seg_tree->size;
+
+  count_stat(seg_tree->stats.updates, 1);
+  count_stat(seg_tree->stats.update_node_visits, 1);
+  count_stat(seg_tree->stats.update_funcalls, 1);
+  set_node(seg_tree, i, single_cell_val_at(seg_tree, idx));
+
+  for (i >>= 1; i >= TREE_ROOT; i >>= 1) {
+    count_stat(seg_tree->stats.update_node_visits, 1);
+    count_stat(seg_tree->stats.update_funcalls, 1);
+    set_node(seg_tree, i, combined_val(seg_tree, tree[left_child(i)], tree[right_child(i)]));
   }
 }
 
@@ -313,15 +343,11 @@ static VALUE segment_tree_init(VALUE self, VALUE combine, VALUE single_cell_arra
 }
 
 /*
- * (see SegmentTreeTemplate#query_on)
+ * The value on left..right, after checking that the interval makes sense.
  */
-static VALUE segment_tree_query_on(VALUE self, VALUE left, VALUE right) {
-  segment_tree_data* seg_tree = unwrapped(self);
-  size_t c_left = checked_nonneg_fixnum(left);
-  size_t c_right = checked_nonneg_fixnum(right);
-
-  if (c_right >= seg_tree->size) {
-    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", c_left, c_right, seg_tree->size);
+static VALUE checked_query(segment_tree_data* seg_tree, size_t left, size_t right) {
+  if (right >= seg_tree->size) {
+    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", left, right, seg_tree->size);
   }
 
   if (left > right) {
@@ -329,7 +355,34 @@ static VALUE segment_tree_query_on(VALUE self, VALUE left, VALUE right) {
     return seg_tree->identity;
   }
 
-  return determine_val(seg_tree, TREE_ROOT, c_left, c_right, 0, seg_tree->size - 1);
+  return determine_val(seg_tree, left, right);
+}
+
+/*
+ * (see SegmentTreeTemplate#query_on)
+ */
+static VALUE segment_tree_query_on(VALUE self, VALUE left, VALUE right) {
+  return checked_query(unwrapped(self), checked_nonneg_fixnum(left), checked_nonneg_fixnum(right));
+}
+
+/*
+ * CSegmentTreeTemplate#c_query_many(lefts, rights = nil)
+ *
+ * The values in the tree are arbitrary Ruby objects so we always return an Array, even when the intervals are given as a packed
+ * String. The Ruby wrapper query_many packs them in that case (see SegmentTreeTemplate#query_many).
+ */
+static VALUE segment_tree_query_many(int argc, VALUE *argv, VALUE self) {
+  segment_tree_data* seg_tree = unwrapped(self);
+  index_pairs pairs;
+  read_index_pairs(argc, argv, &pairs);
+
+  VALUE results = rb_ary_new_capa(pairs.count);
+  for (long i = 0; i < pairs.count; i++) {
+    size_t left, right;
+    index_pair_at(&pairs, i, &left, &right);
+    rb_ary_push(results, checked_query(seg_tree, left, right));
+  }
+  return results;
 }
 
 /*
@@ -343,10 +396,40 @@ static VALUE segment_tree_update_at(VALUE self, VALUE idx) {
     rb_raise(eSharedDataError, "Cannot update value at index %lu, size = %lu", c_idx, seg_tree->size);
   }
 
-  update_val_at(seg_tree, c_idx, TREE_ROOT, 0, seg_tree->size - 1);
+  update_val_at(seg_tree, c_idx);
+
+  return Qnil;
+}
+
+#ifdef DSRM_STATS
+/*
+ * The hot-path counters since the tree was built, or since the last call to reset_stats, as a Hash:
+ * - queries, query_node_visits, query_funcalls: the number of queries on non-empty intervals, the number of tree nodes whose values
+ *   they used, and the number of calls they made to combine
+ * - updates, update_node_visits, update_funcalls: the same for update_at, whose calls include the one to single_cell_array_val
+ *
+ * Building the tree isn't counted: it visits each node once and makes one call for each.
+ */
+static VALUE segment_tree_stats_hash(VALUE self) {
+  segment_tree_stats *stats = &unwrapped(self)->stats;
+  VALUE hash = rb_hash_new();
+  stat_to_hash(hash, "queries", stats->queries);
+  stat_to_hash(hash, "query_node_visits", stats->query_node_visits);
+  stat_to_hash(hash, "query_funcalls", stats->query_funcalls);
+  stat_to_hash(hash, "updates", stats->updates);
+  stat_to_hash(hash, "update_node_visits", stats->update_node_visits);
+  stat_to_hash(hash, "update_funcalls", stats->update_funcalls);
+  return hash;
+}
 
+/*
+ * Set the counters reported by stats back to zero.
+ */
+static VALUE segment_tree_reset_stats(VALUE self) {
+  memset(&unwrapped(self)->stats, 0, sizeof(segment_tree_stats));
   return Qnil;
 }
+#endif
 
 /*
  * A generic Segment Tree template, written in C.
@@ -360,5 +443,7 @@ void Init_c_segment_tree_template() {
   rb_define_alloc_func(cSegmentTreeTemplate, segment_tree_alloc);
   rb_define_method(cSegmentTreeTemplate, "c_initialize", segment_tree_init, 4);
   rb_define_method(cSegmentTreeTemplate, "query_on", segment_tree_query_on, 2);
+  rb_define_method(cSegmentTreeTemplate, "c_query_many", segment_tree_query_many, -1);
   rb_define_method(cSegmentTreeTemplate, "update_at", segment_tree_update_at, 1);
+  define_stats_methods(cSegmentTreeTemplate, segment_tree_stats_hash, segment_tree_reset_stats);
 }
@@ -0,0 +1,427 @@
+/*
+ * This is a C implementation of a Sparse Table, for range max, min and index-of-max queries on data that never changes.
+ *
+ * Level k of the table holds, for each index i, the combined value on the interval i..(i + 2^k - 1). Any interval l..r is the union
+ * of two such intervals, possibly overlapping: with 2^k the largest power of two not greater than its length, they are the ones
+ * starting at l and ending at r. Max and min don't mind the overlap, so a query is one combine of two table entries: O(1) rather than
+ * the O(log n) of a Segment Tree.
+ *
+ * The price is O(n log n) space and construction time, and no updates. Sums can't be done like this, as the overlap would be counted
+ * twice.
+ *
+ * The values are stored unboxed, just as in CNumericSegmentTree, and the query API is the same. See segment_tree.rb for how
+ * instances are chosen.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+#include "numeric.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Enough levels for any size_t number of values
+#define MAX_LEVELS 64
+
+/**
+ * The C implementation of a Sparse Table
+ */
+
+typedef struct {
+  cell *table; // all the levels, one after the other. For OP_INDEX_OF_MAX the cells hold indices (in .i) rather than values.
+  cell *values; // the data values. For OP_MAX and OP_MIN this is just level 0 of table, and for OP_INDEX_OF_MAX its own array.
+  numeric_op operation;
+  numeric_dtype dtype;
+  size_t size; // the number of data values
+  size_t table_size; // the number of cells in table
+  size_t level_count;
+  size_t level_offset[MAX_LEVELS]; // where in table each level starts. Level k has size - 2^k + 1 cells.
+} sparse_table_data;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap).
+ */
+static sparse_table_data *create_sparse_table() {
+  sparse_table_data *sparse_table = ALLOC(sparse_table_data);
+
+  sparse_table->table = NULL;
+  sparse_table->values = NULL;
+  sparse_table->operation = OP_MAX;
+  sparse_table->dtype = DTYPE_I64;
+  sparse_table->size = 0;
+  sparse_table->table_size = 0;
+  sparse_table->level_count = 0;
+
+  return sparse_table;
+}
+
+/*
+ * Free the memory associated with a sparse_table_data struct.
+ */
+static void sparse_table_free(void *ptr) {
+  if (ptr) {
+    sparse_table_data *sparse_table = ptr;
+    if (sparse_table->values != sparse_table->table) {
+      native_array_free(sparse_table->values, sparse_table->size, sizeof(cell));
+    }
+    native_array_free(sparse_table->table, sparse_table->table_size, sizeof(cell));
+    xfree(sparse_table);
+  }
+}
+
+/*
+ * How much memory does a sparse_table_data instance consume?
+ */
+static size_t sparse_table_memsize(const void *ptr) {
+  if (ptr) {
+    const sparse_table_data *sparse_table = ptr;
+    size_t values_size = sparse_table->values != sparse_table->table ? native_array_memsize(sparse_table->size, sizeof(cell)) : 0;
+
+    return native_array_memsize(sparse_table->table_size, sizeof(cell)) + values_size + sizeof(sparse_table_data);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * We keep our own copy of the data, and hold no Ruby objects at all. So there is nothing to mark and no dmark function.
+ */
+static const rb_data_type_t sparse_table_type = {
+  .wrap_struct_name = "sparse_table",
+  { // help for the Ruby garbage collector
+    .dmark = NULL,
+    .dfree = sparse_table_free,
+    .dsize = sparse_table_memsize,
+  },
+  .data = NULL,
+  .flags = 0
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+
+/************************************************************
+ * Wrapping and unwrapping the C struct and other things.
+ *
+ */
+
+static sparse_table_data *unwrapped(VALUE self) {
+  sparse_table_data *sparse_table;
+  TypedData_Get_Struct((self), sparse_table_data, &sparse_table_type, sparse_table);
+  return sparse_table;
+}
+
+/*
+ * This is for CSparseTable.allocate on the Ruby side.
+ */
+static VALUE sparse_table_alloc(VALUE klass) {
+  sparse_table_data *sparse_table = create_sparse_table();
+  return TypedData_Wrap_Struct(klass, &sparse_table_type, sparse_table);
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * The Sparse Table on the C side.
+ */
+
+/*
+ * The largest k with 2^k <= n, for n > 0.
+ */
+static inline size_t floor_log2(size_t n) {
+  return 63 - __builtin_clzll(n);
+}
+
+/*
+ * The number of values in data, which must be an Array or else a String of packed 8-byte values.
+ */
+static size_t data_size(VALUE data) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    long len = RSTRING_LEN(data);
+    if (len % sizeof(cell) != 0) {
+      rb_raise(rb_eArgError, "packed data must be a whole number of 8-byte values (got %ld bytes)", len);
+    }
+    return len / sizeof(cell);
+  }
+
+  Check_Type(data, T_ARRAY);
+  return RARRAY_LEN(data);
+}
+
+/*
+ * Copy the values from data into st->values. A String is copied as it is.
+ */
+static void read_values(sparse_table_data *st, VALUE data) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    memcpy(st->values, RSTRING_PTR(data), sizeof(cell) * st->size);
+  } else {
+    for (size_t i = 0; i < st->size; i++) {
+      st->values[i] = cell_from_value(st->dtype, rb_ary_entry(data, i));
+    }
+  }
+}
+
+/*
+ * Work out the levels, returning the total number of cells in the table.
+ */
+static size_t plan_levels(sparse_table_data *st) {
+  size_t total = 0;
+
+  st->level_count = floor_log2(st->size) + 1;
+  for (size_t k = 0; k < st->level_count; k++) {
+    st->level_offset[k] = total;
+    total += st->size - ((size_t)1 << k) + 1;
+  }
+  return total;
+}
+
+/*
+ * Combine two table entries - values, or for OP_INDEX_OF_MAX indices - for intervals with a starting to the left of b's.
+ *
+ * For OP_INDEX_OF_MAX we prefer the left-hand index when the values are equal, as CNumericSegmentTree does. Then a query gives the
+ * leftmost index of the maximum: if it lies in the left-hand interval then that interval gives it, and if not, the left-hand
+ * interval's maximum is smaller.
+ */
+static inline cell combined(const sparse_table_data *st, cell a, cell b) {
+  switch (st->operation) {
+  case OP_MIN:
+    return cell_less(st->dtype, b, a) ? b : a;
+  case OP_INDEX_OF_MAX:
+    return cell_less(st->dtype, st->values[a.i], st->values[b.i]) ? b : a;
+  case OP_MAX:
+  default:
+    return cell_less(st->dtype, a, b) ? b : a;
+  }
+}
+
+/*
+ * Fill in levels 1 and up from level 0.
+ */
+static void build(sparse_table_data *st) {
+  for (size_t k = 1; k < st->level_count; k++) {
+    const cell *below = st->table + st->level_offset[k - 1];
+    cell *level = st->table + st->level_offset[k];
+    size_t half = (size_t)1 << (k - 1);
+    size_t count = st->size - 2 * half + 1;
+
+    for (size_t i = 0; i < count; i++) {
+      level[i] = combined(st, below[i], below[i + half]);
+    }
+  }
+}
+
+/*
+ * The table entry for the interval left..right, which must be non-empty and inside 0...size.
+ */
+static inline cell determine_val(const sparse_table_data *st, size_t left, size_t right) {
+  size_t k = floor_log2(right - left + 1);
+  const cell *level = st->table + st->level_offset[k];
+
+  return combined(st, level[left], level[right + 1 - ((size_t)1 << k)]);
+}
+
+/*
+ * Check the interval, returning false if it is empty.
+ */
+static int checked_interval(const sparse_table_data *st, size_t left, size_t right) {
+  if (right >= st->size) {
+    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", left, right, st->size);
+  }
+  return left <= right;
+}
+
+/*
+ * The value we return for an empty interval, as CNumericSegmentTree does.
+ */
+static VALUE identity(const sparse_table_data *st) {
+  switch (st->operation) {
+  case OP_MAX:
+    return DBL2NUM(-HUGE_VAL);
+  case OP_MIN:
+    return DBL2NUM(HUGE_VAL);
+  case OP_INDEX_OF_MAX:
+  default:
+    return Qnil;
+  }
+}
+
+/*
+ * Box up a table entry in the same shape as CNumericSegmentTree gives: for OP_INDEX_OF_MAX the pair [index, value].
+ */
+static VALUE boxed_result(const sparse_table_data *st, cell c) {
+  if (st->operation == OP_INDEX_OF_MAX) {
+    return rb_assoc_new(LL2NUM(c.i), value_from_cell(st->dtype, st->values[c.i]));
+  }
+  return value_from_cell(st->dtype, c);
+}
+
+/*
+ * The raw bytes of a packed result for an empty interval. See CNumericSegmentTree#query_many.
+ */
+static cell packed_identity(const sparse_table_data *st) {
+  cell c;
+  int is_i64 = st->dtype == DTYPE_I64;
+
+  switch (st->operation) {
+  case OP_MAX:
+    if (is_i64) { c.i = INT64_MIN; } else { c.f = -HUGE_VAL; }
+    break;
+  case OP_MIN:
+    if (is_i64) { c.i = INT64_MAX; } else { c.f = HUGE_VAL; }
+    break;
+  case OP_INDEX_OF_MAX:
+  default:
+    c.i = -1;
+  }
+  return c;
+}
+
+/*
+ * End C implementation of the Sparse Table
+ ************************************************************/
+
+/************************************************************
+ * The wrappers around the C functionality.
+ *
+ * These become Ruby methods via rb_define_method() below.
+ */
+
+/*
+ * CSparseTable#initialize(operation, data, dtype)
+ *
+ * - operation: one of :max, :min, :index_of_max
+ * - data: an Array of numeric values, or a String of packed int64 or double values, as for CNumericSegmentTree#initialize. We copy
+ *   the values and don't look at data again.
+ * - dtype: :i64 or :f64. For an Array it must be what CNumericSegmentTree.native_dtype(data, operation) returns. For a String it
+ *   says how to read the bytes.
+ */
+static VALUE sparse_table_init(VALUE self, VALUE operation, VALUE data, VALUE dtype) {
+  sparse_table_data *st = unwrapped(self);
+
+  st->operation = operation_from_symbol(operation);
+  if (st->operation == OP_SUM) {
+    rb_raise(rb_eArgError, "A sparse table can't do sums");
+  }
+  st->dtype = dtype_from_symbol(dtype);
+  st->size = data_size(data);
+
+  if (st->size == 0) {
+    rb_raise(rb_eArgError, "size must be positive.");
+  }
+
+  st->table_size = plan_levels(st);
+  st->table = native_array_alloc(st->table_size, sizeof(cell));
+
+  if (st->operation == OP_INDEX_OF_MAX) {
+    st->values = native_array_alloc(st->size, sizeof(cell));
+    for (size_t i = 0; i < st->size; i++) {
+      st->table[i].i = i;
+    }
+  } else {
+    st->values = st->table;
+  }
+
+  read_values(st, data);
+  build(st);
+
+  return self;
+}
+
+/*
+ * (see SegmentTreeTemplate#query_on)
+ */
+static VALUE sparse_table_query_on(VALUE self, VALUE left, VALUE right) {
+  sparse_table_data *st = unwrapped(self);
+  size_t c_left = checked_nonneg_fixnum(left);
+  size_t c_right = checked_nonneg_fixnum(right);
+
+  if (!checked_interval(st, c_left, c_right)) {
+    return identity(st);
+  }
+  return boxed_result(st, determine_val(st, c_left, c_right));
+}
+
+/*
+ * (see CNumericSegmentTree#query_many)
+ */
+static VALUE sparse_table_query_many(int argc, VALUE *argv, VALUE self) {
+  sparse_table_data *st = unwrapped(self);
+  index_pairs pairs;
+  read_index_pairs(argc, argv, &pairs);
+
+  size_t left, right;
+
+  if (!pairs.packed) {
+    VALUE results = rb_ary_new_capa(pairs.count);
+    for (long i = 0; i < pairs.count; i++) {
+      index_pair_at(&pairs, i, &left, &right);
+      rb_ary_push(results, checked_interval(st, left, right) ? boxed_result(st, determine_val(st, left, right)) : identity(st));
+    }
+    return results;
+  }
+
+  VALUE packed_results = rb_str_new(NULL, pairs.count * sizeof(cell));
+  char *out = RSTRING_PTR(packed_results);
+  cell empty_val = packed_identity(st);
+
+  for (long i = 0; i < pairs.count; i++) {
+    index_pair_at(&pairs, i, &left, &right);
+    cell c = checked_interval(st, left, right) ? determine_val(st, left, right) : empty_val;
+    memcpy(out + i * sizeof(cell), &c, sizeof(cell));
+  }
+  return packed_results;
+}
+
+/*
+ * CSparseTable#update_at(idx)
+ *
+ * A sparse table can't be updated: we always raise Shared::LogicError. The method is here so that a concrete Segment Tree built with
+ * mutable: false says so clearly.
+ */
+static VALUE sparse_table_update_at(VALUE self, VALUE idx) {
+  rb_raise(eSharedLogicError, "Cannot update a tree built with mutable: false");
+}
+
+/*
+ * CSparseTable#operation
+ *
+ * The operation the table does: :max, :min or :index_of_max.
+ */
+static VALUE sparse_table_operation(VALUE self) {
+  switch (unwrapped(self)->operation) {
+  case OP_MIN:
+    return ID2SYM(rb_intern("min"));
+  case OP_INDEX_OF_MAX:
+    return ID2SYM(rb_intern("index_of_max"));
+  case OP_MAX:
+  default:
+    return ID2SYM(rb_intern("max"));
+  }
+}
+
+/*
+ * A Sparse Table over numeric data, answering max, min and index-of-max queries in O(1) time. It can't be updated.
+ *
+ * (see SegmentTree.construct)
+ */
+void Init_c_sparse_table() {
+  VALUE mSegmentTree = rb_define_module_under(mDataStructuresRMolinari, "SegmentTree");
+  VALUE cSparseTable = rb_define_class_under(mSegmentTree, "CSparseTable", rb_cObject);
+
+  rb_define_alloc_func(cSparseTable, sparse_table_alloc);
+  rb_define_method(cSparseTable, "initialize", sparse_table_init, 3);
+  rb_define_method(cSparseTable, "query_on", sparse_table_query_on, 2);
+  rb_define_method(cSparseTable, "query_many", sparse_table_query_many, -1);
+  rb_define_method(cSparseTable, "update_at", sparse_table_update_at, 1);
+  rb_define_method(cSparseTable, "operation", sparse_table_operation, 0);
+}
@@ -0,0 +1,488 @@
+/*
+ * Segment Trees specialized at compile time, one class for each combination of element type and operation.
+ *
+ * CNumericSegmentTree stores unboxed values but is still generic at run time: it decides what to do with a switch on the operation
+ * and the dtype at every node it visits. Here each class gets its own copy of the code, stamped out by including
+ * typed_segment_tree_class.h - and through it segment_tree_kernel.h - with the element type and operation as macros. The combine
+ * step is then a single inlined C expression on C values.
+ *
+ * The element types are
+ * - I64: int64_t
+ * - I32: int32_t
+ * - F64: double
+ *
+ * and the operations are
+ * - SUM: the sum of the values. Integer sums are kept in 64 bits.
+ * - MIN, MAX: the smallest or largest value
+ * - INDEX_OF_MAX: an index at which the largest value is found, the leftmost if there is a tie
+ * - GCD: the greatest common divisor of the values, which is never negative. Only for the integer types.
+ *
+ * The classes are named after them, as SegmentTree::CSumI64, SegmentTree::CIndexOfMaxF64, and so on.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+#include "numeric.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TYPED_CAT_(a, b) a##_##b
+#define TYPED_CAT(a, b) TYPED_CAT_(a, b)
+
+/*
+ * The struct behind every one of the classes. Only the type of the nodes in tree differs from class to class.
+ *
+ * - tree: the 2n nodes of the bottom-up tree. See segment_tree_kernel.h.
+ * - data: the underlying data, an Array or a String of packed values. We read from it again in update_at.
+ * - size: the number of values in data, n.
+ * - node_size: the size of a node in tree.
+ * - weight: for CSumI64 only, the total magnitude of the values, which we keep no larger than INT64_MAX. Every sum over an interval
+ *   is then in range. The other classes can't overflow.
+ */
+typedef struct {
+  void *tree;
+  VALUE data;
+  size_t size;
+  size_t node_size;
+  uint64_t weight;
+} typed_segment_tree_data;
+
+/************************************************************
+ * Memory Management
+ *
+ */
+
+/*
+ * Create one (on the heap).
+ */
+static typed_segment_tree_data *create_typed_segment_tree() {
+  typed_segment_tree_data *segment_tree = ALLOC(typed_segment_tree_data);
+
+  segment_tree->tree = NULL; // we don't yet know how much space we need
+  segment_tree->data = Qnil;
+  segment_tree->size = 0;
+  segment_tree->node_size = 0;
+  segment_tree->weight = 0;
+
+  return segment_tree;
+}
+
+/*
+ * Free the memory associated with a typed_segment_tree_data struct.
+ */
+static void typed_segment_tree_free(void *ptr) {
+  if (ptr) {
+    typed_segment_tree_data *segment_tree = ptr;
+    native_array_free(segment_tree->tree, 2 * segment_tree->size, segment_tree->node_size);
+    xfree(segment_tree);
+  }
+}
+
+/*
+ * How much memory does a typed_segment_tree_data instance consume?
+ */
+static size_t typed_segment_tree_memsize(const void *ptr) {
+  if (ptr) {
+    const typed_segment_tree_data *st = ptr;
+    return native_array_memsize(2 * st->size, st->node_size) + sizeof(typed_segment_tree_data);
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * The only Ruby object we hold is the underlying data.
+ */
+static void typed_segment_tree_mark(void *ptr) {
+  typed_segment_tree_data *st = ptr;
+  rb_gc_mark(st->data);
+}
+
+/*
+ * A configuration struct that tells the Ruby runtime how to deal with a typed_segment_tree_data object. It is shared by all the
+ * classes.
+ *
+ * https://docs.ruby-lang.org/en/master/extension_rdoc.html#label-Encapsulate+C+data+into+a+Ruby+object
+ */
+static const rb_data_type_t typed_segment_tree_type = {
+  .wrap_struct_name = "typed_segment_tree",
+  { // help for the Ruby garbage collector
+    .dmark = typed_segment_tree_mark, // dmark, for marking other Ruby objects.
+    .dfree = typed_segment_tree_free, // how to free the memory associated with an object
+    .dsize = typed_segment_tree_memsize, // roughly how much space does the object consume?
+  },
+  .data = NULL, // a data field we could use for something here if we wanted. Ruby ignores it
+  .flags = 0  // GC-related flag values.
+};
+
+/*
+ * End memory management functions.
+ ************************************************************/
+
+/************************************************************
+ * Wrapping and unwrapping the C struct and other things.
+ *
+ */
+
+/*
+ * Unwrap a Ruby-side typed segment tree object to get the C struct inside.
+ */
+static typed_segment_tree_data *unwrapped(VALUE self) {
+  typed_segment_tree_data *segment_tree;
+  TypedData_Get_Struct((self), typed_segment_tree_data, &typed_segment_tree_type, segment_tree);
+  return segment_tree;
+}
+
+/*
+ * Allocate a typed_segment_tree_data struct and wrap it for the Ruby runtime. This is the allocator for each of the classes.
+ */
+static VALUE typed_segment_tree_alloc(VALUE klass) {
+  // Get one on the heap
+  typed_segment_tree_data *segment_tree = create_typed_segment_tree();
+  // ...and wrap it into a Ruby object
+  return TypedData_Wrap_Struct(klass, &typed_segment_tree_type, segment_tree);
+}
+
+/*
+ * End wrapping and unwrapping functions.
+ ************************************************************/
+
+/************************************************************
+ * The element types
+ *
+ * For each of them, called D below,
+ * - D_ELT: the C type of a value.
+ * - D_FROM_VALUE(val): convert a Ruby value, raising Shared::DataError if it isn't of the right kind and RangeError if it doesn't
+ *   fit.
+ * - D_TO_VALUE(x): and back again.
+ * - D_SET_CELL(c, x): store x in the cell c of a packed result. Integer types give int64 values and F64 gives doubles.
+ * - D_SUM, D_SUM_TO_VALUE, D_SUM_SET_CELL: the same for the type in which we add up values.
+ * - D_SUM_WEIGHT(x): the contribution to typed_segment_tree_data.weight of a value x.
+ */
+
+static VALUE checked_integer(VALUE val) {
+  if (!RB_INTEGER_TYPE_P(val)) {
+    rb_raise(eSharedDataError, "Expected an Integer value but got %" PRIsVALUE, rb_obj_class(val));
+  }
+  return val;
+}
+
+static VALUE checked_float(VALUE val) {
+  if (!RB_FLOAT_TYPE_P(val)) {
+    rb_raise(eSharedDataError, "Expected a Float value but got %" PRIsVALUE, rb_obj_class(val));
+  }
+  return val;
+}
+
+/* The magnitude of x, which is a little awkward for INT64_MIN */
+static inline uint64_t magnitude(int64_t x) {
+  return x < 0 ? -(uint64_t)x : (uint64_t)x;
+}
+
+#define I64_ELT int64_t
+#define I64_FROM_VALUE(val) ((int64_t)NUM2LL(checked_integer(val)))
+#define I64_TO_VALUE(x) LL2NUM(x)
+#define I64_SET_CELL(c, x) ((c).i = (x))
+#define I64_SUM int64_t
+#define I64_SUM_TO_VALUE(x) LL2NUM(x)
+#define I64_SUM_SET_CELL(c, x) ((c).i = (x))
+#define I64_SUM_WEIGHT(x) magnitude(x)
+
+// Sums of int32 values are kept in 64 bits. There can't be enough values to overflow them.
+#define I32_ELT int32_t
+#define I32_FROM_VALUE(val) ((int32_t)NUM2INT(checked_integer(val)))
+#define I32_TO_VALUE(x) INT2NUM(x)
+#define I32_SET_CELL(c, x) ((c).i = (x))
+#define I32_SUM int64_t
+#define I32_SUM_TO_VALUE(x) LL2NUM(x)
+#define I32_SUM_SET_CELL(c, x) ((c).i = (x))
+#define I32_SUM_WEIGHT(x) 0
+
+#define F64_ELT double
+#define F64_FROM_VALUE(val) RFLOAT_VALUE(checked_float(val))
+#define F64_TO_VALUE(x) DBL2NUM(x)
+#define F64_SET_CELL(c, x) ((c).f = (x))
+#define F64_SUM double
+#define F64_SUM_TO_VALUE(x) DBL2NUM(x)
+#define F64_SUM_SET_CELL(c, x) ((c).f = (x))
+#define F64_SUM_WEIGHT(x) 0
+
+/*
+ * End element types
+ ************************************************************/
+
+/************************************************************
+ * The operations
+ *
+ * For each of them, called OP below, and an element type d,
+ * - OP_NODE(d): the type of a node.
+ * - OP_LEAF(d, x, idx): the node for the value x at index idx of the data.
+ * - OP_COMBINE(a, b): combine two nodes. See segment_tree_kernel.h.
+ * - OP_TO_VALUE(d, node), OP_SET_CELL(d, c, node): the result of a query, as a Ruby value or in a packed result.
+ * - OP_EMPTY_VALUE(d), OP_EMPTY_CELL(d, c): the same for an empty interval. They agree with CNumericSegmentTree.
+ * - OP_WEIGHT(d, node): the contribution of a leaf to typed_segment_tree_data.weight.
+ */
+
+#define SUM_NODE(d) TYPED_CAT(d, SUM)
+#define SUM_LEAF(d, x, idx) ((TYPED_CAT(d, SUM))(x))
+#define SUM_COMBINE(a, b) ((a) + (b))
+#define SUM_TO_VALUE(d, node) TYPED_CAT(d, SUM_TO_VALUE)(node)
+#define SUM_SET_CELL(d, c, node) TYPED_CAT(d, SUM_SET_CELL)(c, node)
+#define SUM_EMPTY_VALUE(d) INT2FIX(0)
+#define SUM_EMPTY_CELL(d, c) TYPED_CAT(d, SUM_SET_CELL)(c, 0)
+#define SUM_WEIGHT(d, node) TYPED_CAT(d, SUM_WEIGHT)(node)
+
+#define MIN_NODE(d) TYPED_CAT(d, ELT)
+#define MIN_LEAF(d, x, idx) (x)
+#define MIN_COMBINE(a, b) ((b) < (a) ? (b) : (a))
+#define MIN_TO_VALUE(d, node) TYPED_CAT(d, TO_VALUE)(node)
+#define MIN_SET_CELL(d, c, node) TYPED_CAT(d, SET_CELL)(c, node)
+#define MIN_EMPTY_VALUE(d) DBL2NUM(HUGE_VAL)
+#define MIN_EMPTY_CELL(d, c) TYPED_CAT(d, EMPTY_MIN_CELL)(c)
+#define MIN_WEIGHT(d, node) 0
+
+// A packed result for an empty interval. The integer types have no infinities, so we use the most extreme int64 values.
+#define I64_EMPTY_MIN_CELL(c) ((c).i = INT64_MAX)
+#define I32_EMPTY_MIN_CELL(c) ((c).i = INT64_MAX)
+#define F64_EMPTY_MIN_CELL(c) ((c).f = HUGE_VAL)
+#define I64_EMPTY_MAX_CELL(c) ((c).i = INT64_MIN)
+#define I32_EMPTY_MAX_CELL(c) ((c).i = INT64_MIN)
+#define F64_EMPTY_MAX_CELL(c) ((c).f = -HUGE_VAL)
+
+#define MAX_NODE(d) TYPED_CAT(d, ELT)
+#define MAX_LEAF(d, x, idx) (x)
+#define MAX_COMBINE(a, b) ((a) < (b) ? (b) : (a))
+#define MAX_TO_VALUE(d, node) TYPED_CAT(d, TO_VALUE)(node)
+#define MAX_SET_CELL(d, c, node) TYPED_CAT(d, SET_CELL)(c, node)
+#define MAX_EMPTY_VALUE(d) DBL2NUM(-HUGE_VAL)
+#define MAX_EMPTY_CELL(d, c) TYPED_CAT(d, EMPTY_MAX_CELL)(c)
+#define MAX_WEIGHT(d, node) 0
+
+// A node for INDEX_OF_MAX carries the value along with its index
+typedef struct { int64_t val; size_t idx; } index_of_max_i64_node;
+typedef struct { int32_t val; size_t idx; } index_of_max_i32_node;
+typedef struct { double val; size_t idx; } index_of_max_f64_node;
+#define I64_INDEX_OF_MAX_NODE index_of_max_i64_node
+#define I32_INDEX_OF_MAX_NODE index_of_max_i32_node
+#define F64_INDEX_OF_MAX_NODE index_of_max_f64_node
+
+// We return just the index, as IndexOfMaxValSegmentTree#index_of_max_val_on does. Packed results hold it as an int64.
+#define INDEX_OF_MAX_NODE(d) TYPED_CAT(d, INDEX_OF_MAX_NODE)
+#define INDEX_OF_MAX_LEAF(d, x, i) ((TYPED_CAT(d, INDEX_OF_MAX_NODE)){ .val = (x), .idx = (i) })
+#define INDEX_OF_MAX_COMBINE(a, b) ((a).val < (b).val ? (b) : (a))
+#define INDEX_OF_MAX_TO_VALUE(d, node) SIZET2NUM((node).idx)
+#define INDEX_OF_MAX_SET_CELL(d, c, node) ((c).i = (int64_t)(node).idx)
+#define INDEX_OF_MAX_EMPTY_VALUE(d) Qnil
+#define INDEX_OF_MAX_EMPTY_CELL(d, c) ((c).i = -1)
+#define INDEX_OF_MAX_WEIGHT(d, node) 0
+
+/*
+ * Binary GCD, for the GCD operation. The nodes hold magnitudes, so that gcd(a, b) is defined even when a or b is INT64_MIN. A packed
+ * result holds the uint64 value: read it with unpack('Q*').
+ */
+static inline uint64_t gcd(uint64_t a, uint64_t b) {
+  if (a == 0) {
+    return b;
+  }
+  if (b == 0) {
+    return a;
+  }
+  int shift = __builtin_ctzll(a | b);
+  a >>= __builtin_ctzll(a);
+  do {
+    b >>= __builtin_ctzll(b);
+    if (a > b) {
+      uint64_t tmp = a;
+      a = b;
+      b = tmp;
+    }
+    b -= a;
+  } while (b != 0);
+  return a << shift;
+}
+
+#define GCD_NODE(d) uint64_t
+#define GCD_LEAF(d, x, idx) magnitude(x)
+#define GCD_COMBINE(a, b) gcd((a), (b))
+#define GCD_TO_VALUE(d, node) ULL2NUM(node)
+#define GCD_SET_CELL(d, c, node) ((c).i = (int64_t)(node))
+#define GCD_EMPTY_VALUE(d) INT2FIX(0)
+#define GCD_EMPTY_CELL(d, c) ((c).i = 0)
+#define GCD_WEIGHT(d, node) 0
+
+/*
+ * End operations
+ ************************************************************/
+
+/************************************************************
+ * Helpers shared by the classes
+ *
+ */
+
+/*
+ * The number of values in data, which must be an Array or else a String of packed values of elt_size bytes.
+ */
+static size_t data_size(VALUE data, size_t elt_size) {
+  if (RB_TYPE_P(data, T_STRING)) {
+    long len = RSTRING_LEN(data);
+    if (len % elt_size != 0) {
+      rb_raise(rb_eArgError, "packed data must be a whole number of %zu-byte values (got %ld bytes)", elt_size, len);
+    }
+    return len / elt_size;
+  }
+
+  Check_Type(data, T_ARRAY);
+  return RARRAY_LEN(data);
+}
+
+/*
+ * Replace old_weight by new_weight in the total weight of the tree, for the value at index idx. We raise Shared::DataError if the
+ * total gets too large, leaving it alone.
+ */
+static inline void change_weight(typed_segment_tree_data *st, uint64_t old_weight, uint64_t new_weight, size_t idx) {
+  uint64_t weight = st->weight - old_weight + new_weight;
+  if (weight > INT64_MAX) {
+    rb_raise(eSharedDataError, "Value at index %zu is too large in magnitude for a native sum tree", idx);
+  }
+  st->weight = weight;
+}
+
+/*
+ * Check the interval left..right for a query. Return false if it is empty.
+ */
+static int checked_interval(const typed_segment_tree_data* st, size_t left, size_t right) {
+  if (right >= st->size) {
+    rb_raise(eSharedDataError, "Bad query interval %lu..%lu (size = %lu)", left, right, st->size);
+  }
+  return left <= right;
+}
+
+/*
+ * End helpers
+ ************************************************************/
+
+/************************************************************
+ * The classes
+ *
+ * Each block stamps out one class. See typed_segment_tree_class.h
+ */
+
+#define TST_NAME sum_i64
+#define TST_CLASS "CSumI64"
+#define TST_OP SUM
+#define TST_DTYPE I64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME sum_i32
+#define TST_CLASS "CSumI32"
+#define TST_OP SUM
+#define TST_DTYPE I32
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME sum_f64
+#define TST_CLASS "CSumF64"
+#define TST_OP SUM
+#define TST_DTYPE F64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME min_i64
+#define TST_CLASS "CMinI64"
+#define TST_OP MIN
+#define TST_DTYPE I64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME min_i32
+#define TST_CLASS "CMinI32"
+#define TST_OP MIN
+#define TST_DTYPE I32
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME min_f64
+#define TST_CLASS "CMinF64"
+#define TST_OP MIN
+#define TST_DTYPE F64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME max_i64
+#define TST_CLASS "CMaxI64"
+#define TST_OP MAX
+#define TST_DTYPE I64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME max_i32
+#define TST_CLASS "CMaxI32"
+#define TST_OP MAX
+#define TST_DTYPE I32
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME max_f64
+#define TST_CLASS "CMaxF64"
+#define TST_OP MAX
+#define TST_DTYPE F64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME index_of_max_i64
+#define TST_CLASS "CIndexOfMaxI64"
+#define TST_OP INDEX_OF_MAX
+#define TST_DTYPE I64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME index_of_max_i32
+#define TST_CLASS "CIndexOfMaxI32"
+#define TST_OP INDEX_OF_MAX
+#define TST_DTYPE I32
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME index_of_max_f64
+#define TST_CLASS "CIndexOfMaxF64"
+#define TST_OP INDEX_OF_MAX
+#define TST_DTYPE F64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME gcd_i64
+#define TST_CLASS "CGcdI64"
+#define TST_OP GCD
+#define TST_DTYPE I64
+#include "typed_segment_tree_class.h"
+
+#define TST_NAME gcd_i32
+#define TST_CLASS "CGcdI32"
+#define TST_OP GCD
+#define TST_DTYPE I32
+#include "typed_segment_tree_class.h"
+
+/*
+ * End classes
+ ************************************************************/
+
+/*
+ * Segment Trees over numeric data, specialized in C for each element type and operation.
+ *
+ * Each class, like CSumI64, has the methods
+ * - new(data): data is an Array of values of the element type - Integers for I64 and I32, Floats for F64 - or a String of packed
+ *   values in native byte order, as made by Array#pack with 'q*', 'l*' or 'd*'.
+ * - query_on(i, j): the sum, minimum, etc., of the values in data[i..j].
+ * - query_many(lefts, rights): the same for a batch of intervals. See CNumericSegmentTree#query_many for the packed form.
+ * - update_at(idx): tell the tree that the value at index idx of data has changed.
+ * - size: the number of values.
+ */
+void Init_c_typed_segment_tree() {
+  VALUE mSegmentTree = rb_define_module_under(mDataStructuresRMolinari, "SegmentTree");
+
+  sum_i64_define_class(mSegmentTree);
+  sum_i32_define_class(mSegmentTree);
+  sum_f64_define_class(mSegmentTree);
+  min_i64_define_class(mSegmentTree);
+  min_i32_define_class(mSegmentTree);
+  min_f64_define_class(mSegmentTree);
+  max_i64_define_class(mSegmentTree);
+  max_i32_define_class(mSegmentTree);
+  max_f64_define_class(mSegmentTree);
+  index_of_max_i64_define_class(mSegmentTree);
+  index_of_max_i32_define_class(mSegmentTree);
+  index_of_max_f64_define_class(mSegmentTree);
+  gcd_i64_define_class(mSegmentTree);
+  gcd_i32_define_class(mSegmentTree);
+}
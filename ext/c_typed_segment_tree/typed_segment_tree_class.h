@@ -0,0 +1,156 @@
+/*
+ * A "template" for one of the classes of typed_segment_tree.c. It is included there once for each class, with these defined:
+ *
+ * - TST_NAME: the prefix of the C functions for the class, like sum_i64.
+ * - TST_CLASS: the name of the Ruby class, like "CSumI64".
+ * - TST_OP: one of the operations, like SUM.
+ * - TST_DTYPE: one of the element types, like I64.
+ *
+ * See typed_segment_tree.c for what the operations and element types provide. We #undef all four at the end.
+ *
+ * Everything here is static. The one function the extension calls directly is TST_NAME_define_class(), which defines the Ruby class
+ * under the given module.
+ */
+
+#define TST_FN(suffix) TYPED_CAT(TST_NAME, suffix)
+#define TST_ELT TYPED_CAT(TST_DTYPE, ELT)
+#define TST_NODE TYPED_CAT(TST_OP, NODE)(TST_DTYPE)
+#define TST_OP_MACRO(m) TYPED_CAT(TST_OP, m)
+
+#define SEGMENT_TREE_KERNEL_NAME TST_NAME
+#define SEGMENT_TREE_KERNEL_NODE TST_NODE
+#define SEGMENT_TREE_KERNEL_COMBINE(a, b) TST_OP_MACRO(COMBINE)(a, b)
+#include "segment_tree_kernel.h"
+
+/*
+ * The node for the value at index idx of the data. Packed data is read in place, without making a Ruby object.
+ */
+static TST_NODE TST_FN(leaf_at)(const typed_segment_tree_data *st, size_t idx) {
+  TST_ELT x;
+
+  if (RB_TYPE_P(st->data, T_STRING)) {
+    // The caller may have changed the String since we last looked
+    if ((size_t)RSTRING_LEN(st->data) / sizeof(TST_ELT) <= idx) {
+      rb_raise(eSharedDataError, "Packed data no longer has a value at index %zu", idx);
+    }
+    memcpy(&x, RSTRING_PTR(st->data) + idx * sizeof(TST_ELT), sizeof(TST_ELT));
+  } else {
+    x = TYPED_CAT(TST_DTYPE, FROM_VALUE)(rb_ary_entry(st->data, idx));
+  }
+  return TST_OP_MACRO(LEAF)(TST_DTYPE, x, idx);
+}
+
+static VALUE TST_FN(init)(VALUE self, VALUE data) {
+  typed_segment_tree_data *st = unwrapped(self);
+  size_t n = data_size(data, sizeof(TST_ELT));
+
+  if (n == 0) {
+    rb_raise(rb_eArgError, "size must be positive.");
+  }
+
+  st->data = data;
+  st->size = n;
+  st->node_size = sizeof(TST_NODE);
+  st->weight = 0;
+  st->tree = native_array_alloc(2 * n, sizeof(TST_NODE));
+
+  TST_NODE *tree = st->tree;
+  for (size_t i = 0; i < n; i++) {
+    tree[n + i] = TST_FN(leaf_at)(st, i);
+    change_weight(st, 0, TST_OP_MACRO(WEIGHT)(TST_DTYPE, tree[n + i]), i);
+  }
+  TST_FN(build)(tree, n);
+
+  return self;
+}
+
+static VALUE TST_FN(query_on)(VALUE self, VALUE left, VALUE right) {
+  typed_segment_tree_data *st = unwrapped(self);
+  size_t c_left = checked_nonneg_fixnum(left);
+  size_t c_right = checked_nonneg_fixnum(right);
+
+  if (!checked_interval(st, c_left, c_right)) {
+    return TST_OP_MACRO(EMPTY_VALUE)(TST_DTYPE);
+  }
+  TST_NODE result = TST_FN(query)(st->tree, st->size, c_left, c_right);
+  return TST_OP_MACRO(TO_VALUE)(TST_DTYPE, result);
+}
+
+static VALUE TST_FN(query_many)(int argc, VALUE *argv, VALUE self) {
+  typed_segment_tree_data *st = unwrapped(self);
+  index_pairs pairs;
+  read_index_pairs(argc, argv, &pairs);
+
+  size_t left, right;
+
+  if (!pairs.packed) {
+    VALUE results = rb_ary_new_capa(pairs.count);
+    for (long i = 0; i < pairs.count; i++) {
+      index_pair_at(&pairs, i, &left, &right);
+      if (checked_interval(st, left, right)) {
+        TST_NODE result = TST_FN(query)(st->tree, st->size, left, right);
+        rb_ary_push(results, TST_OP_MACRO(TO_VALUE)(TST_DTYPE, result));
+      } else {
+        rb_ary_push(results, TST_OP_MACRO(EMPTY_VALUE)(TST_DTYPE));
+      }
+    }
+    return results;
+  }
+
+  VALUE packed_results = rb_str_new(NULL, pairs.count * sizeof(cell));
+  char *out = RSTRING_PTR(packed_results);
+
+  for (long i = 0; i < pairs.count; i++) {
+    cell c;
+    index_pair_at(&pairs, i, &left, &right);
+    if (checked_interval(st, left, right)) {
+      TST_NODE result = TST_FN(query)(st->tree, st->size, left, right);
+      TST_OP_MACRO(SET_CELL)(TST_DTYPE, c, result);
+    } else {
+      TST_OP_MACRO(EMPTY_CELL)(TST_DTYPE, c);
+    }
+    memcpy(out + i * sizeof(cell), &c, sizeof(cell));
+  }
+  return packed_results;
+}
+
+static VALUE TST_FN(update_at)(VALUE self, VALUE idx) {
+  typed_segment_tree_data *st = unwrapped(self);
+  size_t c_idx = checked_nonneg_fixnum(idx);
+
+  if (c_idx >= st->size) {
+    rb_raise(eSharedDataError, "Cannot update value at index %lu, size = %lu", c_idx, st->size);
+  }
+
+  TST_NODE *tree = st->tree;
+  TST_NODE leaf = TST_FN(leaf_at)(st, c_idx);
+  change_weight(st, TST_OP_MACRO(WEIGHT)(TST_DTYPE, tree[st->size + c_idx]), TST_OP_MACRO(WEIGHT)(TST_DTYPE, leaf), c_idx);
+  TST_FN(update)(tree, st->size, c_idx, leaf);
+
+  return Qnil;
+}
+
+static VALUE TST_FN(size)(VALUE self) {
+  return SIZET2NUM(unwrapped(self)->size);
+}
+
+static void TST_FN(define_class)(VALUE mSegmentTree) {
+  VALUE klass = rb_define_class_under(mSegmentTree, TST_CLASS, rb_cObject);
+
+  rb_define_alloc_func(klass, typed_segment_tree_alloc);
+  rb_define_method(klass, "initialize", TST_FN(init), 1);
+  rb_define_method(klass, "query_on", TST_FN(query_on), 2);
+  rb_define_method(klass, "query_many", TST_FN(query_many), -1);
+  rb_define_method(klass, "update_at", TST_FN(update_at), 1);
+  rb_define_method(klass, "size", TST_FN(size), 0);
+}
+
+#undef TST_FN
+#undef TST_ELT
+#undef TST_NODE
+#undef TST_OP_MACRO
+
+#undef TST_NAME
+#undef TST_CLASS
+#undef TST_OP
+#undef TST_DTYPE
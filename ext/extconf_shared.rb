@@ -4,11 +4,48 @@ def generate_makefile(name)
 
   abort 'missing malloc()' unless have_func "malloc"
   abort 'missing realloc()' unless have_func "realloc"
+  abort 'missing mmap()' unless have_func("mmap", "sys/mman.h")
 
   if try_cflags('-O3')
     append_cflags('-O3')
   end
 
+  # Vector instructions for the reductions in simd.h. The AVX2 functions are compiled with a target attribute and only chosen at run
+  # time on a CPU that has AVX2, so all we need here is a compiler that supports them. NEON is part of the baseline on aarch64.
+  $defs << '-DHAVE_AVX2' if try_link(<<~SRC)
+    #include <immintrin.h>
+    __attribute__((target("avx2"))) static void f(long long *x, double *y) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)x);
+      __m256d b = _mm256_loadu_pd(y);
+      _mm256_storeu_si256((__m256i *)x, _mm256_blendv_epi8(a, _mm256_add_epi64(a, a), _mm256_cmpgt_epi64(a, a)));
+      _mm256_storeu_pd(y, _mm256_min_pd(_mm256_max_pd(b, b), _mm256_add_pd(b, b)));
+    }
+    int main(void) {
+      long long x[4] = { 0 };
+      double y[4] = { 0 };
+      if (__builtin_cpu_supports("avx2")) {
+        f(x, y);
+      }
+      return (int)x[0];
+    }
+  SRC
+  $defs << '-DHAVE_NEON' if try_compile(<<~SRC)
+    #include <arm_neon.h>
+    #if !defined(__aarch64__)
+    #error "NEON with 64-bit lanes needs aarch64"
+    #endif
+    int main(void) {
+      int64x2_t a = vdupq_n_s64(1);
+      float64x2_t b = vdupq_n_f64(1.0);
+      a = vbslq_s64(vcgtq_s64(a, vaddq_s64(a, a)), a, vld1q_s64((const int64_t *)&a));
+      b = vminq_f64(vmaxq_f64(b, vaddq_f64(b, vld1q_f64((const double *)&b))), b);
+      return (int)vgetq_lane_s64(a, 0) + (int)vgetq_lane_f64(b, 1);
+    }
+  SRC
+
+  # The hot-path counters behind #stats. See shared.h.
+  $defs << '-DDSRM_STATS' if enable_config('stats', false)
+
   dir_config(extension_name)
 
   $srcs = [source_name, "../shared.c"]
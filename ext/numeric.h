@@ -0,0 +1,158 @@
+#ifndef NUMERIC_H
+#define NUMERIC_H
+
+/*
+ * Helpers for the C extensions that store unboxed numeric values - int64_t or double - rather than Ruby objects.
+ *
+ * Everything here is static inline so that each extension gets its own copy and unused functions cause no warnings.
+ */
+
+#include "ruby.h"
+#include "shared.h"
+
+#include <stdint.h>
+
+/*
+ * The operations we know how to do natively.
+ */
+typedef enum {
+  OP_SUM,
+  OP_MAX,
+  OP_MIN,
+  OP_INDEX_OF_MAX
+} numeric_op;
+
+/*
+ * The type of the values being stored.
+ */
+typedef enum {
+  DTYPE_I64,
+  DTYPE_F64
+} numeric_dtype;
+
+/*
+ * A single unboxed value. Which member is live depends on the dtype.
+ */
+typedef union {
+  int64_t i;
+  double f;
+} cell;
+
+/*
+ * Translate the Ruby-side symbols into our enums.
+ */
+static inline numeric_op operation_from_symbol(VALUE operation) {
+  Check_Type(operation, T_SYMBOL);
+  ID id = SYM2ID(operation);
+
+  if (id == rb_intern("sum")) {
+    return OP_SUM;
+  } else if (id == rb_intern("max")) {
+    return OP_MAX;
+  } else if (id == rb_intern("min")) {
+    return OP_MIN;
+  } else if (id == rb_intern("index_of_max")) {
+    return OP_INDEX_OF_MAX;
+  }
+  rb_raise(rb_eArgError, "Unknown operation %" PRIsVALUE, operation);
+}
+
+static inline numeric_dtype dtype_from_symbol(VALUE dtype) {
+  Check_Type(dtype, T_SYMBOL);
+  ID id = SYM2ID(dtype);
+
+  if (id == rb_intern("i64")) {
+    return DTYPE_I64;
+  } else if (id == rb_intern("f64")) {
+    return DTYPE_F64;
+  }
+  rb_raise(rb_eArgError, "Unknown dtype %" PRIsVALUE, dtype);
+}
+
+/*
+ * Convert a Ruby value to a cell of the given dtype, raising Shared::DataError if it isn't of the right kind.
+ *
+ * We are strict: an i64 cell accepts only Integers and an f64 cell accepts only Floats. Otherwise we would silently return values of
+ * a different type than the generic Ruby implementations do.
+ */
+static inline cell cell_from_value(numeric_dtype dtype, VALUE val) {
+  cell c;
+
+  if (dtype == DTYPE_I64) {
+    if (!RB_INTEGER_TYPE_P(val)) {
+      rb_raise(eSharedDataError, "Expected an Integer value but got %" PRIsVALUE, rb_obj_class(val));
+    }
+    c.i = NUM2LL(val); // raises RangeError if val is too big
+  } else {
+    if (!RB_FLOAT_TYPE_P(val)) {
+      rb_raise(eSharedDataError, "Expected a Float value but got %" PRIsVALUE, rb_obj_class(val));
+    }
+    c.f = RFLOAT_VALUE(val);
+  }
+  return c;
+}
+
+static inline VALUE value_from_cell(numeric_dtype dtype, cell c) {
+  return dtype == DTYPE_I64 ? LL2NUM(c.i) : DBL2NUM(c.f);
+}
+
+/* Is a < b? */
+static inline int cell_less(numeric_dtype dtype, cell a, cell b) {
+  return dtype == DTYPE_I64 ? a.i < b.i : a.f < b.f;
+}
+
+/*
+ * Can the values in data be stored as cells? If so return the dtype to use, :i64 or :f64, and otherwise return nil.
+ *
+ * data must be a non-empty Array, all of whose elements are Integers that fit into an int64_t or all of whose elements are Floats.
+ *
+ * - max_abs: if it isn't NULL and we return :i64, it is set to the largest magnitude of the values in data.
+ */
+static inline VALUE native_dtype_of(VALUE data, int64_t *max_abs) {
+  if (!RB_TYPE_P(data, T_ARRAY)) {
+    return Qnil;
+  }
+
+  long len = RARRAY_LEN(data);
+  if (len == 0) {
+    return Qnil;
+  }
+
+  if (RB_FLOAT_TYPE_P(RARRAY_AREF(data, 0))) {
+    for (long i = 1; i < len; i++) {
+      if (!RB_FLOAT_TYPE_P(RARRAY_AREF(data, i))) {
+        return Qnil;
+      }
+    }
+    return ID2SYM(rb_intern("f64"));
+  }
+
+  int64_t largest = 0;
+  for (long i = 0; i < len; i++) {
+    VALUE val = RARRAY_AREF(data, i);
+    int64_t c_val;
+
+    if (FIXNUM_P(val)) {
+      c_val = FIX2LONG(val);
+    } else if (RB_TYPE_P(val, T_BIGNUM) && rb_absint_numwords(val, 63, NULL) <= 1) {
+      c_val = NUM2LL(val);
+    } else {
+      return Qnil;
+    }
+
+    if (c_val == INT64_MIN) {
+      return Qnil;
+    }
+    int64_t abs_val = c_val < 0 ? -c_val : c_val;
+    if (abs_val > largest) {
+      largest = abs_val;
+    }
+  }
+
+  if (max_abs) {
+    *max_abs = largest;
+  }
+  return ID2SYM(rb_intern("i64"));
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * A "template" for the core of a Segment Tree, specialized at compile time for a node type and a combine operation.
+ *
+ * CSegmentTreeTemplate combines the values in its tree with Ruby lambdas and CNumericSegmentTree chooses its operation with a switch
+ * at every node. Here the combine step is a macro, so each specialization is a plain C loop over plain C values that the compiler can
+ * inline and optimize as it likes.
+ *
+ * Each inclusion of this file stamps out three static functions for a bottom-up tree in an array of 2n nodes, laid out as in
+ * segment_tree_template.c: the leaves are tree[n], ..., tree[2n - 1] and each internal node i < n combines its children 2i and 2i + 1.
+ *
+ * - NAME_build(tree, n): fill in the internal nodes, given the leaves.
+ * - NAME_query(tree, n, left, right): the combined value on left..right, which must be a non-empty interval inside 0...n.
+ * - NAME_update(tree, n, idx, leaf): set the leaf for index idx and recalculate its ancestors.
+ *
+ * Define these before including the file. They are #undef'd again at the end, so that the file can be included once for each
+ * specialization, as in typed_segment_tree.c.
+ *
+ * - SEGMENT_TREE_KERNEL_NAME: the prefix of the function names.
+ * - SEGMENT_TREE_KERNEL_NODE: the type of a node.
+ * - SEGMENT_TREE_KERNEL_COMBINE(a, b): an expression combining the values of two adjacent subintervals, with a from the one on the
+ *   left. It need not be commutative. It may evaluate its arguments more than once.
+ */
+
+#include <stddef.h>
+
+#ifndef SEGMENT_TREE_KERNEL_CAT
+#define SEGMENT_TREE_KERNEL_CAT_(a, b) a##_##b
+#define SEGMENT_TREE_KERNEL_CAT(a, b) SEGMENT_TREE_KERNEL_CAT_(a, b)
+#endif
+
+#if !defined(SEGMENT_TREE_KERNEL_NAME) || !defined(SEGMENT_TREE_KERNEL_NODE) || !defined(SEGMENT_TREE_KERNEL_COMBINE)
+#error "Define SEGMENT_TREE_KERNEL_NAME, SEGMENT_TREE_KERNEL_NODE and SEGMENT_TREE_KERNEL_COMBINE before including segment_tree_kernel.h"
+#endif
+
+#define STK_FN(suffix) SEGMENT_TREE_KERNEL_CAT(SEGMENT_TREE_KERNEL_NAME, suffix)
+#define STK_NODE SEGMENT_TREE_KERNEL_NODE
+#define STK_COMBINE(a, b) SEGMENT_TREE_KERNEL_COMBINE(a, b)
+
+/*
+ * We build a level at a time rather than in one loop from n - 1 down to the root. The children of the nodes lo...hi on a level are
+ * in 2lo...2hi, which don't overlap the level itself, so the loop over the level has no dependencies from one iteration to the next
+ * and the compiler is free to vectorize it.
+ *
+ * Unless n is a power of two a "level" here isn't quite a level of the tree, but the argument is the same: a node i in lo...hi has
+ * children at 2i >= 2lo >= hi, which were done in an earlier pass.
+ */
+static void STK_FN(build)(STK_NODE *tree, size_t n) {
+  for (size_t hi = n; hi > 1; ) {
+    size_t lo = (hi + 1) / 2;
+    for (size_t i = lo; i < hi; i++) {
+      tree[i] = STK_COMBINE(tree[2 * i], tree[2 * i + 1]);
+    }
+    hi = lo;
+  }
+}
+
+/*
+ * The left- and right-hand results are kept apart so that values are combined in the order of their subintervals. See
+ * determine_val() in segment_tree_template.c.
+ */
+static inline STK_NODE STK_FN(query)(const STK_NODE *tree, size_t n, size_t left, size_t right) {
+  STK_NODE left_result = { 0 }, right_result = { 0 };
+  int have_left = 0, have_right = 0;
+
+  size_t l = left + n;
+  size_t r = right + n + 1;
+
+  while (l < r) {
+    if (l & 1) {
+      left_result = have_left ? STK_COMBINE(left_result, tree[l]) : tree[l];
+      have_left = 1;
+      l++;
+    }
+    if (r & 1) {
+      r--;
+      right_result = have_right ? STK_COMBINE(tree[r], right_result) : tree[r];
+      have_right = 1;
+    }
+    l >>= 1;
+    r >>= 1;
+  }
+
+  if (have_left && have_right) {
+    return STK_COMBINE(left_result, right_result);
+  }
+  return have_left ? left_result : right_result;
+}
+
+static void STK_FN(update)(STK_NODE *tree, size_t n, size_t idx, STK_NODE leaf) {
+  size_t i = idx + n;
+
+  tree[i] = leaf;
+  for (i >>= 1; i >= 1; i >>= 1) {
+    tree[i] = STK_COMBINE(tree[2 * i], tree[2 * i + 1]);
+  }
+}
+
+#undef STK_FN
+#undef STK_NODE
+#undef STK_COMBINE
+
+#undef SEGMENT_TREE_KERNEL_NAME
+#undef SEGMENT_TREE_KERNEL_NODE
+#undef SEGMENT_TREE_KERNEL_COMBINE
@@ -1,6 +1,14 @@
 #include "ruby.h"
 #include "shared.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 /*
  * Arithmetic for in-array binary tree
  */
@@ -30,4 +38,308 @@ unsigned long checked_nonneg_fixnum(VALUE val) {
   return c_val;
 }
 
+/*
+ * Large flat arrays
+ */
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static int mapped_array_p(size_t count, size_t elt_size) {
+  return count * elt_size >= NATIVE_ARRAY_MAP_THRESHOLD;
+}
+
+static size_t mapped_array_length(size_t count, size_t elt_size) {
+  return (count * elt_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+void *native_array_alloc(size_t count, size_t elt_size) {
+  if (elt_size > 0 && count > (SIZE_MAX - 2 * HUGE_PAGE_SIZE) / elt_size) {
+    rb_memerror();
+  }
+  if (!mapped_array_p(count, elt_size)) {
+    return ruby_xcalloc(count, elt_size);
+  }
+
+  // mmap only promises page alignment, so we map an extra huge page and trim the ends
+  size_t length = mapped_array_length(count, elt_size);
+  char *base = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    rb_memerror();
+  }
+  char *aligned = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+  size_t head = aligned - base;
+  if (head > 0) {
+    munmap(base, head);
+  }
+  if (HUGE_PAGE_SIZE - head > 0) {
+    munmap(aligned + length, HUGE_PAGE_SIZE - head);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, length, MADV_HUGEPAGE); // only advice: we don't care if it fails
+#endif
+
+  rb_gc_adjust_memory_usage((ssize_t)length);
+  return aligned;
+}
+
+void native_array_free(void *ptr, size_t count, size_t elt_size) {
+  if (!ptr) {
+    return;
+  }
+  if (!mapped_array_p(count, elt_size)) {
+    ruby_xfree(ptr);
+    return;
+  }
+
+  size_t length = mapped_array_length(count, elt_size);
+  munmap(ptr, length);
+  rb_gc_adjust_memory_usage(-(ssize_t)length);
+}
+
+size_t native_array_memsize(size_t count, size_t elt_size) {
+  return mapped_array_p(count, elt_size) ? mapped_array_length(count, elt_size) : count * elt_size;
+}
+
+static size_t aligned_array_padding() {
+  return CACHE_LINE_SIZE + sizeof(void *);
+}
+
+void *native_aligned_array_alloc(size_t count, size_t elt_size) {
+  if (mapped_array_p(count, elt_size)) {
+    return native_array_alloc(count, elt_size);
+  }
+  if (elt_size > 0 && count > (SIZE_MAX - aligned_array_padding()) / elt_size) {
+    rb_memerror();
+  }
+
+  char *base = ruby_xcalloc(1, count * elt_size + aligned_array_padding());
+  void **aligned = (void **)(((uintptr_t)base + sizeof(void *) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+  aligned[-1] = base;
+  return aligned;
+}
+
+void native_aligned_array_free(void *ptr, size_t count, size_t elt_size) {
+  if (!ptr) {
+    return;
+  }
+  if (mapped_array_p(count, elt_size)) {
+    native_array_free(ptr, count, elt_size);
+    return;
+  }
+  ruby_xfree(((void **)ptr)[-1]);
+}
+
+size_t native_aligned_array_memsize(size_t count, size_t elt_size) {
+  return mapped_array_p(count, elt_size) ? mapped_array_length(count, elt_size) : count * elt_size + aligned_array_padding();
+}
+
+/*
+ * Hot-path counters
+ */
+void stat_to_hash(VALUE hash, const char *name, uint64_t value) {
+  rb_hash_aset(hash, ID2SYM(rb_intern(name)), ULL2NUM(value));
+}
+
+/*
+ * Batched pairs of indices
+ */
+void read_index_pairs(int argc, VALUE *argv, index_pairs *pairs) {
+  VALUE lefts, rights;
+  rb_scan_args(argc, argv, "11", &lefts, &rights);
 
+  if (NIL_P(rights)) {
+    StringValue(lefts);
+    long len = RSTRING_LEN(lefts);
+    if (len % (2 * sizeof(int64_t)) != 0) {
+      rb_raise(rb_eArgError, "packed index pairs must be a whole number of pairs of int64 values (got %ld bytes)", len);
+    }
+    pairs->count = len / (2 * sizeof(int64_t));
+    pairs->packed = RSTRING_PTR(lefts);
+  } else {
+    Check_Type(lefts, T_ARRAY);
+    Check_Type(rights, T_ARRAY);
+    if (RARRAY_LEN(lefts) != RARRAY_LEN(rights)) {
+      rb_raise(rb_eArgError, "lefts and rights must have the same size (%ld != %ld)", RARRAY_LEN(lefts), RARRAY_LEN(rights));
+    }
+    pairs->count = RARRAY_LEN(lefts);
+    pairs->packed = NULL;
+  }
+  pairs->lefts = lefts;
+  pairs->rights = rights;
+}
+
+void index_pair_at(const index_pairs *pairs, long i, size_t *left, size_t *right) {
+  if (pairs->packed) {
+    int64_t vals[2];
+    memcpy(vals, pairs->packed + 2 * i * sizeof(int64_t), sizeof(vals));
+    if (vals[0] < 0 || vals[1] < 0) {
+      rb_raise(eSharedDataError, "Value must be non-negative");
+    }
+    *left = vals[0];
+    *right = vals[1];
+  } else {
+    *left = checked_nonneg_fixnum(RARRAY_AREF(pairs->lefts, i));
+    *right = checked_nonneg_fixnum(RARRAY_AREF(pairs->rights, i));
+  }
+}
+
+/*
+ * Batched indices
+ */
+void read_index_list(VALUE arg, index_list *list) {
+  if (RB_TYPE_P(arg, T_ARRAY)) {
+    list->count = RARRAY_LEN(arg);
+    list->packed = NULL;
+  } else {
+    StringValue(arg);
+    long len = RSTRING_LEN(arg);
+    if (len % sizeof(int64_t) != 0) {
+      rb_raise(rb_eArgError, "packed indices must be a whole number of int64 values (got %ld bytes)", len);
+    }
+    list->count = len / sizeof(int64_t);
+    list->packed = RSTRING_PTR(arg);
+  }
+  list->array = arg;
+}
+
+size_t index_list_at(const index_list *list, long i) {
+  if (list->packed) {
+    int64_t val;
+    memcpy(&val, list->packed + i * sizeof(int64_t), sizeof(val));
+    if (val < 0) {
+      rb_raise(eSharedDataError, "Value must be non-negative");
+    }
+    return val;
+  } else {
+    return checked_nonneg_fixnum(RARRAY_AREF(list->array, i));
+  }
+}
+
+/*
+ * Images
+ */
+#define IMAGE_BYTE_ORDER 0x01020304
+
+static size_t padding_for(size_t len) {
+  return (IMAGE_ALIGNMENT - len % IMAGE_ALIGNMENT) % IMAGE_ALIGNMENT;
+}
+
+static void check_image_header(const image_header *header, const char *kind, uint32_t version) {
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+    rb_raise(eSharedDataError, "Not an image of a native structure");
+  }
+  if (memcmp(header->kind, kind, sizeof(header->kind)) != 0) {
+    rb_raise(eSharedDataError, "Image is of a %.4s, not a %.4s", header->kind, kind);
+  }
+  if (header->byte_order != IMAGE_BYTE_ORDER) {
+    rb_raise(eSharedDataError, "Image was written on a machine with a different byte order");
+  }
+  if (header->version != version) {
+    rb_raise(eSharedDataError, "Image has version %u, but we can only read version %u", header->version, version);
+  }
+}
+
+void image_write_header(VALUE io, const char *kind, uint32_t version) {
+  image_header header;
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  memcpy(header.kind, kind, sizeof(header.kind));
+  header.version = version;
+  header.byte_order = IMAGE_BYTE_ORDER;
+
+  image_write(io, &header, sizeof(header));
+}
+
+void image_write(VALUE io, const void *ptr, size_t len) {
+  static const char zeros[IMAGE_ALIGNMENT] = { 0 };
+
+  if (len > 0) {
+    rb_io_write(io, rb_str_new(ptr, len));
+  }
+  size_t padding = padding_for(len);
+  if (padding > 0) {
+    rb_io_write(io, rb_str_new(zeros, padding));
+  }
+}
+
+void image_read_header(VALUE io, const char *kind, uint32_t version) {
+  image_header header;
+  image_read(io, &header, sizeof(header));
+  check_image_header(&header, kind, version);
+}
+
+void image_read(VALUE io, void *ptr, size_t len) {
+  size_t wanted = len + padding_for(len);
+  if (wanted == 0) {
+    return;
+  }
+
+  VALUE str = rb_funcall(io, rb_intern("read"), 1, SIZET2NUM(wanted));
+  if (NIL_P(str) || (size_t)RSTRING_LEN(StringValue(str)) != wanted) {
+    rb_raise(eSharedDataError, "Image is truncated");
+  }
+  memcpy(ptr, RSTRING_PTR(str), len);
+  RB_GC_GUARD(str);
+}
+
+void image_map(VALUE path, image_mapping *mapping, const char *kind, uint32_t version) {
+  mapping->base = NULL;
+  mapping->length = 0;
+  mapping->offset = 0;
+
+  FilePathValue(path);
+  int fd = open(StringValueCStr(path), O_RDONLY);
+  if (fd < 0) {
+    rb_sys_fail_str(path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int fstat_errno = errno;
+    close(fd);
+    errno = fstat_errno;
+    rb_sys_fail_str(path);
+  }
+  if ((size_t)st.st_size < sizeof(image_header)) {
+    close(fd);
+    rb_raise(eSharedDataError, "Image is truncated");
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  int mmap_errno = errno;
+  close(fd); // the mapping doesn't need the descriptor
+  if (base == MAP_FAILED) {
+    errno = mmap_errno;
+    rb_sys_fail_str(path);
+  }
+  mapping->base = base;
+  mapping->length = st.st_size;
+
+  check_image_header(image_mapped_part(mapping, sizeof(image_header)), kind, version);
+}
+
+void *image_mapped_part(image_mapping *mapping, size_t len) {
+  size_t wanted = len + padding_for(len);
+  if (wanted > mapping->length - mapping->offset) {
+    rb_raise(eSharedDataError, "Image is truncated");
+  }
+
+  void *part = mapping->base + mapping->offset;
+  mapping->offset += wanted;
+  return part;
+}
+
+void image_unmap(image_mapping *mapping) {
+  if (mapping->base) {
+    munmap(mapping->base, mapping->length);
+    mapping->base = NULL;
+  }
+}
+
+size_t image_array_bytes(size_t count, size_t elt_size) {
+  if (elt_size > 0 && count > (SIZE_MAX - IMAGE_ALIGNMENT) / elt_size) {
+    rb_raise(eSharedDataError, "Image has an impossible array size %zu", count);
+  }
+  return count * elt_size;
+}
@@ -2,15 +2,47 @@
 #define SHARED_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define mShared rb_define_module("Shared")
 #define eSharedDataError rb_const_get(mShared, rb_intern_const("DataError"))
+#define eSharedLogicError rb_const_get(mShared, rb_intern_const("LogicError"))
 #define eSharedInternalLogicError rb_const_get(mShared, rb_intern_const("InternalLogicError"))
+#define cSharedPoint rb_const_get(mShared, rb_intern_const("Point"))
 #define mDataStructuresRMolinari rb_define_module("DataStructuresRMolinari")
 
 //#define debug(...) printf(__VA_ARGS__)
 #define debug(...)
 
+/*
+ * Hot-path counters, reported as a Hash by #stats on the native structures that keep them. Even an increment costs something in
+ * the tightest loops, so they are compiled out unless DSRM_STATS is defined: uncomment the line below, as for debug(), or build the
+ * extensions with --enable-stats, as in gem install data_structures_rmolinari -- --enable-stats.
+ */
+//#define DSRM_STATS
+#ifdef DSRM_STATS
+#define count_stat(counter, n) ((counter) += (n))
+#else
+#define count_stat(counter, n)
+#endif
+
+/*
+ * Define #stats and #reset_stats on klass. When the counters are compiled out the methods are left unimplemented, so that
+ * respond_to?(:stats) is false and calling them raises NotImplementedError.
+ */
+#ifdef DSRM_STATS
+#define define_stats_methods(klass, stats_func, reset_func) \
+  (rb_define_method((klass), "stats", (stats_func), 0), rb_define_method((klass), "reset_stats", (reset_func), 0))
+#else
+#define define_stats_methods(klass, stats_func, reset_func) \
+  (rb_define_method((klass), "stats", rb_f_notimplement, -1), rb_define_method((klass), "reset_stats", rb_f_notimplement, -1))
+#endif
+
+/*
+ * Set hash[:name] = value, for building the Hash returned by #stats.
+ */
+void stat_to_hash(VALUE hash, const char *name, uint64_t value);
+
 /* What we might think of as vector[index] for a CC vec(foo). It is assignable */
 #define lval(vector, index) (*get(vector, index))
 
@@ -27,4 +59,149 @@ size_t right_child(size_t i);
  */
 unsigned long checked_nonneg_fixnum(VALUE val);
 
+/*
+ * Large flat arrays for the native structures: their trees, tables and coordinate arrays.
+ *
+ * A small array comes from Ruby's allocator. An array of at least NATIVE_ARRAY_MAP_THRESHOLD bytes gets an anonymous mapping of its
+ * own, aligned to and rounded up to a whole number of HUGE_PAGE_SIZE pages, and where the kernel supports it we ask for transparent
+ * huge pages. Then the lookups in a big tree miss in the TLB much less often. The GC doesn't see mapped memory by itself, so we report
+ * it with rb_gc_adjust_memory_usage() and it counts toward the malloc budget just as the small arrays do.
+ *
+ * The arrays are zeroed. The count and elt_size given to native_array_free() and native_array_memsize() must be those given to
+ * native_array_alloc(). A NULL ptr is fine.
+ */
+#define NATIVE_ARRAY_MAP_THRESHOLD (2 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+
+void *native_array_alloc(size_t count, size_t elt_size);
+void native_array_free(void *ptr, size_t count, size_t elt_size);
+
+/*
+ * The memory actually taken by such an array, for the dsize functions.
+ */
+size_t native_array_memsize(size_t count, size_t elt_size);
+
+/*
+ * The same, but a small array also starts on a cache-line boundary. (A mapped one already starts on a huge page.) Ruby's allocator
+ * makes no such promise, so we take a little more from it and keep the pointer it gave us just before the array.
+ */
+#define CACHE_LINE_SIZE 64
+
+void *native_aligned_array_alloc(size_t count, size_t elt_size);
+void native_aligned_array_free(void *ptr, size_t count, size_t elt_size);
+size_t native_aligned_array_memsize(size_t count, size_t elt_size);
+
+/*
+ * A batch of (left, right) pairs of indices handed to us by Ruby code for a "_many" method. It is given either as
+ * - two Arrays of non-negative Integers, lefts and rights, of the same length, or
+ * - a single String of packed int64 values l0, r0, l1, r1, ..., in native byte order as made by Array#pack('q*').
+ */
+typedef struct {
+  long count;
+  VALUE lefts;
+  VALUE rights;
+  const char *packed; // NULL unless we were given a String
+} index_pairs;
+
+/*
+ * Check and read the arguments to a "_many" method. argc must be 1 (a packed String) or 2 (two Arrays)
+ */
+void read_index_pairs(int argc, VALUE *argv, index_pairs *pairs);
+
+/*
+ * Get the i-th pair from the batch, raising Shared::DataError if either value is negative.
+ */
+void index_pair_at(const index_pairs *pairs, long i, size_t *left, size_t *right);
+
+/*
+ * A batch of non-negative indices handed to us by Ruby code for a "_many" method. It is given either as an Array of Integers or as a
+ * String of packed int64 values, as made by Array#pack('q*').
+ */
+typedef struct {
+  long count;
+  VALUE array;
+  const char *packed; // NULL unless we were given a String
+} index_list;
+
+/*
+ * Check and read the argument to a "_many" method that takes a list of indices.
+ */
+void read_index_list(VALUE arg, index_list *list);
+
+/*
+ * Get the i-th value from the list, raising Shared::DataError if it is negative.
+ */
+size_t index_list_at(const index_list *list, long i);
+
+/*
+ * Images: the native structures can dump themselves to an IO and be loaded back without being rebuilt.
+ *
+ * An image is an image_header, followed by a fixed-size preamble of the structure's own, followed by its raw arrays. Everything is
+ * in native byte order and word size, so an image can only be loaded on the sort of machine that wrote it. Each part is padded to a
+ * multiple of IMAGE_ALIGNMENT bytes so that, when a file image is mmap'd, the arrays in it are aligned and can be used in place.
+ */
+#define IMAGE_MAGIC "DSRM"
+#define IMAGE_ALIGNMENT 8
+
+typedef struct {
+  char magic[4]; // IMAGE_MAGIC
+  char kind[4]; // which structure the image is of, like "CPST"
+  uint32_t version; // the version of the structure's own image format
+  uint32_t byte_order; // a known value as written by the dumping machine, so we can detect a foreign image
+} image_header;
+
+/*
+ * Write the header for an image of the given kind to io.
+ */
+void image_write_header(VALUE io, const char *kind, uint32_t version);
+
+/*
+ * Write len bytes from ptr to io, followed by padding.
+ */
+void image_write(VALUE io, const void *ptr, size_t len);
+
+/*
+ * Read an image header from io and check that it is for the given kind and version, raising Shared::DataError if not.
+ */
+void image_read_header(VALUE io, const char *kind, uint32_t version);
+
+/*
+ * Read len bytes written by image_write from io into ptr, raising Shared::DataError if the image is truncated.
+ */
+void image_read(VALUE io, void *ptr, size_t len);
+
+/*
+ * A file image mapped into memory with mmap. The mapping is private and copy-on-write: pages are shared with the page cache - and
+ * so with other processes mapping the same file - until we write to them.
+ */
+typedef struct {
+  char *base; // NULL when nothing is mapped
+  size_t length;
+  size_t offset; // where the next part of the image starts
+} image_mapping;
+
+/*
+ * Map the file at path, which is the Ruby String or Pathname given to an open() method, and check its header as image_read_header()
+ * does. Raises a SystemCallError if the file can't be mapped.
+ *
+ * The mapping is initialized first thing, so that if we raise partway through, image_unmap() still does the right thing.
+ */
+void image_map(VALUE path, image_mapping *mapping, const char *kind, uint32_t version);
+
+/*
+ * The next len bytes of a mapped image, written by image_write. Raises Shared::DataError if the image is truncated.
+ */
+void *image_mapped_part(image_mapping *mapping, size_t len);
+
+/*
+ * Unmap an image, if anything is mapped.
+ */
+void image_unmap(image_mapping *mapping);
+
+/*
+ * The number of bytes taken by count elements of the given size, raising Shared::DataError if it overflows. We use it on counts
+ * read from an image, which we can't trust.
+ */
+size_t image_array_bytes(size_t count, size_t elt_size);
+
 #endif
@@ -0,0 +1,317 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/*
+ * Reductions over short runs of unboxed values: the sum, minimum or maximum of count int64_t or double cells, for count >= 1.
+ *
+ * Each comes in up to three versions.
+ * - A portable scalar loop.
+ * - AVX2, on x86-64 when the compiler supports it (HAVE_AVX2, from extconf_shared.rb). These functions are compiled with a target
+ *   attribute, so the rest of the extension is built for the baseline ISA, and are only chosen if the CPU we are running on has
+ *   AVX2.
+ * - NEON, on aarch64 (HAVE_NEON), where it is always available.
+ *
+ * simd_reducer() picks the best version for the operation, dtype and CPU.
+ *
+ * The vector versions add up doubles in a different order from the scalar loop, so float sums can differ in the last bits. Max and
+ * min return one of the values, except that we don't promise anything about which NaN wins.
+ *
+ * Like numeric.h, everything here is static so that each extension gets its own copy.
+ */
+
+#include "numeric.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+typedef cell (*simd_reduce_fn)(const cell *cells, size_t count);
+
+/************************************************************
+ * Scalar
+ */
+
+static cell scalar_sum_i64(const cell *cells, size_t count) {
+  cell result = { .i = 0 };
+  for (size_t i = 0; i < count; i++) {
+    result.i += cells[i].i;
+  }
+  return result;
+}
+
+static cell scalar_max_i64(const cell *cells, size_t count) {
+  cell result = cells[0];
+  for (size_t i = 1; i < count; i++) {
+    result.i = cells[i].i > result.i ? cells[i].i : result.i;
+  }
+  return result;
+}
+
+static cell scalar_min_i64(const cell *cells, size_t count) {
+  cell result = cells[0];
+  for (size_t i = 1; i < count; i++) {
+    result.i = cells[i].i < result.i ? cells[i].i : result.i;
+  }
+  return result;
+}
+
+static cell scalar_sum_f64(const cell *cells, size_t count) {
+  cell result = { .f = 0.0 };
+  for (size_t i = 0; i < count; i++) {
+    result.f += cells[i].f;
+  }
+  return result;
+}
+
+static cell scalar_max_f64(const cell *cells, size_t count) {
+  cell result = cells[0];
+  for (size_t i = 1; i < count; i++) {
+    result.f = result.f < cells[i].f ? cells[i].f : result.f;
+  }
+  return result;
+}
+
+static cell scalar_min_f64(const cell *cells, size_t count) {
+  cell result = cells[0];
+  for (size_t i = 1; i < count; i++) {
+    result.f = cells[i].f < result.f ? cells[i].f : result.f;
+  }
+  return result;
+}
+
+/*
+ * End scalar
+ ************************************************************/
+
+/************************************************************
+ * AVX2: four 64-bit lanes. Runs of fewer than four cells go to the scalar loop.
+ *
+ * AVX2 has no 64-bit integer max or min, so we compare and blend.
+ */
+#ifdef HAVE_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static cell avx2_sum_i64(const cell *cells, size_t count) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(cells + i)));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+
+  cell result = { .i = lanes[0] + lanes[1] + lanes[2] + lanes[3] };
+  for (; i < count; i++) {
+    result.i += cells[i].i;
+  }
+  return result;
+}
+
+/*
+ * Max and min for int64 differ only in which way round we compare.
+ */
+#define DEFINE_AVX2_EXTREME_I64(name, BETTER)                                 \
+  AVX2 static cell avx2_##name##_i64(const cell *cells, size_t count) {       \
+    if (count < 4) {                                                          \
+      return scalar_##name##_i64(cells, count);                               \
+    }                                                                         \
+    __m256i acc = _mm256_loadu_si256((const __m256i *)cells);                 \
+    size_t i = 4;                                                             \
+    for (; i + 4 <= count; i += 4) {                                          \
+      __m256i v = _mm256_loadu_si256((const __m256i *)(cells + i));           \
+      acc = _mm256_blendv_epi8(acc, v, BETTER(v, acc));                       \
+    }                                                                         \
+    cell lanes[4];                                                            \
+    _mm256_storeu_si256((__m256i *)lanes, acc);                               \
+    cell result = scalar_##name##_i64(lanes, 4);                              \
+    if (i < count) {                                                          \
+      cell rest = scalar_##name##_i64(cells + i, count - i);                  \
+      lanes[0] = result;                                                      \
+      lanes[1] = rest;                                                        \
+      result = scalar_##name##_i64(lanes, 2);                                 \
+    }                                                                         \
+    return result;                                                            \
+  }
+
+#define AVX2_GREATER(a, b) _mm256_cmpgt_epi64((a), (b))
+#define AVX2_LESS(a, b) _mm256_cmpgt_epi64((b), (a))
+DEFINE_AVX2_EXTREME_I64(max, AVX2_GREATER)
+DEFINE_AVX2_EXTREME_I64(min, AVX2_LESS)
+
+/*
+ * The double versions all have the same shape: an accumulator of four lanes, which we then reduce with the scalar code.
+ */
+#define DEFINE_AVX2_F64(name, START, STEP)                                    \
+  AVX2 static cell avx2_##name##_f64(const cell *cells, size_t count) {       \
+    if (count < 4) {                                                          \
+      return scalar_##name##_f64(cells, count);                               \
+    }                                                                         \
+    __m256d acc = START;                                                      \
+    size_t i = 4;                                                             \
+    for (; i + 4 <= count; i += 4) {                                          \
+      acc = STEP(acc, _mm256_loadu_pd((const double *)(cells + i)));          \
+    }                                                                         \
+    cell lanes[6];                                                            \
+    _mm256_storeu_pd((double *)lanes, acc);                                   \
+    size_t lane_count = 4;                                                    \
+    if (i < count) {                                                          \
+      lanes[lane_count++] = scalar_##name##_f64(cells + i, count - i);        \
+    }                                                                         \
+    return scalar_##name##_f64(lanes, lane_count);                            \
+  }
+
+DEFINE_AVX2_F64(sum, _mm256_loadu_pd((const double *)cells), _mm256_add_pd)
+DEFINE_AVX2_F64(max, _mm256_loadu_pd((const double *)cells), _mm256_max_pd)
+DEFINE_AVX2_F64(min, _mm256_loadu_pd((const double *)cells), _mm256_min_pd)
+
+#undef AVX2
+#endif
+
+/*
+ * End AVX2
+ ************************************************************/
+
+/************************************************************
+ * NEON: two 64-bit lanes. Runs of fewer than two cells go to the scalar loop.
+ */
+#ifdef HAVE_NEON
+
+static cell neon_sum_i64(const cell *cells, size_t count) {
+  int64x2_t acc = vdupq_n_s64(0);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    acc = vaddq_s64(acc, vld1q_s64(&cells[i].i));
+  }
+
+  cell result = { .i = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1) };
+  if (i < count) {
+    result.i += cells[i].i;
+  }
+  return result;
+}
+
+static cell neon_max_i64(const cell *cells, size_t count) {
+  if (count < 2) {
+    return cells[0];
+  }
+  int64x2_t acc = vld1q_s64(&cells[0].i);
+  size_t i = 2;
+  for (; i + 2 <= count; i += 2) {
+    int64x2_t v = vld1q_s64(&cells[i].i);
+    acc = vbslq_s64(vcgtq_s64(v, acc), v, acc);
+  }
+
+  cell lanes[3] = { { .i = vgetq_lane_s64(acc, 0) }, { .i = vgetq_lane_s64(acc, 1) } };
+  size_t lane_count = 2;
+  if (i < count) {
+    lanes[lane_count++] = cells[i];
+  }
+  return scalar_max_i64(lanes, lane_count);
+}
+
+static cell neon_min_i64(const cell *cells, size_t count) {
+  if (count < 2) {
+    return cells[0];
+  }
+  int64x2_t acc = vld1q_s64(&cells[0].i);
+  size_t i = 2;
+  for (; i + 2 <= count; i += 2) {
+    int64x2_t v = vld1q_s64(&cells[i].i);
+    acc = vbslq_s64(vcgtq_s64(acc, v), v, acc);
+  }
+
+  cell lanes[3] = { { .i = vgetq_lane_s64(acc, 0) }, { .i = vgetq_lane_s64(acc, 1) } };
+  size_t lane_count = 2;
+  if (i < count) {
+    lanes[lane_count++] = cells[i];
+  }
+  return scalar_min_i64(lanes, lane_count);
+}
+
+#define DEFINE_NEON_F64(name, STEP)                                           \
+  static cell neon_##name##_f64(const cell *cells, size_t count) {            \
+    if (count < 2) {                                                          \
+      return cells[0];                                                        \
+    }                                                                         \
+    float64x2_t acc = vld1q_f64(&cells[0].f);                                 \
+    size_t i = 2;                                                             \
+    for (; i + 2 <= count; i += 2) {                                          \
+      acc = STEP(acc, vld1q_f64(&cells[i].f));                                \
+    }                                                                         \
+    cell lanes[3] = { { .f = vgetq_lane_f64(acc, 0) }, { .f = vgetq_lane_f64(acc, 1) } }; \
+    size_t lane_count = 2;                                                    \
+    if (i < count) {                                                          \
+      lanes[lane_count++] = cells[i];                                         \
+    }                                                                         \
+    return scalar_##name##_f64(lanes, lane_count);                            \
+  }
+
+DEFINE_NEON_F64(sum, vaddq_f64)
+DEFINE_NEON_F64(max, vmaxq_f64)
+DEFINE_NEON_F64(min, vminq_f64)
+
+#endif
+
+/*
+ * End NEON
+ ************************************************************/
+
+/*
+ * Which instruction set simd_reducer() uses on this CPU: "avx2", "neon" or "scalar".
+ */
+static inline const char *simd_isa(void) {
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return "avx2";
+  }
+#endif
+#ifdef HAVE_NEON
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+/*
+ * The reduction for the operation and dtype, or NULL if there isn't one (for OP_INDEX_OF_MAX).
+ */
+static inline simd_reduce_fn simd_reducer(numeric_op operation, numeric_dtype dtype) {
+  int i64 = dtype == DTYPE_I64;
+
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    switch (operation) {
+    case OP_SUM: return i64 ? avx2_sum_i64 : avx2_sum_f64;
+    case OP_MAX: return i64 ? avx2_max_i64 : avx2_max_f64;
+    case OP_MIN: return i64 ? avx2_min_i64 : avx2_min_f64;
+    default: return NULL;
+    }
+  }
+#endif
+
+#ifdef HAVE_NEON
+  switch (operation) {
+  case OP_SUM: return i64 ? neon_sum_i64 : neon_sum_f64;
+  case OP_MAX: return i64 ? neon_max_i64 : neon_max_f64;
+  case OP_MIN: return i64 ? neon_min_i64 : neon_min_f64;
+  default: return NULL;
+  }
+#else
+  switch (operation) {
+  case OP_SUM: return i64 ? scalar_sum_i64 : scalar_sum_f64;
+  case OP_MAX: return i64 ? scalar_max_i64 : scalar_max_f64;
+  case OP_MIN: return i64 ? scalar_min_i64 : scalar_min_f64;
+  default: return NULL;
+  }
+#endif
+}
+
+#endif
@@ -17,7 +17,9 @@ require_relative 'data_structures_rmolinari/c_disjoint_union' # version as a C e
 require_relative 'data_structures_rmolinari/segment_tree'
 
 require_relative 'data_structures_rmolinari/heap'
+require_relative 'data_structures_rmolinari/c_heap' # version as a C extension
 require_relative 'data_structures_rmolinari/max_priority_search_tree'
+require_relative 'data_structures_rmolinari/c_max_priority_search_tree' # version as a C extension
 require_relative 'data_structures_rmolinari/min_priority_search_tree'
 
 module DataStructuresRMolinari
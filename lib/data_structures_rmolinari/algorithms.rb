@@ -16,10 +16,65 @@ module DataStructuresRMolinari::Algorithms
   # 310-327.
   #
   # It runs in O(m log n) time, where m is the number of MERs enumerated and n is the number of points in P.  (Contructing the
-  # MaxPST takes O(n log^2 n) time, but m = O(n^2) so we are still O(m log n) overall.)
+  # MaxPST takes O(n log n) time, so we are still O(m log n) overall.)
+  #
+  # For a large P, use +maximal_empty_rectangles_packed+, which does the whole job in C and returns the rectangles as packed doubles.
+  #
+  # @param points [Array] an array of points in the x-y plane. Each must respond to +x+ and +y+.
+  def self.maximal_empty_rectangles(points, &)
+    each_maximal_empty_rectangle(points, nil, &)
+  end
+
+  # The largest maximal empty rectangles for P. See +maximal_empty_rectangles+.
+  #
+  # Rather than enumerating all of the MERs and filtering them afterwards we keep the best rectangles found so far in a Heap and skip
+  # the parts of the search that can't produce a rectangle large enough to be kept. Every rectangle we find in the type 3 sweep is
+  # limited in height by its top, and the tops come in decreasing order, so once the limit is too small we can stop altogether. How
+  # much this saves depends on the points and how selective the request is. In the worst case we do as much work as
+  # +maximal_empty_rectangles+.
   #
   # @param points [Array] an array of points in the x-y plane. Each must respond to +x+ and +y+.
-  def self.maximal_empty_rectangles(points)
+  # @param k [Integer] return (at most) the k rectangles of largest area.
+  # @param min_area [Numeric] return only rectangles with at least this area.
+  #   At least one of +k+ and +min_area+ must be given.
+  # @return [Array] the rectangles, each as [left, right, bottom, top], in descending order of area. Ties are in no particular order.
+  def self.largest_empty_rectangles(points, k: nil, min_area: nil)
+    raise ArgumentError, 'At least one of k: and min_area: must be given' if k.nil? && min_area.nil?
+    raise DataError, "k must not be negative (#{k})" if k&.negative?
+    return [] if k&.zero?
+
+    floor = min_area || -INFINITY
+    found = DataStructuresRMolinari::Heap.new(addressable: false) # a min-heap on area
+
+    # The smallest area worth finding
+    threshold = lambda do
+      k && found.size >= k ? [found.top_priority, floor].max : floor
+    end
+
+    each_maximal_empty_rectangle(points, threshold) do |rect|
+      left, right, bottom, top = rect
+      area = (right - left) * (top - bottom)
+      next if area < floor
+
+      if k.nil? || found.size < k
+        found.insert(rect, area)
+      elsif area > found.top_priority
+        found.pop
+        found.insert(rect, area)
+      end
+    end
+
+    found.pop_many(found.size).reverse
+  end
+
+  # The engine of maximal_empty_rectangles.
+  #
+  # When threshold is not nil it is a lambda giving the smallest area the caller is still interested in. It must never decrease. We
+  # then skip work that can only find smaller rectangles. Some smaller ones may still be yielded.
+  private_class_method def self.each_maximal_empty_rectangle(points, threshold)
+    # Can the rectangles of width at most w and height at most h be skipped?
+    too_small = ->(w, h) { threshold && w * h < threshold.call }
+
     # We break the emtpy rectangles into three types
     #   1. bounded at bottom and top by y_min and y_max
     #   2. bounded at the top by y_max and at the bottom by one of the points of P
@@ -44,14 +99,18 @@ module DataStructuresRMolinari::Algorithms
 
     # Enumerate type 2. We consider each point of P and work out the largest rectangle bounded below by P and above by y_max. The
     # points constraining us on the left and right are given by queries on the MaxPST.
-    points.each do |pt|
-      next if pt.y == y_max # 0 area
-      next if pt.y == y_min # type 1
+    #
+    # The queries for all the points are independent so we make them as two batches.
+    candidates = points.reject { |pt| pt.y == y_max || pt.y == y_min } # 0 area and type 1, respectively
+    candidates.reject! { |pt| too_small.call(x_max - x_min, y_max - pt.y) } if threshold
+    xs = candidates.map(&:x)
+    ys = candidates.map(&:y)
 
-      # Open region means we don't just get pt back again. The De et al. paper is rather vague.
-      left_bound  = max_pst.largest_x_in_nw(pt.x, pt.y, open: true)
-      right_bound = max_pst.smallest_x_in_ne(pt.x, pt.y, open: true)
+    # Open region means we don't just get pt back again. The De et al. paper is rather vague.
+    left_bounds  = max_pst.largest_x_in_nw_many(xs, ys, open: true)
+    right_bounds = max_pst.smallest_x_in_ne_many(xs, ys, open: true)
 
+    candidates.zip(left_bounds, right_bounds).each do |pt, left_bound, right_bound|
       left = left_bound.x.infinite? ? x_min : left_bound.x
       right = right_bound.x.infinite? ? x_max : right_bound.x
       next if left == right
@@ -75,10 +134,16 @@ module DataStructuresRMolinari::Algorithms
       next if top == y_max # this one is type 1 or 2
       next if top == y_min # zero area: no good
 
+      # The tops only get lower from here on
+      break if too_small.call(x_max - x_min, top - y_min)
+
       l = x_min
       r = x_max
 
       loop do
+        # The rectangles only get narrower from here on
+        break if too_small.call(r - l, top - y_min)
+
         next_pt = max_pst.largest_y_in_3_sided(l, r, y_min, open: true)
 
         bottom = next_pt.y.infinite? ? y_min : next_pt.y
@@ -75,8 +75,34 @@ class DataStructuresRMolinari::DisjointUnion
     @d[x]
   end
 
+  # Unite each of a batch of pairs of elements. Pairs in which both elements are the same are skipped (rather than raising an error
+  # as +unite+ does).
+  #
+  # @param firsts an Array of elements, or a String of packed int64 values e0, f0, e1, f1, ... as made by Array#pack('q*')
+  # @param seconds an Array of the same size as firsts. It must be omitted when firsts is a String.
+  def unite_many(firsts, seconds = nil)
+    firsts, seconds = firsts.unpack('q*').partition.with_index { |_, i| i.even? } if seconds.nil?
+    raise ArgumentError, "firsts and seconds must have the same size (#{firsts.size} != #{seconds.size})" unless firsts.size == seconds.size
+
+    firsts.each_with_index do |e, i|
+      f = seconds[i]
+      unite(e, f) unless e == f
+    end
+    nil
+  end
+
+  # The canonical representatives of a batch of elements.
+  #
+  # @param elements an Array of elements, or a String of packed int64 values
+  # @return an Array of the representatives, or a String of packed int64 values if elements was a String
+  def find_many(elements)
+    return elements.map { find(_1) } if elements.is_a?(Array)
+
+    elements.unpack('q*').map { find(_1) }.pack('q*')
+  end
+
   private def check_value(v)
-    raise Shared::DataError, "Value #{v} is not part of the univserse." unless @d[v]
+    raise Shared::DataError, "Value #{v} is not part of the univserse." if v.negative? || !@d[v]
   end
 
   private def link(e, f)
@@ -26,15 +26,29 @@ require_relative 'shared'
 # - +update(item, priority)+
 #   - tell the heap that the priority of a particular item has changed
 #   - O(log N)
+# - +insert_many(items, priorities)+
+#   - add k new items at once
+#   - O(k log N), or O(N) when k is large enough that it is cheaper to rebuild the heap from scratch
+# - +pop_many(k)+
+#   - remove and return the top k items, in order
+#   - O(k log N)
 #
 # Here N is the number of elements in the heap.
 #
+# The class methods +from(items, priorities)+ and +heapify(pairs)+ build a heap from existing data in O(N) time using Floyd's
+# bottom-up construction. This is much quicker than inserting the items one at a time.
+#
 # The internal requirements needed to implement +update+ have several consequences.
 # - Items added to the heap must be distinct. Otherwise we would not know which occurrence to update
 # - There is some bookkeeping overhead.
 # If client code doesn't need to call +update+ then we can create a "non-addressable" heap that allows for the insertion of
 # duplicate items and has slightly faster runtime overall. See the arguments to the initializer.
 #
+# By default the tree is binary. A d-ary tree, in which each node has d children, is shallower, so +pop+ visits fewer levels but
+# makes more comparisons at each one. Since the children of a node are adjacent in memory, they are likely to share a cache line, and
+# for large heaps a small arity like 4 or 8 can be faster overall. See the +arity+ argument to the initializer and
+# benchmark/benchmark_heap.rb.
+#
 # References:
 #
 # - https://en.wikipedia.org/wiki/Binary_heap
@@ -60,9 +74,13 @@ class DataStructuresRMolinari::Heap
   #   - items added to the heap must be distinct.
   #   When falsy, priorities are not updateable but items may be inserted multiple times. Operations are slightly faster because
   #   there is less internal bookkeeping.
+  # @param arity the number of children of each node in the tree. It must be an Integer, at least 2.
   # @param debug when truthy, verify the heap property after each change that might violate it. This makes operations much slower.
-  def initialize(max_heap: false, addressable: true, debug: false)
+  def initialize(max_heap: false, addressable: true, arity: 2, debug: false)
+    raise DataError, "arity must be an Integer at least 2, not #{arity}" unless arity.is_a?(Integer) && arity >= 2
+
     @data = []
+    @arity = arity
     @size = 0
     @max_heap = max_heap
     @addressable = addressable
@@ -70,6 +88,24 @@ class DataStructuresRMolinari::Heap
     @debug = debug
   end
 
+  # Build a heap containing the given items in O(N) time.
+  #
+  # @param items an Array of the items
+  # @param priorities an Array of the same size. priorities[i] is the priority of items[i]. If omitted, each item is its own priority.
+  # @param options the keyword arguments to pass to the initializer
+  def self.from(items, priorities = items, **options)
+    heap = new(**options)
+    heap.insert_many(items, priorities)
+    heap
+  end
+
+  # Build a heap in O(N) time from an Array of [item, priority] pairs.
+  #
+  # @param options the keyword arguments to pass to the initializer
+  def self.heapify(pairs, **options)
+    from(pairs.map(&:first), pairs.map(&:last), **options)
+  end
+
   # Is the heap empty?
   def empty?
     @size.zero?
@@ -89,6 +125,35 @@ class DataStructuresRMolinari::Heap
     assign(d, @size)
 
     sift_up(@size)
+    check_heap_property if @debug
+  end
+
+  # Insert the given items into the heap.
+  #
+  # When there are enough new items compared to the size of the heap we add them all at the bottom and then rebuild the heap with
+  # Floyd's method, rather than sifting each one up.
+  #
+  # @param items an Array of the items to insert
+  #   - If the heap is addressable (the default) it is an error for any of them to be present already, or for there to be duplicates
+  #     among them. In that case the items before the offending one are inserted and the rest are not.
+  # @param priorities an Array of the same size. priorities[i] is the priority of items[i]. If omitted, each item is its own priority.
+  def insert_many(items, priorities = items)
+    raise ArgumentError, "items and priorities must have the same size (#{items.size} != #{priorities.size})" unless items.size == priorities.size
+
+    if rebuild_is_cheaper?(items.size)
+      begin
+        items.each_with_index { |item, i| append(item, priorities[i]) }
+      ensure
+        rebuild
+      end
+    else
+      items.each_with_index do |item, i|
+        append(item, priorities[i])
+        sift_up(@size)
+      end
+    end
+
+    check_heap_property if @debug
   end
 
   # Return the top of the heap without removing it
@@ -119,10 +184,20 @@ class DataStructuresRMolinari::Heap
     @index_of.delete(result) if @addressable
 
     sift_down(root) if @size.positive?
+    check_heap_property if @debug
 
     result
   end
 
+  # Remove the top k items from the heap
+  # @return an Array of the items, in the order +pop+ would have returned them. If there are fewer than k items in the heap we return
+  #   all of them.
+  def pop_many(k)
+    raise DataError, "Cannot pop a negative number (#{k}) of items" if k.negative?
+
+    Array.new([k, @size].min) { pop }
+  end
+
   # Update the priority of the given element and maintain the necessary heap properties.
   #
   # @param element the item whose priority we are updating. It is an error to update the priority of an element not already in the
@@ -165,23 +240,28 @@ class DataStructuresRMolinari::Heap
 
     x = @data[idx]
     while idx != root
-      i = parent(idx)
+      i = parent_of(idx)
       break unless less_than?(x, @data[i])
 
       assign(@data[i], idx)
       idx = i
     end
     assign(x, idx)
-
-    check_heap_property if @debug
   end
 
   # Filter the value at index down to its correct location. Algorithm from Edelkamp et. al.
   private def sift_down(idx)
     x = @data[idx]
 
-    while (j = left(idx)) <= @size
-      j += 1 if j + 1 <= @size && less_than?(@data[j + 1], @data[j])
+    while (j = first_child(idx)) <= @size
+      # Find the least of the children
+      last = j + @arity - 1
+      last = @size if last > @size
+      k = j + 1
+      while k <= last
+        j = k if less_than?(@data[k], @data[j])
+        k += 1
+      end
 
       break unless less_than?(@data[j], x)
 
@@ -189,8 +269,39 @@ class DataStructuresRMolinari::Heap
       idx = j
     end
     assign(x, idx)
+  end
 
-    check_heap_property if @debug
+  # Add a new pair at the bottom of the heap without restoring the heap property
+  private def append(item, priority)
+    raise DataError, "Heap already contains #{item}" if @addressable && contains?(item)
+
+    @size += 1
+    assign(InternalPair.new(item, priority), @size)
+  end
+
+  # Restore the heap property everywhere with Floyd's bottom-up method: sift down each node that has a child, from the bottom up. This
+  # takes O(N) time.
+  private def rebuild
+    return if @size < 2
+
+    parent_of(@size).downto(root) { |idx| sift_down(idx) }
+  end
+
+  # When inserting k new items, is it cheaper to rebuild the heap than to sift each one up? Rebuilding takes about N comparisons, while
+  # sifting up can take about log N for each new item.
+  private def rebuild_is_cheaper?(k)
+    n = @size + k
+    k * Math.log2(n + 1) > n
+  end
+
+  # The parent of the node at idx in the d-ary tree. The root is at 1 and the children of node i are at d(i - 1) + 2, ..., di + 1. When
+  # d = 2 these are the usual binary tree formulas.
+  private def parent_of(idx)
+    (idx - 2) / @arity + 1
+  end
+
+  private def first_child(idx)
+    @arity * (idx - 1) + 2
   end
 
   # Put the pair in the given heap location
@@ -221,12 +332,8 @@ class DataStructuresRMolinari::Heap
 
   # For debugging
   private def check_heap_property
-    (root..@size).each do |idx|
-      left = left(idx)
-      right = right(idx)
-
-      raise InternalLogicError, "Heap property violated by left child of index #{idx}" if left <= @size && less_than?(@data[left], @data[idx])
-      raise InternalLogicError, "Heap property violated by right child of index #{idx}" if right <= @size && less_than?(@data[right], @data[idx])
+    ((root + 1)..@size).each do |idx|
+      raise InternalLogicError, "Heap property violated by child #{idx} of index #{parent_of(idx)}" if less_than?(@data[idx], @data[parent_of(idx)])
     end
   end
 end
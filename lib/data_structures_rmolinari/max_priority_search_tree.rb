@@ -34,6 +34,14 @@ require_relative 'shared'
 # +smallest_x_in_ne+ with +open: true+ then we consider points satisifying x > x0 and y > y0. The default value for this parameter
 # is always +false+. See below for limitations in this functionality.
 #
+# Each of the four quadrant queries also has a batch version, such as +largest_y_in_ne_many+, that answers a query for each of a
+# list of corners (x0, y0). CMaxPrioritySearchTree answers such a batch in a single call into C.
+#
+# For big enumerations there are also
+#
+# - +count_3_sided+: for x0, x1, and y0, how many points are in P satisfying x >= x0, x <= x1 and y >= y0?
+# - +enumerate_3_sided_into+: write the coordinates of those points into a caller-supplied buffer, a chunk at a time.
+#
 # If the MaxPST is constructed to be "dynamic" we also have an operation that deletes the top element.
 #
 # - +delete_top!+: remove the top (max-y) element of the tree and return it.
@@ -181,12 +189,28 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     @size = @data.size
     @member_count = @size # these can diverge for dynamic PSTs
     @dynamic = dynamic
+    @y_sign = y_sign
 
     construct_pst
 
     verify_properties if verify
   end
 
+  # Construct a MaxPST from the coordinates of the points, given as two Strings of packed doubles in native byte order, as made by
+  # +Array#pack('d*')+.
+  #
+  # The Ruby tree needs objects for its points, so we make a Shared::Point for each pair of coordinates. CMaxPrioritySearchTree has a
+  # method of the same name that makes no objects at all.
+  def self.from_columns(xs, ys, dynamic: false, verify: false)
+    raise ArgumentError, 'packed coordinates must be a whole number of doubles' unless (xs.bytesize % 8).zero?
+
+    xs = xs.unpack('d*')
+    ys = ys.unpack('d*')
+    raise ArgumentError, "xs and ys must have the same size (#{xs.size} != #{ys.size})" unless xs.size == ys.size
+
+    new(xs.zip(ys).map { Point.new(*_1) }, dynamic:, verify:)
+  end
+
   def empty?
     @member_count.zero?
   end
@@ -256,14 +280,15 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
   private def largest_y_in_quadrant(x0, y0, quadrant)
     quadrant.must_be_in [:ne, :nw]
 
+    y_sign = @y_sign
     p = root
     if quadrant == :ne
-      best = Point.new(INFINITY, -INFINITY)
+      best = sentinel(INFINITY, -INFINITY)
       preferred_child = ->(n) { right(n) }
       nonpreferred_child = ->(n) { left(n) }
       sufficient_x = ->(x) { x >= x0 }
     else
-      best = Point.new(-INFINITY, -INFINITY)
+      best = sentinel(-INFINITY, -INFINITY)
       preferred_child = ->(n) { left(n) }
       nonpreferred_child = ->(n) { right(n) }
       sufficient_x = ->(x) { x <= x0 }
@@ -275,7 +300,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     exclusionary_x = ->(x) { x == x0 || !sufficient_x.call(x) }
 
     in_q = lambda do |pair|
-      sufficient_x.call(pair.x) && pair.y >= y0
+      sufficient_x.call(pair.x) && y_sign * pair.y >= y0
     end
 
     # From the paper:
@@ -285,7 +310,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     # We break ties by preferring points with smaller x values
     update_highest = lambda do |node|
       t = @data[node]
-      if in_q.call(t) && (t.y > best.y || (t.y == best.y && t.x < best.x))
+      if in_q.call(t) && (y_sign * t.y > y_sign * best.y || (y_sign * t.y == y_sign * best.y && t.x < best.x))
         best = t
       end
     end
@@ -298,7 +323,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
         # p \in Q and nothing in its subtree can beat it because of the max-heap
         update_highest.call(p)
         return best
-      elsif p_val.y < y0
+      elsif y_sign * p_val.y < y0
         # p is too low for Q, so the entire subtree is too low as well
         return best
       elsif (child = one_child?(p))
@@ -311,11 +336,11 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
         # Both children have sufficient x, so try the y-higher of them. Note that nothing else in either subtree will beat this one,
         # by the y-property of the PST
         higher = left(p)
-        if @data[right(p)].y > @data[left(p)].y
+        if y_sign * @data[right(p)].y > y_sign * @data[left(p)].y
           higher = right(p)
         end
         p = higher
-      elsif @data[preferred_child.call(p)].y < y0
+      elsif y_sign * @data[preferred_child.call(p)].y < y0
         # Nothing in the right subtree is in Q, but maybe we'll find something in the left
         p = nonpreferred_child.call(p)
       else
@@ -376,6 +401,53 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     end
   end
 
+  ########################################
+  # Batch quadrant queries
+
+  # The results of +largest_y_in_ne+ for a batch of corners (x0, y0).
+  #
+  # The corners are given either as
+  # - two Arrays of the same size, +xs+ and +ys+, in which case the corners are (xs[k], ys[k]); or
+  # - a single String of packed doubles x0, y0, x1, y1, ..., as made by +Array#pack('d*')+. In this case +ys+ is omitted.
+  #
+  # @return the points +largest_y_in_ne+ would return for each corner: an Array of them if the corners are given as Arrays, and a
+  #   String of their packed coordinates x, y, as doubles, if the corners are packed.
+  def largest_y_in_ne_many(xs, ys = nil, open: false)
+    quadrant_query_many(:largest_y_in_ne, xs, ys, open)
+  end
+
+  # The results of +largest_y_in_nw+ for a batch of corners. See +largest_y_in_ne_many+.
+  def largest_y_in_nw_many(xs, ys = nil, open: false)
+    quadrant_query_many(:largest_y_in_nw, xs, ys, open)
+  end
+
+  # The results of +smallest_x_in_ne+ for a batch of corners. See +largest_y_in_ne_many+.
+  def smallest_x_in_ne_many(xs, ys = nil, open: false)
+    quadrant_query_many(:smallest_x_in_ne, xs, ys, open)
+  end
+
+  # The results of +largest_x_in_nw+ for a batch of corners. See +largest_y_in_ne_many+.
+  def largest_x_in_nw_many(xs, ys = nil, open: false)
+    quadrant_query_many(:largest_x_in_nw, xs, ys, open)
+  end
+
+  private def quadrant_query_many(method, xs, ys, open)
+    if ys.nil?
+      unless (xs.bytesize % 16).zero?
+        raise ArgumentError, "packed coordinates must be a whole number of pairs of doubles (got #{xs.bytesize} bytes)"
+      end
+
+      return xs.unpack('d*').each_slice(2).flat_map do |x0, y0|
+        pt = send(method, x0, y0, open:)
+        [pt.x.to_f, pt.y.to_f]
+      end.pack('d*')
+    end
+
+    raise ArgumentError, "xs and ys must have the same size (#{xs.size} != #{ys.size})" unless xs.size == ys.size
+
+    xs.zip(ys).map { |x0, y0| send(method, x0, y0, open:) }
+  end
+
   # A genericized version of the paper's smallest_x_in_ne that can calculate either smallest_x_in_ne or largest_x_in_nw as specifies via a
   # parameter.
   #
@@ -391,12 +463,13 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
   private def extremal_in_x_dimension(x0, y0, quadrant)
     quadrant.must_be_in [:ne, :nw]
 
+    y_sign = @y_sign
     if quadrant == :ne
       sign = 1
-      best = Point.new(INFINITY, INFINITY)
+      best = sentinel(INFINITY, INFINITY)
     else
       sign = -1
-      best = Point.new(-INFINITY, INFINITY)
+      best = sentinel(-INFINITY, INFINITY)
     end
 
     return best if empty?
@@ -404,7 +477,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     p = q = root
 
     in_q = lambda do |pair|
-      sign * pair.x >= sign * x0 && pair.y >= y0
+      sign * pair.x >= sign * x0 && y_sign * pair.y >= y0
     end
 
     # From the paper:
@@ -446,7 +519,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
 
       if sign * @data[c.first].x > sign * x0
         # All subtrees have x-values good enough for Q. We look at y-values to work out which subtree to focus on
-        leftmost = c.find { |node| @data[node].y >= y0 } # might be nil
+        leftmost = c.find { |node| y_sign * @data[node].y >= y0 } # might be nil
 
         # Otherwise, explore the "leftmost" subtree with large enough y values. Its root is in Q and can't be beaten as "leftmost"
         # by anything to its "right". If it's nil the calling code can bail
@@ -464,8 +537,9 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
       i = (0...4).find { |j| sign * values[j].x <= sign * x0 && sign * x0 < sign * values[j + 1].x }
 
       # These nodes all have large-enough x values so looking at y finds the ones in Q
-      new_q = c[(i + 1)..].find { |node| @data[node].y >= y0 } # could be nil
-      new_p = c[i] if values[i].y >= y0 # The leftmost subtree is worth exploring if the y-value is big enough but not otherwise
+      new_q = c[(i + 1)..].find { |node| y_sign * @data[node].y >= y0 } # could be nil
+      # The leftmost subtree is worth exploring if the y-value is big enough but not otherwise
+      new_p = c[i] if y_sign * values[i].y >= y0
       new_p ||= new_q # if nodes[i] is no good, send p along with q
       new_q ||= new_p # but if there is no worthwhile value for q we should send it along with p
 
@@ -564,15 +638,16 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     #
     # Sometimes we don't have a relevant node to the left or right of Q. The booleans L and R (which we call left and right) track
     # whether p and q are defined at the moment.
-    best = Point.new(INFINITY, -INFINITY)
+    best = sentinel(INFINITY, -INFINITY)
     return best if empty?
 
+    y_sign = @y_sign
     p = q = left = right = nil
 
     x_range = (x0..x1)
 
     in_q = lambda do |pair|
-      x_range.cover?(pair.x) && pair.y >= y0
+      x_range.cover?(pair.x) && y_sign * pair.y >= y0
     end
 
     # From the paper:
@@ -582,7 +657,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     # Note that the paper identifies a node in the tree with its value. We need to grab the correct node.
     update_highest = lambda do |node|
       t = @data[node]
-      if in_q.call(t) && (t.y > best.y || (t.y == best.y && t.x < best.x))
+      if in_q.call(t) && (y_sign * t.y > y_sign * best.y || (y_sign * t.y == y_sign * best.y && t.x < best.x))
         best = t
       end
     end
@@ -701,7 +776,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
       # If y(root) is large enough then the root is the winner because of the max heap property in y. And if it isn't large enough
       # then no other point in the tree can be high enough either
       left = right = false
-      best = root_val if root_val.y >= y0
+      best = root_val if y_sign * root_val.y >= y0
     end
 
     if root_val.x < x0
@@ -756,6 +831,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
       x1 = slightly_smaller(x1)
       y0 = slightly_bigger(y0)
     end
+    y_sign = @y_sign
 
     # From the paper
     #
@@ -830,17 +906,17 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
           # State 0: we have arrived at this node for the first time
           # look at current and perhaps descend to left child
           # The paper describes this algorithm as in-order, but isn't this pre-order?
-          if @data[current].y >= y0
+          if y_sign * @data[current].y >= y0
             report.call(current)
           end
-          if !leaf?(current) && in_tree?(left(current)) && @data[left(current)].y >= y0
+          if !leaf?(current) && in_tree?(left(current)) && y_sign * @data[left(current)].y >= y0
             current = left(current)
           else
             state = 1
           end
         when 1
           # State 1: we've already handled this node and its left subtree. Should we descend to the right subtree?
-          if in_tree?(right(current)) && @data[right(current)].y >= y0
+          if in_tree?(right(current)) && y_sign * @data[right(current)].y >= y0
             current = right(current)
             state = 0
           else
@@ -959,7 +1035,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
 
     # Given: p' satisfied x0 <= x(p') <= x1. (Our p_in is the paper's p')
     enumerate_left_in = lambda do
-      if @data[p_in].y >= y0
+      if y_sign * @data[p_in].y >= y0
         report.call(p_in)
       end
 
@@ -1094,7 +1170,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     enumerate_right_in = lambda do
       raise InternalLogicError, 'right_in should be true if we call enumerate_right_in' unless right_in
 
-      if @data[q_in].y >= y0
+      if y_sign * @data[q_in].y >= y0
         report.call(q_in)
       end
 
@@ -1170,7 +1246,7 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     val = ->(sym) { { left: p, left_in: p_in, right_in: q_in, right: q }[sym] }
 
     root_val = @data[root]
-    if root_val.y < y0
+    if y_sign * root_val.y < y0
       # no hope, no op
     elsif root_val.x < x0
       p = root
@@ -1208,6 +1284,76 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     return result unless block_given?
   end
 
+  # The number of points of P in the box bounded by x0, x1, and y0. See +enumerate_3_sided+ for the box.
+  #
+  # This takes O(m + log n) time, just as the enumeration does, but doesn't build a collection of the points. CMaxPrioritySearchTree
+  # doesn't touch the point objects at all.
+  def count_3_sided(x0, x1, y0, open: false)
+    count = 0
+    enumerate_3_sided(x0, x1, y0, open:) { count += 1 }
+    count
+  end
+
+  # Enumerate the points of P in the box bounded by x0, x1, and y0, writing their coordinates into a buffer supplied by the caller.
+  # This lets a large enumeration be drained in chunks. See +enumerate_3_sided+ for the box.
+  #
+  # @param buffer [String] a binary String of preallocated space, such as +"\0".b * (16 * k)+, with room for at least one point. We
+  #   overwrite it with the packed doubles x, y of as many points as will fit: bytesize / 16 of them. The rest of the buffer is left
+  #   as it was.
+  # @param cursor [Object] nil to start an enumeration, or the cursor returned by the previous call to carry on with it. The
+  #   bounds must be the same as before and the PST must not have changed since.
+  # @return [Array] a pair [written, cursor]: the number of points written and the cursor to pass to the next call. The cursor is
+  #   nil when the enumeration is finished.
+  #
+  # A chunked drain looks like this:
+  #
+  #   cursor = nil
+  #   loop do
+  #     written, cursor = pst.enumerate_3_sided_into(buffer, x0, x1, y0, cursor:)
+  #     process(buffer.byteslice(0, 16 * written).unpack('d*'))
+  #     break unless cursor
+  #   end
+  #
+  # The cursor holds the state of the search, so each call carries on where the last one stopped and a drain of m points takes
+  # O(m + log n) time in all, whatever the chunk size. When the points fill the buffer exactly we can't yet tell that there are no
+  # more, and the last call writes none.
+  def enumerate_3_sided_into(buffer, x0, x1, y0, open: false, cursor: nil)
+    raise ArgumentError, 'buffer must be a binary String' unless buffer.encoding == Encoding::BINARY
+
+    capacity = buffer.bytesize / 16
+    raise ArgumentError, 'buffer must have room for at least one point' if capacity.zero?
+
+    bounds = [x0, x1, y0, open]
+    if cursor
+      raise ArgumentError, 'cursor must be nil or a cursor returned by enumerate_3_sided_into' unless cursor.is_a?(EnumerationCursor)
+      unless cursor.tree.equal?(self) && cursor.member_count == @member_count
+        raise ArgumentError, 'cursor belongs to a different tree, or the tree has changed since'
+      end
+      raise ArgumentError, 'cursor belongs to a query with different bounds' unless cursor.bounds == bounds
+    else
+      cursor = EnumerationCursor.new(self, @member_count, bounds, to_enum(:enumerate_3_sided, x0, x1, y0, open:))
+    end
+
+    coords = []
+    begin
+      while coords.size < 2 * capacity
+        pt = cursor.points.next
+        coords << pt.x.to_f << pt.y.to_f
+      end
+    rescue StopIteration
+      cursor = nil
+    end
+
+    packed = coords.pack('d*')
+    buffer[0, packed.bytesize] = packed
+    [coords.size / 2, cursor]
+  end
+
+  # A paused enumerate_3_sided_into search: an external Enumerator over the points, and what we need to check that it is resumed on
+  # the same query.
+  EnumerationCursor = Struct.new(:tree, :member_count, :bounds, :points)
+  private_constant :EnumerationCursor
+
   ########################################
   # Delete Top
   #
@@ -1281,14 +1427,25 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     in_tree?(left(i)) && in_tree?(right(i))
   end
 
+  # The PST logic compares y_sign * y for the points. It is 1 here, and the MinPST overrides it with -1 to see each point (x, y) as
+  # (x, -y). We read it once at construction, and the queries copy @y_sign into a local.
+  private def y_sign
+    1
+  end
+
+  # A point for a "nothing found" result. The y-value is as seen by the PST logic.
+  private def sentinel(x, y)
+    Point.new(x, @y_sign * y)
+  end
+
   # Does the value at index i have a "better" y value than the value at index j.
   #
   # A value is better if it is larger, or if it is equal and the x value is smaller (which is how we break the tie)
   private def better_y?(i, j)
     val_i = @data[i]
     val_j = @data[j]
-    return true if val_i.y > val_j.y
-    return false if val_i.y < val_j.y
+    return true if @y_sign * val_i.y > @y_sign * val_j.y
+    return false if @y_sign * val_i.y < @y_sign * val_j.y
 
     val_i.x < val_j.x
   end
@@ -1318,12 +1475,18 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
   private def construct_pst
     raise DataError, 'Duplicate x values are not supported' if contains_duplicates?(@data, by: :x)
 
-    # We follow the algorithm in the paper by De, Maheshwari et al, which takes O(n log^2 n) time. Their follow-up paper that
-    # defines the Min-max PST, describes how to do the construction in O(n log n) time, but it is more complex and probably not
-    # worth the trouble of both a bespoke heapsort and the special sorting algorithm of Katajainen and Pasanen.
+    # We build the tree level by level as in the paper by De, Maheshwari et al. The points not yet placed in the tree are kept,
+    # sorted by x, in @data[2**i..@size] as we work on level i. They fall into consecutive groups, one for each node at the level,
+    # and the point with the largest y in a group goes to the node.
+    #
+    # The paper then re-sorts the points still to be placed, taking O(n log n) time for each level and O(n log^2 n) in all. But
+    # they were sorted before we took out the chosen points, so it is enough to move the chosen points to the front and let the rest
+    # close up behind them, keeping their order. This is the "stable partitioning" step in the O(n log n) construction of the
+    # follow-up paper on Min-max PSTs. There it is done in place with the algorithm of Katajainen and Pasanen, but here we just copy
+    # slices of the array, which is O(n) work for each level and mostly happens in C.
 
     # Since we are building an implicit binary tree, things are simpler if the array is 1-based. This requires a malloc (perhaps)
-    # and memcpy (for sure), which isn't great, but it's in the C layer so cheap compared to the O(n log^2 n) work we need to do for
+    # and memcpy (for sure), which isn't great, but it's in the C layer so cheap compared to the O(n log n) work we need to do for
     # construction.
     @data.unshift nil
 
@@ -1346,28 +1509,22 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
       k1 = 2**(h + 1 - i) - 1
       k2 = (1 - k) * 2**(h - i) - 1 + a
       k3 = 2**(h - i) - 1
-      (1..k).each do |j|
-        l = index_with_largest_y_in(
-          pow_of_2 + (j - 1) * k1, pow_of_2 + j * k1 - 1
-        )
-        swap(l, pow_of_2 + j - 1)
+
+      # The groups are k of size k1, then (if k < 2**i) one of size k2 and the rest of size k3. These are the sizes of the subtrees
+      # at the nodes of level i.
+      chosen = (1..k).map do |j|
+        index_with_largest_y_in(pow_of_2 + (j - 1) * k1, pow_of_2 + j * k1 - 1)
       end
 
       if k < pow_of_2
-        l = index_with_largest_y_in(
-          pow_of_2 + k * k1, pow_of_2 + k * k1 + k2 - 1
-        )
-        swap(l, pow_of_2 + k)
+        chosen << index_with_largest_y_in(pow_of_2 + k * k1, pow_of_2 + k * k1 + k2 - 1)
 
         m = pow_of_2 + k * k1 + k2
         (1..(pow_of_2 - k - 1)).each do |j|
-          l = index_with_largest_y_in(
-            m + (j - 1) * k3, m + j * k3 - 1
-          )
-          swap(l, pow_of_2 + k + j)
+          chosen << index_with_largest_y_in(m + (j - 1) * k3, m + j * k3 - 1)
         end
       end
-      sort_subarray(2 * pow_of_2, @size)
+      move_to_front(pow_of_2, chosen)
     end
   end
 
@@ -1377,12 +1534,26 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
     @data[index1], @data[index2] = @data[index2], @data[index1]
   end
 
+  # Move the elements of @data at the indices in chosen, which are increasing, to the front of @data[start..], keeping them in
+  # order. The other elements of @data[start..] close up behind them, also in order.
+  private def move_to_front(start, chosen)
+    rest = []
+    prev = start
+    chosen.each do |idx|
+      rest.concat(@data[prev...idx])
+      prev = idx + 1
+    end
+    rest.concat(@data[prev..])
+
+    @data[start..] = chosen.map { |idx| @data[idx] }.concat(rest)
+  end
+
   # The index in @data[l..r] having the largest value for y, breaking ties with the smaller x value. Since we are already sorted by
   # x we don't actually need to check the x value.
   private def index_with_largest_y_in(l, r)
     return nil if r < l
 
-    (l..r).max_by { |idx| @data[idx].y }
+    (l..r).max_by { |idx| @y_sign * @data[idx].y }
   end
 
   # Sort the subarray @data[l..r].
@@ -1420,7 +1591,9 @@ class DataStructuresRMolinari::MaxPrioritySearchTree
   private def verify_properties
     # It's a max-heap in y
     (2..@size).each do |node|
-      raise InternalLogicError, "Heap property violated at child #{node}" unless @data[node].y <= @data[parent(node)].y
+      unless @y_sign * @data[node].y <= @y_sign * @data[parent(node)].y
+        raise InternalLogicError, "Heap property violated at child #{node}"
+      end
     end
 
     # Left subtree has x values less than all of the right subtree
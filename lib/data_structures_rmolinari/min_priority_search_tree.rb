@@ -13,17 +13,13 @@ require_relative 'shared'
 # a PST in-place (using only O(1) extra memory), at the expense of some slightly more complicated code for the various supported
 # operations. It is their approach that we have implemented. See the class +MaxPrioritySearchTree+ for more details.
 #
-# Here we implement the MinPST by adding a thin layer of code over a MaxPST and reflecting all points through the x-axis.
+# Here we implement the MinPST as a thin layer of code over a private subclass of MaxPST in which every comparison of y-values goes
+# the other way. In effect, the MaxPST sees each point reflected through the x-axis, but we don't have to create any reflected
+# points to get that. So, as with the MaxPST,
+# - the tree structure is built in place in the data array passed to the constructor, and
+# - client code gets the same (x, y) objects back in results as it passed to the constructor.
 #
-# This means a few things.
-# - The bookkeeping means that performance will be slightly slower than for the MaxPST due to the bookkeeping. It is unlikely to be
-#   noticable in practice.
-# - MaxPST builds the tree structure in place, modifying the data array passed it. Indeed, this is the point of the approach of De
-#   et al. But we don't do that, as we create a separate array of Points.
-# - Whereas the implementation of MaxPST means that client code gets the same (x, y) objects back in results as it passed into the
-#   contructor, that's not the case here.
-#   - we map each point in the input - which is an object responding to +#x+ and +#y+ - to an instance of +Point+, and will return (different) instances of +Point+ in response to queries.
-#   - client code is unlikely to care, but be aware of this, just in case.
+# The y-coordinates must be Numeric, so that they can be negated.
 #
 # Given a set of n points, we can answer the following questions quickly:
 #
@@ -36,6 +32,8 @@ require_relative 'shared'
 #
 # (Here, "leftmost/rightmost" means "minimal/maximal x", and "lowest" means "minimal y".)
 #
+# The four quadrant queries also have batch versions, such as +smallest_y_in_se_many+. See MaxPrioritySearchTree.
+#
 # Each of these methods has a named parameter +open:+ that makes the search region an open set. For example, if we call
 # +smallest_x_in_ne+ with +open: true+ then we consider points satisifying x > x0 and y < y0. The default value for this parameter
 # is always +false+. See the documentation of MaxPrioritySearchTree for limitiations of this support.
@@ -60,7 +58,7 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   # Construct a MinPST from the collection of points in +data+.
   #
   # @param data [Array] the set P of points as an array. The internal data structure is constructed in-place inside this array
-  #     without cloning it. Indeed, each element of data is replaced by a different object.
+  #     without cloning it.
   #   - Each element of the array must respond to +#x+ and +#y+.
   #   - The +x+ values must be distinct. We raise a +Shared::DataError+ if this isn't the case.
   #     - This is a restriction that simplifies some of the algorithm code. It can be removed as the cost of some extra work. Issue
@@ -69,10 +67,7 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   # @param verify [Boolean] when truthy, check that the properties of a PST are satisified after construction, raising an exception
   #        if not.
   def initialize(data, dynamic: false, verify: false)
-    (0...(data.size)).each do |i|
-      data[i] = flip data[i]
-    end
-    @max_pst = DataStructuresRMolinari::MaxPrioritySearchTree.new(data, dynamic:, verify:)
+    @max_pst = ReflectedMaxPST.new(data, dynamic:, verify:)
   end
 
   ########################################
@@ -93,7 +88,7 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   #
   # This method returns p* in O(log n) time and O(1) extra space.
   def smallest_y_in_se(x0, y0, open: false)
-    flip @max_pst.largest_y_in_ne(x0, -y0, open:)
+    @max_pst.largest_y_in_ne(x0, -y0, open:)
   end
 
   # Return the "lowest" point in P to the "southwest" of (x0, y0).
@@ -111,7 +106,7 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   #
   # This method returns p* in O(log n) time and O(1) extra space.
   def smallest_y_in_sw(x0, y0, open: false)
-    flip @max_pst.largest_y_in_nw(x0, -y0, open:)
+    @max_pst.largest_y_in_nw(x0, -y0, open:)
   end
 
   ########################################
@@ -132,7 +127,7 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   #
   # This method returns p* in O(log n) time and O(1) extra space.
   def smallest_x_in_se(x0, y0, open: false)
-    flip @max_pst.smallest_x_in_ne(x0, -y0, open:)
+    @max_pst.smallest_x_in_ne(x0, -y0, open:)
   end
 
   # Return the rightmost (max-x) point in P to the southwest of (x0, y0).
@@ -150,7 +145,42 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   #
   # This method returns p* in O(log n) time and O(1) extra space.
   def largest_x_in_sw(x0, y0, open: false)
-    flip @max_pst.largest_x_in_nw(x0, -y0, open:)
+    @max_pst.largest_x_in_nw(x0, -y0, open:)
+  end
+
+  ########################################
+  # Batch quadrant queries
+
+  # The results of +smallest_y_in_se+ for a batch of corners (x0, y0). The corners are given as for
+  # MaxPrioritySearchTree#largest_y_in_ne_many.
+  def smallest_y_in_se_many(xs, ys = nil, open: false)
+    @max_pst.largest_y_in_ne_many(*reflected_corners(xs, ys), open:)
+  end
+
+  # The results of +smallest_y_in_sw+ for a batch of corners. See +smallest_y_in_se_many+.
+  def smallest_y_in_sw_many(xs, ys = nil, open: false)
+    @max_pst.largest_y_in_nw_many(*reflected_corners(xs, ys), open:)
+  end
+
+  # The results of +smallest_x_in_se+ for a batch of corners. See +smallest_y_in_se_many+.
+  def smallest_x_in_se_many(xs, ys = nil, open: false)
+    @max_pst.smallest_x_in_ne_many(*reflected_corners(xs, ys), open:)
+  end
+
+  # The results of +largest_x_in_sw+ for a batch of corners. See +smallest_y_in_se_many+.
+  def largest_x_in_sw_many(xs, ys = nil, open: false)
+    @max_pst.largest_x_in_nw_many(*reflected_corners(xs, ys), open:)
+  end
+
+  # The batch arguments with each y0 negated, for the underlying MaxPST
+  private def reflected_corners(xs, ys)
+    return [xs, ys.map(&:-@)] unless ys.nil?
+
+    unless (xs.bytesize % 16).zero?
+      raise ArgumentError, "packed coordinates must be a whole number of pairs of doubles (got #{xs.bytesize} bytes)"
+    end
+
+    [xs.unpack('d*').each_slice(2).flat_map { |x0, y0| [x0, -y0] }.pack('d*')]
   end
 
   ########################################
@@ -173,7 +203,7 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   #
   # This method returns p* in O(log n) time and O(1) extra space.
   def smallest_y_in_3_sided(x0, x1, y0, open: false)
-    flip @max_pst.largest_y_in_3_sided(x0, x1, -y0, open:)
+    @max_pst.largest_y_in_3_sided(x0, x1, -y0, open:)
   end
 
   ########################################
@@ -197,12 +227,23 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   # This method runs in O(m + log n) time and O(1) extra space, where m is the number of points found.
   def enumerate_3_sided(x0, x1, y0, open: false)
     if block_given?
-      @max_pst.enumerate_3_sided(x0, x1, -y0, open:) { |point| yield(flip point) }
+      @max_pst.enumerate_3_sided(x0, x1, -y0, open:) { |point| yield point }
     else
-      Set.new( @max_pst.enumerate_3_sided(x0, x1, -y0, open:).map { |pt| flip pt })
+      @max_pst.enumerate_3_sided(x0, x1, -y0, open:)
     end
   end
 
+  # The number of points of P in the box bounded by x0, x1, and y0. See +enumerate_3_sided+ for the box.
+  def count_3_sided(x0, x1, y0, open: false)
+    @max_pst.count_3_sided(x0, x1, -y0, open:)
+  end
+
+  # Write the coordinates of the points of P in the box bounded by x0, x1, and y0 into a buffer. See
+  # MaxPrioritySearchTree#enumerate_3_sided_into.
+  def enumerate_3_sided_into(buffer, x0, x1, y0, open: false, cursor: nil)
+    @max_pst.enumerate_3_sided_into(buffer, x0, x1, -y0, open:, cursor:)
+  end
+
   ########################################
   # Delete top
 
@@ -214,11 +255,16 @@ class DataStructuresRMolinari::MinPrioritySearchTree
   #
   # @return [Point] the top element that was deleted
   def delete_top!
-    flip @max_pst.delete_top!
+    @max_pst.delete_top!
   end
 
-  # (x, y) -> (x, -y)
-  private def flip(point)
-    Point.new(point.x, -point.y)
+  # A MaxPST that compares -y where the MaxPST compares y, and so sees each point (x, y) as (x, -y). The y-value arguments to its
+  # queries must be negated, but the points it returns are the ones we were given and the "nothing found" results are in the
+  # original coordinates.
+  class ReflectedMaxPST < DataStructuresRMolinari::MaxPrioritySearchTree
+    private def y_sign
+      -1
+    end
   end
+  private_constant :ReflectedMaxPST
 end
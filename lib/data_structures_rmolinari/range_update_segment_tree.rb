@@ -0,0 +1,170 @@
+require_relative 'shared'
+
+# A Segment Tree that supports updates to whole subintervals of the underlying array, using "lazy propagation."
+#
+# The trees built on SegmentTreeTemplate learn about changes to the underlying array one cell at a time, via +update_at(idx)+. Changing
+# k cells then costs O(k log n). Here the tree holds its own copy of the values, and we can add a value to every cell in A(i..j), or
+# set every such cell to a value, in O(log n) time.
+#
+# The idea is that when an update covers the whole interval of a node we update the node's value but don't go on to update its
+# descendants. Instead we leave a "pending" note at the node, and push it down to the children only when we next need to descend
+# past the node. See https://cp-algorithms.com/data_structures/segment_tree.html#range-updates-lazy-propagation.
+#
+# The supported operations are
+# - +:sum+: +query_on(i, j)+ gives the sum of A(i..j).
+# - +:max+: +query_on(i, j)+ gives the maximum value in A(i..j).
+# - +:min+: +query_on(i, j)+ gives the minimum value in A(i..j).
+#
+# CRangeUpdateSegmentTree is the C sibling for Integer and Float data. Use +SegmentTree.construct_with_range_updates+ to get an
+# instance of one or the other.
+class DataStructuresRMolinari::SegmentTree::RangeUpdateSegmentTree
+  include Shared
+  include Shared::BinaryTreeArithmetic
+
+  # @param operation one of +:sum+, +:max+, +:min+
+  # @param data the initial values of the array A. They must be numeric. We take a copy of them: later changes to data are not
+  #   seen by the tree.
+  def initialize(operation, data)
+    operation.must_be_in %i[sum max min]
+    raise DataError, 'There must be at least one value' if data.size.zero?
+
+    @operation = operation
+    @size = data.size
+    @identity = { sum: 0, max: -INFINITY, min: INFINITY }[operation]
+
+    @tree = []
+    @pending_add = []
+    @pending_assign = [] # nil when there is no pending assignment
+    build(root, 0, @size - 1, data)
+  end
+
+  # The sum (or max or min) of the values in A(left..right).
+  #
+  # It must be that right < size. We return the identity value (0, -Infinity, or Infinity) if left > right.
+  def query_on(left, right)
+    check_interval(left, right)
+    return @identity if left > right
+
+    determine_val(root, 0, @size - 1, left, right)
+  end
+
+  # The current value of A(idx).
+  def value_at(idx)
+    query_on(idx, idx)
+  end
+
+  # Add delta to each value in A(left..right).
+  def update_range(left, right, delta)
+    check_interval(left, right)
+    return if left > right
+
+    change_range(root, 0, @size - 1, left, right) { |node, len| apply_add(node, len, delta) }
+  end
+
+  # Set each value in A(left..right) to value.
+  def assign_range(left, right, value)
+    check_interval(left, right)
+    return if left > right
+
+    change_range(root, 0, @size - 1, left, right) { |node, len| apply_assign(node, len, value) }
+  end
+
+  private def check_interval(left, right)
+    raise DataError, "Bad interval #{left}..#{right} (size = #{@size})" if left.negative? || right >= @size
+  end
+
+  private def build(node, tree_l, tree_r, data)
+    @pending_add[node] = 0
+    if tree_l == tree_r
+      @tree[node] = data[tree_l]
+    else
+      mid = midpoint(tree_l, tree_r)
+      build(left(node), tree_l, mid, data)
+      build(right(node), mid + 1, tree_r, data)
+      @tree[node] = combine(@tree[left(node)], @tree[right(node)])
+    end
+  end
+
+  private def determine_val(node, tree_l, tree_r, left, right)
+    return @tree[node] if left <= tree_l && tree_r <= right
+
+    push_down(node, tree_l, tree_r)
+
+    mid = midpoint(tree_l, tree_r)
+    if right <= mid
+      determine_val(left(node), tree_l, mid, left, right)
+    elsif left > mid
+      determine_val(right(node), mid + 1, tree_r, left, right)
+    else
+      combine(
+        determine_val(left(node), tree_l, mid, left, right),
+        determine_val(right(node), mid + 1, tree_r, left, right)
+      )
+    end
+  end
+
+  # Apply a change to the interval left..right. The block is called with (node, length) for each node whose whole interval is covered.
+  private def change_range(node, tree_l, tree_r, left, right, &change)
+    return if right < tree_l || tree_r < left
+
+    if left <= tree_l && tree_r <= right
+      change.call(node, tree_r - tree_l + 1)
+      return
+    end
+
+    push_down(node, tree_l, tree_r)
+
+    mid = midpoint(tree_l, tree_r)
+    change_range(left(node), tree_l, mid, left, right, &change)
+    change_range(right(node), mid + 1, tree_r, left, right, &change)
+    @tree[node] = combine(@tree[left(node)], @tree[right(node)])
+  end
+
+  # Pass the pending changes at node down to its children
+  private def push_down(node, tree_l, tree_r)
+    mid = midpoint(tree_l, tree_r)
+    left_len = mid - tree_l + 1
+    right_len = tree_r - mid
+
+    unless @pending_assign[node].nil?
+      apply_assign(left(node), left_len, @pending_assign[node])
+      apply_assign(right(node), right_len, @pending_assign[node])
+      @pending_assign[node] = nil
+    end
+
+    return if @pending_add[node].zero?
+
+    apply_add(left(node), left_len, @pending_add[node])
+    apply_add(right(node), right_len, @pending_add[node])
+    @pending_add[node] = 0
+  end
+
+  # Set every value in the interval of node, which has length len, to value
+  private def apply_assign(node, len, value)
+    @tree[node] = @operation == :sum ? value * len : value
+    @pending_assign[node] = value
+    @pending_add[node] = 0
+  end
+
+  # Add delta to every value in the interval of node, which has length len
+  private def apply_add(node, len, delta)
+    @tree[node] += @operation == :sum ? delta * len : delta
+    if @pending_assign[node].nil?
+      @pending_add[node] += delta
+    else
+      @pending_assign[node] += delta
+    end
+  end
+
+  private def combine(a, b)
+    case @operation
+    when :sum then a + b
+    when :max then a > b ? a : b
+    else           a < b ? a : b
+    end
+  end
+
+  private def midpoint(left, right)
+    (left + right) / 2
+  end
+end
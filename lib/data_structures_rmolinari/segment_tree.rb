@@ -6,6 +6,15 @@ end
 
 require_relative 'segment_tree_template'   # Ruby implementation of the generic API
 require_relative 'c_segment_tree_template' # C implementation of the generic API
+require_relative 'c_numeric_segment_tree'  # C implementation of some concrete trees over unboxed numeric data
+
+require_relative 'range_update_segment_tree'   # Ruby implementation of trees with range updates
+require_relative 'c_range_update_segment_tree' # C implementation of trees with range updates
+
+require_relative 'c_typed_segment_tree' # C trees specialized for each element type and operation, like CSumI64
+require_relative 'c_sparse_table'       # C structure for O(1) max, min and index-of-max queries on data that doesn't change
+require_relative 'c_persistent_segment_tree' # C tree whose updates make new versions and leave the old ones valid
+require_relative 'c_fenwick_tree'            # C Fenwick (binary indexed) tree for prefix and interval sums
 
 # Segment Tree: various concrete implementations
 #
@@ -19,7 +28,10 @@ require_relative 'c_segment_tree_template' # C implementation of the generic API
 # Ruby.
 #
 # Here we provide several concrete segment tree implementations built on top of the template (generic) versions. Each instance is
-# backed either by the pure Ruby SegmentTreeTemplate or its C-based sibling CSegmentTreeTemplate
+# backed either by the pure Ruby SegmentTreeTemplate or its C-based sibling CSegmentTreeTemplate.
+#
+# When the C template is requested and the data is an Array of Integers or of Floats, the concrete classes instead use
+# CNumericSegmentTree, which stores the values unboxed and combines them in C without calling back into Ruby.
 module DataStructuresRMolinari
   module SegmentTree
     # A convenience method to construct a Segment Tree that, for a given array A(0...size), answers questions of the kind given by
@@ -27,49 +39,257 @@ module DataStructuresRMolinari
     #
     # - @param data: the array A.
     #   - It must respond to +#size+ and to +#[]+ with non-negative integer arguments.
+    #   - Or it can be a String of packed int64 or double values in native byte order, as made by +Array#pack('q*')+ or
+    #     +Array#pack('d*')+, in which case +dtype+ must say which. With +:c+ the C tree reads the values straight from the String and
+    #     no Ruby object is made for any of them. To change a value, overwrite its bytes in the String and call +update_at+.
     # - @param operation: a supported "style" of Segment Tree
     #   - for now, must be one of these (but you can write your own concrete version)
     #     - +:max+: implementing +max_on(i, j)+, returning the maximum value in A(i..j)
+    #     - +:min+: implementing +min_on(i, j)+, returning the minimum value in A(i..j)
     #     - +:index_of_max+: implementing +index_of_max_val_on(i, j)+, returning an index corresponding to the maximum value in
     #       A(i..j).
+    #     - +:sum+: implementing +sum_on(i, j)+, returning the sum of the values in A(i..j)
     # - @param lang: the language in which the underlying "template" is written
     #   - +:c+ or +:ruby+
     #   - the C version will run faster but for now may be buggier and harder to debug
-    module_function def construct(data, operation, lang)
-      operation.must_be_in [:max, :index_of_max, :sum]
+    #   - with +:c+, if data is an Array all of whose elements are Integers (in the int64 range) or all of whose elements are Floats
+    #     we use the operation's native C implementation, CNumericSegmentTree. If a later update doesn't fit it - a Float or a
+    #     Rational among Integers, say, or an Integer sum that could overflow int64 - the tree is rebuilt with the generic template,
+    #     once, and carries on. See NativeOrTemplate#update_at.
+    # - @param layout: the memory layout for a CNumericSegmentTree. It is ignored otherwise.
+    #   - +:binary+ (the default): a binary tree with 2n nodes.
+    #   - +:wide+: a tree in which each node has 8 children, which fit in a single cache line. It needs only about 8n/7 cells and a
+    #     query touches fewer cache lines, though it does more comparisons. So it is worth trying only for very large arrays.
+    #   - +:blocked+: the leaves are kept in blocks of 32 under a binary tree of blocks. A query scans the partial blocks at its ends
+    #     with vector instructions (AVX2 or NEON) where the CPU has them, and so works on short intervals quickly. Not for
+    #     +:index_of_max+. CNumericSegmentTree.simd says which instructions are in use.
+    # - @param dtype: for packed data only, +:i64+ or +:f64+.
+    # - @param mutable: pass +false+ if the data will never change after construction. Then, for +:max+, +:min+ and +:index_of_max+
+    #   with +:c+ over data that CNumericSegmentTree could store, we build a CSparseTable instead of a tree. It answers each query in
+    #   O(1) time rather than O(log n) but takes O(n log n) time and space to build - about 8 log2(n) bytes per value. It can't be
+    #   dumped. In other cases we build the usual tree. Either way +update_at+ raises Shared::LogicError.
+    module_function def construct(data, operation, lang, layout: :binary, dtype: nil, mutable: true)
+      operation.must_be_in [:max, :min, :index_of_max, :sum]
       lang.must_be_in [:ruby, :c]
 
+      if data.is_a?(String)
+        raise ArgumentError, "Packed data needs dtype: :i64 or :f64, not #{dtype.inspect}" unless %i[i64 f64].include?(dtype)
+
+        if lang == :c
+          return wrapped_numeric_tree(CSparseTable.new(operation, data, dtype)) if !mutable && operation != :sum
+
+          return immutable_unless(mutable, wrapped_numeric_tree(CNumericSegmentTree.new(operation, data, dtype, layout)))
+        end
+
+        data = data.unpack(dtype == :i64 ? 'q*' : 'd*')
+      end
+
+      if !mutable && lang == :c && operation != :sum && (native_dtype = CNumericSegmentTree.native_dtype(data, operation))
+        return wrapped_numeric_tree(CSparseTable.new(operation, data, native_dtype))
+      end
+
       klass = case operation
               when :max then MaxValSegmentTree
+              when :min then MinValSegmentTree
               when :index_of_max then IndexOfMaxValSegmentTree
               when :sum then SumSegmentTree
               else raise ArgumentError, "Unknown operation #{operation}"
               end
       template = lang == :ruby ? SegmentTreeTemplate : CSegmentTreeTemplate
 
-      klass.new(template, data)
+      immutable_unless(mutable, klass.new(template, data, layout:))
+    end
+
+    # Read back a Segment Tree from an image written by +dump+, without rebuilding it.
+    #
+    # Only trees backed by a CNumericSegmentTree - those made by +construct+ with +:c+ over an Array of Integers or Floats - can be
+    # dumped. The image holds the built tree but not the data array, and is in native byte order.
+    #
+    # - @param io: anything responding to +read+, like a File or StringIO.
+    # - @param data: the data array the tree was built over. It is needed only if +update_at+ will be called.
+    # @return an instance of the same concrete class as the tree that was dumped.
+    module_function def load(io, data = nil)
+      wrapped_numeric_tree(CNumericSegmentTree.load(io, data))
+    end
+
+    # Like +load+, but the image file at path is mmap'd and used in place rather than read. The mapping is copy-on-write, so
+    # processes that open the same image share its pages until they call +update_at+.
+    module_function def open(path, data = nil)
+      wrapped_numeric_tree(CNumericSegmentTree.open(path, data))
+    end
+
+    # The tree, made to refuse updates unless mutable is truthy. See NativeOrTemplate#update_at.
+    private_class_method def self.immutable_unless(mutable, tree)
+      tree.instance_variable_set(:@immutable, true) unless mutable
+      tree
+    end
+
+    # A concrete tree wrapping an existing CNumericSegmentTree or CSparseTable
+    private_class_method def self.wrapped_numeric_tree(structure)
+      klass = case structure.operation
+              when :max then MaxValSegmentTree
+              when :min then MinValSegmentTree
+              when :index_of_max then IndexOfMaxValSegmentTree
+              when :sum then SumSegmentTree
+              end
+      klass.allocate.tap { _1.instance_variable_set(:@structure, structure) }
+    end
+
+    # A convenience method to construct a Segment Tree that supports updates to whole subintervals of A, not just single cells. See
+    # RangeUpdateSegmentTree.
+    #
+    # - @param data: the initial values of the array A. The tree keeps its own copy of the values.
+    # - @param operation: +:max+, +:min+, or +:sum+. The returned instance answers +query_on(i, j)+ with the maximum, minimum or sum of
+    #   the values in A(i..j).
+    # - @param lang: +:c+ or +:ruby+
+    #   - with +:c+, if data is an Array all of whose elements are Integers (in the int64 range) or all of whose elements are Floats
+    #     we return a CRangeUpdateSegmentTree. For +:sum+ over Integers the magnitudes must also sum to at most 2^63 - 1. Otherwise
+    #     we fall back to the Ruby implementation.
+    module_function def construct_with_range_updates(data, operation, lang)
+      operation.must_be_in [:max, :min, :sum]
+      lang.must_be_in [:ruby, :c]
+
+      if lang == :c
+        dtype = CRangeUpdateSegmentTree.native_dtype(data, operation)
+        return CRangeUpdateSegmentTree.new(operation, data, dtype) if dtype
+      end
+
+      RangeUpdateSegmentTree.new(operation, data)
+    end
+
+    # A convenience method to construct a persistent Segment Tree, a CPersistentSegmentTree. Its +update_at(idx, value)+ doesn't change
+    # the tree but returns a new version of it, in O(log n) time. The new version shares all but O(log n) of its nodes with the old,
+    # and queries on the old version go on giving the same answers.
+    #
+    # The versions answer +query_on(i, j)+ and +query_many+ just as a CNumericSegmentTree doing the same operation does.
+    #
+    # - @param data: the initial values, as an Array of Integers (in the int64 range) or of Floats, or a String of packed values as for
+    #   +construct+. The tree keeps its own copy.
+    # - @param operation: +:max+, +:min+, +:index_of_max+ or +:sum+.
+    # - @param dtype: for packed data only, +:i64+ or +:f64+.
+    #
+    # The nodes of all the versions made from one tree are kept in a single pool, which is freed only when none of the versions is
+    # still reachable.
+    module_function def construct_persistent(data, operation, dtype: nil)
+      operation.must_be_in [:max, :min, :index_of_max, :sum]
+
+      if data.is_a?(String)
+        raise ArgumentError, "Packed data needs dtype: :i64 or :f64, not #{dtype.inspect}" unless %i[i64 f64].include?(dtype)
+      else
+        dtype = CNumericSegmentTree.native_dtype(data, operation)
+        raise Shared::DataError, 'A persistent tree needs an Array of Integers in the int64 range or of Floats' unless dtype
+      end
+
+      CPersistentSegmentTree.new(operation, data, dtype)
+    end
+
+    # A convenience method to construct a Fenwick Tree (or Binary Indexed Tree), a CFenwickTree. It answers sum queries as a
+    # SumSegmentTree does, with +sum_on(i, j)+, +sum_on_many+ and the template's +query_on+ and +query_many+, but keeps just n
+    # unboxed values and walks them in a loop.
+    #
+    # It keeps its own copy of the values, and so is changed directly rather than told of changes to data:
+    # - +add_at(idx, delta)+ and +add_many(indices, deltas)+ add to values, and +update_at(idx, value)+ sets one.
+    # - +prefix_sum(idx)+ is the sum of A(0..idx), and +prefix_sum_many(indices)+ does a batch of them.
+    # - +lower_bound(target)+ is the smallest idx with +prefix_sum(idx) >= target+, or nil. It needs the values to be non-negative.
+    #   +lower_bound_many(targets)+ does a batch.
+    # Each of these takes O(log n) time. The construction takes O(n) time.
+    #
+    # - @param data: the initial values, as an Array of Integers (in the int64 range) or of Floats, or a String of packed values as for
+    #   +construct+. Or an Integer n, for n zeros.
+    # - @param dtype: for packed data or a size, +:i64+ or +:f64+.
+    #
+    # The batch methods take and return packed Strings as CNumericSegmentTree#query_many does. Integer values must have magnitudes
+    # that sum to at most 2^63 - 1, so that no sum can overflow: data that doesn't raises Shared::DataError, and so does an +add_at+
+    # or +update_at+ that would break the bound, leaving the tree as it was. A query never raises for overflow.
+    module_function def construct_fenwick(data, dtype: nil)
+      if data.is_a?(String) || data.is_a?(Integer)
+        raise ArgumentError, "Packed data or a size needs dtype: :i64 or :f64, not #{dtype.inspect}" unless %i[i64 f64].include?(dtype)
+      else
+        dtype = CFenwickTree.native_dtype(data)
+        raise Shared::DataError, 'A Fenwick tree needs an Array of Integers in the int64 range or of Floats' unless dtype
+      end
+
+      CFenwickTree.new(data, dtype)
+    end
+
+    # How the concrete trees below choose their underlying structure, and how they fall back from a native one.
+    module NativeOrTemplate
+      # Tell the tree that the value at idx has changed
+      #
+      # A CNumericSegmentTree raises Shared::DataError (or RangeError, for a Bignum) when the new value can't be stored natively. If
+      # the native tree was chosen in initialize over an Array, rather than requested for packed data or read from an image, we then
+      # rebuild the tree with the generic template over the data as it is now. Later updates go straight to the template.
+      #
+      # The tree's results keep their types across the switch. Packed batch results are still in the native tree's dtype, so a value
+      # that doesn't fit it, like 2.5 in an int64 tree, makes the batch query raise Shared::DataError. But the tree can no longer be
+      # dumped.
+      #
+      # A tree built by SegmentTree.construct with +mutable: false+ raises Shared::LogicError instead.
+      def update_at(idx)
+        raise Shared::LogicError, 'Cannot update a tree built with mutable: false' if @immutable
+
+        @structure.update_at(idx)
+      rescue Shared::DataError, RangeError
+        raise unless @generic_structure && idx.is_a?(Integer) && idx >= 0 && idx < @size
+
+        @packed_dtype = @structure.dtype
+        @structure = @generic_structure.call
+        @generic_structure = nil
+      end
+
+      # Write an image of the tree to io. See SegmentTree.load.
+      #
+      # Only a tree backed by a CNumericSegmentTree can be dumped. Otherwise we raise Shared::LogicError.
+      def dump(io)
+        unless @structure.respond_to?(:dump)
+          raise Shared::LogicError, "A tree backed by a #{@structure.class.name.split('::').last} can't be dumped"
+        end
+
+        @structure.dump(io)
+      end
+
+      # Use the native version of operation from template_klass if there is one for data, and otherwise the generic template made by
+      # the block.
+      private def choose_structure(template_klass, operation, data, layout, &generic_structure)
+        @structure = template_klass.numeric_version(operation, data, layout:) if template_klass.respond_to?(:numeric_version)
+        if @structure
+          @generic_structure = generic_structure
+          @size = data.size
+        else
+          @structure = generic_structure.call
+          @packed_dtype = CNumericSegmentTree.native_dtype(data, operation) || :f64
+        end
+      end
+
+      # The batch query on the structure. A template packs its results for packed intervals in @packed_dtype, which is what a
+      # CNumericSegmentTree would use for the data, so that the result is the same whichever we have.
+      private def structure_query_many(lefts, rights)
+        return @structure.query_many(lefts, rights) unless @packed_dtype
+
+        @structure.query_many(lefts, rights, dtype: @packed_dtype)
+      end
     end
 
     # A segment tree that for an array A(0...n) answers questions of the form "what is the maximum value in the subinterval A(i..j)?"
     # in O(log n) time.
     class MaxValSegmentTree
-      extend Forwardable
-
-      # Tell the tree that the value at idx has changed
-      def_delegator :@structure, :update_at
+      include NativeOrTemplate
 
       # @param template_klass the "template" class that provides the generic implementation of the Segment Tree functionality.
       # @param data an object that contains values at integer indices based at 0, via +data[i]+.
       #   - This will usually be an Array, but it could also be a hash or a proc.
-      def initialize(template_klass, data)
+      # @param layout the memory layout to use if we get a CNumericSegmentTree. See SegmentTree.construct.
+      def initialize(template_klass, data, layout: :binary)
         data.must_be_a Enumerable
 
-        @structure = template_klass.new(
-          combine:               ->(a, b) { [a, b].max },
-          single_cell_array_val: ->(i) { data[i] },
-          size:                  data.size,
-          identity:              -Shared::INFINITY
-        )
+        choose_structure(template_klass, :max, data, layout) do
+          template_klass.new(
+            combine:               ->(a, b) { [a, b].max },
+            single_cell_array_val: ->(i) { data[i] },
+            size:                  data.size,
+            identity:              -Shared::INFINITY
+          )
+        end
       end
 
       # The maximum value in A(i..j).
@@ -79,26 +299,69 @@ module DataStructuresRMolinari
       def max_on(i, j)
         @structure.query_on(i, j)
       end
+
+      # The maximum values on a batch of intervals, in a single call.
+      #
+      # See SegmentTreeTemplate#query_many for the arguments and CNumericSegmentTree#query_many for the packed results. These are int64
+      # values when the data are Integers that a CNumericSegmentTree could store, and doubles otherwise, whichever template is used.
+      def max_on_many(lefts, rights = nil)
+        structure_query_many(lefts, rights)
+      end
+    end
+
+    # A segment tree that for an array A(0...n) answers questions of the form "what is the minimum value in the subinterval A(i..j)?"
+    # in O(log n) time.
+    class MinValSegmentTree
+      include NativeOrTemplate
+
+      # @param (see MaxValSegmentTree#initialize)
+      def initialize(template_klass, data, layout: :binary)
+        data.must_be_a Enumerable
+
+        choose_structure(template_klass, :min, data, layout) do
+          template_klass.new(
+            combine:               ->(a, b) { [a, b].min },
+            single_cell_array_val: ->(i) { data[i] },
+            size:                  data.size,
+            identity:              Shared::INFINITY
+          )
+        end
+      end
+
+      # The minimum value in A(i..j).
+      #
+      # The arguments must be integers in 0...(A.size)
+      # @return the smallest value in A(i..j) or Infinity if i > j.
+      def min_on(i, j)
+        @structure.query_on(i, j)
+      end
+
+      # The minimum values on a batch of intervals, in a single call.
+      #
+      # See SegmentTreeTemplate#query_many for the arguments and CNumericSegmentTree#query_many for the packed results. These are int64
+      # values when the data are Integers that a CNumericSegmentTree could store, and doubles otherwise, whichever template is used.
+      def min_on_many(lefts, rights = nil)
+        structure_query_many(lefts, rights)
+      end
     end
 
     # A segment tree that for an array A(0...n) answers questions of the form "what is the index of the maximal value in the
     # subinterval A(i..j)?" in O(log n) time.
     class IndexOfMaxValSegmentTree
-      extend Forwardable
-
-      # Tell the tree that the value at idx has changed
-      def_delegator :@structure, :update_at
+      include NativeOrTemplate
 
       # @param (see MaxValSegmentTree#initialize)
-      def initialize(template_klass, data)
+      def initialize(template_klass, data, layout: :binary)
         data.must_be_a Enumerable
 
-        @structure = template_klass.new(
-          combine:               ->(p1, p2) { p1[1] >= p2[1] ? p1 : p2 },
-          single_cell_array_val: ->(i) { [i, data[i]] },
-          size:                  data.size,
-          identity:              nil
-        )
+        choose_structure(template_klass, :index_of_max, data, layout) do
+          template_klass.new(
+            combine:               ->(p1, p2) { p1[1] >= p2[1] ? p1 : p2 },
+            single_cell_array_val: ->(i) { [i, data[i]] },
+            size:                  data.size,
+            identity:              nil
+          )
+        end
       end
 
       # The index of the maximum value in A(i..j)
@@ -110,24 +373,42 @@ module DataStructuresRMolinari
       def index_of_max_val_on(i, j)
         @structure.query_on(i, j)&.first # discard the value part of the pair, which is a bookkeeping
       end
+
+      # The indices of the maximum values on a batch of intervals, in a single call.
+      #
+      # See SegmentTreeTemplate#query_many for the arguments. For packed intervals the result is a String of packed int64 indices,
+      # with -1 for an empty interval, whichever template is used.
+      def index_of_max_val_on_many(lefts, rights = nil)
+        if rights.nil? && @packed_dtype
+          # The template's values are [index, value] pairs, which can't be packed. We pack the indices, with -1 for an empty interval.
+          pairs = SegmentTreeTemplate.unpack_intervals(lefts)
+          return @structure.query_many(pairs.map(&:first), pairs.map(&:last)).map { _1 ? _1.first : -1 }.pack('q*')
+        end
+
+        results = @structure.query_many(lefts, rights)
+        return results if results.is_a?(String) # packed indices
+
+        results.map { _1&.first }
+      end
     end
 
+    # A segment tree that for an array A(0...n) answers questions of the form "what is the sum of the values in the subinterval
+    # A(i..j)?" in O(log n) time.
     class SumSegmentTree
-      extend Forwardable
-
-      # Tell the tree that the value at idx has changed
-      def_delegator :@structure, :update_at
+      include NativeOrTemplate
 
       # @param (see MaxValSegmentTree#initialize)
-      def initialize(template_klass, data)
+      def initialize(template_klass, data, layout: :binary)
         data.must_be_a Enumerable
 
-        @structure = template_klass.new(
-          combine:               ->(a, b) { a + b },
-          single_cell_array_val: ->(i) { data[i] },
-          size:                  data.size,
-          identity:              0
-        )
+        choose_structure(template_klass, :sum, data, layout) do
+          template_klass.new(
+            combine:               ->(a, b) { a + b },
+            single_cell_array_val: ->(i) { data[i] },
+            size:                  data.size,
+            identity:              0
+          )
+        end
       end
 
       # The sum of the values in A(i..j)
@@ -137,6 +418,14 @@ module DataStructuresRMolinari
       def sum_on(i, j)
         @structure.query_on(i, j)
       end
+
+      # The sums on a batch of intervals, in a single call.
+      #
+      # See SegmentTreeTemplate#query_many for the arguments and CNumericSegmentTree#query_many for the packed results. These are int64
+      # values when the data are Integers that a CNumericSegmentTree could store, and doubles otherwise, whichever template is used.
+      def sum_on_many(lefts, rights = nil)
+        structure_query_many(lefts, rights)
+      end
     end
 
     # The underlying functionality of the Segment Tree data type, implemented in C as a Ruby extension.
@@ -145,14 +434,33 @@ module DataStructuresRMolinari
     #
     # Implementation note
     #
-    # The functionality is entirely written in C. But we write the constructor in Ruby because keyword arguments are difficult to
-    # parse on the C side.
+    # The functionality is entirely written in C. But we write the constructor and query_many in Ruby because keyword arguments are
+    # difficult to parse on the C side.
     class CSegmentTreeTemplate
       # (see SegmentTreeTemplate::initialize)
       def initialize(combine:, single_cell_array_val:, size:, identity:)
         # having sorted out the keyword arguments, pass them more easily to the C layer.
         c_initialize(combine, single_cell_array_val, size, identity)
       end
+
+      # (see SegmentTreeTemplate#query_many)
+      def query_many(lefts, rights = nil, dtype: :f64)
+        return c_query_many(lefts, rights) unless rights.nil?
+
+        SegmentTreeTemplate.pack_results(c_query_many(lefts), dtype)
+      end
+
+      # A native C structure for one of the built-in operations, if data allows it.
+      #
+      # @param operation one of +:max+, +:min+, +:index_of_max+, +:sum+
+      # @param data the underlying data array
+      # @param layout +:binary+, +:wide+ or +:blocked+. See SegmentTree.construct.
+      # @return a CNumericSegmentTree providing the operation over data, or nil if the values in data can't be stored natively. In
+      #   that case the caller should fall back to the generic template.
+      def self.numeric_version(operation, data, layout: :binary)
+        dtype = CNumericSegmentTree.native_dtype(data, operation)
+        CNumericSegmentTree.new(operation, data, dtype, layout) if dtype
+      end
     end
   end
 end
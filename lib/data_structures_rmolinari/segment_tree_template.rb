@@ -64,6 +64,58 @@ class DataStructuresRMolinari::SegmentTree::SegmentTreeTemplate
     determine_val(root, left, right, 0, @size - 1)
   end
 
+  # The desired values on a batch of subintervals. The C implementations answer the whole batch in a single call, saving the cost of
+  # a method call for each interval. Here we just call +query_on+ for each.
+  #
+  # The intervals are given either as
+  # - two Arrays of the same size, +lefts+ and +rights+, in which case the intervals are lefts[k]..rights[k]; or
+  # - a single String of packed int64 values l0, r0, l1, r1, ..., as made by +Array#pack('q*')+. In this case +rights+ is omitted.
+  #
+  # @param dtype how to pack the results for packed intervals: +:i64+ or +:f64+. It is ignored for Arrays.
+  # @return for Arrays, an Array of the values +query_on+ would return for each interval. For a packed String, a packed String of
+  #   those values as CNumericSegmentTree#query_many gives them: see SegmentTreeTemplate.pack_results.
+  def query_many(lefts, rights = nil, dtype: :f64)
+    return self.class.pack_results(self.class.unpack_intervals(lefts).map { |l, r| query_on(l, r) }, dtype) if rights.nil?
+
+    raise ArgumentError, "lefts and rights must have the same size (#{lefts.size} != #{rights.size})" unless lefts.size == rights.size
+
+    lefts.zip(rights).map { |l, r| query_on(l, r) }
+  end
+
+  # @private
+  #
+  # The pairs [l, r] of packed int64 intervals, checked as the C implementations check them.
+  def self.unpack_intervals(packed)
+    unless (packed.bytesize % 16).zero?
+      raise ArgumentError, "packed index pairs must be a whole number of pairs of int64 values (got #{packed.bytesize} bytes)"
+    end
+
+    packed.unpack('q*').each_slice(2).to_a
+  end
+
+  # @private
+  #
+  # Pack the results of a batch query, one 8-byte value for each, in native byte order, as CNumericSegmentTree#query_many does.
+  # - +:f64+: each value is packed as a double.
+  # - +:i64+: each value must be an Integer in the int64 range. The identities -Infinity and Infinity of max and min become the most
+  #   extreme int64 values. Anything else raises DataError.
+  def self.pack_results(values, dtype)
+    case dtype
+    when :f64
+      values.pack('d*')
+    when :i64
+      values.map do |v|
+        next v if v.is_a?(Integer) && v.bit_length < 64
+        next -(2**63) if v == -INFINITY
+        next 2**63 - 1 if v == INFINITY
+
+        raise DataError, "Cannot pack #{v.inspect} as an int64 value"
+      end.pack('q*')
+    else
+      raise ArgumentError, "dtype must be :i64 or :f64, not #{dtype.inspect}"
+    end
+  end
+
   # Reflect the fact that the underlying array has been updated at the given idx
   #
   # @param idx an index in the underlying data array.
@@ -20,6 +20,103 @@ class AlgorithmTest < Test::Unit::TestCase
     )
   end
 
+  def test_packed_mer_matches_ruby
+    size = 300
+    xs = (1..size).to_a.shuffle.map(&:to_f)
+    ys = Array.new(size) { rand(1..size).to_f }
+
+    expected = []
+    Algorithms.maximal_empty_rectangles(xs.zip(ys).map { |pt| Point.new(*pt) }) { |rect| expected << rect.map(&:to_f) }
+
+    assert_equal expected, unpacked_mers(Algorithms.maximal_empty_rectangles_packed(xs, ys))
+    assert_equal expected, unpacked_mers(Algorithms.maximal_empty_rectangles_packed(xs.zip(ys).flatten.pack('d*')))
+
+    area = ->(rect) { (rect[1] - rect[0]) * (rect[3] - rect[2]) }
+    min_area = area.call(expected.max_by(&area)) / 4
+    assert_equal expected.select { |rect| area.call(rect) >= min_area },
+                 unpacked_mers(Algorithms.maximal_empty_rectangles_packed(xs, ys, min_area:))
+
+    top = unpacked_mers(Algorithms.maximal_empty_rectangles_packed(xs, ys, k: 10))
+    assert_equal expected.map(&area).sort.reverse.first(10), top.map(&area)
+    assert_equal [], unpacked_mers(Algorithms.maximal_empty_rectangles_packed(xs, ys, k: 0))
+  end
+
+  def test_packed_mer_edge_cases
+    assert_equal '', Algorithms.maximal_empty_rectangles_packed([], [])
+    assert_equal '', Algorithms.maximal_empty_rectangles_packed([1], [1])
+    assert_equal [[0.0, 1.0, 0.0, 1.0]], unpacked_mers(Algorithms.maximal_empty_rectangles_packed([0, 1], [0, 1]))
+    assert_raise(Shared::DataError) { Algorithms.maximal_empty_rectangles_packed([1, 1], [0, 1]) }
+    assert_raise(Shared::DataError) { Algorithms.maximal_empty_rectangles_packed([1, 2], [0, Float::NAN]) }
+    xs = (0...10).map(&:to_f)
+    [1, 2].each do |threads|
+      assert_raise(Shared::DataError) { Algorithms.maximal_empty_rectangles_packed(xs + [Float::INFINITY], xs + [5.5], threads:) }
+      assert_raise(Shared::DataError) { Algorithms.maximal_empty_rectangles_packed(xs + [10.5], xs + [-Float::INFINITY], threads:) }
+    end
+    assert_raise(ArgumentError) { Algorithms.maximal_empty_rectangles_packed([1, 2], [0]) }
+  end
+
+  # The threaded version gives exactly the same results
+  def test_packed_mer_with_threads
+    size = 500
+    xs = (1..size).to_a.shuffle
+    ys = Array.new(size) { rand(1..size) }
+
+    all = Algorithms.maximal_empty_rectangles_packed(xs, ys)
+    top = Algorithms.maximal_empty_rectangles_packed(xs, ys, k: 20, min_area: 10)
+    [2, 3, 8].each do |threads|
+      assert_equal all, Algorithms.maximal_empty_rectangles_packed(xs, ys, threads:)
+      assert_equal top, Algorithms.maximal_empty_rectangles_packed(xs, ys, k: 20, min_area: 10, threads:)
+    end
+
+    assert_equal unpacked_mers(Algorithms.maximal_empty_rectangles_packed([0, 1], [0, 1])),
+                 unpacked_mers(Algorithms.maximal_empty_rectangles_packed([0, 1], [0, 1], threads: 4))
+    assert_raise(ArgumentError) { Algorithms.maximal_empty_rectangles_packed(xs, ys, threads: 0) }
+    assert_raise(ArgumentError) { Algorithms.maximal_empty_rectangles_packed(xs, ys, threads: 257) }
+  end
+
+  # An interrupt that doesn't raise, like a Thread#wakeup, stops the native threads for a moment but mustn't cut the results short
+  def test_packed_mer_survives_interrupts
+    size = 2_000
+    xs = (1..size).to_a.shuffle.map(&:to_f)
+    ys = Array.new(size) { rand(1..size).to_f }
+
+    [[1, {}], [4, {}], [6, {}], [1, { k: 10 }], [4, { k: 10 }]].each do |threads, opts|
+      expected = Algorithms.maximal_empty_rectangles_packed(xs, ys, threads:, **opts)
+      result, interrupts = Algorithms.send(:maximal_empty_rectangles_packed_with_interrupts, 5, xs, ys, threads:, **opts)
+      assert_equal 5, interrupts
+      assert_equal expected, result
+    end
+  end
+
+  def test_largest_empty_rectangles
+    size = 300
+    points = (1..size).to_a.shuffle.zip(Array.new(size) { rand(1..size) }).map { |pt| Point.new(*pt) }
+
+    area = ->(rect) { (rect[1] - rect[0]) * (rect[3] - rect[2]) }
+    all = []
+    Algorithms.maximal_empty_rectangles(points) { |rect| all << rect }
+    areas = all.map(&area).sort.reverse
+
+    [1, 10, 100, all.size + 1].each do |k|
+      assert_equal areas.first(k), Algorithms.largest_empty_rectangles(points, k:).map(&area)
+    end
+
+    min_area = areas[50]
+    result = Algorithms.largest_empty_rectangles(points, min_area:)
+    assert_equal areas.select { |a| a >= min_area }, result.map(&area)
+    assert_equal all.select { |rect| area.call(rect) >= min_area }.to_set, result.to_set
+
+    assert_equal areas.first(10), Algorithms.largest_empty_rectangles(points, k: 10, min_area:).map(&area)
+    assert_equal [], Algorithms.largest_empty_rectangles(points, k: 0)
+    assert_equal [], Algorithms.largest_empty_rectangles([Point.new(0, 0)], k: 3)
+    assert_raise(ArgumentError) { Algorithms.largest_empty_rectangles(points) }
+    assert_raise(Shared::DataError) { Algorithms.largest_empty_rectangles(points, k: -1) }
+  end
+
+  private def unpacked_mers(packed)
+    packed.unpack('d*').each_slice(4).to_a
+  end
+
   # Because its easy, for now check that we get the expected set of MER areas
   private def check_mer_case(points, expected_areas)
     points.map! { |pt| pt.is_a?(Point) ? pt : Point.new(*pt) }
@@ -1,5 +1,8 @@
 require 'byebug'
 require 'test/unit'
+require 'objspace'
+require 'stringio'
+require 'tempfile'
 
 require 'data_structures_rmolinari'
 
@@ -31,9 +34,443 @@ class DisjointUnionTest < Test::Unit::TestCase
     check_make_set CDisjointUnion.new
   end
 
+  def test_batch_operations
+    check_batch_operations DisjointUnion
+  end
+
+  def test_batch_operations_in_c
+    check_batch_operations CDisjointUnion
+  end
+
+  def test_basic_operation_in_compact_c
+    check_basic_operation CDisjointUnion.new(10, compact: true)
+  end
+
+  def test_member_check_in_compact_c
+    check_member_check CDisjointUnion.new(10, compact: true)
+  end
+
+  def test_make_set_in_compact_c
+    check_make_set CDisjointUnion.new(compact: true)
+  end
+
+  def test_compact_layout
+    size = 10_000
+    du = CDisjointUnion.new(size)
+    compact_du = CDisjointUnion.new(size, compact: true)
+    firsts = Array.new(size) { rand(size) }
+    seconds = Array.new(size) { rand(size) }
+    du.unite_many(firsts, seconds)
+    compact_du.unite_many(firsts, seconds)
+
+    # The layouts use the same algorithms and so give the same canonical representatives
+    assert_equal du.subset_count, compact_du.subset_count
+    assert_equal du.find_many((0...size).to_a), compact_du.find_many((0...size).to_a)
+
+    assert_operator ObjectSpace.memsize_of(compact_du) * 3, :<, ObjectSpace.memsize_of(du)
+
+    assert_raise(Shared::DataError) { compact_du.make_set(2**31) }
+    compact_du.make_set(size + 5)
+    assert_equal size + 5, compact_du.find(size + 5)
+  end
+
   ########################################
   # Helpers
 
+  private def check_batch_operations(klass)
+    du = klass.new(10)
+    du.unite_many([0, 2, 4, 1], [2, 4, 6, 1]) # the last pair is skipped
+    assert_equal 7, du.subset_count
+    assert_equal [du.find(0)] * 4, du.find_many([0, 2, 4, 6])
+
+    du.unite_many([1, 3, 3, 5].pack('q*'))
+    assert_equal 5, du.subset_count
+    roots = du.find_many([1, 3, 5, 7].pack('q*')).unpack('q*')
+    assert_equal [du.find(1), du.find(1), du.find(1), du.find(7)], roots
+
+    assert_raise(Shared::DataError) { du.unite_many([0], [10]) }
+    assert_raise(Shared::DataError) { du.find_many([[-1].pack('q*')].join) }
+    assert_raise(ArgumentError) { du.unite_many([0, 1], [2]) }
+
+    # Compare with one-at-a-time operation
+    size = 1000
+    firsts = Array.new(2000) { rand(size) }
+    seconds = Array.new(2000) { rand(size) }
+    batch = klass.new(size)
+    batch.unite_many(firsts, seconds)
+    single = klass.new(size)
+    firsts.zip(seconds).each { |e, f| single.unite(e, f) unless e == f }
+
+    assert_equal single.subset_count, batch.subset_count
+    assert_equal (0...size).map { single.find(_1) }, batch.find_many((0...size).to_a)
+  end
+
+  def test_concurrent_unite_many
+    size = 20_000
+    firsts = Array.new(size) { rand(size) }
+    seconds = Array.new(size) { rand(size) }
+    sequential = CDisjointUnion.new(size)
+    sequential.unite_many(firsts, seconds)
+
+    [false, true].each do |compact|
+      [2, 3, 8].each do |threads|
+        du = CDisjointUnion.new(size, compact:)
+        du.unite_many(firsts, seconds, threads:)
+        assert_same_partition sequential, du, size
+
+        packed = CDisjointUnion.new(size, compact:)
+        packed.unite_many(firsts.zip(seconds).flatten.pack('q*'), threads:)
+        assert_same_partition sequential, packed, size
+
+        # The usual operations work on the result
+        du.unite(firsts.first, size - 1) unless du.find(firsts.first) == du.find(size - 1)
+        assert_equal du.find(firsts.first), du.find(size - 1)
+      end
+    end
+
+    du = CDisjointUnion.new(10)
+    assert_raise(Shared::DataError) { du.unite_many([0, 1], [2, 10], threads: 2) }
+    assert_equal 10, du.subset_count # nothing was united
+    assert_raise(ArgumentError) { du.unite_many([0], [1], threads: 0) }
+  end
+
+  def test_images_in_c
+    size = 1_000
+    [false, true].each do |compact|
+      du = CDisjointUnion.new(size, compact:)
+      du.make_set(size + 10) # leaves a gap of slots that aren't elements
+      size.times do
+        e, f = rand(size), rand(size)
+        du.unite(e, f) unless du.find(e) == du.find(f)
+      end
+      io = StringIO.new(+'')
+      du.dump(io)
+      io.rewind
+
+      Tempfile.create('du') do |file|
+        du.dump(file)
+        file.close
+
+        [CDisjointUnion.load(io), CDisjointUnion.open(file.path)].each do |loaded|
+          assert_same_partition du, loaded, size
+          assert_equal size + 10, loaded.find(size + 10)
+          assert_raise(Shared::DataError) { loaded.find(size) }
+
+          # The loaded union carries on as usual
+          loaded.make_set(size)
+          loaded.unite(size, 0)
+          assert_equal loaded.find(0), loaded.find(size)
+        end
+      end
+    end
+
+    image = StringIO.new(+'')
+    CDisjointUnion.new(3).dump(image)
+    corrupt = image.string.dup
+    corrupt[-32, 8] = [3].pack('q') # the parent of element 1
+    assert_raise(Shared::DataError) { CDisjointUnion.load(StringIO.new(corrupt)) }
+    assert_raise(Shared::DataError) { CDisjointUnion.load(StringIO.new(image.string.byteslice(0, 20))) }
+  end
+
+  # The parents must form trees, with ranks increasing towards the roots, and the roots must match the subset count
+  def test_corrupt_image_structure_in_c
+    image = StringIO.new(+'')
+    CDisjointUnion.new(3).dump(image)
+    image = image.string.b
+    preamble = image.size - 24 - 3 * 16 # three (parent, rank) pairs follow the preamble
+    edit = lambda do |changes|
+      edited = image.dup
+      changes.each { |offset, value| edited[offset, 8] = [value].pack('q') }
+      CDisjointUnion.load(StringIO.new(edited))
+    end
+    parent = ->(e) { preamble + 24 + 16 * e }
+    rank = ->(e) { parent.(e) + 8 }
+    subset_count = preamble + 8
+
+    cycle = { parent.(0) => 1, parent.(1) => 0 }
+    assert_raise(Shared::DataError) { edit.(cycle) }
+    assert_raise(Shared::DataError) { edit.(cycle.merge(rank.(0) => 1, subset_count => 1)) }
+    assert_raise(Shared::DataError) { edit.(parent.(1) => 0) } # ranks equal
+    assert_raise(Shared::DataError) { edit.(parent.(1) => 0, rank.(0) => 1) } # subset_count is still 3
+
+    du = edit.(parent.(1) => 0, rank.(0) => 1, subset_count => 2)
+    assert_equal 0, du.find(1)
+    assert_equal 2, du.subset_count
+  end
+
+  # The concurrent batches link without regard to rank, so dump repairs the ranks for the loader's checks
+  def test_images_after_concurrent_unite_many_in_c
+    size = 2_000
+    [false, true].each do |compact|
+      du = CDisjointUnion.new(size, compact:)
+      du.unite_many(Array.new(size) { rand(size) }, Array.new(size) { rand(size) }, threads: 4)
+      io = StringIO.new(+'')
+      du.dump(io)
+      io.rewind
+
+      loaded = CDisjointUnion.load(io)
+      assert_same_partition du, loaded, size
+      assert_equal du.subset_count, loaded.subset_count
+    end
+  end
+
+  # find halves the path it walks, making each element on it point to its grandparent. We look at the parents in an image.
+  def test_path_halving_in_c
+    [false, true].each do |compact|
+      du = CDisjointUnion.new(8, compact:)
+      [[0, 1], [2, 3], [0, 2], [4, 5], [6, 7], [4, 6], [0, 4]].each { du.unite(*_1) }
+      assert_equal [0, 0, 0, 2, 0, 4, 4, 6], image_parents(du, 8, compact) # 7 is three steps from the root
+
+      du.find(7) # 7 now points to its old grandparent, 4, which is a child of the root
+      assert_equal [0, 0, 0, 2, 0, 4, 4, 4], image_parents(du, 8, compact)
+      du.find(7)
+      assert_equal [0, 0, 0, 2, 0, 4, 4, 0], image_parents(du, 8, compact)
+    end
+  end
+
+  # Rolling back restores the parents exactly, so find gives the same representatives as at the checkpoint
+  def test_rollback_in_c
+    size = 500
+    [false, true].each do |compact|
+      du = CDisjointUnion.new(size, compact:, rollback: true)
+      saved = []
+      300.times do |step|
+        if step % 50 == 0
+          saved << [du.checkpoint, du.subset_count, du.find_many((0...size).to_a)]
+        end
+        e, f = rand(size), rand(size)
+        du.unite(e, f) unless e == f
+      end
+      du.make_set(size + 3)
+      du.unite(size + 3, 0)
+      du.unite_many(Array.new(100) { rand(size) }, Array.new(100) { rand(size) })
+
+      saved.reverse_each do |checkpoint, subset_count, representatives|
+        du.rollback_to(checkpoint)
+        assert_equal subset_count, du.subset_count
+        assert_equal representatives, du.find_many((0...size).to_a)
+      end
+      assert_equal size, du.subset_count
+      assert_raise(Shared::DataError) { du.find(size + 3) }
+
+      du.unite(0, 1)
+      assert_raise(Shared::DataError) { du.rollback_to(saved.last.first + 2) } # beyond the end of the log
+      du.make_set(size + 3) # it can be added again
+
+      # An image keeps the mode but not the log
+      io = StringIO.new(+'')
+      du.dump(io)
+      io.rewind
+      loaded = CDisjointUnion.load(io)
+      checkpoint = loaded.checkpoint
+      loaded.unite(2, 3)
+      loaded.rollback_to(checkpoint)
+      assert_same_partition du, loaded, size
+    end
+
+    du = CDisjointUnion.new(4)
+    assert_raise(Shared::LogicError) { du.checkpoint }
+    assert_raise(Shared::LogicError) { du.rollback_to(0) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(4, rollback: true).unite_many([0], [1], threads: 2) }
+  end
+
+  # Offline dynamic connectivity by divide and conquer over time: each edge is added for the segment tree nodes covering its
+  # lifetime, and we roll back on the way out of each node
+  def test_rollback_for_offline_connectivity
+    size = 30
+    time_count = 64
+    edges = Array.new(40) do
+      from = rand(time_count)
+      [rand(size), rand(size), from, rand(from...time_count)]
+    end
+
+    du = CDisjointUnion.new(size, rollback: true)
+    actual = Array.new(time_count)
+    solve = lambda do |lo, hi, live|
+      checkpoint = du.checkpoint
+      covering, partial = live.partition { |_, _, from, to| from <= lo && hi <= to }
+      covering.each { |e, f, _, _| du.unite(e, f) unless e == f }
+      if lo == hi
+        actual[lo] = du.subset_count
+      else
+        mid = (lo + hi) / 2
+        solve.call(lo, mid, partial.select { |_, _, from, _| from <= mid })
+        solve.call(mid + 1, hi, partial.select { |_, _, _, to| to > mid })
+      end
+      du.rollback_to(checkpoint)
+    end
+    solve.call(0, time_count - 1, edges)
+
+    expected = (0...time_count).map do |t|
+      fresh = CDisjointUnion.new(size)
+      edges.each { |e, f, from, to| fresh.unite(e, f) if from <= t && t <= to && e != f }
+      fresh.subset_count
+    end
+    assert_equal expected, actual
+    assert_equal size, du.subset_count
+  end
+
+  def test_aggregates_in_c
+    size = 300
+    [[-> { rand(-100..100) }, :i64], [-> { rand(-100.0..100.0) }, :f64]].each do |gen, dtype|
+      [false, true].each do |compact|
+        values = Array.new(size) { gen.call }
+        du = CDisjointUnion.new(size, compact:, values:)
+        sized = CDisjointUnion.new(size, compact:, aggregates: true)
+        400.times do
+          e, f = rand(size), rand(size)
+          next if e == f
+
+          du.unite(e, f)
+          sized.unite(e, f)
+        end
+        du.make_set(size + 2, gen.call.tap { values[size + 2] = _1 })
+        du.unite(size + 2, 0)
+
+        members = (0...size).to_a.push(size + 2).group_by { du.find(_1) }
+        members.each_value do |set|
+          set_values = set.map { values[_1] }
+          set.sample(3).each do |e|
+            expected = { size: set.size, sum: set_values.sum, min: set_values.min, max: set_values.max }
+            actual = du.set_aggregate(e)
+            assert_in_delta expected.delete(:sum), actual.delete(:sum), 1e-9 if dtype == :f64
+            assert_equal expected, actual
+            assert_equal set.size, du.set_size(e)
+          end
+        end
+        (0...size).each { |e| assert_equal({ size: sized.set_size(e) }, sized.set_aggregate(e)) }
+      end
+
+      empty = CDisjointUnion.new(values: dtype)
+      empty.make_set(3, gen.call)
+      assert_equal 1, empty.set_size(3)
+      assert_raise(ArgumentError) { empty.make_set(4) }
+      assert_raise(Shared::DataError) { empty.make_set(4, dtype == :i64 ? 1.5 : 1) }
+    end
+
+    assert_raise(Shared::LogicError) { CDisjointUnion.new(3).set_size(0) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(3).make_set(3, 1) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(3, values: [1, 2]) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(3, values: :i64) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(1, values: :f64) }
+    assert_equal 0, CDisjointUnion.new(0, values: :i64).subset_count
+    assert_raise(Shared::DataError) { CDisjointUnion.new(2, values: [1, 2.0]) }
+    assert_raise(Shared::DataError) { CDisjointUnion.new(2, values: [2**62, 2**62]).unite(0, 1) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(2, aggregates: true).unite_many([0], [1], threads: 2) }
+    assert_raise(Shared::LogicError) { CDisjointUnion.new(2, aggregates: true).dump(StringIO.new(+'')) }
+  end
+
+  # The aggregates come back as they were when links are undone
+  def test_aggregates_with_rollback_in_c
+    size = 200
+    values = Array.new(size) { rand(-100..100) }
+    du = CDisjointUnion.new(size, values:, rollback: true)
+    checkpoint = du.checkpoint
+    before = (0...size).map { du.set_aggregate(_1) }
+    300.times do
+      e, f = rand(size), rand(size)
+      du.unite(e, f) unless e == f
+    end
+    middle_checkpoint = du.checkpoint
+    middle = (0...size).map { du.set_aggregate(_1) }
+    du.unite_many(Array.new(100) { rand(size) }, Array.new(100) { rand(size) })
+
+    du.rollback_to(middle_checkpoint)
+    assert_equal middle, (0...size).map { du.set_aggregate(_1) }
+    du.rollback_to(checkpoint)
+    assert_equal before, (0...size).map { du.set_aggregate(_1) }
+  end
+
+  # Each element gets a hidden integer position, and we are told the differences between some of them
+  def test_potentials_in_c
+    size = 300
+    [[false, false], [true, false], [false, true]].each do |compact, rollback|
+      positions = Array.new(size) { rand(-1000..1000) }
+      du = CDisjointUnion.new(size, compact:, rollback:, potentials: :i64)
+      checkpoint = du.checkpoint if rollback
+      400.times do
+        e, f = rand(size), rand(size)
+        du.unite(e, f, positions[f] - positions[e]) unless e == f
+      end
+
+      (0...size).each do |e|
+        f = rand(size)
+        expected = du.find(e) == du.find(f) ? positions[f] - positions[e] : nil
+        assert_equal expected, du.potential_difference(e, f)
+        assert_equal positions[e] - positions[du.find(e)], du.potential(e)
+      end
+
+      e, f = (0...size).to_a.combination(2).find { |a, b| du.find(a) == du.find(b) }
+      du.unite(e, f, positions[f] - positions[e]) # consistent with what we know
+      assert_raise(Shared::DataError) { du.unite(e, f, positions[f] - positions[e] + 1) }
+
+      next unless rollback
+
+      du.rollback_to(checkpoint)
+      assert_equal size, du.subset_count
+      assert_equal 0, du.potential(5)
+    end
+
+    floats = CDisjointUnion.new(3, potentials: :f64)
+    floats.unite(0, 1, 1.5)
+    floats.unite(2, 1, -0.25)
+    assert_in_delta 1.75, floats.potential_difference(0, 2), 1e-12
+    assert_nil CDisjointUnion.new(3, potentials: :f64).potential_difference(0, 2)
+
+    du = CDisjointUnion.new(3, potentials: :i64)
+    assert_raise(ArgumentError) { du.unite(0, 1) }
+    assert_raise(Shared::LogicError) { du.unite_many([0], [1]) }
+    assert_raise(ArgumentError) { CDisjointUnion.new(3).unite(0, 1, 5) }
+    assert_raise(Shared::LogicError) { CDisjointUnion.new(3).potential(0) }
+  end
+
+  # The counters are there only when the extension is built with --enable-stats
+  def test_stats_in_c
+    [false, true].each do |compact|
+      du = CDisjointUnion.new(8, compact:)
+      unless du.respond_to?(:stats)
+        flunk 'Expected a build with --enable-stats' if ENV['DSRM_STATS']
+        assert_raise(NotImplementedError) { du.stats }
+        omit 'Built without --enable-stats'
+      end
+
+      du.unite(0, 1)
+      du.unite(2, 3)
+      du.unite(0, 2) # 2 goes under 0, so 3 is now two steps from the root
+      assert_equal({ finds: 6, find_hops: 0, path_halving_writes: 0, links: 3, rank_increments: 3 }, du.stats)
+
+      du.find(3) # halving makes 0 the parent of 3...
+      du.find(3) # ...so this time it is one step
+      du.unite(1, 3) # already united
+      assert_equal({ finds: 10, find_hops: 5, path_halving_writes: 1, links: 3, rank_increments: 3 }, du.stats)
+
+      du.reset_stats
+      assert du.stats.values.all?(&:zero?)
+    end
+  end
+
+  # The parents of the first size elements in an image of du. They follow the 16-byte header and the 24-byte preamble, as int32s in
+  # the compact layout and otherwise in 16-byte (parent, rank) pairs.
+  private def image_parents(du, size, compact)
+    io = StringIO.new(+'')
+    du.dump(io)
+    slots = io.string.byteslice(40..)
+    return slots.unpack("l#{size}") if compact
+
+    slots.unpack('qQ' * size).each_slice(2).map(&:first)
+  end
+
+  # The canonical representatives may differ, but the same pairs of elements must be in the same set
+  private def assert_same_partition(expected, actual, size)
+    assert_equal expected.subset_count, actual.subset_count
+    pairing = {}
+    (0...size).each do |e|
+      root = expected.find(e)
+      pairing[root] ||= actual.find(e)
+      assert_equal pairing[root], actual.find(e)
+    end
+  end
+
   private def check_basic_operation(du)
     assert_equal 10, du.subset_count # all in separate sets
 
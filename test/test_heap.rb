@@ -1,11 +1,15 @@
 require 'byebug'
 require 'test/unit'
+require 'objspace'
 
 require 'data_structures_rmolinari'
 
 Heap = DataStructuresRMolinari::Heap
+CHeap = DataStructuresRMolinari::CHeap
 
 class HeapTest < Test::Unit::TestCase
+  HEAP_CLASSES = [Heap, CHeap].freeze
+
   def test_basic_operation
     data = [
       32, 5, 43, 49, 8, 15, 29, 50, 13, 25, 46, 48, 2, 14, 10, 35, 9, 18, 36, 40, 11, 21, 33, 4, 42, 20, 17, 19, 22, 38, 24, 23, 16,
@@ -124,6 +128,214 @@ class HeapTest < Test::Unit::TestCase
     end
   end
 
+  # The HEAP_CLASSES tests below cover CHeap's unboxed priorities. Here are the paths of its own that they don't reach: priorities it
+  # has to compare in Ruby, the unaddressable mode, and the membership checks.
+  def test_c_heap_specifics
+    heap = CHeap.new(debug: true)
+    (1..50).to_a.shuffle.each { |v| heap.insert(v, [v]) }
+    heap.update(7, [0])
+    assert_equal [7, 1, 2], heap.pop_many(3)
+
+    heap = CHeap.new(addressable: false)
+    [[1, 2], [2, 1], [1, 0]].each { |v, p| heap.insert(v, p) }
+    assert_equal [1, 2, 1], heap.pop_many(3)
+    heap.insert(1, 2)
+    assert_raise(Shared::LogicError) { heap.update(1, 0) }
+
+    heap = CHeap.new
+    assert_raise(Shared::DataError) { heap.update(1, 1) }
+    heap.insert(1, 1)
+    heap.pop
+    assert_raise(Shared::DataError) { heap.update(1, 1) }
+  end
+
+  def test_top_priority
+    HEAP_CLASSES.each do |heap_class|
+      heap = heap_class.new(max_heap: true)
+      heap.insert(:a, 2.5)
+      heap.insert(:b, 7.25)
+      assert_equal :b, heap.top
+      assert_equal 7.25, heap.top_priority
+      assert_equal 2, heap.size
+
+      assert_raise(RuntimeError) { heap_class.new.top_priority }
+    end
+  end
+
+  # CHeap stores Integer and Float priorities unboxed and changes its representation when it sees another kind of value.
+  def test_mixed_priority_types
+    HEAP_CLASSES.each do |heap_class|
+      heap = heap_class.new(debug: true)
+      heap.insert(:a, 5)
+      heap.insert(:b, 2.5)
+      heap.insert(:c, 3r)
+      heap.insert(:d, 2**70)
+      heap.update_by_delta(:a, -4)
+      heap.update(:d, 3.5)
+      heap.update_by_delta(:c, 1/4r)
+
+      assert_equal 1, heap.top_priority
+      assert_equal %i[a b c d], Array.new(4) { heap.pop }
+
+      # Once emptied, the heap can go back to unboxed storage
+      heap.insert(:x, 1.5)
+      heap.insert(:y, 0.5)
+      assert_equal :y, heap.pop
+    end
+  end
+
+  def test_priority_overflow
+    HEAP_CLASSES.each do |heap_class|
+      heap = heap_class.new
+      heap.insert(:a, 2**62 - 1)
+      heap.insert(:b, 0)
+      heap.update_by_delta(:b, 2**62)
+
+      assert_equal 2**62, heap.top_priority + 1
+      assert_equal %i[a b], Array.new(2) { heap.pop }
+    end
+  end
+
+  # Items are distinguished the way that Hash keys are, with #hash and #eql?
+  def test_item_identity
+    HEAP_CLASSES.each do |heap_class|
+      heap = heap_class.new
+      heap.insert([1, 2], 3)
+      heap.insert('a', 1)
+      heap.insert(1.0, 2)
+
+      assert_raise(Shared::DataError) { heap.insert('a'.dup, 0) }
+      heap.insert(1, 0) # 1 and 1.0 are not eql?
+
+      heap.update([1, 2], -1)
+      assert_equal [[1, 2], 1, 'a', 1.0], Array.new(4) { heap.pop }
+    end
+  end
+
+  def test_arity
+    HEAP_CLASSES.each do |heap_class|
+      [3, 4, 8].each do |arity|
+        [false, true].each do |max_heap|
+          priorities = (1..200).to_h { [_1, rand] }
+          heap = heap_class.new(arity:, max_heap:, debug: true)
+          priorities.each { |v, p| heap.insert(v, p) }
+          priorities.keys.sample(50).each do |v|
+            priorities[v] = -priorities[v]
+            heap.update(v, priorities[v])
+          end
+
+          expected = priorities.keys.sort_by { priorities[_1] }
+          expected.reverse! if max_heap
+          assert_equal expected, Array.new(priorities.size) { heap.pop }
+        end
+      end
+
+      assert_raise(Shared::DataError) { heap_class.new(arity: 1) }
+    end
+  end
+
+  def test_from_and_heapify
+    HEAP_CLASSES.each do |heap_class|
+      [2, 3, 4].each do |arity|
+        items = (1..300).to_a.shuffle
+        priorities = items.map { -_1 }
+
+        heap = heap_class.from(items, priorities, arity:, debug: true)
+        assert_equal 300, heap.size
+        assert_equal (1..300).to_a.reverse, heap.pop_many(300)
+
+        heap = heap_class.heapify(items.zip(items), arity:, max_heap: true, debug: true)
+        assert_equal [300, 299, 298], heap.pop_many(3)
+        heap.update(1, 1000)
+        assert_equal 1, heap.pop
+
+        assert_equal (1..300).to_a, heap_class.from(items).pop_many(400)
+      end
+
+      assert heap_class.from([]).empty?
+      assert_raise(Shared::DataError) { heap_class.from([1, 2, 1]) }
+      assert_raise(ArgumentError) { heap_class.from([1, 2], [1]) }
+    end
+  end
+
+  def test_insert_many
+    HEAP_CLASSES.each do |heap_class|
+      # Few items into a large heap, inserted one by one, and many into a small one, by rebuilding
+      [[1000, 5], [5, 1000]].each do |initial_count, new_count|
+        heap = heap_class.from((0...initial_count).to_a.shuffle, debug: true)
+        new_items = (initial_count...(initial_count + new_count)).to_a.shuffle
+        heap.insert_many(new_items, new_items.map { _1 - initial_count - new_count })
+
+        expected = (initial_count...(initial_count + new_count)).to_a + (0...initial_count).to_a
+        assert_equal expected.first(10), heap.pop_many(10)
+        assert_equal expected.size - 10, heap.size
+      end
+
+      # A duplicate stops the insertion but leaves a valid heap
+      heap = heap_class.new(debug: true)
+      assert_raise(Shared::DataError) { heap.insert_many([3, 1, 2, 1, 0]) }
+      assert_equal [1, 2, 3], heap.pop_many(5)
+
+      assert_raise(Shared::DataError) { heap.pop_many(-1) }
+    end
+  end
+
+  def test_against_ruby_version
+    [-> { rand(1000) }, -> { rand }, -> { Rational(rand(1000), 7) }].each do |priority_maker|
+      ruby_heap = Heap.new
+      c_heap = CHeap.new(debug: true)
+      present = []
+
+      1000.times do |i|
+        case rand(3)
+        when 0
+          priority = priority_maker.call
+          ruby_heap.insert(i, priority)
+          c_heap.insert(i, priority)
+          present << i
+        when 1
+          next if present.empty?
+
+          item = present.sample
+          priority = priority_maker.call
+          ruby_heap.update(item, priority)
+          c_heap.update(item, priority)
+        else
+          next if present.empty?
+
+          assert_equal ruby_heap.top_priority, c_heap.top_priority
+          present.delete(c_heap.pop)
+          ruby_heap.pop
+        end
+        assert_equal ruby_heap.size, c_heap.size
+      end
+
+      until c_heap.empty?
+        assert_equal ruby_heap.top_priority, c_heap.top_priority
+        ruby_heap.pop
+        c_heap.pop
+      end
+      assert ruby_heap.empty?
+    end
+  end
+
+  # The priorities come from Ruby's allocator, or from a mapping that the GC is told about, and memsize_of counts them
+  def test_memory
+    small = CHeap.new
+    small.insert(1, 1)
+    assert_operator ObjectSpace.memsize_of(small), :<, 10_000
+
+    size = 300_000
+    priorities = Array.new(size) { rand(1000) }
+    heap = CHeap.new(addressable: false)
+    heap.insert_many((0...size).to_a, priorities)
+    assert_operator ObjectSpace.memsize_of(heap), :>=, 2 * size * 8
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+
+    assert_equal priorities.sort, heap.pop_many(size).map { priorities[_1] }
+  end
+
   # Create a new Hash, insert the given items, yield the hash to a block, and then assert that the hash pops the items in the given
   # order
   private def test_pop_ordering(inserts, expected_order)
@@ -1,6 +1,8 @@
 require 'byebug'
 require 'must_be'
 require 'set'
+require 'stringio'
+require 'tempfile'
 require 'test/unit'
 require 'timeout'
 require 'ruby-prof'
@@ -16,6 +18,7 @@ class PrioritySearchTreeTest < Test::Unit::TestCase
   InternalLogicError = Shared::InternalLogicError
 
   MaxPrioritySearchTree = DataStructuresRMolinari::MaxPrioritySearchTree
+  CMaxPrioritySearchTree = DataStructuresRMolinari::CMaxPrioritySearchTree
   MinPrioritySearchTree = DataStructuresRMolinari::MinPrioritySearchTree
 
   INFINITY = Shared::INFINITY
@@ -126,14 +129,352 @@ class PrioritySearchTreeTest < Test::Unit::TestCase
     end
   end
 
-  private def before_and_after_deletion_pair
-    pst_pair = dynamic_max_pst_pair
+  private def before_and_after_deletion_pair(flavor: :max)
+    pst_pair = flavor == :max ? dynamic_max_pst_pair : make_pst_pair(flavor, dynamic: true)
     yield pst_pair
 
     pst_pair.delete_top!
     yield pst_pair
   end
 
+  ########################################
+  # The same tests for the C implementation, CMaxPrioritySearchTree
+
+  def test_c_pst_construction
+    CMaxPrioritySearchTree.new(raw_data(@size).shuffle, verify: true)
+    CMaxPrioritySearchTree.new((1..@size).map { Point.new(rand, rand) }, verify: true)
+
+    # Small sizes exercise the corner cases of the construction
+    (0..40).each do |size|
+      CMaxPrioritySearchTree.new(raw_data(size).shuffle, verify: true)
+    end
+  end
+
+  def test_c_duplicate_coordinate_checks
+    assert_raise(Shared::DataError) do
+      CMaxPrioritySearchTree.new([Point.new(0, 0), Point.new(0, 1)])
+    end
+    assert_raise(Shared::DataError) do
+      CMaxPrioritySearchTree.new([Point.new(0, Float::NAN)])
+    end
+    assert_raise(TypeError) do
+      CMaxPrioritySearchTree.new([Point.new('a', 1)])
+    end
+  end
+
+  def test_c_nan_query_checks
+    pst = CMaxPrioritySearchTree.new(Array.new(100) { Point.new(_1, _1) })
+    nan = Float::NAN
+
+    %i[largest_y_in_ne largest_y_in_nw smallest_x_in_ne largest_x_in_nw].each do |method|
+      assert_raise(Shared::DataError) { pst.send(method, nan, 10) }
+      assert_raise(Shared::DataError) { pst.send(method, 10, nan) }
+      assert_raise(Shared::DataError) { pst.send(:"#{method}_many", [1, nan], [10, 10]) }
+      assert_raise(Shared::DataError) { pst.send(:"#{method}_many", [nan, 10].pack('d*')) }
+    end
+    assert_raise(Shared::DataError) { pst.largest_y_in_3_sided(nan, 50, 10) }
+    assert_raise(Shared::DataError) { pst.count_3_sided(0, nan, 10) }
+    assert_raise(Shared::DataError) { pst.enumerate_3_sided(0, 50, nan) }
+
+    assert_equal Point.new(10, 10), pst.smallest_x_in_ne(10, 10)
+  end
+
+  def test_c_max_pst_quadrant_calls
+    MAX_PST_QUADRANT_CALLS.each do |method|
+      [true, false].each do |open|
+        check_quadrant_calc(c_max_pst_pair, method, open:)
+      end
+    end
+  end
+
+  def test_c_max_pst_3_sided_calls
+    [true, false].each do |open|
+      check_3_sided_calc(c_max_pst_pair, :largest_y_in_3_sided, open:)
+    end
+  end
+
+  def test_c_max_pst_enumerate_3_sided_calls
+    [true, false].each do |open|
+      [true, false].each do |enumerate_via_block|
+        check_3_sided_calc(c_max_pst_pair, :enumerate_3_sided, open:, enumerate_via_block:)
+      end
+    end
+  end
+
+  def test_c_dynamic_calls
+    ALL_MAX_PST_CALLS.each do |method|
+      before_and_after_deletion_pair(flavor: :c_max) do |pst_pair|
+        if method =~ /3_sided/
+          check_3_sided_calc(pst_pair, method)
+        else
+          check_quadrant_calc(pst_pair, method)
+        end
+      end
+    end
+  end
+
+  # Points need only respond to #x and #y, and we get the same objects back
+  def test_c_pst_with_other_point_types
+    klass = Struct.new(:x, :y, :name)
+    points = raw_data(100).map { |pt| klass.new(pt.x, pt.y, "#{pt.x}") }
+    pst = CMaxPrioritySearchTree.new(points.shuffle)
+    top = points.max_by { |pt| [pt.y, -pt.x] }
+    assert_same top, pst.largest_y_in_ne(-INFINITY, -INFINITY)
+    assert_equal Point.new(INFINITY, -INFINITY), pst.largest_y_in_ne(1000, 0)
+
+    assert CMaxPrioritySearchTree.new([]).empty?
+    assert_raise(Shared::LogicError) { pst.delete_top! }
+    assert_raise(Shared::DataError) { CMaxPrioritySearchTree.new([], dynamic: true).delete_top! }
+  end
+
+  def test_c_bad_inputs
+    check_one_case(
+      :smallest_x_in_ne,
+      [[6, 19], [9, 18], [15, 17], [2, 16], [11, 13], [16, 12], [19, 10], [4, 6], [8, 15], [10, 7],
+       [12, 11], [13, 9], [14, 4], [17, 2], [18, 3], [1, 5], [3, 1], [5, 8], [7, 14]],
+      4, 15,
+      Point.new(6, 19),
+      klass: CMaxPrioritySearchTree
+    )
+    check_one_case(:largest_x_in_nw, [[3, 6], [2, 5], [6, 3], [1, 1], [4, 4], [5, 2]], 5, 2, Point.new(5, 2),
+                   klass: CMaxPrioritySearchTree)
+    check_one_case(:largest_y_in_nw, [[3, 3], [2, 2], [1, 2]], 2, 1, Point.new(1, 2), klass: CMaxPrioritySearchTree)
+    check_one_case(:largest_y_in_ne, [[1, 3], [2, 2], [3, 1]], 2, 1, Point.new(2, 2), klass: CMaxPrioritySearchTree)
+    check_one_dynamic_case(
+      :largest_x_in_nw,
+      [[7, 5], [9, 3], [5, 8], [2, 2], [8, 5], [6, 7], [1, 7], [10, 10], [4, 4], [3, 1]],
+      9, 1,
+      [[10, 10], [5, 8], [1, 7], [6, 7], [7, 5], [8, 5], [4, 4], [9, 3], [2, 2], [3, 1]],
+      [-INFINITY, INFINITY],
+      klass: CMaxPrioritySearchTree
+    )
+    check_one_dynamic_case(:enumerate_3_sided, [[2, 2], [1, 2], [3, 2]], 3, 3, 2, [[1, 2]], [[3, 2]],
+                           klass: CMaxPrioritySearchTree)
+  end
+
+  ########################################
+  # Batch quadrant queries
+
+  def test_quadrant_calls_many
+    [[:max, MAX_PST_QUADRANT_CALLS], [:c_max, MAX_PST_QUADRANT_CALLS], [:min, MIN_PST_QUADRANT_CALLS]].each do |flavor, methods|
+      pst = make_pst(flavor)
+      methods.each do |method|
+        [true, false].each do |open|
+          check_quadrant_calc_many(pst, method, open:)
+        end
+      end
+    end
+  end
+
+  def test_quadrant_calls_many_bad_inputs
+    %i[max c_max min].each do |flavor|
+      pst = make_pst(flavor, pairs: raw_data(10))
+      method = flavor == :min ? :smallest_y_in_se_many : :largest_y_in_ne_many
+      assert_raise(ArgumentError) { pst.send(method, [1, 2], [3]) }
+      assert_raise(ArgumentError) { pst.send(method, [1.0, 2.0, 3.0].pack('d*')) }
+      assert_equal [], pst.send(method, [], [])
+      assert_equal ''.b, pst.send(method, ''.b)
+    end
+  end
+
+  def test_quadrant_calls_many_packed_results_agree_across_backends
+    pairs = @common_raw_data.shuffle
+    ruby_pst = make_pst(:max, pairs:)
+    c_pst = make_pst(:c_max, pairs:)
+    corners = Array.new(200) { rand(-1.0..(@size + 1.0)) }.pack('d*')
+    MAX_PST_QUADRANT_CALLS.each do |method|
+      many = :"#{method}_many"
+      [true, false].each do |open|
+        assert_equal c_pst.send(many, corners, open:), ruby_pst.send(many, corners, open:)
+      end
+    end
+  end
+
+  def test_count_3_sided
+    %i[max c_max min].each do |flavor|
+      pst = make_pst(flavor)
+      20.times do
+        x0, x1 = [rand(0..@size), rand(0..@size)].sort
+        y0 = rand(0..@size)
+        [true, false].each do |open|
+          assert_equal pst.enumerate_3_sided(x0, x1, y0, open:).size, pst.count_3_sided(x0, x1, y0, open:)
+        end
+      end
+    end
+  end
+
+  def test_enumerate_3_sided_into
+    %i[max c_max min].each do |flavor|
+      pst = make_pst(flavor)
+      [1, 37, @size].each do |chunk_size|
+        x0, x1 = [rand(0..@size), rand(0..@size)].sort
+        y0 = flavor == :min ? rand(0..@size) : rand(0..(@size / 2))
+        expected = pst.enumerate_3_sided(x0, x1, y0).map { |pt| [pt.x.to_f, pt.y.to_f] }
+
+        buffer = "\0".b * (16 * chunk_size)
+        found = []
+        cursor = nil
+        loop do
+          written, cursor = pst.enumerate_3_sided_into(buffer, x0, x1, y0, cursor:)
+          found.concat(buffer.byteslice(0, 16 * written).unpack('d*').each_slice(2).to_a)
+          break unless cursor
+
+          assert_equal chunk_size, written
+        end
+        assert_equal expected, found
+      end
+
+      y_all = flavor == :min ? @size : 0 # every point is in the region
+      buffer = "\0".b * 16
+      _, cursor = pst.enumerate_3_sided_into(buffer, 0, @size, y_all)
+      refute_nil cursor
+      assert_raise(ArgumentError) { pst.enumerate_3_sided_into(buffer, 0, @size - 1, y_all, cursor:) }
+      assert_raise(ArgumentError) { make_pst(flavor).enumerate_3_sided_into(buffer, 0, @size, y_all, cursor:) }
+      assert_raise(ArgumentError) { pst.enumerate_3_sided_into(buffer, 0, @size, y_all, cursor: 3) }
+      assert_raise(ArgumentError) { pst.enumerate_3_sided_into(+''.b, 0, @size, y_all) }
+
+      dynamic_pst = make_pst(flavor, dynamic: true)
+      _, cursor = dynamic_pst.enumerate_3_sided_into(buffer, 0, @size, y_all)
+      dynamic_pst.delete_top!
+      assert_raise(ArgumentError) { dynamic_pst.enumerate_3_sided_into(buffer, 0, @size, y_all, cursor:) }
+      assert_raise(ArgumentError) { pst.enumerate_3_sided_into(+'abc', 0, 1, 0) }
+      assert_raise(FrozenError) { pst.enumerate_3_sided_into(("\0" * 16).b.freeze, 0, @size, 0) }
+    end
+  end
+
+  # A loaded tree gives Shared::Points with Float coordinates. They are == to the originals, though not eql?
+  def test_c_pst_images
+    [false, true].each do |dynamic|
+      pst = make_pst(:c_max, dynamic:)
+      io = StringIO.new(+'')
+      pst.dump(io)
+      io.rewind
+
+      Tempfile.create('pst') do |file|
+        pst.dump(file)
+        file.close
+
+        loaded = [CMaxPrioritySearchTree.load(io), CMaxPrioritySearchTree.open(file.path)]
+        50.times do
+          x0, x1 = [rand(0..@size), rand(0..@size)].sort
+          y0 = rand(0..@size)
+          loaded.each do |other|
+            MAX_PST_QUADRANT_CALLS.each { |method| assert_equal pst.send(method, x0, y0), other.send(method, x0, y0) }
+            assert_equal pst.largest_y_in_3_sided(x0, x1, y0), other.largest_y_in_3_sided(x0, x1, y0)
+            assert_equal coords(pst.enumerate_3_sided(x0, x1, y0)), coords(other.enumerate_3_sided(x0, x1, y0))
+          end
+        end
+        next unless dynamic
+
+        deleted = Array.new(10) { pst.delete_top! }
+        loaded.each { |other| assert_equal deleted, Array.new(10) { other.delete_top! } }
+        # The deletions from the mapped tree didn't reach the file
+        assert_equal deleted.first, CMaxPrioritySearchTree.open(file.path).delete_top!
+      end
+    end
+
+    bad_image = StringIO.new(+'')
+    DataStructuresRMolinari::CDisjointUnion.new(3).dump(bad_image)
+    bad_image.rewind
+    assert_raise(Shared::DataError) { CMaxPrioritySearchTree.load(bad_image) }
+    assert_raise(Shared::DataError) { CMaxPrioritySearchTree.load(StringIO.new('DSRM')) }
+    assert_raise(Errno::ENOENT) { CMaxPrioritySearchTree.open('/no/such/image') }
+  end
+
+  # The shape of the tree is fixed by its size, so an image with any other shape is corrupt
+  def test_c_pst_corrupt_images
+    size = 1_000
+    pst = CMaxPrioritySearchTree.new(Array.new(size) { Point.new(_1, rand) })
+    image = StringIO.new(+'')
+    pst.dump(image)
+    image = image.string.b
+
+    # The preamble starts with size, member_count, last_non_leaf, and parent_of_one_child. The xs array follows, entry 0 first.
+    preamble = image.index([size, size, size / 2, size / 2].pack('Q*'))
+    xs_start = preamble + 40
+    corruptions = {
+      last_non_leaf: [preamble + 16, [size].pack('Q')],
+      parent_of_one_child: [preamble + 24, [0].pack('Q')],
+      nan_x: [xs_start + 8 * 5, [Float::NAN].pack('d')]
+    }
+
+    corruptions.each_value do |offset, bytes|
+      bad_image = image.dup
+      bad_image[offset, bytes.size] = bytes
+      assert_raise(Shared::DataError) { CMaxPrioritySearchTree.load(StringIO.new(bad_image)) }
+
+      Tempfile.create('pst') do |file|
+        file.write(bad_image)
+        file.close
+        assert_raise(Shared::DataError) { CMaxPrioritySearchTree.open(file.path) }
+      end
+    end
+
+    assert_equal size, CMaxPrioritySearchTree.load(StringIO.new(image)).count_3_sided(0, 2 * size, -1)
+  end
+
+  def test_from_columns
+    xs = @common_raw_data.map { _1.x.to_f }
+    ys = @common_raw_data.map { _1.y.to_f }
+    pst = make_pst(:c_max)
+
+    [MaxPrioritySearchTree, CMaxPrioritySearchTree].each do |klass|
+      from_columns = klass.from_columns(xs.pack('d*'), ys.pack('d*'), verify: true)
+      50.times do
+        x0, x1 = [rand(0..@size), rand(0..@size)].sort
+        y0 = rand(0..@size)
+        MAX_PST_QUADRANT_CALLS.each { |method| assert_equal pst.send(method, x0, y0), from_columns.send(method, x0, y0) }
+        assert_equal coords(pst.enumerate_3_sided(x0, x1, y0)), coords(from_columns.enumerate_3_sided(x0, x1, y0))
+      end
+
+      dynamic = klass.from_columns(xs.pack('d*'), ys.pack('d*'), dynamic: true)
+      assert_equal @common_raw_data.max_by { [_1.y, -_1.x] }, dynamic.delete_top!
+
+      assert_raise(ArgumentError) { klass.from_columns(xs.pack('d*'), ys.drop(1).pack('d*')) }
+      assert_raise(ArgumentError) { klass.from_columns('abc', 'abc') }
+      assert_raise(Shared::DataError) { klass.from_columns([1.0, 1.0].pack('d*'), [2.0, 3.0].pack('d*')) }
+    end
+  end
+
+  # The counters are there only when the extension is built with --enable-stats
+  def test_c_pst_stats
+    size = 1_000
+    pst = CMaxPrioritySearchTree.new(Array.new(size) { Point.new(_1, rand) }, dynamic: true)
+    unless pst.respond_to?(:stats)
+      flunk 'Expected a build with --enable-stats' if ENV['DSRM_STATS']
+      assert_raise(NotImplementedError) { pst.stats }
+      omit 'Built without --enable-stats'
+    end
+
+    height = Math.log2(size).floor
+    100.times { pst.delete_top! }
+    stats = pst.stats
+    assert_equal 100, stats[:delete_tops]
+    assert stats[:max_delete_top_depth].between?(1, height)
+    assert stats[:delete_top_depths].between?(100, 100 * stats[:max_delete_top_depth])
+
+    pst.reset_stats
+    assert pst.stats.values.all?(&:zero?)
+  end
+
+  private def coords(points)
+    points.map { [_1.x.to_f, _1.y.to_f] }.sort
+  end
+
+  # Check a batch of quadrant queries against the single-query version, with the corners given as Arrays and then packed.
+  private def check_quadrant_calc_many(pst, method, open:)
+    xs = Array.new(100) { rand(0..@size + 1) }
+    ys = Array.new(100) { rand(0..@size + 1) }
+    expected = xs.zip(ys).map { |x0, y0| pst.send(method, x0, y0, open:) }
+
+    many = :"#{method}_many"
+    assert_equal expected, pst.send(many, xs, ys, open:)
+
+    packed_results = pst.send(many, xs.zip(ys).flatten.pack('d*'), open:)
+    assert_equal Encoding::BINARY, packed_results.encoding
+    assert_equal expected.flat_map { |pt| [pt.x.to_f, pt.y.to_f] }, packed_results.unpack('d*')
+  end
+
   ########################################
   # Analagous tests for the MinPST
 
@@ -159,6 +500,24 @@ class PrioritySearchTreeTest < Test::Unit::TestCase
     end
   end
 
+  def test_min_pst_dynamic_calls
+    before_and_after_deletion_pair(flavor: :min) do |pst_pair|
+      check_3_sided_calc(pst_pair, :smallest_y_in_3_sided)
+    end
+  end
+
+  # The MinPST is built in place and hands back the objects it was given, just like the MaxPST
+  def test_min_pst_returns_original_points
+    data = @common_raw_data.shuffle
+    originals = data.to_set(&:object_id)
+    pst = MinPrioritySearchTree.new(data, verify: true)
+
+    # The PST works 1-based and pads the front of the array with nil
+    assert_equal originals, data.compact.to_set(&:object_id)
+    assert_same data[1], pst.smallest_y_in_3_sided(-INFINITY, INFINITY, INFINITY)
+    pst.enumerate_3_sided(-INFINITY, INFINITY, INFINITY) { |pt| assert originals.include?(pt.object_id) }
+  end
+
   ########################################
   # Some regression tests on inputs found to be bad during testing
 
@@ -416,6 +775,10 @@ class PrioritySearchTreeTest < Test::Unit::TestCase
     @max_pst_pair ||= make_pst_pair(:max)
   end
 
+  private def c_max_pst_pair
+    @c_max_pst_pair ||= make_pst_pair(:c_max)
+  end
+
   private def min_pst_pair
     @min_pst_pair ||= make_pst_pair(:min)
   end
@@ -440,6 +803,8 @@ class PrioritySearchTreeTest < Test::Unit::TestCase
       MaxPrioritySearchTree.new(pairs.clone, dynamic:, verify:)
     when :min
       MinPrioritySearchTree.new(pairs.clone, dynamic:, verify:)
+    when :c_max
+      CMaxPrioritySearchTree.new(pairs.clone, dynamic:, verify:)
     else
       raise "Unknown flavor #{flavor.inspect}"
     end
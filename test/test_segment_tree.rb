@@ -1,6 +1,9 @@
 require 'test/unit'
 require 'byebug'
 require 'must_be'
+require 'objspace'
+require 'stringio'
+require 'tempfile'
 
 require 'data_structures_rmolinari'
 
@@ -12,6 +15,12 @@ class SegmentTreeTest < Test::Unit::TestCase
       3, -10, -8, 9, 2
     ]
 
+  FLOAT_DATA = DATA.map { |v| v + rand.round(3) }
+
+  INFINITY = Shared::INFINITY
+
+  QUERY_METHOD = { max: :max_on, min: :min_on, sum: :sum_on, index_of_max: :index_of_max_val_on }.freeze
+
   def test_max_val_segment_tree
     seg_tree = make_one(:max, :ruby, DATA)
     test_seg_tree_basic(seg_tree, :max_on, DATA.size) { |i, j| DATA[i..j].max }
@@ -34,6 +43,11 @@ class SegmentTreeTest < Test::Unit::TestCase
     test_seg_tree_with_updates(seg_tree, :index_of_max_val_on, mutable_data) { |i, j| (i..j).max_by { mutable_data[_1] } }
   end
 
+  def test_min_val_segment_tree
+    seg_tree = make_one(:min, :ruby, DATA)
+    test_seg_tree_basic(seg_tree, :min_on, DATA.size) { |i, j| DATA[i..j].min }
+  end
+
   ########################################
   # C implementation
 
@@ -70,32 +84,807 @@ class SegmentTreeTest < Test::Unit::TestCase
     test_seg_tree_with_updates(seg_tree, :sum_on, mutable_data) { |i, j| mutable_data[i..j].sum }
   end
 
+  def test_min_val_segment_tree_updates_with_c
+    mutable_data = DATA.clone
+    seg_tree = make_one(:min, :c, mutable_data)
+    test_seg_tree_with_updates(seg_tree, :min_on, mutable_data) { |i, j| mutable_data[i..j].min }
+  end
+
+  # An update that doesn't fit the native tree makes the concrete tree switch to the generic template
+  def test_native_tree_falls_back_on_updates
+    %i[max min sum index_of_max].each do |op|
+      [2.5, Rational(1, 2), 2**62, 2**70].each do |value|
+        mutable_data = DATA.clone
+        seg_tree = make_one(op, :c, mutable_data)
+        mutable_data[1] = value
+        seg_tree.update_at(1)
+        expected = ->(i, j) { op == :index_of_max ? (i..j).max_by { mutable_data[_1] } : mutable_data[i..j].send(op) }
+        test_seg_tree_with_updates(seg_tree, QUERY_METHOD[op], mutable_data, sample: 3) { |i, j| expected.call(i, j) }
+        assert_raise(Shared::DataError) { seg_tree.update_at(DATA.size) }
+      end
+    end
+
+    seg_tree = make_one(:sum, :c, DATA.clone)
+    assert_raise(Shared::DataError) { seg_tree.update_at(DATA.size) } # a bad index doesn't cause a fallback
+
+    packed = DATA.pack('q*')
+    seg_tree = SegmentTree.construct(packed, :sum, :c, dtype: :i64)
+    packed[0, 8] = [2**62].pack('q')
+    assert_raise(Shared::DataError) { seg_tree.update_at(0) } # we were asked for a native tree
+  end
+
+  # A tree that falls back keeps the types of its results, and can no longer be dumped
+  def test_native_tree_keeps_its_types_across_a_fallback
+    packed_intervals = [[0, 39], [1, 1], [5, 4]].flatten.pack('q*')
+    empty_val = { max: -INFINITY, min: INFINITY, sum: 0, index_of_max: -1 }
+
+    %i[max min sum index_of_max].each do |op|
+      method = :"#{QUERY_METHOD[op]}_many"
+      format = op == :index_of_max ? 'q*' : 'd*'
+
+      # An Integer among Floats. The packed results are still doubles.
+      mutable_data = FLOAT_DATA.clone
+      seg_tree = make_one(op, :c, mutable_data)
+      assert_kind_of String, seg_tree.send(method, packed_intervals)
+      seg_tree.dump(StringIO.new(+''))
+
+      mutable_data[1] = 100
+      seg_tree.update_at(1)
+      whole = seg_tree.send(QUERY_METHOD[op], 0, 39)
+      assert_equal [whole, op == :index_of_max ? 1 : 100, empty_val[op]], seg_tree.send(method, packed_intervals).unpack(format)
+      assert_equal [whole], seg_tree.send(method, [0], [39])
+      assert_raise(Shared::LogicError) { seg_tree.dump(StringIO.new(+'')) }
+
+      # A Float among Integers. The packed results are still int64 values, and so can't include the Float.
+      mutable_data = DATA.clone
+      seg_tree = make_one(op, :c, mutable_data)
+      mutable_data[1] = 2.5
+      seg_tree.update_at(1)
+      others = [[2, 39], [5, 4]].flatten.pack('q*')
+      whole = op == :index_of_max ? (2..39).max_by { mutable_data[_1] } : mutable_data[2..39].send(op)
+      packed_empty_val = { max: -2**63, min: 2**63 - 1, sum: 0, index_of_max: -1 }
+      assert_equal [whole, packed_empty_val[op]], seg_tree.send(method, others).unpack('q*')
+      if op == :index_of_max
+        assert_equal 1, seg_tree.send(method, [1, 1].pack('q*')).unpack1('q')
+      else
+        assert_raise(Shared::DataError) { seg_tree.send(method, [1, 1].pack('q*')) }
+      end
+      assert_raise(Shared::LogicError) { seg_tree.dump(StringIO.new(+'')) }
+    end
+  end
+
+  ########################################
+  # Native numeric C implementation with Float data. (The C tests above with Integer data use it too.)
+
+  def test_max_val_segment_tree_with_floats
+    mutable_data = FLOAT_DATA.clone
+    seg_tree = make_one(:max, :c, mutable_data)
+    test_seg_tree_with_updates(seg_tree, :max_on, mutable_data) { |i, j| mutable_data[i..j].max }
+  end
+
+  def test_index_of_max_val_segment_tree_with_floats
+    mutable_data = FLOAT_DATA.clone
+    seg_tree = make_one(:index_of_max, :c, mutable_data)
+    test_seg_tree_with_updates(seg_tree, :index_of_max_val_on, mutable_data) { |i, j| (i..j).max_by { mutable_data[_1] } }
+  end
+
+  def test_sum_segment_tree_with_floats
+    seg_tree = make_one(:sum, :c, FLOAT_DATA)
+    check_all_intervals(seg_tree, :sum_on, FLOAT_DATA.size, delta: 1e-9) { |i, j| FLOAT_DATA[i..j].sum }
+  end
+
+  # The wide layout has several levels only for larger arrays
+  def test_wide_layout
+    %i[max min sum index_of_max].each do |op|
+      [17, 200].each do |size|
+        mutable_data = Array.new(size) { rand(-100..100) }
+        seg_tree = make_one(op, :c, mutable_data, layout: :wide)
+        expected = ->(i, j) { op == :index_of_max ? (i..j).max_by { mutable_data[_1] } : mutable_data[i..j].send(op) }
+
+        test_seg_tree_with_updates(seg_tree, QUERY_METHOD[op], mutable_data, sample: 5) { |i, j| expected.call(i, j) }
+      end
+    end
+  end
+
+  # Intervals inside one block, across two, and across several
+  def test_blocked_layout
+    %i[max min sum].each do |op|
+      [1, 5, 32, 33, 200].each do |size|
+        [[-> { rand(-100..100) }, nil], [-> { rand(-100.0..100.0) }, 1e-9]].each do |gen, delta|
+          mutable_data = Array.new(size) { gen.call }
+          seg_tree = make_one(op, :c, mutable_data, layout: :blocked)
+          check_all_intervals(seg_tree, QUERY_METHOD[op], size, delta:) { |i, j| mutable_data[i..j].send(op) } if size < 50
+
+          10.times do
+            idx = rand(size)
+            mutable_data[idx] = gen.call
+            seg_tree.update_at(idx)
+            left = rand(size)
+            right = rand(left...size)
+            expected = mutable_data[left..right].send(op)
+            actual = seg_tree.send(QUERY_METHOD[op], left, right)
+            delta ? assert_in_delta(expected, actual, delta) : assert_equal(expected, actual)
+          end
+        end
+      end
+    end
+
+    assert_raise(ArgumentError) { make_one(:index_of_max, :c, DATA, layout: :blocked) }
+    assert_include %i[avx2 neon scalar], SegmentTree::CNumericSegmentTree.simd
+  end
+
+  ########################################
+  # Batch queries
+
+  def test_query_many
+    lefts = Array.new(200) { rand(DATA.size) }
+    rights = lefts.map { rand(_1...DATA.size) }
+
+    %i[max min sum index_of_max].each do |op|
+      method = QUERY_METHOD[op]
+      [DATA, DATA.map(&:to_r)].each do |data|
+        %i[ruby c].each do |lang|
+          seg_tree = make_one(op, lang, data)
+          expected = lefts.zip(rights).map { |i, j| seg_tree.send(method, i, j) }
+
+          assert_equal expected, seg_tree.send(:"#{method}_many", lefts, rights)
+
+          # Packed intervals give packed results, whichever template is used
+          format = op == :index_of_max || data.first.is_a?(Integer) ? 'q*' : 'd*'
+          assert_equal expected.pack(format), seg_tree.send(:"#{method}_many", lefts.zip(rights).flatten.pack('q*'))
+        end
+      end
+    end
+  end
+
+  def test_query_many_with_packed_results
+    packed_intervals = [[0, 39], [3, 3], [5, 4], [10, 20]].flatten.pack('q*')
+
+    # Empty intervals give extreme values for integer max and min, and -1 for the index of the max
+    assert_equal [DATA.max, DATA[3], -2**63, DATA[10..20].max], make_one(:max, :c, DATA).max_on_many(packed_intervals).unpack('q*')
+    assert_equal [DATA.min, DATA[3], 2**63 - 1, DATA[10..20].min], make_one(:min, :c, DATA).min_on_many(packed_intervals).unpack('q*')
+    assert_equal [DATA.sum, DATA[3], 0, DATA[10..20].sum], make_one(:sum, :c, DATA).sum_on_many(packed_intervals).unpack('q*')
+
+    expected_indices = [(0..39).max_by { DATA[_1] }, 3, -1, (10..20).max_by { DATA[_1] }]
+    index_of_max_tree = make_one(:index_of_max, :c, DATA)
+    assert_equal expected_indices, index_of_max_tree.index_of_max_val_on_many(packed_intervals).unpack('q*')
+
+    floats = make_one(:max, :c, FLOAT_DATA).max_on_many(packed_intervals).unpack('d*')
+    assert_equal [FLOAT_DATA.max, FLOAT_DATA[3], -INFINITY, FLOAT_DATA[10..20].max], floats
+
+    # A tree over the generic C template gives the same packed results. Rationals are packed as doubles.
+    rational_data = DATA.map(&:to_r)
+    {
+      max: SegmentTree::MaxValSegmentTree, min: SegmentTree::MinValSegmentTree, sum: SegmentTree::SumSegmentTree,
+      index_of_max: SegmentTree::IndexOfMaxValSegmentTree
+    }.each do |op, klass|
+      method = :"#{QUERY_METHOD[op]}_many"
+      generic_tree = klass.new(SegmentTree::CSegmentTreeTemplate, rational_data)
+      assert_equal make_one(op, :c, DATA.map(&:to_f)).send(method, packed_intervals), generic_tree.send(method, packed_intervals)
+    end
+  end
+
+  # The templates themselves pack their results as they are told
+  def test_template_query_many_with_packed_results
+    [SegmentTree::SegmentTreeTemplate, SegmentTree::CSegmentTreeTemplate].each do |template|
+      packed_intervals = (template == SegmentTree::CSegmentTreeTemplate ? [[0, 39], [5, 4]] : [[0, 39], [5, 5]]).flatten.pack('q*')
+      empty_val = template == SegmentTree::CSegmentTreeTemplate ? -INFINITY : DATA[5]
+
+      tree = template.new(combine: ->(a, b) { [a, b].max }, single_cell_array_val: ->(i) { DATA[i] }, size: DATA.size,
+                          identity: -INFINITY)
+      assert_equal [DATA.max, empty_val == -INFINITY ? -2**63 : empty_val], tree.query_many(packed_intervals, dtype: :i64).unpack('q*')
+      assert_equal [DATA.max, empty_val], tree.query_many(packed_intervals).unpack('d*')
+
+      rational_tree = template.new(combine: ->(a, b) { a + b }, single_cell_array_val: ->(i) { DATA[i].to_r / 2 }, size: DATA.size,
+                                   identity: 0)
+      assert_equal [DATA.sum / 2.0], rational_tree.query_many([0, 39].pack('q*'), dtype: :f64).unpack('d*')
+      assert_raise(Shared::DataError) { rational_tree.query_many([0, 0].pack('q*'), dtype: :i64) }
+
+      assert_raise(ArgumentError) { tree.query_many(packed_intervals[0, 24]) }
+    end
+  end
+  def test_query_many_checks_arguments
+    seg_tree = make_one(:max, :c, DATA)
+
+    assert_raise(ArgumentError) { seg_tree.max_on_many([1, 2], [3]) }
+    assert_raise(ArgumentError) { seg_tree.max_on_many('abc') }
+    assert_raise(ArgumentError) { make_one(:max, :ruby, DATA).max_on_many([1, 2, 3].pack('q*')) }
+    assert_raise(ArgumentError) { make_one(:index_of_max, :ruby, DATA).index_of_max_val_on_many([1, 2, 3].pack('q*')) }
+    assert_raise(Shared::DataError) { seg_tree.max_on_many([1], [DATA.size]) }
+    assert_raise(Shared::DataError) { seg_tree.max_on_many([-1, 2].pack('q*')) }
+  end
+
+  ########################################
+  # Range updates
+
+  def test_range_updates
+    %i[max min sum].each do |op|
+      %i[ruby c].each do |lang|
+        [DATA, FLOAT_DATA, DATA.map(&:to_r)].each do |data|
+          check_range_updates(op, lang, data)
+        end
+      end
+    end
+  end
+
+  def test_range_update_tree_uses_c_only_for_numeric_data
+    assert_kind_of SegmentTree::CRangeUpdateSegmentTree, SegmentTree.construct_with_range_updates(DATA, :sum, :c)
+    assert_kind_of SegmentTree::RangeUpdateSegmentTree, SegmentTree.construct_with_range_updates(DATA.map(&:to_r), :sum, :c)
+  end
+
+  def test_range_update_checks
+    seg_tree = SegmentTree.construct_with_range_updates(DATA, :sum, :c)
+
+    assert_raise(Shared::DataError) { seg_tree.update_range(0, DATA.size, 1) }
+    assert_raise(Shared::DataError) { seg_tree.assign_range(0, 1, 1.5) }
+    assert_raise(RangeError) { seg_tree.update_range(0, DATA.size - 1, 2**62) }
+
+    assert_equal 0, seg_tree.query_on(3, 2)
+
+    float_tree = SegmentTree.construct_with_range_updates(DATA.map(&:to_f), :sum, :c)
+    assert_raise(Shared::DataError) { float_tree.update_range(0, 1, 1) }
+    assert_raise(Shared::DataError) { float_tree.assign_range(0, 1, 1) }
+  end
+
+  # A refused update changes nothing
+  def test_range_update_overflow_leaves_tree_unchanged
+    data = (1..8).to_a
+    %i[sum max min].each do |op|
+      seg_tree = SegmentTree.construct_with_range_updates(data, op, :c)
+      seg_tree.update_range(3, 3, 2**62) if op != :sum
+      values = data.clone
+      values[3] += 2**62 if op != :sum
+
+      assert_raise(RangeError) { seg_tree.update_range(1, 6, op == :sum ? 2**61 : 2**62) }
+      assert_raise(RangeError) { seg_tree.assign_range(0, 7, -2**61) } if op == :sum
+      check_all_intervals(seg_tree, :query_on, data.size) { |i, j| values[i..j].send(op) }
+    end
+  end
+
+  # Updates that come close to the int64 limits are refused exactly when some value, or for :sum the sum of the magnitudes of the
+  # values, would be too large.
+  def test_range_updates_near_int64_limits
+    max = 2**63 - 1
+    %i[sum max min].each do |op|
+      data = Array.new(10) { rand(-2**58..2**58) }
+      seg_tree = SegmentTree.construct_with_range_updates(data, op, :c)
+
+      300.times do
+        i = rand(data.size)
+        j = rand(i...data.size)
+        new_data = data.clone
+        if rand < 0.5
+          change = rand(-2**61..2**61)
+          (i..j).each { new_data[_1] += change }
+          action = -> { seg_tree.update_range(i, j, change) }
+        else
+          value = rand(-2**61..2**61)
+          (i..j).each { new_data[_1] = value }
+          action = -> { seg_tree.assign_range(i, j, value) }
+        end
+
+        fits = op == :sum ? new_data.sum(&:abs) <= max : new_data.all? { _1.abs <= max }
+        if fits
+          action.call
+          data = new_data
+        else
+          assert_raise(RangeError, &action)
+        end
+        check_all_intervals(seg_tree, :query_on, data.size) { |i2, j2| data[i2..j2].send(op) }
+      end
+    end
+  end
+
+  def test_range_update_sum_tree_falls_back_to_ruby_for_large_magnitudes
+    data = [2**62, -2**62, 2**62, -2**62]
+    assert_kind_of SegmentTree::RangeUpdateSegmentTree, SegmentTree.construct_with_range_updates(data, :sum, :c)
+    assert_kind_of SegmentTree::CRangeUpdateSegmentTree, SegmentTree.construct_with_range_updates(data, :max, :c)
+  end
+
+  def test_numeric_tree_is_used_only_for_numeric_data
+    assert_not_nil SegmentTree::CSegmentTreeTemplate.numeric_version(:max, DATA)
+    assert_not_nil SegmentTree::CSegmentTreeTemplate.numeric_version(:max, FLOAT_DATA)
+
+    assert_nil SegmentTree::CSegmentTreeTemplate.numeric_version(:max, DATA + [1.5])
+    assert_nil SegmentTree::CSegmentTreeTemplate.numeric_version(:max, DATA.map(&:to_r))
+    assert_nil SegmentTree::CSegmentTreeTemplate.numeric_version(:sum, [2**62, 2**62])
+  end
+
+  # Data that can't be stored natively falls back to the generic C template
+  def test_max_val_segment_tree_with_c_and_generic_data
+    mutable_data = DATA.map(&:to_r)
+    seg_tree = make_one(:max, :c, mutable_data)
+    test_seg_tree_with_updates(seg_tree, :max_on, mutable_data) { |i, j| mutable_data[i..j].max }
+  end
+
+  # CNumericSegmentTree itself rejects a change of type. (The concrete trees then fall back to the template, as in
+  # test_native_tree_falls_back_on_updates.)
+  def test_numeric_tree_rejects_change_of_type
+    mutable_data = DATA.clone
+    numeric_tree = SegmentTree::CNumericSegmentTree.new(:max, mutable_data, :i64, :binary)
+
+    mutable_data[3] = 2.5
+    assert_raise(Shared::DataError) do
+      numeric_tree.update_at(3)
+    end
+  end
+
+  # Packed data is read in place by the C tree, and unpacked for the Ruby one
+  def test_packed_data
+    [[DATA, :i64, 'q*'], [FLOAT_DATA, :f64, 'd*']].each do |data, dtype, format|
+      %i[max min sum index_of_max].each do |op|
+        %i[c ruby].each do |lang|
+          packed = data.pack(format)
+          seg_tree = SegmentTree.construct(packed, op, lang, dtype:)
+          check_all_intervals(seg_tree, QUERY_METHOD[op], data.size, delta: (1e-9 if op == :sum && dtype == :f64)) do |i, j|
+            op == :index_of_max ? (i..j).max_by { data[_1] } : data[i..j].send(op)
+          end
+          next if lang == :ruby
+
+          # Overwrite a value in place
+          new_val = dtype == :i64 ? 1_000 : 1_000.5
+          packed[8 * 3, 8] = [new_val].pack(format)
+          seg_tree.update_at(3)
+          expected = op == :index_of_max ? 3 : [new_val, data[4]].send(op)
+          assert_equal expected, seg_tree.send(QUERY_METHOD[op], 3, 4)
+        end
+      end
+    end
+
+    assert_raise(ArgumentError) { SegmentTree.construct('abc', :max, :c, dtype: :f64) }
+    assert_raise(ArgumentError) { SegmentTree.construct('', :max, :c, dtype: :f64) }
+    assert_raise(Shared::DataError) { SegmentTree.construct([2**62, 2**62].pack('q*'), :sum, :c, dtype: :i64) }
+    assert_raise(ArgumentError) { SegmentTree.construct([1.0].pack('d*'), :max, :c) } # dtype is needed
+
+    packed = DATA.pack('q*')
+    seg_tree = SegmentTree.construct(packed, :max, :c, dtype: :i64)
+    packed.clear
+    assert_raise(Shared::DataError) { seg_tree.update_at(0) }
+  end
+
+  ########################################
+  # Immutable trees
+
+  def test_immutable_trees
+    %i[max min index_of_max].each do |op|
+      method = QUERY_METHOD[op]
+      [[DATA, :i64, 'q*'], [FLOAT_DATA, :f64, 'd*']].each do |data, dtype, format|
+        [data, data.pack(format)].each do |given|
+          seg_tree = SegmentTree.construct(given, op, :c, dtype:, mutable: false)
+          check_all_intervals(seg_tree, method, data.size) do |i, j|
+            op == :index_of_max ? (i..j).max_by { data[_1] } : data[i..j].send(op) # the leftmost index of the max
+          end
+          assert_equal({ max: -INFINITY, min: INFINITY, index_of_max: nil }[op], seg_tree.send(method, 3, 2))
+          assert_raise(Shared::LogicError) { seg_tree.update_at(0) }
+
+          lefts = Array.new(100) { rand(data.size) }
+          rights = lefts.map { rand([_1 - 1, 0].max...data.size) } # including some empty intervals
+          mutable_tree = SegmentTree.construct(data, op, :c)
+          assert_equal mutable_tree.send(:"#{method}_many", lefts, rights), seg_tree.send(:"#{method}_many", lefts, rights)
+          packed_pairs = lefts.zip(rights).flatten.pack('q*')
+          assert_equal mutable_tree.send(:"#{method}_many", packed_pairs), seg_tree.send(:"#{method}_many", packed_pairs)
+        end
+      end
+    end
+
+    # The other cases get the usual trees, which refuse updates all the same
+    [[:sum, :c, DATA], [:max, :ruby, DATA], [:max, :c, DATA.map(&:to_r)]].each do |op, lang, data|
+      seg_tree = SegmentTree.construct(data.clone, op, lang, mutable: false)
+      check_all_intervals(seg_tree, QUERY_METHOD[op], data.size) { |i, j| data[i..j].send(op) }
+      assert_raise(Shared::LogicError) { seg_tree.update_at(0) }
+    end
+    packed_sum = SegmentTree.construct(DATA.pack('q*'), :sum, :c, dtype: :i64, mutable: false)
+    assert_equal DATA.sum, packed_sum.sum_on(0, DATA.size - 1)
+    assert_raise(Shared::LogicError) { packed_sum.update_at(0) }
+
+    assert_raise(ArgumentError) { SegmentTree::CSparseTable.new(:sum, DATA, :i64) }
+    assert_raise(Shared::DataError) { SegmentTree::CSparseTable.new(:max, [1, 2.0], :i64) }
+  end
+
+  ########################################
+  # Persistent trees
+
+  def test_persistent_trees
+    %i[max min sum index_of_max].each do |op|
+      [[DATA, :i64, 'q*'], [FLOAT_DATA, :f64, 'd*']].each do |data, dtype, format|
+        [data, data.pack(format)].each do |given|
+          versions = [SegmentTree.construct_persistent(given, op, dtype:)]
+          contents = [data.clone]
+          10.times do
+            idx = rand(data.size)
+            value = dtype == :i64 ? rand(-20..20) : rand(-20.0..20.0)
+            versions << versions.last.update_at(idx, value)
+            contents << contents.last.clone.tap { _1[idx] = value }
+          end
+
+          # Every version, old or new, answers queries about its own contents
+          versions.zip(contents).each do |version, content|
+            delta = op == :sum && dtype == :f64 ? 1e-9 : nil
+            check_all_intervals(version, :query_on, data.size, delta:) { |i, j| expected_persistent_val(op, content, i, j) }
+            assert_equal content, (0...data.size).map { version.value_at(_1) }
+          end
+          assert_equal({ max: -INFINITY, min: INFINITY, sum: 0, index_of_max: nil }[op], versions.last.query_on(3, 2))
+
+          lefts = Array.new(100) { rand(data.size) }
+          rights = lefts.map { rand([_1 - 1, 0].max...data.size) } # including some empty intervals
+          numeric_tree = SegmentTree::CNumericSegmentTree.new(op, contents.last.pack(format), dtype, :binary)
+          packed_pairs = lefts.zip(rights).flatten.pack('q*')
+          assert_equal numeric_tree.query_many(packed_pairs), versions.last.query_many(packed_pairs) unless op == :sum && dtype == :f64
+          assert_equal lefts.zip(rights).map { versions.last.query_on(*_1) }, versions.last.query_many(lefts, rights)
+        end
+      end
+    end
+  end
+
+  def test_persistent_update_many
+    tree = SegmentTree.construct_persistent(DATA, :sum)
+    indices = Array.new(50) { rand(DATA.size) }
+    values = Array.new(50) { rand(-20..20) }
+    expected = DATA.clone
+    indices.zip(values) { |i, v| expected[i] = v }
+
+    [[indices, values], [indices.pack('q*'), values.pack('q*')]].each do |given_indices, given_values|
+      updated = tree.update_many(given_indices, given_values)
+      check_all_intervals(updated, :query_on, DATA.size) { |i, j| expected[i..j].sum }
+    end
+    check_all_intervals(tree, :query_on, DATA.size) { |i, j| DATA[i..j].sum }
+
+    assert_raise(ArgumentError) { tree.update_many([1, 2], [3]) }
+    assert_raise(Shared::DataError) { tree.update_at(DATA.size, 1) }
+    assert_raise(Shared::DataError) { tree.update_at(0, 1.5) }
+    assert_raise(Shared::DataError) { tree.update_at(0, Shared::INFINITY) }
+    assert_raise(Shared::DataError) { SegmentTree.construct_persistent(DATA.map(&:to_r), :sum) }
+    assert_raise(Shared::DataError) { SegmentTree.construct_persistent([2**62, 2**62], :sum) }
+  end
+
+  # An update copies just one root-to-leaf path, so the pool grows by O(log n) nodes per version
+  def test_persistent_sharing
+    size = 100_000
+    tree = SegmentTree.construct_persistent(Array.new(size) { rand(-1000..1000) }, :max)
+    assert_equal 2 * size - 1, tree.node_count
+
+    path_length = Math.log2(size).ceil + 1
+    latest = tree
+    1_000.times { latest = latest.update_at(rand(size), rand(-1000..1000)) }
+    assert latest.node_count <= 2 * size - 1 + 1_000 * path_length
+    assert_equal tree.node_count, latest.node_count # they share the pool
+
+    assert ObjectSpace.memsize_of(latest) < 100
+  end
+
+  ########################################
+  # Fenwick trees
+
+  def test_fenwick_trees
+    [[DATA, :i64, 'q*'], [FLOAT_DATA, :f64, 'd*']].each do |data, dtype, format|
+      delta = dtype == :f64 ? 1e-9 : nil
+      [data, data.pack(format)].each do |given|
+        content = data.clone
+        tree = SegmentTree.construct_fenwick(given, dtype:)
+        check_all_intervals(tree, :sum_on, data.size, delta:) { |i, j| content[i..j].sum }
+        assert_equal 0, tree.sum_on(3, 2)
+
+        10.times do
+          idx = rand(data.size)
+          change = dtype == :i64 ? rand(-20..20) : rand(-20.0..20.0)
+          if rand(2).zero?
+            tree.add_at(idx, change)
+            content[idx] += change
+          else
+            tree.update_at(idx, change)
+            content[idx] = change
+          end
+          check_all_intervals(tree, :query_on, data.size, delta:) { |i, j| content[i..j].sum }
+        end
+        content.each_with_index { |v, i| assert_in_delta v, tree.value_at(i), 1e-9 }
+
+        lefts = Array.new(100) { rand(data.size) }
+        rights = lefts.map { rand([_1 - 1, 0].max...data.size) } # including some empty intervals
+        expected = lefts.zip(rights).map { |i, j| content[i..j].sum }
+        assert_equal expected, tree.sum_on_many(lefts, rights) if dtype == :i64
+        tree.query_many(lefts.zip(rights).flatten.pack('q*')).unpack(format).zip(expected) { |a, e| assert_in_delta e, a, 1e-9 }
+
+        indices = Array.new(20) { rand(data.size) }
+        assert_equal indices.map { tree.prefix_sum(_1) }, tree.prefix_sum_many(indices)
+        assert_equal indices.map { tree.prefix_sum(_1) }, tree.prefix_sum_many(indices.pack('q*')).unpack(format)
+      end
+    end
+  end
+
+  def test_fenwick_add_many
+    tree = SegmentTree.construct_fenwick(DATA.size, dtype: :i64)
+    indices = Array.new(50) { rand(DATA.size) }
+    deltas = Array.new(50) { rand(-20..20) }
+    expected = Array.new(DATA.size, 0)
+    indices.zip(deltas) { |i, d| expected[i] += d }
+
+    tree.add_many(indices, deltas)
+    check_all_intervals(tree, :sum_on, DATA.size) { |i, j| expected[i..j].sum }
+    tree.add_many(indices.pack('q*'), deltas.map(&:-@).pack('q*'))
+    check_all_intervals(tree, :sum_on, DATA.size) { 0 }
+
+    assert_raise(ArgumentError) { tree.add_many([1, 2], [3]) }
+    assert_raise(Shared::DataError) { tree.add_at(DATA.size, 1) }
+    assert_raise(Shared::DataError) { tree.add_at(0, 1.5) }
+    assert_raise(Shared::DataError) { SegmentTree.construct_fenwick(DATA.map(&:to_r)) }
+    assert_raise(ArgumentError) { SegmentTree.construct_fenwick(10) } # dtype is needed
+  end
+
+  def test_fenwick_lower_bound
+    [[Array.new(200) { rand(0..5) }, :i64], [Array.new(200) { rand(0.0..5.0) }, :f64]].each do |data, dtype|
+      tree = SegmentTree.construct_fenwick(data)
+      prefix_sums = data.each_with_index.map { |_, i| data[0..i].sum }
+      expected = ->(target) { prefix_sums.index { _1 >= target } }
+
+      targets = Array.new(100) { dtype == :i64 ? rand(-2..prefix_sums.last + 2) : rand(-2.0..prefix_sums.last + 2.0) }
+      targets += dtype == :i64 ? [0, prefix_sums.last] : [0.0]
+      assert_equal targets.map { expected.call(_1) }, targets.map { tree.lower_bound(_1) }
+      assert_equal targets.map { expected.call(_1) }, tree.lower_bound_many(targets)
+
+      format = dtype == :i64 ? 'q*' : 'd*'
+      assert_equal targets.map { expected.call(_1) || -1 }, tree.lower_bound_many(targets.pack(format)).unpack('q*')
+    end
+  end
+
+  # Integer sums that overflow raise, and a failed add leaves the tree as it was
+  def test_fenwick_overflow
+    tree = SegmentTree.construct_fenwick([2**62, 0, 0, 0])
+    tree.add_at(1, 2**62 - 1)
+    assert_equal 2**63 - 1, tree.sum_on(0, 3)
+    assert_raise(Shared::DataError) { tree.add_at(2, 1) }
+    assert_equal [2**62, 2**62 - 1, 0, 0], (0..3).map { tree.value_at(_1) }
+    assert_raise(Shared::DataError) { SegmentTree.construct_fenwick([2**62, 2**62]) }
+  end
+
+  # The magnitudes of Integer values must sum to at most 2^63 - 1. Then no query can fail, and an update can swing a value by more
+  # than that.
+  def test_fenwick_bounds_the_values
+    # The sum of this interval fits, but not every sum does. We refuse the data rather than failing some queries later.
+    assert_raise(Shared::DataError) { SegmentTree.construct_fenwick([-(2**62), 0, 0, 0, 2**61, 2**61, 2**62]) }
+
+    data = [-(2**61), 0, 0, 0, 2**60, 2**60, 2**62 - 1]
+    tree = SegmentTree.construct_fenwick(data)
+    check_all_intervals(tree, :sum_on, data.size) { |i, j| data[i..j].sum }
+
+    tree.update_at(0, 2**61)
+    data[0] = 2**61
+    check_all_intervals(tree, :sum_on, data.size) { |i, j| data[i..j].sum }
+
+    assert_raise(Shared::DataError) { tree.update_at(1, 1) }
+    assert_raise(Shared::DataError) { tree.add_at(6, 1) }
+    assert_equal data, (0...data.size).map { tree.value_at(_1) }
+
+    tree = SegmentTree.construct_fenwick([-(2**62), 0])
+    tree.update_at(0, 2**62) # a change of 2^63
+    assert_equal [2**62, 0], [tree.value_at(0), tree.value_at(1)]
+    assert_equal 2**62, tree.sum_on(0, 1)
+  end
+
+  ########################################
+  # Memory
+
+  # Trees over large arrays live in memory of their own, which the GC is told about
+  def test_memory
+    size = 200_000
+    data = Array.new(size) { rand(-1000..1000) }
+    i, j = 1_000, 150_000
+
+    numeric = SegmentTree::CNumericSegmentTree.new(:max, data, :i64, :binary)
+    assert_operator ObjectSpace.memsize_of(numeric), :>=, 2 * size * 8
+    small = SegmentTree::CNumericSegmentTree.new(:max, data.first(10), :i64, :binary)
+    assert_operator ObjectSpace.memsize_of(small), :<, 1_000
+
+    typed = SegmentTree::CMaxI64.new(data)
+    sparse = SegmentTree::CSparseTable.new(:max, data, :i64)
+    template = make_one(:max, :c, data.map(&:to_r)) # the generic template, holding objects that must be marked
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+
+    [numeric, typed, sparse].each { assert_equal data[i..j].max, _1.query_on(i, j) }
+    assert_equal data[i..j].max, template.max_on(i, j)
+  end
+
+  ########################################
+  # Images
+
+  def test_images
+    %i[max min sum index_of_max].each do |op|
+      %i[binary wide blocked].each do |layout|
+        next if layout == :blocked && op == :index_of_max
+
+        seg_tree = make_one(op, :c, DATA, layout:)
+        io = StringIO.new(+'')
+        seg_tree.dump(io)
+        io.rewind
+        loaded = SegmentTree.load(io)
+        assert_equal seg_tree.class, loaded.class
+        check_all_intervals(loaded, QUERY_METHOD[op], DATA.size) { |i, j| seg_tree.send(QUERY_METHOD[op], i, j) }
+        assert_raise(Shared::LogicError) { loaded.update_at(0) } # the image has no data array
+
+        Tempfile.create('seg_tree') do |file|
+          seg_tree.dump(file)
+          file.close
+
+          mutable_data = DATA.clone
+          mapped = SegmentTree.open(file.path, mutable_data)
+          expected = ->(i, j) { op == :index_of_max ? (i..j).max_by { mutable_data[_1] } : mutable_data[i..j].send(op) }
+          test_seg_tree_with_updates(mapped, QUERY_METHOD[op], mutable_data, sample: 3) { |i, j| expected.call(i, j) }
+
+          # The updates to the mapped tree didn't reach the file
+          reopened = SegmentTree.open(file.path)
+          check_all_intervals(reopened, QUERY_METHOD[op], DATA.size) { |i, j| seg_tree.send(QUERY_METHOD[op], i, j) }
+        end
+      end
+    end
+  end
+
+  def test_image_checks
+    io = StringIO.new(+'')
+    make_one(:sum, :c, FLOAT_DATA).dump(io)
+    image = io.string
+
+    assert_raise(Shared::DataError) { SegmentTree.load(StringIO.new(image.byteslice(0, image.bytesize - 8))) }
+    assert_raise(Shared::DataError) { SegmentTree.load(StringIO.new(image.sub('CNST', 'CPST'))) }
+    assert_raise(Shared::DataError) { SegmentTree.load(StringIO.new('not an image at all')) }
+    assert_raise(ArgumentError) { SegmentTree.load(StringIO.new(image), [1.0]) } # data of the wrong size
+  end
+
   ########################################
   # Helpers
 
+  # What a persistent tree's query_on gives for content[i..j]: for :index_of_max, the leftmost index of the maximum and the maximum
+  private def expected_persistent_val(op, content, i, j)
+    return content[i..j].send(op) unless op == :index_of_max
+
+    idx = (i..j).max_by { content[_1] }
+    [idx, content[idx]]
+  end
+
   private def test_seg_tree_basic(seg_tree, method, data_size, &block)
     check_all_intervals(seg_tree, method, data_size) { |i, j| block.call(i, j) }
   end
 
-  private def test_seg_tree_with_updates(seg_tree, method, mutable_data, &block)
-    (0...(mutable_data.size)).each do |idx|
+  # Update each index in turn and check the tree after each one. With sample: we update only that many randomly chosen indices.
+  private def test_seg_tree_with_updates(seg_tree, method, mutable_data, sample: nil, &block)
+    indices = (0...(mutable_data.size)).to_a
+    indices = indices.sample(sample) if sample
+    indices.each do |idx|
       mutable_data[idx] += rand(-5..5)
       seg_tree.update_at(idx)
       check_all_intervals(seg_tree, method, mutable_data.size) { |i, j| block.call(i, j) }
     end
   end
 
-  private def check_all_intervals(segment_tree, method, data_size)
+  private def check_all_intervals(segment_tree, method, data_size, delta: nil)
     (0...data_size).each do |i|
       (i...data_size).each do |j|
         expected_value = yield(i, j)
         actual_value = segment_tree.send(method, i, j)
-        assert_equal expected_value, actual_value
+        if delta
+          assert_in_delta expected_value, actual_value, delta
+        else
+          assert_equal expected_value, actual_value
+        end
+      end
+    end
+  end
+
+  TYPED_TREE_OPS = {
+    Sum: ->(vals, _) { vals.sum },
+    Min: ->(vals, _) { vals.min },
+    Max: ->(vals, _) { vals.max },
+    IndexOfMax: ->(vals, offset) { offset + vals.each_index.max_by { [vals[_1], -_1] } },
+    Gcd: ->(vals, _) { vals.reduce(0) { |g, v| g.gcd(v) } }
+  }.freeze
+
+  TYPED_TREE_DTYPES = {
+    I64: { values: DATA.map { _1 * 1_000_000_007 }, pack: 'q*' },
+    I32: { values: DATA, pack: 'l*' },
+    F64: { values: FLOAT_DATA, pack: 'd*' }
+  }.freeze
+
+  def test_typed_trees
+    TYPED_TREE_OPS.each do |op, expected|
+      TYPED_TREE_DTYPES.each do |dtype, spec|
+        next if op == :Gcd && dtype == :F64
+
+        klass = SegmentTree.const_get("C#{op}#{dtype}")
+        values = spec[:values].dup
+        delta = dtype == :F64 ? 1e-9 : nil
+        [values, values.pack(spec[:pack])].each do |data|
+          tree = klass.new(data)
+          assert_equal values.size, tree.size
+          check_all_intervals(tree, :query_on, values.size, delta:) { |i, j| expected.call(values[i..j], i) }
+
+          # Change a value in the data and tell the tree
+          values[3] = values[7]
+          data.is_a?(String) ? data.replace(values.pack(spec[:pack])) : data[3] = values[7]
+          tree.update_at(3)
+          check_all_intervals(tree, :query_on, values.size, delta:) { |i, j| expected.call(values[i..j], i) }
+          values = spec[:values].dup
+        end
       end
     end
   end
 
-  private def make_one(op, lang, data)
-    SegmentTree.construct(data, op, lang)
+  def test_typed_tree_batches_and_empty_intervals
+    tree = SegmentTree::CMaxI32.new(DATA)
+    assert_equal [DATA[0..5].max, -INFINITY], tree.query_many([0, 4], [5, 3])
+    assert_equal [DATA[0..5].max, -(2**63)], tree.query_many([0, 5, 4, 3].pack('q*')).unpack('q*')
+
+    assert_nil SegmentTree::CIndexOfMaxF64.new(FLOAT_DATA).query_on(4, 3)
+    assert_equal 0, SegmentTree::CSumF64.new(FLOAT_DATA).query_on(4, 3)
+    assert_equal [2**63], SegmentTree::CGcdI64.new([-(2**63), 0]).query_many([0, 1].pack('q*')).unpack('Q*')
+  end
+
+  def test_typed_tree_checks
+    assert_raise(Shared::DataError) { SegmentTree::CSumI64.new([2**62, 2**62]) }
+    assert_raise(Shared::DataError) { SegmentTree::CSumI64.new([1, 2.0]) }
+    assert_raise(Shared::DataError) { SegmentTree::CMaxF64.new([1.0, 2]) }
+    assert_raise(RangeError) { SegmentTree::CMinI32.new([2**31]) }
+    assert_raise(ArgumentError) { SegmentTree::CMinI32.new('abc') }
+    assert_raise(ArgumentError) { SegmentTree::CMinI32.new([]) }
+    assert_raise(Shared::DataError) { SegmentTree::CMinI32.new(DATA).query_on(0, DATA.size) }
+
+    data = [2**62, 2**61]
+    tree = SegmentTree::CSumI64.new(data)
+    data[1] = -(2**62) # the sum is fine but the sum of the magnitudes isn't
+    assert_raise(Shared::DataError) { tree.update_at(1) }
+    assert_equal 2**62 + 2**61, tree.query_on(0, 1) # unchanged
+    assert_raise(Shared::DataError) { tree.update_at(2) }
+  end
+
+  # The counters are there only when the extension is built with --enable-stats
+  def test_stats_for_c_template
+    tree = SegmentTree::CSegmentTreeTemplate.new(combine: ->(a, b) { a + b }, single_cell_array_val: ->(i) { i }, size: 16,
+                                                 identity: 0)
+    unless tree.respond_to?(:stats)
+      flunk 'Expected a build with --enable-stats' if ENV['DSRM_STATS']
+      assert_raise(NotImplementedError) { tree.stats }
+      omit 'Built without --enable-stats'
+    end
+
+    assert_equal 120, tree.query_on(0, 15) # just the root
+    assert_equal 0, tree.query_on(5, 4) # empty, so not counted
+    tree.update_at(3) # a leaf and its four ancestors
+    assert_equal(
+      { queries: 1, query_node_visits: 1, query_funcalls: 0, updates: 1, update_node_visits: 5, update_funcalls: 5 },
+      tree.stats
+    )
+
+    assert_equal 7, tree.query_on(3, 4) # two leaves with different parents, combined once
+    assert_equal [2, 3, 1], tree.stats.values_at(:queries, :query_node_visits, :query_funcalls)
+
+    tree.reset_stats
+    assert tree.stats.values.all?(&:zero?)
+  end
+
+  # Make a sequence of random range updates, checking all intervals after each one
+  private def check_range_updates(op, lang, data)
+    mutable_data = data.clone
+    seg_tree = SegmentTree.construct_with_range_updates(data, op, lang)
+    float = data.first.is_a?(Float)
+    delta = float ? 1e-9 : nil
+
+    20.times do
+      i = rand(mutable_data.size)
+      j = rand(i...mutable_data.size)
+      if rand < 0.5
+        change = float ? rand(-5.0..5.0) : rand(-5..5)
+        seg_tree.update_range(i, j, change)
+        (i..j).each { mutable_data[_1] += change }
+      else
+        value = float ? rand(-10.0..10.0) : rand(-10..10)
+        seg_tree.assign_range(i, j, value)
+        (i..j).each { mutable_data[_1] = value }
+      end
+
+      check_all_intervals(seg_tree, :query_on, mutable_data.size, delta:) { |i2, j2| mutable_data[i2..j2].send(op) }
+    end
+    assert_equal mutable_data[7], seg_tree.value_at(7)
+  end
+
+  private def make_one(op, lang, data, layout: :binary)
+    SegmentTree.construct(data, op, lang, layout:)
   end
 end